@@ -0,0 +1,415 @@
+/*
+ * cpu_kernels_bench - the CPU hot loops of the examples, without a device
+ *
+ * Each loop runs at 640x480, 1080p and 4K, once as the scalar baseline the
+ * examples started from and once for every raster kernel the CPU supports
+ * (see RasterSetIsa()):
+ *
+ *  - fill: painting a frame, and one of the 8 bands modeset_paint_rect()
+ *    repaints per frame; the baseline is the per-pixel loop with an offset
+ *    computation per pixel,
+ *  - copy: the shadow-to-scanout copy, memcpy() vs. StreamCopy() vs.
+ *    CopyEngine,
+ *  - row copy: the same with a scanout stride padded to 256 bytes, so rows
+ *    have to be copied one by one; CopyDamage() vs. Blit(),
+ *  - blend: BlendOver() of a premultiplied frame,
+ *  - convert: XRGB8888 to XBGR8888 and RGB565, the other formats
+ *    FormatCpp() knows. There are no optimized conversions yet, so this is
+ *    the scalar baseline for them,
+ *  - property lookup: the set_drm_object_property() strcmp() search over a
+ *    plane's properties vs. the PropertyTable index of drm_property.h.
+ *
+ * Reported per pass: ns per pixel, GB/s of destination bytes and CPU cycles
+ * per pixel. Cycles come from perf_event_open(), "-" where that isn't
+ * allowed (see /proc/sys/kernel/perf_event_paranoid).
+ *
+ * Usage: cpu_kernels_bench [seconds per case]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "damage.h"
+#include "drm_property.h"
+#include "raster.h"
+
+using namespace DrmLab;
+
+static double min_seconds = 0.2;
+static int cycles_fd = -1;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * A user-space cycle counter for this thread, -1 if perf events aren't
+ * available.
+ */
+static int open_cycles()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static uint64_t read_cycles()
+{
+    uint64_t cycles = 0;
+
+    if (cycles_fd < 0 || read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+        return 0;
+    }
+    return cycles;
+}
+
+struct Result
+{
+    double ns;     // per pass
+    double cycles; // per pass, 0 if unknown
+};
+
+/*
+ * Run `pass` until `min_seconds` have passed, at least 3 times, after one
+ * pass to warm up caches and page tables.
+ */
+template <typename Pass>
+static Result measure(Pass pass)
+{
+    pass();
+
+    uint64_t passes = 0;
+    uint64_t cycles = read_cycles();
+    uint64_t start = now_ns();
+    uint64_t end;
+    do {
+        pass();
+        passes++;
+        end = now_ns();
+    } while (passes < 3 || end - start < static_cast<uint64_t>(min_seconds * 1e9));
+
+    Result result;
+    result.ns = static_cast<double>(end - start) / passes;
+    result.cycles = cycles_fd >= 0 ? static_cast<double>(read_cycles() - cycles) / passes : 0.0;
+    return result;
+}
+
+static void print_row(const char* kernel, const char* variant, uint32_t width, uint32_t height, uint64_t pixels,
+                      uint64_t bytes, const Result& result)
+{
+    char cycles[32] = "-";
+
+    if (result.cycles > 0) {
+        snprintf(cycles, sizeof(cycles), "%.3f", result.cycles / pixels);
+    }
+    printf("%-12s %-10s %4ux%-5u %10.4f %10.2f %12s\n", kernel, variant, width, height, result.ns / pixels,
+           bytes / result.ns, cycles);
+}
+
+static uint8_t* alloc_buffer(size_t size)
+{
+    /* page aligned like a mapping, with room for a padded stride */
+    void* p = aligned_alloc(4096, (size + 4095) & ~static_cast<size_t>(4095));
+    if (p == nullptr) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(p, 0x40, size);
+    return static_cast<uint8_t*>(p);
+}
+
+/*
+ * Run `body` once per raster kernel the CPU has, named after it.
+ */
+template <typename Body>
+static void for_each_isa(Body body)
+{
+    RasterIsa detected = RasterDetectIsa();
+
+    for (int i = 0; i <= static_cast<int>(detected); i++) {
+        RasterIsa isa = static_cast<RasterIsa>(i);
+        if (RasterSetIsa(isa)) {
+            body(RasterIsaName(isa));
+        }
+    }
+    RasterSetIsa(detected);
+}
+
+/* the paint loop of the first atomic example, a pixel at a time, with plain
+ * stores the compiler may vectorize just the same; the barrier only keeps
+ * it from dropping them, since nothing reads the buffer */
+static void fill_baseline(uint8_t* map, uint32_t stride, const Rect& rect, uint32_t color)
+{
+    for (int32_t j = rect.y1; j < rect.y2; ++j) {
+        for (int32_t k = rect.x1; k < rect.x2; ++k) {
+            size_t off = static_cast<size_t>(stride) * j + k * 4;
+            *reinterpret_cast<uint32_t*>(&map[off]) = color;
+        }
+    }
+    asm volatile("" : : "r"(map) : "memory");
+}
+
+static void bench_fill(uint32_t width, uint32_t height)
+{
+    uint32_t stride = width * 4;
+    uint8_t* dst = alloc_buffer(static_cast<size_t>(stride) * height);
+    const Rect frame = { 0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height) };
+    /* the third of the 8 bands of modeset_band() */
+    const Rect band = { 0, static_cast<int32_t>(height / 8 * 2), static_cast<int32_t>(width),
+                        static_cast<int32_t>(height / 8 * 3) };
+    uint32_t color = 0x00336699;
+
+    for (const Rect* rect : { &frame, &band }) {
+        const char* name = rect == &frame ? "fill" : "fill band";
+        uint64_t pixels = static_cast<uint64_t>(rect->Width()) * rect->Height();
+
+        print_row(name, "baseline", width, height, pixels, pixels * 4, measure([&] {
+                      fill_baseline(dst, stride, *rect, color++);
+                  }));
+        for_each_isa([&](const char* isa) {
+            print_row(name, isa, width, height, pixels, pixels * 4, measure([&] {
+                          FillRect(dst, stride, *rect, color++);
+                      }));
+        });
+    }
+    free(dst);
+}
+
+static void bench_copy(uint32_t width, uint32_t height)
+{
+    uint32_t stride = width * 4;
+    size_t size = static_cast<size_t>(stride) * height;
+    uint64_t pixels = static_cast<uint64_t>(width) * height;
+    uint8_t* src = alloc_buffer(size);
+    uint8_t* dst = alloc_buffer(size);
+    Damage full;
+
+    full.SetFull(width, height);
+
+    print_row("copy", "memcpy", width, height, pixels, size, measure([&] {
+                  memcpy(dst, src, size);
+              }));
+    for_each_isa([&](const char* isa) {
+        print_row("copy", isa, width, height, pixels, size, measure([&] {
+                      StreamCopy(dst, src, size);
+                  }));
+    });
+
+    unsigned threads = CopyEngine::ThreadsFromEnv();
+    if (threads > 1) {
+        CopyEngine engine(threads);
+        char name[32];
+        snprintf(name, sizeof(name), "engine/%u", threads);
+        print_row("copy", name, width, height, pixels, size, measure([&] {
+                      engine.Copy(dst, stride, src, stride, 4, full);
+                  }));
+    }
+
+    free(dst);
+    free(src);
+}
+
+static void bench_row_copy(uint32_t width, uint32_t height)
+{
+    uint32_t src_stride = width * 4;
+    /* scanout strides are often aligned to 256 bytes, or more */
+    uint32_t dst_stride = (width * 4 + 256) & ~255u;
+    uint64_t pixels = static_cast<uint64_t>(width) * height;
+    uint8_t* src = alloc_buffer(static_cast<size_t>(src_stride) * height);
+    uint8_t* dst = alloc_buffer(static_cast<size_t>(dst_stride) * height);
+    const Rect frame = { 0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height) };
+    Damage full;
+
+    full.SetFull(width, height);
+
+    print_row("row copy", "memcpy", width, height, pixels, pixels * 4, measure([&] {
+                  CopyDamage(dst, dst_stride, src, src_stride, 4, full);
+              }));
+    for_each_isa([&](const char* isa) {
+        print_row("row copy", isa, width, height, pixels, pixels * 4, measure([&] {
+                      Blit(dst, dst_stride, 0, 0, src, src_stride, frame);
+                  }));
+    });
+
+    free(dst);
+    free(src);
+}
+
+static void bench_blend(uint32_t width, uint32_t height)
+{
+    uint32_t stride = width * 4;
+    size_t size = static_cast<size_t>(stride) * height;
+    uint64_t pixels = static_cast<uint64_t>(width) * height;
+    uint8_t* src = alloc_buffer(size);
+    uint8_t* dst = alloc_buffer(size);
+    const Rect frame = { 0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height) };
+
+    /* half transparent premultiplied pixels, so nothing takes the opaque or
+     * transparent shortcut */
+    uint32_t* s = reinterpret_cast<uint32_t*>(src);
+    for (uint64_t i = 0; i < pixels; i++) {
+        s[i] = 0x80402010 + (i & 0xf);
+    }
+
+    for_each_isa([&](const char* isa) {
+        print_row("blend", isa, width, height, pixels, size, measure([&] {
+                      BlendOver(dst, stride, 0, 0, src, stride, frame);
+                  }));
+    });
+
+    free(dst);
+    free(src);
+}
+
+static void convert_xbgr8888(uint8_t* dst, const uint8_t* src, uint64_t pixels)
+{
+    const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+    uint32_t* d = reinterpret_cast<uint32_t*>(dst);
+
+    for (uint64_t i = 0; i < pixels; i++) {
+        uint32_t p = s[i];
+        d[i] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    }
+}
+
+static void convert_rgb565(uint8_t* dst, const uint8_t* src, uint64_t pixels)
+{
+    const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+    uint16_t* d = reinterpret_cast<uint16_t*>(dst);
+
+    for (uint64_t i = 0; i < pixels; i++) {
+        uint32_t p = s[i];
+        d[i] = static_cast<uint16_t>(((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f));
+    }
+}
+
+static void bench_convert(uint32_t width, uint32_t height)
+{
+    uint64_t pixels = static_cast<uint64_t>(width) * height;
+    uint8_t* src = alloc_buffer(pixels * 4);
+    uint8_t* dst = alloc_buffer(pixels * 4);
+
+    print_row("to xbgr8888", "baseline", width, height, pixels, pixels * 4, measure([&] {
+                  convert_xbgr8888(dst, src, pixels);
+              }));
+    print_row("to rgb565", "baseline", width, height, pixels, pixels * 2, measure([&] {
+                  convert_rgb565(dst, src, pixels);
+              }));
+
+    free(dst);
+    free(src);
+}
+
+/*
+ * The properties of a typical primary plane, in the order the kernel lists
+ * them; the ones the commit path sets are spread across the list.
+ */
+static const char* const plane_props[] = {
+    "type", "FB_ID", "IN_FENCE_FD", "CRTC_ID", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+    "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "IN_FORMATS", "rotation", "zpos", "alpha",
+    "pixel blend mode", "COLOR_ENCODING", "COLOR_RANGE", "FB_DAMAGE_CLIPS", "SCALING_FILTER",
+};
+static constexpr uint32_t plane_prop_count = sizeof(plane_props) / sizeof(plane_props[0]);
+
+/* set_drm_object_property() of the first atomic example */
+static uint32_t lookup_baseline(const PropertyInfo* infos, uint32_t count, const char* name)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (!strcmp(infos[i].name, name)) {
+            return infos[i].prop_id;
+        }
+    }
+    return 0;
+}
+
+static void bench_property_lookup()
+{
+    static constexpr uint32_t lookups = static_cast<uint32_t>(PlaneProperty::Count);
+    PropertyInfo infos[plane_prop_count];
+    PlaneProperties table;
+    volatile uint32_t sink = 0;
+
+    memset(&table, 0, sizeof(table));
+    for (uint32_t i = 0; i < plane_prop_count; i++) {
+        infos[i].prop_id = 100 + i;
+        infos[i].flags = 0;
+        snprintf(infos[i].name, sizeof(infos[i].name), "%s", plane_props[i]);
+    }
+    for (uint32_t p = 0; p < lookups; p++) {
+        table.prop_ids[p] = lookup_baseline(infos, plane_prop_count, PropertyName(static_cast<PlaneProperty>(p)));
+    }
+
+    /* one flip's worth: every plane property the commit path knows */
+    Result baseline = measure([&] {
+        for (uint32_t p = 0; p < lookups; p++) {
+            sink = sink + lookup_baseline(infos, plane_prop_count, PropertyName(static_cast<PlaneProperty>(p)));
+        }
+    });
+    Result indexed = measure([&] {
+        for (uint32_t p = 0; p < lookups; p++) {
+            sink = sink + table.PropId(static_cast<PlaneProperty>(p));
+        }
+    });
+
+    for (const Result* result : { &baseline, &indexed }) {
+        char cycles[32] = "-";
+        if (result->cycles > 0) {
+            snprintf(cycles, sizeof(cycles), "%.1f", result->cycles / lookups);
+        }
+        printf("%-12s %-10s %10.2f ns/lookup %12s cycles/lookup\n", "prop lookup",
+               result == &baseline ? "strcmp" : "table", result->ns / lookups, cycles);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    static const uint32_t sizes[][2] = { { 640, 480 }, { 1920, 1080 }, { 3840, 2160 } };
+
+    if (argc > 1) {
+        min_seconds = atof(argv[1]);
+        if (min_seconds <= 0) {
+            fprintf(stderr, "usage: %s [seconds per case]\n", argv[0]);
+            return 1;
+        }
+    }
+
+#ifndef __OPTIMIZE__
+    fprintf(stderr, "[!] built without optimization, these numbers mean little.\n");
+#endif
+
+    cycles_fd = open_cycles();
+    printf("raster kernels up to %s, cycles %s\n\n", RasterIsaName(RasterDetectIsa()),
+           cycles_fd >= 0 ? "from perf" : "not available");
+
+    printf("%-12s %-10s %-10s %10s %10s %12s\n", "kernel", "variant", "size", "ns/pixel", "GB/s", "cycles/pixel");
+    for (const uint32_t* size : sizes) {
+        bench_fill(size[0], size[1]);
+        bench_copy(size[0], size[1]);
+        bench_row_copy(size[0], size[1]);
+        bench_blend(size[0], size[1]);
+        bench_convert(size[0], size[1]);
+    }
+    printf("\n");
+    bench_property_lookup();
+
+    if (cycles_fd >= 0) {
+        close(cycles_fd);
+    }
+    return 0;
+}
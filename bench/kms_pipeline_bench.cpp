@@ -0,0 +1,1131 @@
+/*
+ * kms_pipeline_bench - the whole KMS pipeline against vkms
+ *
+ * Runs the atomic example (examples/atomic.cpp) on vkms, the virtual KMS
+ * driver, and reads back the frame timing it writes to LABDRM_TIMING_JSON.
+ * That is the real pipeline: per-output render threads, the frame
+ * scheduler, damage tracking, the commit thread, and with the "planes"
+ * scenario LABDRM_LAYERS=4 sprites offloaded to planes and a
+ * LABDRM_CURSOR=60 pointer. For each allocator and scenario it reports
+ *
+ *  - flips per second over the whole run, startup included,
+ *  - the vblanks missed,
+ *  - p50 and p99 of the paint, copy, commit and flip stages, of the worst
+ *    output.
+ *
+ * The example uses the preferred mode of every connected output, so on vkms
+ * it runs once per allocator and scenario. It is found next to this binary,
+ * as drme_atomic or ../examples/atomic, or at LABDRM_BENCH_ATOMIC.
+ *
+ * Below that, a raw baseline makes the bare modeset and page-flip calls of
+ * atomic.cpp and legacy.cpp itself, through the same labdrm allocators,
+ * atomic requests and copy engine but with nothing else, at 1080p and 4K on
+ * 1, 2, 4 and 8 outputs. Against the pipeline numbers it shows what the
+ * pipeline costs. It measures
+ *
+ *  - time to first flip: from allocating the buffers to the page-flip event
+ *    of the modeset on every output,
+ *  - sustained flips per second, each output flipping as soon as its
+ *    previous flip completed,
+ *  - the latency of the commit ioctl (drmModePageFlip() for legacy),
+ *  - the latency of TEST_ONLY commits of the shown frames, in a loop of
+ *    their own after the flips (atomic only),
+ *  - the bandwidth of copying a full frame from a shadow buffer into the
+ *    scanout buffer, as atomic.cpp does.
+ *
+ * The results go to stdout as tables and to a JSON file, LABDRM_BENCH_JSON
+ * or kms_pipeline_bench.json in the current directory.
+ *
+ * Usage: kms_pipeline_bench [card] [seconds]
+ *
+ * `seconds` is the length of each run, 2 by default; the example stops by
+ * itself after 5.
+ *
+ * Without a card the first vkms device is used (modprobe vkms). vkms has one
+ * output unless more are configured through its configfs; combinations with
+ * more outputs than there are are reported as skipped, as are allocators
+ * which aren't available. Exits with 77, the skip code of meson, if there is
+ * no vkms device or it can't be made DRM master.
+ *
+ * The card "virtual" runs the same on the in-process virtual KMS device of
+ * labdrm/virtual_kms.h with dumb buffers, to compare it with vkms. It has
+ * max_outputs outputs with a 4K 60 Hz mode unless LABDRM_VIRTUAL says
+ * otherwise; the example then runs on a device of its own with each size and
+ * number of outputs of the baseline.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "allocator.h"
+#include "atomic_request.h"
+#include "copy_engine.h"
+#include "damage.h"
+#include "drm_property.h"
+#include "event_loop.h"
+#include "frame_timing.h"
+#include "virtual_kms.h"
+
+using namespace DrmLab;
+
+static constexpr uint32_t format = DRM_FORMAT_XRGB8888;
+static constexpr unsigned max_outputs = 8;
+static constexpr int skip_exit_code = 77;
+static constexpr unsigned test_only_rounds = 200;
+
+/*
+ * A connector with a CRTC and primary plane of its own, found once.
+ */
+struct Pipe
+{
+    uint32_t connector;
+    uint32_t crtc;
+    uint32_t plane;
+    std::vector<drmModeModeInfo> modes;
+};
+
+/*
+ * A pipe during one run, double buffered.
+ */
+struct Output
+{
+    ConnectorProperties connector;
+    CrtcProperties crtc;
+    PlaneProperties plane;
+    drmModeModeInfo mode;
+    uint32_t mode_blob;
+
+    Buffer bufs[2];
+    unsigned back; // the buffer the next frame goes to
+    uint8_t* shadow;
+    uint32_t shadow_stride;
+
+    bool pending;
+    bool shown; // the modeset completed
+    uint64_t flips;
+};
+
+struct Config
+{
+    bool atomic;
+    AllocatorBackend backend;
+    uint32_t width;
+    uint32_t height;
+    unsigned outputs;
+};
+
+/*
+ * What the atomic example gets on top of the environment for a run.
+ */
+struct Scenario
+{
+    const char* name;
+    const char* layers; // LABDRM_LAYERS, nullptr for none
+    const char* cursor; // LABDRM_CURSOR, nullptr for none
+};
+
+static const Scenario scenarios[] = {
+    { "fifo", nullptr, nullptr },
+    { "planes", "4", "60" },
+};
+
+struct StageResult
+{
+    double p50_ns;
+    double p99_ns;
+};
+
+/*
+ * A run of the atomic example, from its LABDRM_TIMING_JSON. The stages are
+ * those of the worst output.
+ */
+struct PipelineResult
+{
+    const char* skipped; // why, nullptr if it ran
+    double seconds;      // from starting the example to its exit
+    unsigned outputs;
+    uint64_t flips;
+    uint64_t missed_vblanks;
+    StageResult stages[static_cast<size_t>(FrameStage::Count)];
+};
+
+struct Result
+{
+    const char* skipped; // why, nullptr if it ran
+    double first_flip_ms;
+    double flips_per_second;
+    LatencyHistogram commit;
+    LatencyHistogram test_only;
+    uint64_t copy_bytes;
+    uint64_t copy_ns;
+};
+
+static int drm_fd = -1;
+static std::string card_path;                   // of the vkms device, for the example
+static std::unique_ptr<VirtualKms> virtual_kms; // if the card is "virtual"
+static VirtualKmsConfig virtual_config;
+static PropertyCache* prop_cache = nullptr;
+static std::vector<Pipe> pipes;
+static std::vector<Output>* run_outputs = nullptr; // of the run in progress
+
+/*
+ * The card given, or the first vkms device.
+ */
+static int open_vkms(const char* node)
+{
+    char path[64];
+
+    for (int i = 0; i < 16; i++) {
+        if (node == nullptr) {
+            snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+        }
+        int fd = open(node != nullptr ? node : path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            if (node != nullptr) {
+                return -errno;
+            }
+            continue;
+        }
+
+        drmVersionPtr version = drmGetVersion(fd);
+        bool vkms = version != nullptr && strcmp(version->name, "vkms") == 0;
+        drmFreeVersion(version);
+        if (vkms || node != nullptr) {
+            if (!vkms) {
+                fprintf(stderr, "[!] %s is not vkms, measuring it anyway.\n", node);
+            }
+            card_path = node != nullptr ? node : path;
+            return fd;
+        }
+        close(fd);
+    }
+    return -ENODEV;
+}
+
+static void close_device()
+{
+    if (virtual_kms != nullptr) {
+        virtual_kms.reset();
+    } else {
+        close(drm_fd);
+    }
+    drm_fd = -1;
+}
+
+static bool plane_used(uint32_t plane_id)
+{
+    for (const Pipe& pipe : pipes) {
+        if (pipe.plane == plane_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t find_primary_plane(const drmModePlaneRes* planes, unsigned crtc_index)
+{
+    for (uint32_t i = 0; i < planes->count_planes; i++) {
+        uint32_t plane_id = planes->planes[i];
+        if (plane_used(plane_id)) {
+            continue;
+        }
+
+        drmModePlanePtr plane = drmModeGetPlane(drm_fd, plane_id);
+        if (plane == nullptr) {
+            continue;
+        }
+        bool possible = (plane->possible_crtcs & (1u << crtc_index)) != 0;
+        drmModeFreePlane(plane);
+
+        ObjectSnapshot props(*prop_cache, plane_id, DRM_MODE_OBJECT_PLANE);
+        uint64_t type;
+        if (possible && props.Find("type", &type) && type == DRM_PLANE_TYPE_PRIMARY) {
+            return plane_id;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pair every connected connector with a free CRTC and its primary plane,
+ * like modeset_find_crtc() and modeset_find_plane() of atomic.cpp.
+ */
+static void find_pipes()
+{
+    drmModeResPtr res = drmModeGetResources(drm_fd);
+    drmModePlaneResPtr planes = drmModeGetPlaneResources(drm_fd);
+    uint32_t used_crtcs = 0;
+
+    if (res == nullptr || planes == nullptr) {
+        drmModeFreeResources(res);
+        drmModeFreePlaneResources(planes);
+        return;
+    }
+
+    for (int c = 0; c < res->count_connectors && pipes.size() < max_outputs; c++) {
+        drmModeConnectorPtr conn = drmModeGetConnector(drm_fd, res->connectors[c]);
+        if (conn == nullptr) {
+            continue;
+        }
+        if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0) {
+            drmModeFreeConnector(conn);
+            continue;
+        }
+
+        uint32_t possible = 0;
+        for (int e = 0; e < conn->count_encoders; e++) {
+            drmModeEncoderPtr enc = drmModeGetEncoder(drm_fd, conn->encoders[e]);
+            if (enc != nullptr) {
+                possible |= enc->possible_crtcs;
+                drmModeFreeEncoder(enc);
+            }
+        }
+
+        for (int i = 0; i < res->count_crtcs; i++) {
+            if (!(possible & (1u << i)) || (used_crtcs & (1u << i))) {
+                continue;
+            }
+            uint32_t plane = find_primary_plane(planes, i);
+            if (plane == 0) {
+                continue;
+            }
+            used_crtcs |= 1u << i;
+
+            Pipe pipe;
+            pipe.connector = conn->connector_id;
+            pipe.crtc = res->crtcs[i];
+            pipe.plane = plane;
+            pipe.modes.assign(conn->modes, conn->modes + conn->count_modes);
+            pipes.push_back(pipe);
+            break;
+        }
+        drmModeFreeConnector(conn);
+    }
+
+    drmModeFreePlaneResources(planes);
+    drmModeFreeResources(res);
+}
+
+/*
+ * The `width` x `height` mode of a pipe, the one closest to 60 Hz.
+ */
+static const drmModeModeInfo* find_mode(const Pipe& pipe, uint32_t width, uint32_t height)
+{
+    const drmModeModeInfo* best = nullptr;
+
+    for (const drmModeModeInfo& mode : pipe.modes) {
+        if (mode.hdisplay != width || mode.vdisplay != height) {
+            continue;
+        }
+        if (best == nullptr || abs(static_cast<int>(mode.vrefresh) - 60) < abs(static_cast<int>(best->vrefresh) - 60)) {
+            best = &mode;
+        }
+    }
+    return best;
+}
+
+static void page_flip_handler(int, unsigned int, unsigned int, unsigned int, unsigned int crtc_id, void* data)
+{
+    Output* out = static_cast<Output*>(data);
+
+    /* the events of the modeset carry no output, see modeset() */
+    for (size_t i = 0; out == nullptr && i < run_outputs->size(); i++) {
+        if ((*run_outputs)[i].crtc.id == crtc_id) {
+            out = &(*run_outputs)[i];
+        }
+    }
+    if (out == nullptr) {
+        return;
+    }
+
+    out->pending = false;
+    if (out->shown) {
+        out->flips++;
+    }
+    out->shown = true;
+}
+
+/*
+ * Wait for the events of all outputs until `done` says so or `deadline`
+ * passes.
+ * @return false on timeout or error
+ */
+template <typename Done>
+static bool wait_events(uint64_t deadline, Done done)
+{
+    static drmEventContext context = [] {
+        drmEventContext ctx = {};
+        ctx.version = 3;
+        ctx.page_flip_handler2 = page_flip_handler;
+        return ctx;
+    }();
+
+    while (!done()) {
+        uint64_t now = EventLoop::Now();
+        if (now >= deadline) {
+            return false;
+        }
+        struct pollfd pfd = { drm_fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, static_cast<int>((deadline - now + 999999) / 1000000));
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ret > 0 && drmHandleEvent(drm_fd, &context) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Fill the shadow with a gradient; what it shows doesn't matter, only that
+ * the copy touches every pixel.
+ */
+static void paint_shadow(Output* out, uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        uint32_t* row = reinterpret_cast<uint32_t*>(out->shadow + y * out->shadow_stride);
+        for (uint32_t x = 0; x < width; x++) {
+            row[x] = ((x * 255 / width) << 16) | ((y * 255 / height) << 8) | 0x80;
+        }
+    }
+}
+
+static int copy_frame(Allocator* allocator, CopyEngine* copy, Output* out, Result* result)
+{
+    Buffer* buf = &out->bufs[out->back];
+    Damage damage;
+
+    damage.SetFull(buf->width, buf->height);
+    if (allocator->BeginCpuAccess(buf) != 0 || buf->map == nullptr) {
+        return -EFAULT;
+    }
+    copy->Copy(buf->map, buf->map_stride, out->shadow, out->shadow_stride, 4, damage);
+    allocator->EndCpuAccess(buf);
+
+    result->copy_bytes += copy->LastStats().bytes;
+    result->copy_ns += copy->LastStats().ns;
+    return 0;
+}
+
+static void add_plane(AtomicRequest* req, const Output& out, uint32_t fb)
+{
+    uint32_t w = out.mode.hdisplay;
+    uint32_t h = out.mode.vdisplay;
+
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::FbId), fb);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcId), out.crtc.id);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::SrcX), 0);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::SrcY), 0);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::SrcW), static_cast<uint64_t>(w) << 16);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::SrcH), static_cast<uint64_t>(h) << 16);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcX), 0);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcY), 0);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcW), w);
+    req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcH), h);
+}
+
+/*
+ * Light up every output with its first buffer, in one atomic commit or with
+ * drmModeSetCrtc() and a page-flip each, as atomic.cpp and legacy.cpp do.
+ */
+static int modeset(const Config& config, AtomicRequest* req, std::vector<Output>& outputs)
+{
+    if (config.atomic) {
+        req->Rewind();
+        for (Output& out : outputs) {
+            req->Add(out.connector.id, out.connector.PropId(ConnectorProperty::CrtcId), out.crtc.id);
+            req->Add(out.crtc.id, out.crtc.PropId(CrtcProperty::ModeId), out.mode_blob);
+            req->Add(out.crtc.id, out.crtc.PropId(CrtcProperty::Active), 1);
+            add_plane(req, out, out.bufs[0].fb);
+            out.pending = true;
+        }
+        /* one event per CRTC, all with the same user_data, so the page-flip
+         * handler tells them apart by CRTC */
+        return req->Commit(drm_fd, DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK |
+                                       DRM_MODE_PAGE_FLIP_EVENT, nullptr);
+    }
+
+    for (Output& out : outputs) {
+        uint32_t connector = out.connector.id;
+        if (drmModeSetCrtc(drm_fd, out.crtc.id, out.bufs[0].fb, 0, 0, &connector, 1, &out.mode) != 0) {
+            return -errno;
+        }
+        if (drmModePageFlip(drm_fd, out.crtc.id, out.bufs[1].fb, DRM_MODE_PAGE_FLIP_EVENT, &out) != 0) {
+            return -errno;
+        }
+        out.pending = true;
+        out.back = 0;
+    }
+    return 0;
+}
+
+static void disable(const Config& config, AtomicRequest* req, std::vector<Output>& outputs)
+{
+    if (config.atomic) {
+        req->Rewind();
+        for (Output& out : outputs) {
+            req->Add(out.connector.id, out.connector.PropId(ConnectorProperty::CrtcId), 0);
+            req->Add(out.crtc.id, out.crtc.PropId(CrtcProperty::ModeId), 0);
+            req->Add(out.crtc.id, out.crtc.PropId(CrtcProperty::Active), 0);
+            req->Add(out.plane.id, out.plane.PropId(PlaneProperty::FbId), 0);
+            req->Add(out.plane.id, out.plane.PropId(PlaneProperty::CrtcId), 0);
+        }
+        req->Commit(drm_fd, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr);
+        return;
+    }
+
+    for (Output& out : outputs) {
+        drmModeSetCrtc(drm_fd, out.crtc.id, 0, 0, 0, nullptr, 0, nullptr);
+    }
+}
+
+static int setup_output(const Pipe& pipe, const drmModeModeInfo& mode, Output* out)
+{
+    memset(out, 0, sizeof(*out));
+    out->connector.id = pipe.connector;
+    out->crtc.id = pipe.crtc;
+    out->plane.id = pipe.plane;
+    out->mode = mode;
+
+    if (ResolveProperties(*prop_cache, &out->connector) < 0 || ResolveProperties(*prop_cache, &out->crtc) < 0 ||
+        ResolveProperties(*prop_cache, &out->plane) < 0) {
+        return -ENOENT;
+    }
+    if (drmModeCreatePropertyBlob(drm_fd, &out->mode, sizeof(out->mode), &out->mode_blob) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void free_output(Allocator* allocator, Output* out)
+{
+    for (Buffer& buf : out->bufs) {
+        if (buf.fb != 0) {
+            allocator->Free(&buf);
+        }
+    }
+    free(out->shadow);
+    if (out->mode_blob != 0) {
+        drmModeDestroyPropertyBlob(drm_fd, out->mode_blob);
+    }
+}
+
+/*
+ * Queue the next frame of `out`, which has no flip pending.
+ */
+static int flip(const Config& config, AtomicRequest* req, Allocator* allocator, CopyEngine* copy, Output* out,
+                Result* result)
+{
+    int ret = copy_frame(allocator, copy, out, result);
+    if (ret < 0) {
+        return ret;
+    }
+    uint32_t fb = out->bufs[out->back].fb;
+
+    uint64_t start = EventLoop::Now();
+    if (config.atomic) {
+        req->Rewind();
+        add_plane(req, *out, fb);
+        ret = req->Commit(drm_fd, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, out);
+    } else {
+        ret = drmModePageFlip(drm_fd, out->crtc.id, fb, DRM_MODE_PAGE_FLIP_EVENT, out) != 0 ? -errno : 0;
+    }
+    result->commit.Record(EventLoop::Now() - start);
+    if (ret < 0) {
+        return ret;
+    }
+
+    out->pending = true;
+    out->back ^= 1;
+    return 0;
+}
+
+/*
+ * TEST_ONLY commits of the frame each output shows, with no flip pending,
+ * timed on their own so that they don't slow down the flips.
+ */
+static void test_only(AtomicRequest* req, const std::vector<Output>& outputs, Result* result)
+{
+    for (unsigned i = 0; i < test_only_rounds; i++) {
+        for (const Output& out : outputs) {
+            req->Rewind();
+            add_plane(req, out, out.bufs[out.back ^ 1].fb);
+
+            uint64_t start = EventLoop::Now();
+            if (req->Commit(drm_fd, DRM_MODE_ATOMIC_TEST_ONLY, nullptr) < 0) {
+                return;
+            }
+            result->test_only.Record(EventLoop::Now() - start);
+        }
+    }
+}
+
+static void run(const Config& config, Allocator* allocator, uint64_t duration_ns, Result* result)
+{
+    std::unique_ptr<AtomicRequest> req = AtomicRequest::Create(AtomicBackendFromEnv());
+    CopyEngine copy(CopyEngine::ThreadsFromEnv());
+    std::vector<Output> outputs(config.outputs);
+    uint64_t start, end;
+    int ret = 0;
+
+    if (config.outputs > pipes.size()) {
+        result->skipped = "not enough outputs";
+        return;
+    }
+    run_outputs = &outputs;
+    for (unsigned i = 0; i < config.outputs; i++) {
+        const drmModeModeInfo* mode = find_mode(pipes[i], config.width, config.height);
+        if (mode == nullptr) {
+            result->skipped = "no such mode";
+            goto out_free;
+        }
+        ret = setup_output(pipes[i], *mode, &outputs[i]);
+        if (ret < 0) {
+            result->skipped = "cannot set up output";
+            goto out_free;
+        }
+    }
+
+    /* the first flip includes allocating, painting and copying */
+    start = EventLoop::Now();
+    for (Output& out : outputs) {
+        for (Buffer& buf : out.bufs) {
+            ret = allocator->Allocate(config.width, config.height, format, DRM_FORMAT_MOD_INVALID, &buf);
+            if (ret < 0) {
+                buf.fb = 0;
+                result->skipped = "cannot allocate";
+                goto out_free;
+            }
+        }
+        out.shadow_stride = config.width * 4;
+        out.shadow = static_cast<uint8_t*>(malloc(static_cast<size_t>(out.shadow_stride) * config.height));
+        if (out.shadow == nullptr) {
+            result->skipped = "out of memory";
+            goto out_free;
+        }
+        paint_shadow(&out, config.width, config.height);
+        if (copy_frame(allocator, &copy, &out, result) < 0) {
+            result->skipped = "cannot map";
+            goto out_free;
+        }
+        out.back = 1;
+    }
+
+    ret = modeset(config, req.get(), outputs);
+    if (ret < 0) {
+        result->skipped = "modeset failed";
+        goto out_free;
+    }
+    if (!wait_events(start + 5000000000ull, [&] {
+            for (Output& out : outputs) {
+                if (!out.shown) {
+                    return false;
+                }
+            }
+            return true;
+        })) {
+        result->skipped = "no page-flip event";
+        goto out_disable;
+    }
+    result->first_flip_ms = (EventLoop::Now() - start) / 1e6;
+
+    /* the copy of the first frame isn't part of the sustained bandwidth */
+    result->copy_bytes = 0;
+    result->copy_ns = 0;
+
+    start = EventLoop::Now();
+    end = start + duration_ns;
+    for (;;) {
+        for (Output& out : outputs) {
+            if (!out.pending && flip(config, req.get(), allocator, &copy, &out, result) < 0) {
+                result->skipped = "commit failed";
+                goto out_wait;
+            }
+        }
+        if (EventLoop::Now() >= end) {
+            break;
+        }
+        wait_events(end, [&] {
+            for (Output& out : outputs) {
+                if (!out.pending) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+    {
+        uint64_t flips = 0;
+        for (Output& out : outputs) {
+            flips += out.flips;
+        }
+        result->flips_per_second = flips * 1e9 / (EventLoop::Now() - start);
+    }
+
+out_wait:
+    wait_events(EventLoop::Now() + 1000000000ull, [&] {
+        for (Output& out : outputs) {
+            if (out.pending) {
+                return false;
+            }
+        }
+        return true;
+    });
+    if (config.atomic && result->skipped == nullptr) {
+        test_only(req.get(), outputs, result);
+    }
+out_disable:
+    disable(config, req.get(), outputs);
+out_free:
+    /* outputs not set up yet are still all zero */
+    for (Output& out : outputs) {
+        free_output(allocator, &out);
+    }
+    run_outputs = nullptr;
+}
+
+/*
+ * The atomic example: LABDRM_BENCH_ATOMIC, or where the CMake or meson build
+ * puts it relative to this binary. Empty if not found.
+ */
+static std::string find_example(const char* argv0)
+{
+    const char* path = getenv("LABDRM_BENCH_ATOMIC");
+    if (path != nullptr) {
+        return path;
+    }
+
+    std::string dir = argv0;
+    size_t slash = dir.rfind('/');
+    dir = slash != std::string::npos ? dir.substr(0, slash) : ".";
+    for (const char* name : { "/drme_atomic", "/../examples/atomic" }) {
+        if (access((dir + name).c_str(), X_OK) == 0) {
+            return dir + name;
+        }
+    }
+    return std::string();
+}
+
+/*
+ * The number after `"key": ` at or after `*pos`, moving `*pos` past it.
+ * Enough for the fixed layout of TimingStats::WriteJson().
+ */
+static bool json_number(const std::string& json, size_t* pos, const char* key, double* value)
+{
+    std::string needle = std::string("\"") + key + "\": ";
+    size_t at = json.find(needle, *pos);
+    if (at == std::string::npos) {
+        return false;
+    }
+
+    const char* start = json.c_str() + at + needle.size();
+    char* end;
+    *value = strtod(start, &end);
+    if (end == start) {
+        return false;
+    }
+    *pos = end - json.c_str();
+    return true;
+}
+
+static bool parse_timing(const std::string& json, PipelineResult* result)
+{
+    size_t pos = 0;
+    double value;
+
+    while (json_number(json, &pos, "connector", &value)) {
+        if (!json_number(json, &pos, "missed_vblanks", &value)) {
+            return false;
+        }
+        result->missed_vblanks += static_cast<uint64_t>(value);
+        result->outputs++;
+
+        for (size_t i = 0; i < static_cast<size_t>(FrameStage::Count); i++) {
+            StageResult* stage = &result->stages[i];
+            double count, p50, p99;
+
+            if (!json_number(json, &pos, "count", &count) || !json_number(json, &pos, "p50_ns", &p50) ||
+                !json_number(json, &pos, "p99_ns", &p99)) {
+                return false;
+            }
+            if (static_cast<FrameStage>(i) == FrameStage::Flip) {
+                result->flips += static_cast<uint64_t>(count);
+            }
+            stage->p50_ns = std::max(stage->p50_ns, p50);
+            stage->p99_ns = std::max(stage->p99_ns, p99);
+        }
+    }
+    return result->outputs != 0;
+}
+
+static std::string read_file(const char* path)
+{
+    std::string data;
+    char chunk[4096];
+    size_t n;
+
+    FILE* f = fopen(path, "r");
+    if (f == nullptr) {
+        return data;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.append(chunk, n);
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * Run the atomic example for `seconds` (it stops by itself after 5) with the
+ * `allocator`, on the vkms device or, with a `virtual_spec`, on a virtual
+ * device of its own.
+ */
+static void run_pipeline(const std::string& example, const char* allocator, const Scenario& scenario,
+                         const char* virtual_spec, double seconds, PipelineResult* result)
+{
+    static const char* const overridden[] = { "LABDRM_TIMING_JSON=", "LABDRM_ALLOCATOR=", "LABDRM_LAYERS=",
+                                              "LABDRM_CURSOR=", "LABDRM_VIRTUAL=" };
+    char json_path[] = "/tmp/kms_pipeline_bench.XXXXXX";
+    std::vector<std::string> env;
+    std::vector<char*> envp;
+    posix_spawn_file_actions_t actions;
+    int input[2], status;
+    pid_t pid, done;
+
+    int json_fd = mkstemp(json_path);
+    if (json_fd < 0) {
+        result->skipped = "cannot create a timing file";
+        return;
+    }
+    close(json_fd);
+
+    for (char** e = environ; *e != nullptr; e++) {
+        bool keep = true;
+        for (const char* name : overridden) {
+            keep = keep && strncmp(*e, name, strlen(name)) != 0;
+        }
+        if (keep) {
+            env.push_back(*e);
+        }
+    }
+    env.push_back(std::string("LABDRM_TIMING_JSON=") + json_path);
+    env.push_back(std::string("LABDRM_ALLOCATOR=") + allocator);
+    if (scenario.layers != nullptr) {
+        env.push_back(std::string("LABDRM_LAYERS=") + scenario.layers);
+    }
+    if (scenario.cursor != nullptr) {
+        env.push_back(std::string("LABDRM_CURSOR=") + scenario.cursor);
+    }
+    if (virtual_spec != nullptr) {
+        env.push_back(std::string("LABDRM_VIRTUAL=") + virtual_spec);
+    }
+    for (std::string& var : env) {
+        envp.push_back(&var[0]);
+    }
+    envp.push_back(nullptr);
+
+    const char* card = virtual_spec != nullptr ? "virtual" : card_path.c_str();
+    char* args[] = { const_cast<char*>(example.c_str()), const_cast<char*>(card), nullptr };
+
+    /* the example quits when its stdin closes, see modeset_stdin_event() */
+    if (pipe2(input, O_CLOEXEC) != 0) {
+        result->skipped = "cannot create a pipe";
+        unlink(json_path);
+        return;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input[0], 0);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    uint64_t start = EventLoop::Now();
+    int ret = posix_spawn(&pid, example.c_str(), &actions, nullptr, args, envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    close(input[0]);
+    if (ret != 0) {
+        close(input[1]);
+        result->skipped = "cannot start the example";
+        unlink(json_path);
+        return;
+    }
+
+    uint64_t deadline = start + static_cast<uint64_t>(seconds * 1e9);
+    while ((done = waitpid(pid, &status, WNOHANG)) == 0 && EventLoop::Now() < deadline) {
+        usleep(10000);
+    }
+    close(input[1]);
+    if (done == 0) {
+        done = waitpid(pid, &status, 0);
+    }
+    result->seconds = (EventLoop::Now() - start) / 1e9;
+
+    if (done != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        result->skipped = "the example failed";
+    } else if (!parse_timing(read_file(json_path), result)) {
+        result->skipped = "no timing from the example";
+    } else if (result->flips == 0) {
+        result->skipped = "no page-flip in time";
+    }
+    unlink(json_path);
+}
+
+static void write_histogram(FILE* f, const char* name, const LatencyHistogram& histogram)
+{
+    if (histogram.Count() == 0) {
+        fprintf(f, "\"%s\": null", name);
+        return;
+    }
+    fprintf(f, "\"%s\": {\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}", name,
+            static_cast<unsigned long long>(histogram.Count()),
+            static_cast<unsigned long long>(histogram.Percentile(0.5)),
+            static_cast<unsigned long long>(histogram.Percentile(0.99)),
+            static_cast<unsigned long long>(histogram.Max()));
+}
+
+static void write_result(FILE* f, const Config& config, const Result& result, bool first)
+{
+    fprintf(f, "%s\n    {\"path\": \"%s\", \"allocator\": \"%s\", \"width\": %u, \"height\": %u, \"outputs\": %u, ",
+            first ? "" : ",", config.atomic ? "atomic" : "legacy", AllocatorBackendName(config.backend),
+            config.width, config.height, config.outputs);
+    if (result.skipped != nullptr) {
+        fprintf(f, "\"skipped\": \"%s\"}", result.skipped);
+        return;
+    }
+    fprintf(f, "\"time_to_first_flip_ms\": %.3f, \"flips_per_second\": %.2f, ", result.first_flip_ms,
+            result.flips_per_second);
+    write_histogram(f, "commit", result.commit);
+    fprintf(f, ", ");
+    write_histogram(f, "test_only", result.test_only);
+    fprintf(f, ", \"copy_gbps\": %.3f}",
+            result.copy_ns != 0 ? static_cast<double>(result.copy_bytes) / result.copy_ns : 0.0);
+}
+
+static void write_pipeline_result(FILE* f, const char* allocator, const Scenario& scenario, uint32_t width,
+                                  uint32_t height, unsigned outputs, const PipelineResult& result, bool first)
+{
+    fprintf(f, "%s\n    {\"scenario\": \"%s\", \"allocator\": \"%s\", \"width\": %u, \"height\": %u, \"outputs\": %u, ",
+            first ? "" : ",", scenario.name, allocator, width, height, outputs);
+    if (result.skipped != nullptr) {
+        fprintf(f, "\"skipped\": \"%s\"}", result.skipped);
+        return;
+    }
+    fprintf(f, "\"seconds\": %.3f, \"flips_per_second\": %.2f, \"missed_vblanks\": %llu", result.seconds,
+            result.flips / result.seconds, static_cast<unsigned long long>(result.missed_vblanks));
+    for (size_t i = 0; i < static_cast<size_t>(FrameStage::Count); i++) {
+        fprintf(f, ", \"%s\": {\"p50_ns\": %.0f, \"p99_ns\": %.0f}", FrameStageName(static_cast<FrameStage>(i)),
+                result.stages[i].p50_ns, result.stages[i].p99_ns);
+    }
+    fprintf(f, "}");
+}
+
+static void print_pipeline_result(const char* allocator, const Scenario& scenario, uint32_t width, uint32_t height,
+                                  unsigned outputs, const PipelineResult& result)
+{
+    printf("%-7s %-7s %4ux%-5u %7u  ", scenario.name, allocator, width, height, outputs);
+    if (result.skipped != nullptr) {
+        printf("skipped: %s\n", result.skipped);
+        return;
+    }
+    printf("%9.1f %7llu", result.flips / result.seconds, static_cast<unsigned long long>(result.missed_vblanks));
+    for (const StageResult& stage : result.stages) {
+        printf(" %8.1f %8.1f", stage.p50_ns / 1e3, stage.p99_ns / 1e3);
+    }
+    printf("\n");
+}
+
+/*
+ * All runs of the atomic example: on vkms one per allocator and scenario
+ * with all outputs, on a virtual device also one per size and number of
+ * outputs.
+ */
+static void run_pipelines(FILE* json, const std::string& example, double seconds, const uint32_t (*sizes)[2],
+                          size_t size_count)
+{
+    bool first = true;
+
+    printf("\n%-7s %-7s %-10s %7s  %9s %7s", "example", "alloc", "size", "outputs", "flips/s", "missed");
+    for (size_t i = 0; i < static_cast<size_t>(FrameStage::Count); i++) {
+        const char* name = FrameStageName(static_cast<FrameStage>(i));
+        printf(" %5s_us %5s_99", name, name);
+    }
+    printf("\n");
+
+    std::vector<const char*> allocators = { "shm", "gbm" };
+    if (virtual_kms != nullptr) {
+        allocators = { "dumb" };
+    }
+    for (const char* allocator : allocators) {
+        for (const Scenario& scenario : scenarios) {
+            if (virtual_kms == nullptr) {
+                PipelineResult result = {};
+
+                if (example.empty()) {
+                    result.skipped = "atomic example not found";
+                } else {
+                    run_pipeline(example, allocator, scenario, nullptr, seconds, &result);
+                }
+                print_pipeline_result(allocator, scenario, pipes[0].modes[0].hdisplay,
+                                      pipes[0].modes[0].vdisplay, pipes.size(), result);
+                write_pipeline_result(json, allocator, scenario, pipes[0].modes[0].hdisplay,
+                                      pipes[0].modes[0].vdisplay, pipes.size(), result, first);
+                first = false;
+                continue;
+            }
+
+            for (size_t s = 0; s < size_count; s++) {
+                for (unsigned outputs = 1; outputs <= max_outputs; outputs *= 2) {
+                    PipelineResult result = {};
+                    char spec[128];
+
+                    snprintf(spec, sizeof(spec), "outputs=%u,refresh=%g,latency_us=%llu,mode=%ux%u,overlays=%u",
+                             outputs, virtual_config.refresh,
+                             static_cast<unsigned long long>(virtual_config.commit_latency_ns / 1000), sizes[s][0],
+                             sizes[s][1], virtual_config.overlays);
+                    if (example.empty()) {
+                        result.skipped = "atomic example not found";
+                    } else {
+                        run_pipeline(example, allocator, scenario, spec, seconds, &result);
+                    }
+                    print_pipeline_result(allocator, scenario, sizes[s][0], sizes[s][1], outputs, result);
+                    write_pipeline_result(json, allocator, scenario, sizes[s][0], sizes[s][1], outputs, result,
+                                          first);
+                    first = false;
+                }
+            }
+        }
+    }
+}
+
+static void print_result(const Config& config, const Result& result)
+{
+    printf("%-7s %-5s %4ux%-5u %7u  ", config.atomic ? "atomic" : "legacy", AllocatorBackendName(config.backend),
+           config.width, config.height, config.outputs);
+    if (result.skipped != nullptr) {
+        printf("skipped: %s\n", result.skipped);
+        return;
+    }
+    printf("%9.2f %9.1f %10.1f %10.1f %10.1f %8.2f\n", result.first_flip_ms, result.flips_per_second,
+           result.commit.Percentile(0.5) / 1e3, result.commit.Percentile(0.99) / 1e3,
+           result.test_only.Count() != 0 ? result.test_only.Percentile(0.5) / 1e3 : 0.0,
+           result.copy_ns != 0 ? static_cast<double>(result.copy_bytes) / result.copy_ns : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* node = argc > 1 ? argv[1] : nullptr;
+    double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    const char* json_path = getenv("LABDRM_BENCH_JSON");
+    static const uint32_t sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+    bool first = true;
+
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [card] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    if (node != nullptr && strcmp(node, "virtual") == 0) {
+        const char* spec = getenv("LABDRM_VIRTUAL");
+
+        virtual_config.outputs = max_outputs;
+        virtual_config.width = 3840;
+        virtual_config.height = 2160;
+        if (spec != nullptr && !VirtualKms::ParseConfig(spec, &virtual_config)) {
+            fprintf(stderr, "invalid LABDRM_VIRTUAL=%s\n", spec);
+            return 1;
+        }
+        virtual_kms = VirtualKms::Create(virtual_config);
+        if (virtual_kms == nullptr) {
+            return 1;
+        }
+        drm_fd = virtual_kms->Fd();
+    } else {
+        drm_fd = open_vkms(node);
+    }
+    if (drm_fd < 0) {
+        fprintf(stderr, "no vkms device, skipping (modprobe vkms)\n");
+        return skip_exit_code;
+    }
+    if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 ||
+        drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0 || drmSetMaster(drm_fd) != 0) {
+        fprintf(stderr, "cannot become DRM master with atomic modesetting, skipping\n");
+        close_device();
+        return skip_exit_code;
+    }
+
+    prop_cache = new PropertyCache(drm_fd);
+    find_pipes();
+    if (pipes.empty()) {
+        fprintf(stderr, "no connected output, skipping\n");
+        delete prop_cache;
+        close_device();
+        return skip_exit_code;
+    }
+
+    FILE* json = fopen(json_path != nullptr ? json_path : "kms_pipeline_bench.json", "w");
+    if (json == nullptr) {
+        fprintf(stderr, "cannot write results: %m\n");
+        delete prop_cache;
+        close_device();
+        return 1;
+    }
+    fprintf(json, "{\"device\": \"%s\", \"outputs_available\": %zu, \"seconds\": %.3f, \"raw\": [",
+            virtual_kms != nullptr ? "virtual" : "vkms", pipes.size(), seconds);
+
+    printf("%-7s %-5s %-10s %7s  %9s %9s %10s %10s %10s %8s\n", "path", "alloc", "size", "outputs", "first_ms",
+           "flips/s", "commit_us", "c_p99_us", "test_us", "copy_GBs");
+    /* a virtual device only has dumb buffers */
+    std::vector<AllocatorBackend> backends = { AllocatorBackend::Shm, AllocatorBackend::Gbm };
+    if (virtual_kms != nullptr) {
+        backends = { AllocatorBackend::Dumb };
+    }
+    for (AllocatorBackend backend : backends) {
+        std::unique_ptr<Allocator> allocator = Allocator::Create(backend, drm_fd);
+
+        for (const uint32_t* size : sizes) {
+            for (bool atomic : { true, false }) {
+                for (unsigned outputs = 1; outputs <= max_outputs; outputs *= 2) {
+                    Config config = { atomic, backend, size[0], size[1], outputs };
+                    std::unique_ptr<Result> result(new Result());
+
+                    if (allocator == nullptr) {
+                        result->skipped = "allocator not available";
+                    } else {
+                        run(config, allocator.get(), static_cast<uint64_t>(seconds * 1e9), result.get());
+                    }
+                    print_result(config, *result);
+                    write_result(json, config, *result, first);
+                    first = false;
+                }
+            }
+        }
+    }
+
+    /* the example has to become DRM master of vkms itself */
+    fprintf(json, "\n], \"pipeline\": [");
+    if (virtual_kms == nullptr) {
+        drmDropMaster(drm_fd);
+    }
+    run_pipelines(json, find_example(argv[0]), seconds, sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+    fprintf(json, "\n]}\n");
+    fclose(json);
+    delete prop_cache;
+    close_device();
+    return 0;
+}
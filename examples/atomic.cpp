@@ -0,0 +1,2394 @@
+/*
+ * modeset-atomic - DRM Atomic-API Modesetting Example
+ * Written 2019 by Ezequiel Garcia <ezequiel@collabora.com>
+ *
+ * Dedicated to the Public Domain.
+ */
+
+/*
+ * DRM Double-Buffered VSync'ed Atomic Modesetting Howto
+ * This example extends modeset-vsync.c, introducing planes and the
+ * atomic API.
+ *
+ * Planes can be used to blend or overlay images on top of a CRTC
+ * framebuffer during the scanout process. Not all hardware provide
+ * planes and the number of planes available is also limited. If there's
+ * not enough planes available or the hardware does not provide them,
+ * users should fallback to composition via GPU or CPU to blend or
+ * overlay the planes. Notice that this render process will result
+ * in delay, what justifies the usage of planes by modern hardware
+ * that needs to be fast.
+ *
+ * There are three types of planes: primary, cursor and overlay. For
+ * compatibility with legacy userspace, the default behavior is to expose
+ * only overlay planes to userspace (we're going to see in the code that
+ * we have to ask to receive all types of planes). A good example of plane
+ * usage is this: imagine a static desktop screen and the user is moving
+ * the cursor around. Only the cursor is moving. Instead of calculating the
+ * complete scene for each time the user moves its cursor, we can update only
+ * the cursor plane and it will be automatically overlayed by the hardware on
+ * top of the primary plane. There's no need of software composition in this
+ * case.
+ *
+ * But there was synchronisation problems related to multiple planes
+ * usage. The KMS API was not atomic, so you'd have to update the primary
+ * plane and then the overlay planes with distinct IOCTL's. This could lead
+ * to tearing and also some trouble related to blocking, so the atomic
+ * API was proposed to fix these problems.
+ *
+ * With the introduction of the KMS atomic API, all the planes could get
+ * updated in a single IOCTL, using drmModeAtomicCommit(). This can be
+ * either asynchronous or fully blocking.
+ *
+ * This example assumes that you are familiar with modeset-vsync. Only
+ * the differences between both files are highlighted here.
+ */
+
+#define _GNU_SOURCE
+#define EGL_EGLEXT_PROTOTYPES
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <libudev.h>
+#include <memory>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "allocator.h"
+#include "swapchain.h"
+#include "drm_property.h"
+#include "atomic_state.h"
+#include "atomic_request.h"
+#include "alloc_counter.h"
+#include "damage.h"
+#include "raster.h"
+#include "copy_engine.h"
+#include "event_loop.h"
+#include "spsc_ring.h"
+#include "frame_scheduler.h"
+#include "vblank_clock.h"
+#include "frame_timing.h"
+#include "tracer.h"
+#include "virtual_kms.h"
+#include "output_assigner.h"
+#include "cursor.h"
+#include "plane_offload.h"
+
+/* only in recent kernel headers */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+/*
+ * The connector, CRTC and plane objects are stored as property tables (see
+ * labdrm/drm_property.h). Each one holds the object id plus the ids of the
+ * properties that are used in atomic modeset setup and also in atomic
+ * page-flips (all planes updated in a single IOCTL). The ids are resolved by
+ * name once, so a page-flip never has to search for a property.
+ *
+ * Next to them, each output keeps its atomic state (see labdrm/atomic_state.h):
+ * the property values we want, and the values the kernel has already accepted.
+ * A commit only carries the properties that differ, which for a page-flip is
+ * usually just the plane's FB_ID.
+ */
+
+/*
+ * Frames travel from the render worker of an output to the commit thread,
+ * and framebuffers back once the commit thread is done with them, through a
+ * pair of lock-free rings (see labdrm/spsc_ring.h). An eventfd next to each
+ * ring wakes up the other side. See modeset_worker().
+ *
+ * A ring never holds more than all framebuffers of the output, so pushing
+ * never fails.
+ */
+
+struct modeset_frame {
+	DrmLab::Buffer *buf;
+	DrmLab::Damage damage;
+	DrmLab::LayerStack layers;	/* the sprites, as painted */
+};
+
+struct modeset_return {
+	DrmLab::Buffer *buf;
+	bool presented;		/* on screen now, or dropped unseen */
+	uint32_t sequence;	/* vblank of the page-flip, if presented */
+	uint64_t timestamp;
+};
+
+struct modeset_pipe {
+	std::thread thread;
+	DrmLab::SpscRing<modeset_frame, DrmLab::Swapchain::max_buffers> frames;
+	DrmLab::SpscRing<modeset_return, DrmLab::Swapchain::max_buffers> returns;
+	int frames_fd;		/* readable by the commit thread */
+	int returns_fd;		/* read by the worker */
+	std::atomic<bool> quit;
+
+	/* when the worker starts each frame, NULL to start right away */
+	DrmLab::FrameScheduler *scheduler;
+
+	/* the time of the vblank the worker's next frame is for: 0 if it
+	 * comes right away, UINT64_MAX while the worker waits for a
+	 * framebuffer */
+	std::atomic<uint64_t> target;
+};
+
+struct modeset_output {
+	struct modeset_output *next;
+
+	/*
+	 * The framebuffers of this output (LABDRM_BUFFERS of them, 2 by
+	 * default). Once the render worker runs, the swapchain is its own,
+	 * like everything it paints with, down to the band colors below.
+	 * `ready` holds a rendered frame which the commit thread hasn't
+	 * committed yet, `flipping` the one whose page-flip is pending. See
+	 * modeset_draw_out().
+	 */
+	DrmLab::Swapchain *swapchain;
+	DrmLab::Buffer *ready;
+	DrmLab::Buffer *flipping;
+	struct modeset_pipe *pipe;
+
+	/*
+	 * Unless the allocator's buffers have a cached CPU mapping, we paint into
+	 * a shadow buffer, which always holds the latest frame, and copy what a
+	 * framebuffer lacks from it with our own copy engine, see
+	 * modeset_paint_framebuffer(). NULL when painting directly.
+	 */
+	uint8_t *shadow;
+	uint32_t shadow_stride;
+	DrmLab::CopyEngine *copy_engine;
+
+	DrmLab::ConnectorProperties connector;
+	DrmLab::CrtcProperties crtc;
+	DrmLab::PlaneProperties plane;
+
+	DrmLab::OutputState state;
+	DrmLab::OutputState::Dirty pending;
+	DrmLab::AtomicRequest *req;
+
+	drmModeModeInfo mode;
+	uint32_t mode_blob_id;
+	uint32_t crtc_index;
+
+	bool pflip_pending;
+	bool cleanup;
+
+	/*
+	 * The vblank clock of our CRTC (see labdrm/vblank_clock.h), NULL if
+	 * the device doesn't timestamp vblanks with CLOCK_MONOTONIC. Only the
+	 * commit thread reads it.
+	 */
+	DrmLab::VBlankClock *vblank;
+
+	/*
+	 * How long each stage of our frames takes (see labdrm/frame_timing.h).
+	 * The render worker and the commit thread record into a ring each, the
+	 * commit thread adds them up in `timing` as it goes. `commit_ns` is
+	 * when the frame in flight was committed.
+	 */
+	DrmLab::TimingRecorder *render_timing;
+	DrmLab::TimingRecorder *commit_timing;
+	DrmLab::TimingStats *timing;
+	uint64_t commit_ns;
+
+	uint8_t r, g, b;
+	bool r_up, g_up, b_up;
+
+	/*
+	 * Damage tracking, see modeset_paint_framebuffer(). The picture is 8
+	 * bands of rows and every frame only repaints one of them, so only that
+	 * band has to be uploaded by the driver.
+	 */
+	unsigned int band;
+	uint32_t band_colors[8];
+	DrmLab::Damage damage;
+	uint32_t damage_blob_id;
+
+	/*
+	 * Damage since the frame last committed, for FB_DAMAGE_CLIPS. More than
+	 * `damage` when Mailbox replaced uncommitted frames.
+	 */
+	DrmLab::Damage present_damage;
+
+	/*
+	 * The sprites of LABDRM_LAYERS, see modeset_move_layers(): `layers`
+	 * and their velocities belong to the render worker, `ready_layers` to
+	 * the ready frame. The plane offload engine decides which sprites go on
+	 * planes; NULL without sprites or free planes, then all are composited.
+	 */
+	DrmLab::PlaneOffload *offload;
+	DrmLab::LayerStack layers;
+	DrmLab::LayerStack ready_layers;
+	int32_t layer_dx[DrmLab::LayerStack::max_layers];
+	int32_t layer_dy[DrmLab::LayerStack::max_layers];
+
+	/*
+	 * The pointer of LABDRM_CURSOR on the CRTC's cursor plane, see
+	 * modeset_cursor_event(), and where it is going. Only the commit
+	 * thread uses it. `cursor_pending` is set while a commit which moved
+	 * nothing but the cursor is in flight.
+	 */
+	DrmLab::HardwareCursor *cursor;
+	bool cursor_pending;
+	int32_t cursor_x, cursor_y;
+	int32_t cursor_dx, cursor_dy;
+};
+static struct modeset_output *output_list = NULL;
+
+/*
+ * Property ids (and so their names and flags) are the same for every object of
+ * a device. We keep a single cache of property metadata for all outputs, so a
+ * property is only fetched from the kernel the first time we see it.
+ */
+static DrmLab::PropertyCache *prop_cache = NULL;
+
+/*
+ * Which connector gets which CRTC and primary plane is decided for all
+ * outputs at once (see labdrm/output_assigner.h): taking the first free CRTC
+ * connector by connector can leave a later one without any.
+ */
+static DrmLab::OutputAssigner *assigner = NULL;
+
+/*
+ * Which commit path the atomic requests use: libdrm's drmModeAtomicCommit(), or
+ * labdrm building the DRM_IOCTL_MODE_ATOMIC arguments itself. Selected with
+ * LABDRM_ATOMIC=libdrm|direct.
+ */
+static DrmLab::AtomicBackend atomic_backend = DrmLab::AtomicBackend::Libdrm;
+
+/*
+ * Where the framebuffers come from: dumb buffers, udmabuf'ed shm, a DMA-BUF
+ * heap or GBM. It is probed once, by the first output, for the cheapest one
+ * the primary plane can scan out (see labdrm/allocator.h), and can be forced
+ * with LABDRM_ALLOCATOR=dumb|shm|gbm|dmaheap.
+ */
+static DrmLab::Allocator *allocator = NULL;
+
+/*
+ * Each output's copy engine copies what we painted from its shadow buffer to
+ * the framebuffers. Large copies use non-temporal stores and are split across
+ * LABDRM_COPY_THREADS threads. The bandwidth of every frame's copy is added
+ * up here, by all render workers.
+ */
+static std::mutex copy_stats_lock;
+static uint64_t copy_frames = 0;
+static uint64_t copy_bytes = 0;
+static uint64_t copy_ns = 0;
+static double copy_min_gbps = 0.0;
+static double copy_max_gbps = 0.0;
+
+/* heap allocations made by page-flips, see modeset_present() */
+static uint64_t flip_count = 0;
+static uint64_t flip_allocs = 0;
+
+/*
+ * When rendered frames are shown, selected with
+ * LABDRM_PRESENT=fifo|mailbox|immediate, see modeset_draw(). We count the
+ * frames Mailbox dropped and the commits which found the previous one still
+ * in flight and were retried later.
+ */
+static DrmLab::PresentMode present_mode = DrmLab::PresentMode::Fifo;
+static std::atomic<uint64_t> frames_rendered(0);
+
+/*
+ * How much earlier than strictly needed a frame starts rendering, see
+ * modeset_worker(); LABDRM_SCHED_MARGIN_US, -1 if scheduling is off.
+ */
+static int64_t sched_margin = -1;
+static uint64_t frames_dropped = 0;
+static uint64_t commits_busy = 0;
+
+/*
+ * The event loop of modeset_draw(), see there. `retry_timer` wakes it up
+ * to retry a commit which failed with EBUSY.
+ */
+static DrmLab::EventLoop *event_loop = NULL;
+static int retry_timer = -1;
+
+/*
+ * With LABDRM_TRACE=<file>, paint, copy and commit are marked in a tracefs
+ * instance along with the kernel's DRM events, and written to the file as a
+ * Chrome JSON trace, see modeset_trace_begin().
+ */
+static DrmLab::Tracer *tracer = NULL;
+
+/*
+ * With LABDRM_VIRTUAL set (e.g. "outputs=32,refresh=240"), modeset_open()
+ * opens an in-process virtual KMS device instead of the card, see
+ * labdrm/virtual_kms.h. Everything else runs unchanged on its fd, so the
+ * whole frame pipeline can be profiled at any number of outputs without
+ * hardware or root.
+ */
+static DrmLab::VirtualKms *virtual_kms = NULL;
+
+/*
+ * With LABDRM_LAYERS=n (up to 8), n translucent sprites bounce over the
+ * bands of every output. The outputs share their premultiplied ARGB8888
+ * framebuffers, and a copy of their pixels in cached memory for
+ * compositing. Each output puts as many as it can on its overlay and cursor
+ * planes (see labdrm/plane_offload.h); we count the commits which the
+ * driver rejected anyway.
+ */
+#define SPRITE_SIZE 256
+static unsigned int layer_count = 0;
+static DrmLab::Buffer sprites[DrmLab::LayerStack::max_layers];
+static uint8_t *sprite_pixels[DrmLab::LayerStack::max_layers];
+static uint64_t layers_rejected = 0;
+
+/*
+ * With LABDRM_CURSOR=<Hz>, a pointer moves over every output as if a mouse
+ * sent that many events a second. It is an image on the cursor plane (see
+ * labdrm/cursor.h), so moving it paints and copies nothing: the move rides
+ * along with the next frame, or goes in a commit of its own while the CRTC
+ * has nothing else pending. We count both.
+ */
+#define CURSOR_IMAGE_WIDTH 16
+#define CURSOR_IMAGE_HEIGHT 24
+static unsigned int cursor_rate = 0;
+static int cursor_timer = -1;
+static uint64_t cursor_events = 0;
+static uint64_t cursor_commits = 0;
+
+/*
+ * modeset_open() changes just a little bit. We now have to set that we're going
+ * to use the KMS atomic API and check if the device is capable of handling it.
+ */
+
+static int modeset_open(int *out, const char *node)
+{
+	int fd, ret;
+	uint64_t cap;
+
+	virtual_kms = DrmLab::VirtualKms::FromEnv().release();
+	if (virtual_kms) {
+		fprintf(stderr, "using a virtual KMS device with %u outputs "
+			"instead of '%s'\n", virtual_kms->Config().outputs, node);
+		fd = virtual_kms->Fd();
+	} else {
+		fd = open(node, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			ret = -errno;
+			fprintf(stderr, "cannot open '%s': %m\n", node);
+			return ret;
+		}
+	}
+
+	/* Set that we want to receive all the types of planes in the list. This
+	 * have to be done since, for legacy reasons, the default behavior is to
+	 * expose only the overlay planes to the users. The atomic API only
+	 * works if this is set.
+	 */
+	ret = drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	if (ret) {
+		fprintf(stderr, "failed to set universal planes cap, %d\n", ret);
+		return ret;
+	}
+
+	/* Here we set that we're going to use the KMS atomic API. It's supposed
+	 * to set the DRM_CLIENT_CAP_UNIVERSAL_PLANES automatically, but it's a
+	 * safe behavior to set it explicitly as we did in the previous
+	 * commands. This is also good for learning purposes.
+	 */
+	ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		fprintf(stderr, "failed to set atomic cap, %d", ret);
+		return ret;
+	}
+
+	if (drmGetCap(fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap) < 0 || !cap) {
+		fprintf(stderr, "drm device '%s' does not support atomic KMS\n",
+			node);
+		close(fd);
+		return -EOPNOTSUPP;
+	}
+
+	/* tearing page-flips with the atomic API need driver support */
+	if (present_mode == DrmLab::PresentMode::Immediate &&
+	    (drmGetCap(fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) < 0 || !cap)) {
+		fprintf(stderr, "drm device '%s' does not support atomic async "
+			"page-flips, using mailbox\n", node);
+		present_mode = DrmLab::PresentMode::Mailbox;
+	}
+
+	*out = fd;
+	return 0;
+}
+
+/*
+ * modeset_setup_objects() is a new function. It resolves the ids of the
+ * connector, CRTC and plane properties that we use during the atomic
+ * modesetting commit and the page-flips, and saves them in our struct
+ * modeset_output object. This is the only place where properties are looked
+ * up by name.
+ */
+
+static int modeset_setup_objects(int fd, struct modeset_output *out)
+{
+	int ret;
+
+	/* resolve connector properties */
+	ret = DrmLab::ResolveProperties(*prop_cache, &out->connector);
+	if (ret)
+		return ret;
+
+	/* resolve CRTC properties */
+	ret = DrmLab::ResolveProperties(*prop_cache, &out->crtc);
+	if (ret)
+		return ret;
+
+	/* resolve plane properties */
+	return DrmLab::ResolveProperties(*prop_cache, &out->plane);
+}
+
+static bool modeset_test_scanout(int fd, struct modeset_output *out,
+				 const DrmLab::Buffer *buf);
+
+/*
+ * modeset_setup_framebuffers() creates framebuffers for the back and front
+ * buffers of a certain output. Also, it copies the connector mode to these
+ * buffers.
+ *
+ * The first output also picks the allocator for all of them: every backend
+ * is asked for a buffer of this mode, and the first one the primary plane
+ * accepts in a TEST_ONLY commit wins. Scanning out of a buffer the CPU can
+ * paint into cheaply saves a full copy every frame, so this is a runtime
+ * decision rather than a choice of example binary.
+ */
+
+static int modeset_setup_framebuffers(int fd, struct modeset_output *out)
+{
+	uint32_t width = out->mode.hdisplay;
+	uint32_t height = out->mode.vdisplay;
+	size_t shadow_size;
+	int ret;
+
+	if (!allocator) {
+		allocator = DrmLab::ProbeAllocator(fd, width, height, DRM_FORMAT_XRGB8888,
+			[fd, out](const DrmLab::Buffer &buf) {
+				return modeset_test_scanout(fd, out, &buf);
+			}).release();
+		if (!allocator) {
+			fprintf(stderr, "no allocator can scan out %ux%u XRGB8888\n",
+				width, height);
+			return -ENODEV;
+		}
+		fprintf(stdout, "using the %s allocator, painting %s\n",
+			DrmLab::AllocatorBackendName(allocator->Backend()),
+			allocator->Has(DrmLab::AllocatorCapCpuCached) ?
+			"into the framebuffers" : "into a shadow buffer");
+	}
+
+	/* setup the framebuffers */
+	out->swapchain = new DrmLab::Swapchain(allocator);
+	ret = out->swapchain->Allocate(DrmLab::Swapchain::BuffersFromEnv(),
+				       width, height, DRM_FORMAT_XRGB8888,
+				       DRM_FORMAT_MOD_INVALID);
+	if (ret)
+		goto err_swapchain;
+	fprintf(stdout, "%u framebuffers for connector %u\n",
+		out->swapchain->Count(), out->connector.id);
+
+	/* Write-combined (or, with GBM, staged) mappings are slow to paint
+	 * into and very slow to read back, so paint into cached memory and
+	 * only copy the result. */
+	if (!allocator->Has(DrmLab::AllocatorCapCpuCached)) {
+		out->shadow_stride = width * 4;
+		shadow_size = (size_t)out->shadow_stride * height;
+		if (posix_memalign((void **)&out->shadow, 64, shadow_size)) {
+			out->shadow = NULL;
+			ret = -ENOMEM;
+			goto err_swapchain;
+		}
+		memset(out->shadow, 0, shadow_size);
+		out->copy_engine = new DrmLab::CopyEngine(
+			DrmLab::CopyEngine::ThreadsFromEnv());
+	}
+
+	return 0;
+
+err_swapchain:
+	delete out->swapchain;
+	out->swapchain = NULL;
+	return ret;
+}
+
+/*
+ * modeset_output_destroy() is new. It destroys the front and back buffers,
+ * the mode blob property and then destroys the output itself.
+ */
+
+static void modeset_output_destroy(int fd, struct modeset_output *out)
+{
+	/* destroy the framebuffers and the shadow */
+	delete out->swapchain;
+	free(out->shadow);
+	delete out->copy_engine;
+
+	/* destroy mode blob property */
+	drmModeDestroyPropertyBlob(fd, out->mode_blob_id);
+
+	/* destroy the page-flip request */
+	delete out->req;
+	delete out->vblank;
+	delete out->offload;
+	delete out->cursor;
+
+	/* destroy the timing statistics */
+	delete out->render_timing;
+	delete out->commit_timing;
+	delete out->timing;
+
+	free(out);
+}
+
+/*
+ * Refresh period of a mode in nanoseconds: the pixel clock is in kHz.
+ */
+
+static uint64_t modeset_mode_period(const drmModeModeInfo *mode)
+{
+	if (!mode->clock)
+		return 0;
+	return (uint64_t)mode->htotal * mode->vtotal * 1000000ull / mode->clock;
+}
+
+/*
+ * modeset_output_create() allocates an output for a connector with a monitor,
+ * in the connector's preferred mode.
+ *
+ * Besides that, we have to create a blob property that receives the output
+ * mode. When we perform an atomic commit, the driver expects a CRTC property
+ * named "MODE_ID", which points to the id of a blob. This usually happens for
+ * properties that are not simple types. In this particular case, out->mode is a
+ * struct. But we could have another property that expects the id of a blob that
+ * holds an array, for instance.
+ */
+
+static struct modeset_output *modeset_output_create(int fd,
+						    drmModeConnector *conn)
+{
+	struct modeset_output *out;
+
+	/* creates an output structure */
+	out = static_cast<modeset_output*>(malloc(sizeof(*out)));
+	memset(out, 0, sizeof(*out));
+	out->connector.id = conn->connector_id;
+
+	/* check if a monitor is connected */
+	if (conn->connection != DRM_MODE_CONNECTED) {
+		fprintf(stderr, "[!] ignoring unused connector %u\n",
+			conn->connector_id);
+		goto out_error;
+	}
+
+	/* check if there is at least one valid mode */
+	if (conn->count_modes == 0) {
+		fprintf(stderr, "[!] no valid mode for connector %u\n",
+			conn->connector_id);
+		goto out_error;
+	}
+
+	/* copy the mode information into our output structure */
+	memcpy(&out->mode, &conn->modes[0], sizeof(out->mode));
+	/* create the blob property using out->mode and save its id in the output*/
+	if (drmModeCreatePropertyBlob(fd, &out->mode, sizeof(out->mode),
+	                              &out->mode_blob_id) != 0) {
+		fprintf(stderr, "[!] couldn't create a blob property\n");
+		goto out_error;
+	}
+	fprintf(stderr, "[!] mode for connector %u is %ux%u\n",
+	        conn->connector_id, out->mode.hdisplay, out->mode.vdisplay);
+
+	return out;
+
+out_error:
+	free(out);
+	return NULL;
+}
+
+/*
+ * modeset_free_sprites() is new. It destroys the framebuffers and CPU copies
+ * of the sprites.
+ */
+
+static void modeset_free_sprites(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DrmLab::LayerStack::max_layers; ++i) {
+		if (sprites[i].fb)
+			allocator->Free(&sprites[i]);
+		free(sprite_pixels[i]);
+		sprite_pixels[i] = NULL;
+	}
+}
+
+/*
+ * modeset_setup_sprites() is new. It creates the framebuffers of the
+ * sprites, each a disc in its own color with a soft edge, once for all
+ * outputs. If one fails, the others are freed again.
+ */
+
+static int modeset_setup_sprites(void)
+{
+	static const uint32_t colors[] = { 0xff4040, 0x40ff40, 0x4040ff, 0xffff40,
+					   0xff40ff, 0x40ffff, 0xffffff, 0xff8000 };
+	/* squared distances from the center, doubled to hit pixel centers */
+	const int32_t outer = SPRITE_SIZE * SPRITE_SIZE;
+	const int32_t inner = (SPRITE_SIZE - 32) * (SPRITE_SIZE - 32);
+	DrmLab::Buffer *buf;
+	uint32_t *px, c, a;
+	int32_t x, y, dx, dy, d;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < layer_count; ++i) {
+		if (sprites[i].fb)
+			continue;
+
+		buf = &sprites[i];
+		ret = allocator->Allocate(SPRITE_SIZE, SPRITE_SIZE,
+					  DRM_FORMAT_ARGB8888,
+					  DRM_FORMAT_MOD_INVALID, buf);
+		if (ret)
+			goto err_free;
+		sprite_pixels[i] = (uint8_t *)malloc(SPRITE_SIZE * SPRITE_SIZE * 4);
+		if (!sprite_pixels[i]) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		/* alpha falls off over the outer 16 pixels; premultiplied,
+		 * the color falls off with it */
+		px = (uint32_t *)sprite_pixels[i];
+		c = colors[i % 8];
+		for (y = 0; y < SPRITE_SIZE; ++y) {
+			for (x = 0; x < SPRITE_SIZE; ++x) {
+				dx = 2 * x + 1 - SPRITE_SIZE;
+				dy = 2 * y + 1 - SPRITE_SIZE;
+				d = dx * dx + dy * dy;
+				a = d >= outer ? 0 : d <= inner ? 0xc0 :
+				    0xc0 * (outer - d) / (outer - inner);
+				px[y * SPRITE_SIZE + x] = a << 24 |
+					(((c >> 16) & 0xff) * a / 255) << 16 |
+					(((c >> 8) & 0xff) * a / 255) << 8 |
+					((c & 0xff) * a / 255);
+			}
+		}
+
+		if (allocator->BeginCpuAccess(buf) != 0 || buf->map == nullptr) {
+			ret = -EIO;
+			goto err_free;
+		}
+		for (y = 0; y < SPRITE_SIZE; ++y)
+			memcpy(buf->map + (size_t)y * buf->map_stride,
+			       sprite_pixels[i] + (size_t)y * SPRITE_SIZE * 4,
+			       SPRITE_SIZE * 4);
+		allocator->EndCpuAccess(buf);
+	}
+
+	return 0;
+
+err_free:
+	modeset_free_sprites();
+	return ret;
+}
+
+/*
+ * modeset_setup_layers() is new. It places the sprites on an output, at
+ * random with random velocities, stacked in order, and takes the free
+ * overlay and cursor planes of the output's CRTC for them.
+ */
+
+static void modeset_setup_layers(int fd, struct modeset_output *out)
+{
+	int32_t width = out->mode.hdisplay, height = out->mode.vdisplay;
+	DrmLab::Layer *layer;
+	unsigned int i;
+
+	if (!layer_count)
+		return;
+	if (modeset_setup_sprites()) {
+		fprintf(stderr, "[!] cannot create the sprites, going without\n");
+		layer_count = 0;
+		return;
+	}
+
+	out->layers.count = layer_count;
+	for (i = 0; i < layer_count; ++i) {
+		layer = &out->layers.layers[i];
+		layer->buffer = &sprites[i];
+		layer->pixels = sprite_pixels[i];
+		layer->stride = SPRITE_SIZE * 4;
+		layer->src = { 0, 0, SPRITE_SIZE, SPRITE_SIZE };
+		layer->dst.x1 = width > SPRITE_SIZE ? rand() % (width - SPRITE_SIZE) : 0;
+		layer->dst.y1 = height > SPRITE_SIZE ? rand() % (height - SPRITE_SIZE) : 0;
+		layer->dst.x2 = layer->dst.x1 + SPRITE_SIZE;
+		layer->dst.y2 = layer->dst.y1 + SPRITE_SIZE;
+		layer->zpos = i;
+		layer->alpha = 0xffff;
+		layer->blend = DrmLab::BlendMode::Premultiplied;
+		layer->rotation = DRM_MODE_ROTATE_0;
+		out->layer_dx[i] = rand() % 2 ? 3 + rand() % 6 : -3 - rand() % 6;
+		out->layer_dy[i] = rand() % 2 ? 3 + rand() % 6 : -3 - rand() % 6;
+	}
+
+	out->offload = DrmLab::PlaneOffload::Create(fd, *prop_cache, out->crtc.id,
+						    out->crtc_index, width,
+						    height).release();
+	fprintf(stdout, "connector %u: %zu planes for %u sprites\n",
+		out->connector.id, out->offload ? out->offload->PlaneCount() : 0,
+		layer_count);
+}
+
+/*
+ * modeset_setup_cursor() is new. It puts an arrow on the cursor plane of the
+ * output's CRTC, in the middle of the screen, heading off in a random
+ * direction. It runs before modeset_setup_layers(), so the sprites don't
+ * take the plane.
+ */
+
+static void modeset_setup_cursor(int fd, struct modeset_output *out)
+{
+	uint32_t image[CURSOR_IMAGE_WIDTH * CURSOR_IMAGE_HEIGHT];
+	int32_t x, y, edge;
+
+	if (!cursor_rate)
+		return;
+
+	out->cursor = DrmLab::HardwareCursor::Create(fd, *prop_cache,
+						     out->crtc.id,
+						     out->crtc_index).release();
+	if (!out->cursor) {
+		fprintf(stderr, "[!] connector %u has no cursor plane for the "
+			"pointer\n", out->connector.id);
+		return;
+	}
+
+	/* a white arrow with a black outline, its tip is the hotspot */
+	for (y = 0; y < CURSOR_IMAGE_HEIGHT; ++y) {
+		edge = y < 16 ? y * 2 / 3 : (CURSOR_IMAGE_HEIGHT - 1 - y) * 4 / 3;
+		for (x = 0; x < CURSOR_IMAGE_WIDTH; ++x) {
+			if (x > edge)
+				image[y * CURSOR_IMAGE_WIDTH + x] = 0;
+			else if (x == 0 || x == edge ||
+				 y == CURSOR_IMAGE_HEIGHT - 1)
+				image[y * CURSOR_IMAGE_WIDTH + x] = 0xff000000;
+			else
+				image[y * CURSOR_IMAGE_WIDTH + x] = 0xffffffff;
+		}
+	}
+	out->cursor->SetImage(image, CURSOR_IMAGE_WIDTH * 4,
+			      CURSOR_IMAGE_WIDTH, CURSOR_IMAGE_HEIGHT, 0, 0);
+
+	out->cursor_x = out->mode.hdisplay / 2;
+	out->cursor_y = out->mode.vdisplay / 2;
+	out->cursor_dx = rand() % 2 ? 2 + rand() % 4 : -2 - rand() % 4;
+	out->cursor_dy = rand() % 2 ? 2 + rand() % 4 : -2 - rand() % 4;
+	out->cursor->MoveTo(out->cursor_x, out->cursor_y);
+	out->cursor->Show(true);
+}
+
+/*
+ * Once the output has a CRTC and a primary plane (see modeset_prepare()), we
+ * retrieve connector, CRTC and plane objects properties from the device.
+ * These objects are used during the atomic modeset setup (see
+ * modeset_atomic_prepare_commit()) and also during the page-flips (see
+ * modeset_draw_out() and modeset_atomic_commit()).
+ */
+
+static int modeset_output_setup(int fd, struct modeset_output *out)
+{
+	int ret;
+
+	/* gather properties of our connector, CRTC and planes */
+	ret = modeset_setup_objects(fd, out);
+	if (ret) {
+		fprintf(stderr, "[!] cannot get plane properties\n");
+		return ret;
+	}
+
+	/* the clock of the CRTC's vblanks, if the timestamps are usable */
+	out->vblank = DrmLab::VBlankClock::Create(fd, out->crtc.id).release();
+	if (out->vblank)
+		out->vblank->SetNominalPeriod(modeset_mode_period(&out->mode));
+
+	/* frame timing, recorded all the time */
+	out->render_timing = new DrmLab::TimingRecorder();
+	out->commit_timing = new DrmLab::TimingRecorder();
+	out->timing = new DrmLab::TimingStats();
+
+	/* the atomic request used by every page-flip of this output */
+	out->req = DrmLab::AtomicRequest::Create(atomic_backend).release();
+	if (!out->req->Valid()) {
+		fprintf(stderr, "[!] cannot allocate atomic request\n");
+		return -ENOMEM;
+	}
+
+	/* setup front/back framebuffers for this CRTC */
+	ret = modeset_setup_framebuffers(fd, out);
+	if (ret) {
+		fprintf(stderr, "[!] cannot create framebuffers for connector %u\n",
+			out->connector.id);
+		return ret;
+	}
+
+	/* the pointer on the cursor plane, then the sprites on what is left */
+	modeset_setup_cursor(fd, out);
+	modeset_setup_layers(fd, out);
+
+	return 0;
+}
+
+/*
+ * modeset_prepare() changes a little bit. It creates an output for every
+ * connector with a monitor, and then lets the assigner pick CRTCs and primary
+ * planes for all of them together, before setting them up. Outputs left
+ * without a CRTC are dropped. It also creates the property cache shared by
+ * all outputs.
+ */
+
+static int modeset_prepare(int fd)
+{
+	drmModeRes *res;
+	drmModeConnector *conn;
+	unsigned int i;
+	struct modeset_output *out, *candidates = NULL;
+	std::vector<DrmLab::OutputRequest> requests;
+	std::vector<DrmLab::PipeAssignment> pipes;
+
+	/* retrieve resources */
+	res = drmModeGetResources(fd);
+	if (!res) {
+		fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+			errno);
+		return -errno;
+	}
+
+	prop_cache = new DrmLab::PropertyCache(fd);
+
+	/* iterate all connectors */
+	for (i = 0; i < res->count_connectors; ++i) {
+		/* get information for each connector */
+		conn = drmModeGetConnector(fd, res->connectors[i]);
+		if (!conn) {
+			fprintf(stderr, "cannot retrieve DRM connector %u:%u (%d): %m\n",
+				i, res->connectors[i], errno);
+			continue;
+		}
+
+		/* create an output structure and free connector data */
+		out = modeset_output_create(fd, conn);
+		drmModeFreeConnector(conn);
+		if (!out)
+			continue;
+
+		out->next = candidates;
+		candidates = out;
+		requests.push_back({ out->connector.id, out->mode_blob_id,
+				     out->mode.hdisplay, out->mode.vdisplay });
+	}
+
+	/* free resources again */
+	drmModeFreeResources(res);
+
+	/* find a CRTC and a primary plane for as many outputs as possible */
+	assigner = DrmLab::OutputAssigner::Create(fd, *prop_cache).release();
+	if (assigner)
+		pipes = assigner->Assign(requests);
+
+	while (candidates) {
+		out = candidates;
+		candidates = out->next;
+
+		for (i = 0; i < pipes.size(); ++i) {
+			if (pipes[i].connector == out->connector.id)
+				break;
+		}
+		if (i == pipes.size()) {
+			fprintf(stderr, "[!] no valid crtc for connector %u\n",
+				out->connector.id);
+			modeset_output_destroy(fd, out);
+			continue;
+		}
+
+		out->crtc.id = pipes[i].crtc;
+		out->crtc_index = pipes[i].crtc_index;
+		out->plane.id = pipes[i].plane;
+		fprintf(stdout, "connector %u: crtc %u, primary plane %u\n",
+			out->connector.id, out->crtc.id, out->plane.id);
+
+		if (modeset_output_setup(fd, out)) {
+			modeset_output_destroy(fd, out);
+			continue;
+		}
+
+		/* link output into global list */
+		out->next = output_list;
+		output_list = out;
+	}
+	if (!output_list) {
+		fprintf(stderr, "couldn't create any outputs\n");
+		return -1;
+	}
+
+	fprintf(stdout, "%u property ioctls, %u test commits for output setup\n",
+		prop_cache->IoctlCount(), assigner->TestCount());
+
+	return 0;
+}
+
+/*
+ * modeset_output_state() sets the values of properties (of our connector, CRTC
+ * and plane objects) that we want to scan out `buf` on this output.
+ */
+
+static void modeset_output_state(struct modeset_output *out,
+				 const DrmLab::Buffer *buf,
+				 DrmLab::OutputState *state)
+{
+	using DrmLab::ConnectorProperty;
+	using DrmLab::CrtcProperty;
+	using DrmLab::PlaneProperty;
+
+	/* set id of the CRTC id that the connector is using */
+	state->connector.Set(ConnectorProperty::CrtcId, out->crtc.id);
+
+	/* set the mode id of the CRTC; this property receives the id of a blob
+	 * property that holds the struct that actually contains the mode info */
+	state->crtc.Set(CrtcProperty::ModeId, out->mode_blob_id);
+
+	/* set the CRTC object as active */
+	state->crtc.Set(CrtcProperty::Active, 1);
+
+	/* set properties of the plane related to the CRTC and the framebuffer */
+	state->plane.Set(PlaneProperty::FbId, buf->fb);
+	state->plane.Set(PlaneProperty::CrtcId, out->crtc.id);
+	state->plane.Set(PlaneProperty::SrcX, 0);
+	state->plane.Set(PlaneProperty::SrcY, 0);
+	state->plane.Set(PlaneProperty::SrcW, buf->width << 16);
+	state->plane.Set(PlaneProperty::SrcH, buf->height << 16);
+	state->plane.Set(PlaneProperty::CrtcX, 0);
+	state->plane.Set(PlaneProperty::CrtcY, 0);
+	state->plane.Set(PlaneProperty::CrtcW, buf->width);
+	state->plane.Set(PlaneProperty::CrtcH, buf->height);
+
+	/* damage of this frame, 0 (no blob) means the whole plane */
+	state->plane.Set(PlaneProperty::FbDamageClips, out->damage_blob_id);
+}
+
+/*
+ * modeset_atomic_prepare_commit() is new. Here we set the values of properties
+ * that we want for the next frame. Only the ones that differ from the
+ * committed state are added to the atomic request, and they are remembered in
+ * out->pending until the commit actually happens (see
+ * modeset_atomic_commit_done()).
+ */
+
+static int modeset_atomic_prepare_commit(int fd, struct modeset_output *out,
+					 DrmLab::AtomicRequest *req)
+{
+	DrmLab::OutputState *state = &out->state;
+
+	modeset_output_state(out, out->ready, state);
+
+	/* The property ids were resolved in modeset_setup_objects(), so the only
+	 * way adding the changed properties can fail is running out of memory. */
+	return state->AddChanged(req, out->connector, out->crtc, out->plane,
+				 &out->pending);
+}
+
+/*
+ * modeset_test_scanout() is new. It checks with a TEST_ONLY commit that the
+ * primary plane can scan out `buf`, without touching the output's state. A
+ * framebuffer only tells us that the driver could import the memory.
+ */
+
+static bool modeset_test_scanout(int fd, struct modeset_output *out,
+				 const DrmLab::Buffer *buf)
+{
+	DrmLab::OutputState state = out->state;
+	DrmLab::OutputState::Dirty dirty;
+	std::unique_ptr<DrmLab::AtomicRequest> req;
+
+	req = DrmLab::AtomicRequest::Create(atomic_backend);
+	if (!req->Valid())
+		return false;
+
+	modeset_output_state(out, buf, &state);
+	if (state.AddChanged(req.get(), out->connector, out->crtc, out->plane,
+			     &dirty) < 0)
+		return false;
+
+	return req->Commit(fd, DRM_MODE_ATOMIC_TEST_ONLY |
+			   DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) == 0;
+}
+
+/*
+ * modeset_atomic_commit_done() is new. Once the kernel has accepted a commit,
+ * the properties we added to it become the committed state of the output.
+ */
+
+static void modeset_atomic_commit_done(struct modeset_output *out)
+{
+	out->state.MarkCommitted(out->pending);
+	memset(&out->pending, 0, sizeof(out->pending));
+}
+
+/*
+ * A short helper function to compute a changing color value. No need to
+ * understand it.
+ */
+
+static uint8_t next_color(bool *up, uint8_t cur, unsigned int mod)
+{
+	uint8_t next;
+
+	next = cur + (*up ? 1 : -1) * (rand() % mod);
+	if ((*up && next < cur) || (!*up && next > cur)) {
+		*up = !*up;
+		next = cur;
+	}
+
+	return next;
+}
+
+/*
+ * The n-th of the 8 bands of rows the picture is made of.
+ */
+
+static DrmLab::Rect modeset_band(const DrmLab::Buffer *buf, unsigned int n)
+{
+	int32_t band_height = buf->height / 8;
+	DrmLab::Rect band;
+
+	band.x1 = 0;
+	band.x2 = buf->width;
+	band.y1 = n * band_height;
+	band.y2 = n == 7 ? buf->height : band.y1 + band_height;
+	return band;
+}
+
+/*
+ * Paint a rectangle of the picture: the parts of it in each band, with the
+ * band's color. The raster library picks the widest SIMD kernels the CPU has,
+ * see raster.h.
+ */
+
+static void modeset_paint_rect(struct modeset_output *out,
+			       const DrmLab::Buffer *buf, uint8_t *map,
+			       uint32_t stride, const DrmLab::Rect *rect)
+{
+	DrmLab::Rect band, r;
+	unsigned int n;
+
+	for (n = 0; n < 8; n++) {
+		band = modeset_band(buf, n);
+		r.x1 = rect->x1 > band.x1 ? rect->x1 : band.x1;
+		r.y1 = rect->y1 > band.y1 ? rect->y1 : band.y1;
+		r.x2 = rect->x2 < band.x2 ? rect->x2 : band.x2;
+		r.y2 = rect->y2 < band.y2 ? rect->y2 : band.y2;
+		if (!r.Empty())
+			DrmLab::FillRect(map, stride, r, out->band_colors[n]);
+	}
+}
+
+/*
+ * Paint the rectangles of `damage`: the bands, and the sprites the CPU
+ * composites on top of them.
+ */
+
+static void modeset_paint_damage(struct modeset_output *out,
+				 const DrmLab::Buffer *buf, uint8_t *map,
+				 uint32_t stride, const DrmLab::Damage *damage)
+{
+	size_t i;
+
+	for (i = 0; i < damage->count; i++) {
+		modeset_paint_rect(out, buf, map, stride, &damage->rects[i]);
+		DrmLab::PlaneOffload::Composite(map, stride, damage->rects[i],
+						out->layers);
+	}
+}
+
+/*
+ * modeset_move_layers() is new. It moves the sprites on, bouncing off the
+ * edges of the screen, and puts them on planes as the plane offload engine
+ * has it cached for their shape. A sprite the CPU composites damages where
+ * it was and where it is now; one on a plane damages nothing, the display
+ * engine moves it. Without a cached assignment all are composited, and the
+ * commit thread searches one with TEST_ONLY commits once the frame is
+ * committed (see modeset_present()): the worker sends no commits. The
+ * first frame, before the modeset (`first`), composites all of them.
+ */
+static void modeset_move_layers(struct modeset_output *out, bool first)
+{
+	DrmLab::LayerStack *stack = &out->layers;
+	int32_t width = out->mode.hdisplay, height = out->mode.vdisplay;
+	DrmLab::Rect *dst;
+	size_t i;
+
+	for (i = 0; i < stack->count && !first; i++) {
+		if (stack->Composited(i))
+			out->damage.Add(stack->layers[i].dst);
+	}
+
+	for (i = 0; i < stack->count; i++) {
+		dst = &stack->layers[i].dst;
+		if (dst->x1 + out->layer_dx[i] < 0 ||
+		    dst->x2 + out->layer_dx[i] > width)
+			out->layer_dx[i] = -out->layer_dx[i];
+		if (dst->y1 + out->layer_dy[i] < 0 ||
+		    dst->y2 + out->layer_dy[i] > height)
+			out->layer_dy[i] = -out->layer_dy[i];
+		dst->x1 += out->layer_dx[i];
+		dst->x2 += out->layer_dx[i];
+		dst->y1 += out->layer_dy[i];
+		dst->y2 += out->layer_dy[i];
+	}
+
+	if (out->offload && !first)
+		out->offload->Lookup(stack);
+
+	for (i = 0; i < stack->count; i++) {
+		if (stack->Composited(i))
+			out->damage.Add(stack->layers[i].dst);
+	}
+	out->damage.Clip(width, height);
+}
+
+/*
+ * Add the statistics of one frame's copy to the totals printed at the end.
+ */
+
+static void modeset_account_copy(const DrmLab::CopyStats *stats)
+{
+	std::lock_guard<std::mutex> lock(copy_stats_lock);
+	double gbps = stats->GBps();
+
+	if (stats->bytes == 0)
+		return;
+
+	if (copy_frames == 0 || gbps < copy_min_gbps)
+		copy_min_gbps = gbps;
+	if (copy_frames == 0 || gbps > copy_max_gbps)
+		copy_max_gbps = gbps;
+	copy_frames++;
+	copy_bytes += stats->bytes;
+	copy_ns += stats->ns;
+}
+
+/*
+ * A slice of the trace for each stage of a frame, named after the stage and
+ * the CRTC so it lines up with the CRTC's vblank events. Without LABDRM_TRACE
+ * this is just a test.
+ */
+
+static void modeset_trace_begin(const char *stage, struct modeset_output *out)
+{
+	if (tracer)
+		tracer->Begin("%s crtc %u", stage, out->crtc.id);
+}
+
+static void modeset_trace_end(void)
+{
+	if (tracer)
+		tracer->End();
+}
+
+/*
+ * Render the next frame into a free framebuffer, queue it in the swapchain
+ * and return it.
+ *
+ * We don't repaint the whole buffer: each frame paints one band of rows (1/8
+ * of the screen, moving down) with the new color, and that band is the damage
+ * of the frame. The first frame paints everything.
+ *
+ * The buffer we get from the swapchain is as many frames old as its age: it
+ * also lacks the bands painted into the other buffers since, so we repaint
+ * those too, with their current colors. With double buffering that is one
+ * band, with triple buffering two. Only this frame's band is damage as far as
+ * the display is concerned, the front buffer already shows the others.
+ * Sprites the CPU composites add to the damage, see modeset_move_layers().
+ *
+ * If there is no free buffer (with double buffering, until the pending flip
+ * completes), nothing happens and we return NULL.
+ */
+
+static DrmLab::Buffer *modeset_paint_framebuffer(struct modeset_output *out)
+{
+	DrmLab::Buffer *buf;
+	DrmLab::Damage repaint;
+	DrmLab::Rect band;
+	unsigned int age;
+	uint32_t color, stride;
+	uint64_t start, copy_start;
+	uint8_t *map;
+	size_t i;
+	bool first;
+
+	buf = out->swapchain->Acquire(&age);
+	if (!buf)
+		return NULL;
+	start = DrmLab::EventLoop::Now();
+	modeset_trace_begin("paint", out);
+
+	/* paint into the shadow buffer if there is one, the framebuffer
+	 * otherwise; the latter has to be made accessible to the CPU */
+	if (out->shadow) {
+		map = out->shadow;
+		stride = out->shadow_stride;
+	} else {
+		if (allocator->BeginCpuAccess(buf) != 0 || buf->map == nullptr) {
+			modeset_trace_end();
+			out->swapchain->Release(buf);
+			return NULL;
+		}
+		map = buf->map;
+		stride = buf->map_stride;
+	}
+
+	/* draw on the framebuffer */
+	out->r = next_color(&out->r_up, out->r, 5);
+	out->g = next_color(&out->g_up, out->g, 5);
+	out->b = next_color(&out->b_up, out->b, 5);
+	color = (out->r << 16) | (out->g << 8) | out->b;
+
+	/* find the band of this frame */
+	first = out->damage.Empty();
+	if (first) {
+		band = { 0, 0, (int32_t)buf->width, (int32_t)buf->height };
+		for (i = 0; i < 8; i++)
+			out->band_colors[i] = color;
+	} else {
+		i = out->band++ % 8;
+		band = modeset_band(buf, i);
+		out->band_colors[i] = color;
+	}
+	out->damage.Clear();
+	out->damage.Add(band);
+	modeset_move_layers(out, first);
+
+	/* what the buffer lacks: this frame's band plus the damage of the
+	 * frames since it was last used, or everything if it's new */
+	repaint = out->damage;
+	if (!out->swapchain->AccumulateDamage(age, &repaint))
+		repaint.SetFull(buf->width, buf->height);
+
+	if (!out->shadow) {
+		modeset_paint_damage(out, buf, map, stride, &repaint);
+		allocator->EndCpuAccess(buf);
+		modeset_trace_end();
+		out->render_timing->Record(DrmLab::FrameStage::Paint, start,
+					   DrmLab::EventLoop::Now());
+	} else {
+		/* the shadow holds the previous frame, so only this frame's
+		 * damage is painted; the rest is copied from it */
+		modeset_paint_damage(out, buf, map, stride, &out->damage);
+		modeset_trace_end();
+		copy_start = DrmLab::EventLoop::Now();
+		out->render_timing->Record(DrmLab::FrameStage::Paint, start,
+					   copy_start);
+		modeset_trace_begin("copy", out);
+		if (allocator->BeginCpuAccess(buf) != 0 || buf->map == nullptr) {
+			modeset_trace_end();
+			out->swapchain->Release(buf);
+			return NULL;
+		}
+		out->copy_engine->Copy(buf->map, buf->map_stride, map, stride,
+				       4, repaint);
+		modeset_account_copy(&out->copy_engine->LastStats());
+		allocator->EndCpuAccess(buf);
+		modeset_trace_end();
+		out->render_timing->Record(DrmLab::FrameStage::Copy, copy_start,
+					   DrmLab::EventLoop::Now());
+	}
+
+	out->swapchain->Queue(buf, out->damage);
+	frames_rendered++;
+	return buf;
+}
+
+static void modeset_wake(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "cannot signal eventfd: %m\n");
+}
+
+/*
+ * modeset_worker() is new. Every output has a render worker thread, so
+ * painting and copying the next frame overlaps with the scanout of the
+ * current one, on another core, and the commit thread (the one running the
+ * event loop) can commit a frame as soon as a page-flip completes, however
+ * long painting takes.
+ *
+ * The worker renders whenever it has a free framebuffer, passes the frame
+ * to the commit thread through `pipe->frames` and goes on with the next.
+ * When every framebuffer is queued or on screen it sleeps until the commit
+ * thread returns one: the front buffer replaced by a completed page-flip, or
+ * a frame Mailbox dropped. In FIFO mode that paces it to the display.
+ *
+ * Paced like that, a frame is rendered right after a page-flip and then
+ * waits most of a refresh period for its vblank. In FIFO mode, if vblank
+ * timestamps are CLOCK_MONOTONIC, the worker has a scheduler instead (see
+ * labdrm/frame_scheduler.h), which predicts the vblanks from the page-flip
+ * timestamps the commit thread passes back and measures how long frames
+ * take, so the worker can sleep until just before the frame is due:
+ * whatever it shows is almost a frame fresher.
+ */
+
+static void modeset_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* take back the framebuffers the commit thread is done with */
+static void modeset_worker_returns(struct modeset_output *out)
+{
+	struct modeset_pipe *pipe = out->pipe;
+	DrmLab::FrameScheduler *sched = pipe->scheduler;
+	struct modeset_return ret;
+
+	while (pipe->returns.Pop(&ret)) {
+		if (ret.presented) {
+			out->swapchain->Presented(ret.buf);
+			if (sched)
+				sched->Presented(ret.buf, ret.sequence,
+						 ret.timestamp);
+		} else {
+			out->swapchain->Discard(ret.buf);
+			if (sched)
+				sched->Dropped(ret.buf);
+		}
+	}
+}
+
+static void modeset_worker(struct modeset_output *out)
+{
+	struct modeset_pipe *pipe = out->pipe;
+	DrmLab::FrameScheduler *sched = pipe->scheduler;
+	struct modeset_frame frame;
+	uint64_t n, start, target = 0;
+
+	while (!pipe->quit) {
+		modeset_worker_returns(out);
+
+		/* start as late as still makes the frame's vblank. With all
+		 * framebuffers in use, the frame before this one completes
+		 * its flip while we sleep and frees the buffer to paint. */
+		if (sched) {
+			start = sched->FrameStart(DrmLab::EventLoop::Now(), &target);
+			pipe->target = target;
+			/* a pointer move waiting for a frame may not have
+			 * to wait for this one, see modeset_cursor_commit() */
+			if (out->cursor)
+				modeset_wake(pipe->frames_fd);
+			modeset_sleep_until(start);
+			modeset_worker_returns(out);
+		}
+		start = DrmLab::EventLoop::Now();
+
+		frame.buf = modeset_paint_framebuffer(out);
+		if (!frame.buf) {
+			pipe->target = UINT64_MAX;
+			if (read(pipe->returns_fd, &n, sizeof(n)) < 0 &&
+			    errno != EINTR)
+				break;
+			pipe->target = 0;
+			continue;
+		}
+		if (sched)
+			sched->Queued(frame.buf, start, DrmLab::EventLoop::Now(),
+				      target);
+
+		frame.damage = out->damage;
+		frame.layers = out->layers;
+		pipe->frames.Push(frame);
+		modeset_wake(pipe->frames_fd);
+	}
+}
+
+/*
+ * modeset_present() asks the driver to perform an atomic commit with the frame
+ * which is ready, if there is one and no page-flip is pending. This will lead
+ * to a page-flip and the content of the framebuffer will be displayed.
+ * Besides the primary plane, the same atomic commit updates the planes of
+ * the sprites and the pointer, see 7. and 8. below.
+ *
+ * Just like in modeset_perform_modeset(), we first setup everything with
+ * modeset_atomic_prepare_commit() and then actually perform the atomic commit.
+ * But there are some important differences:
+ *
+ * 1. Here we just want to perform a commit that changes the state of a specific
+ *    output, and in modeset_perform_modeset() we did an atomic commit that was
+ *    supposed to setup all the outputs at once. So there's no need to prepare
+ *    every output before performing the atomic commit. But let's suppose you
+ *    prepare every output and then perform the commit. It should schedule a
+ *    page-flip for all of them, but modeset_draw_out() was called because the
+ *    page-flip for a specific output has finished. The others may not be
+ *    prepared for a page-flip yet (e.g. in the middle of a scanout), so these
+ *    page-flips will fail.
+ *
+ * 2. Here we have already painted the framebuffer and also we only use the
+ *    flag DRM_MODE_ALLOW_MODESET if one of the modeset properties (connector
+ *    CRTC_ID, CRTC MODE_ID and ACTIVE) changed since the last commit. After
+ *    modeset_perform_modeset() they never do, so a page-flip only carries the
+ *    new FB_ID. The flag only allows (it doesn't force) the driver to perform
+ *    a modeset, and if we don't need one it may be better to fail than to
+ *    glitch (a modeset can cause unecessary latency and also blank the screen).
+ *
+ * 3. Here we don't allocate a new request for every page-flip. Each output
+ *    owns a DrmLab::AtomicRequest, which we just rewind to its (empty) base
+ *    state, so its storage is reused from frame to frame. We count the heap
+ *    allocations done here, modeset_draw() prints them when it's done. With
+ *    LABDRM_ATOMIC=direct the request builds the ioctl arguments itself and
+ *    this should print 0, while drmModeAtomicCommit() allocates on each call.
+ *
+ * 4. A non-blocking commit fails with EBUSY while the previous commit on the
+ *    CRTC is still being processed, which the page-flip event doesn't
+ *    guarantee is over. That isn't an error: the frame stays ready and
+ *    modeset_retry() commits it when the retry timer fires a millisecond
+ *    later, unless a newer frame replaced it by then.
+ *
+ * 5. In Immediate mode the commit carries DRM_MODE_PAGE_FLIP_ASYNC: the flip
+ *    happens right away instead of at the next vblank, and may tear. Async
+ *    commits may only change FB_ID of the primary plane, so they go without
+ *    damage clips, and a frame which also moves sprites or the pointer goes
+ *    without the flag and waits for the vblank.
+ *
+ * 6. The output is the user_data of the commit. The kernel hands it back in
+ *    the page-flip event, so modeset_page_flip_event() doesn't have to look
+ *    the output up.
+ *
+ * 7. The sprites on overlay and cursor planes go in the same commit, so
+ *    they move in step with the frame painted around them. We checked
+ *    their planes with TEST_ONLY commits after an earlier frame of the same
+ *    shape, but a state that wasn't tested can still fail: then the frame
+ *    goes again without them and the worker composites them, until the
+ *    engine has searched again. Searching is ours too, after a frame the
+ *    worker found nothing cached for.
+ *
+ * 8. So does the pointer: wherever it moved since the last commit, the
+ *    cursor plane goes there along with the frame. While a commit of the
+ *    pointer alone is in flight, the frame waits for it like for a
+ *    page-flip.
+ */
+
+static void modeset_present(int fd, struct modeset_output *out)
+{
+	uint64_t allocs = DrmLab::HeapAllocCount();
+	bool async = present_mode == DrmLab::PresentMode::Immediate;
+	uint64_t start, end;
+	int ret, flags, size;
+
+	if (!out->ready || out->pflip_pending || out->cursor_pending)
+		return;
+
+	/* tell the driver which part of the plane changed, if it wants to know;
+	 * the commit references the damage rectangles as a blob */
+	if (!async && out->plane.Has(DrmLab::PlaneProperty::FbDamageClips))
+		DrmLab::CreateDamageBlob(fd, out->present_damage, &out->damage_blob_id);
+
+	/* prepare output for atomic commit */
+	out->req->Rewind();
+	ret = modeset_atomic_prepare_commit(fd, out, out->req);
+	size = out->req->Size();
+	if (ret == 0 && out->offload)
+		ret = out->offload->Apply(out->req, out->ready_layers);
+	if (ret == 0 && out->cursor)
+		ret = out->cursor->Apply(out->req);
+	if (ret < 0) {
+		fprintf(stderr, "prepare atomic commit failed, %d\n", errno);
+		goto out_blob;
+	}
+	/* other planes changed, which an async commit can't do */
+	if (out->req->Size() > size)
+		async = false;
+
+	/* We've just draw on the framebuffer, prepared the commit and now it's
+	 * time to perform a page-flip to display its content.
+	 *
+	 * DRM_MODE_PAGE_FLIP_EVENT signalizes that we want to receive a
+	 * page-flip event in the DRM-fd when the page-flip happens. This flag
+	 * is also used in the non-atomic examples, so you're probably familiar
+	 * with it.
+	 *
+	 * DRM_MODE_ATOMIC_NONBLOCK makes the page-flip non-blocking. We don't
+	 * want to be blocked waiting for the commit to happen, since we can use
+	 * this time to prepare a new framebuffer, for instance. We can only do
+	 * this because there are mechanisms to know when the commit is complete
+	 * (like page flip event, explained above).
+	 */
+	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	if (out->pending.NeedsModeset())
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	else if (async)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	start = DrmLab::EventLoop::Now();
+	modeset_trace_begin("commit", out);
+	ret = out->req->Commit(fd, flags, out);
+	modeset_trace_end();
+	end = DrmLab::EventLoop::Now();
+
+	flip_count++;
+	flip_allocs += DrmLab::HeapAllocCount() - allocs;
+	out->commit_timing->Record(DrmLab::FrameStage::Commit, start, end);
+
+	if (ret == -EBUSY) {
+		commits_busy++;
+		if (retry_timer >= 0)
+			event_loop->ArmTimer(retry_timer,
+					     DrmLab::EventLoop::Now() + 1000000);
+		goto out_blob;
+	}
+	if (ret == -EINVAL && out->offload &&
+	    out->offload->Rejected(&out->ready_layers)) {
+		layers_rejected++;
+		if (retry_timer >= 0)
+			event_loop->ArmTimer(retry_timer, DrmLab::EventLoop::Now());
+		goto out_blob;
+	}
+	if (ret == -EINVAL && (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		fprintf(stderr, "async page-flip rejected, using mailbox\n");
+		present_mode = DrmLab::PresentMode::Mailbox;
+		goto out_blob;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "atomic commit failed, %d\n", errno);
+		goto out_blob;
+	}
+	modeset_atomic_commit_done(out);
+	if (out->offload)
+		out->offload->Committed();
+	if (out->cursor)
+		out->cursor->Committed();
+	/* a new shape of the sprites: find which planes take them for the
+	 * next frames, while this one flips */
+	if (out->offload && out->ready_layers.uncached)
+		out->offload->Assign(out->ready_layers);
+	out->flipping = out->ready;
+	out->ready = NULL;
+	out->present_damage.Clear();
+	out->pflip_pending = true;
+	out->commit_ns = end;
+
+out_blob:
+	/* the kernel keeps its own reference to the damage blob */
+	if (out->damage_blob_id) {
+		drmModeDestroyPropertyBlob(fd, out->damage_blob_id);
+		out->damage_blob_id = 0;
+	}
+}
+
+/*
+ * Hand a framebuffer back to the render worker.
+ */
+
+static void modeset_return_buffer(struct modeset_output *out,
+				  DrmLab::Buffer *buf, bool presented,
+				  uint32_t sequence, uint64_t timestamp)
+{
+	struct modeset_return ret = { buf, presented, sequence, timestamp };
+
+	out->pipe->returns.Push(ret);
+	/* the worker has a framebuffer for its next frame now */
+	out->pipe->target = 0;
+	modeset_wake(out->pipe->returns_fd);
+}
+
+/*
+ * Take the frames the render worker finished. In FIFO mode every frame is
+ * shown, so they are taken one at a time, when the ready one was committed.
+ * Otherwise the newest becomes ready and the ones it replaces go back to the
+ * worker unseen.
+ */
+
+static void modeset_collect(struct modeset_output *out)
+{
+	bool fifo = present_mode == DrmLab::PresentMode::Fifo;
+	struct modeset_frame frame;
+
+	while (!(fifo && out->ready) && out->pipe->frames.Pop(&frame)) {
+		if (out->ready) {
+			modeset_return_buffer(out, out->ready, false, 0, 0);
+			frames_dropped++;
+		}
+		out->ready = frame.buf;
+		out->ready_layers = frame.layers;
+		out->present_damage.Add(frame.damage);
+	}
+}
+
+/*
+ * Whether the render worker is on a frame for the next vblank of the output.
+ */
+
+static bool modeset_frame_coming(struct modeset_output *out)
+{
+	uint64_t target, sequence, ns;
+
+	if (!out->pipe)
+		return false;
+	target = out->pipe->target;
+	if (target == UINT64_MAX)
+		return false;
+	if (target == 0 || !out->vblank || out->vblank->Now(&sequence, &ns))
+		return true;
+	return target < out->vblank->Predict(sequence + 1) +
+		out->vblank->Period() / 2;
+}
+
+/*
+ * modeset_cursor_commit() is new. It commits where the pointer moved, on its
+ * own, if the CRTC has nothing pending: no page-flip, no frame waiting to be
+ * committed, no other pointer commit. Otherwise the move goes with the next
+ * frame, see modeset_present(), or after the page-flip, see
+ * modeset_draw_out().
+ *
+ * Such a commit takes the CRTC until the next vblank, so a frame for that
+ * vblank would have to wait for the one after. The move latches at that
+ * vblank either way, so while the render worker is on such a frame, the move
+ * waits for it instead. The cursor is the user_data of the commit, which
+ * tells modeset_page_flip_event() it moved nothing else.
+ */
+
+static void modeset_cursor_commit(struct modeset_output *out)
+{
+	int ret;
+
+	if (!out->cursor || !out->cursor->Dirty() || out->pflip_pending ||
+	    out->ready || out->cursor_pending || modeset_frame_coming(out))
+		return;
+
+	ret = out->cursor->Commit(DRM_MODE_PAGE_FLIP_EVENT |
+				  DRM_MODE_ATOMIC_NONBLOCK, out->cursor);
+	if (ret == -EBUSY) {
+		if (retry_timer >= 0)
+			event_loop->ArmTimer(retry_timer,
+					     DrmLab::EventLoop::Now() + 1000000);
+		return;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "cursor commit failed, %d\n", ret);
+		return;
+	}
+	cursor_commits++;
+	out->cursor_pending = true;
+}
+
+/*
+ * modeset_draw_out() runs on the commit thread when the page-flip of an
+ * output completed, and when its render worker finished a frame. It commits
+ * the newest frame, if no page-flip is pending, or else where the pointer
+ * moved in the meantime, and then adds up the frame timing recorded since.
+ */
+
+static void modeset_draw_out(int fd, struct modeset_output *out)
+{
+	modeset_collect(out);
+	modeset_present(fd, out);
+	modeset_cursor_commit(out);
+
+	out->timing->Drain(out->render_timing);
+	out->timing->Drain(out->commit_timing);
+}
+
+/*
+ * modeset_cursor_event() is new. It runs LABDRM_CURSOR times a second, like
+ * a mouse event would, and moves the pointer of every output a few pixels,
+ * bouncing off the edges. Nothing is painted for it: a frame the worker just
+ * finished is committed with the move, like any frame, see
+ * modeset_draw_out().
+ */
+
+static void modeset_cursor_event(int fd)
+{
+	struct modeset_output *iter;
+
+	for (iter = output_list; iter; iter = iter->next) {
+		if (!iter->cursor || iter->cleanup)
+			continue;
+
+		iter->cursor_x += iter->cursor_dx;
+		iter->cursor_y += iter->cursor_dy;
+		if (iter->cursor_x < 0 || iter->cursor_x >= iter->mode.hdisplay) {
+			iter->cursor_dx = -iter->cursor_dx;
+			iter->cursor_x += 2 * iter->cursor_dx;
+		}
+		if (iter->cursor_y < 0 || iter->cursor_y >= iter->mode.vdisplay) {
+			iter->cursor_dy = -iter->cursor_dy;
+			iter->cursor_y += 2 * iter->cursor_dy;
+		}
+		iter->cursor->MoveTo(iter->cursor_x, iter->cursor_y);
+		cursor_events++;
+		modeset_draw_out(fd, iter);
+	}
+}
+
+/*
+ * modeset_retry() is new. It runs when the retry timer fires, and commits
+ * the frames and pointer moves whose commit failed with EBUSY.
+ */
+
+static void modeset_retry(int fd)
+{
+	struct modeset_output *iter;
+
+	for (iter = output_list; iter; iter = iter->next) {
+		if (iter->cleanup)
+			continue;
+		modeset_present(fd, iter);
+		modeset_cursor_commit(iter);
+	}
+}
+
+/*
+ * modeset_page_flip_event() changes. Now that we are using page_flip_handler2,
+ * we also receive the CRTC that is responsible for this event. When using the
+ * atomic API we commit multiple CRTC's at once, so we need the information of
+ * what output caused the event in order to schedule a new page-flip for it.
+ *
+ * Page-flips of a single output carry the output as user_data, see
+ * modeset_present(), and commits of its pointer alone the cursor, see
+ * modeset_cursor_commit(). Only the events of the initial modeset, one commit
+ * for all outputs, have to be matched by CRTC.
+ */
+
+static void modeset_page_flip_event(int fd, unsigned int frame,
+				    unsigned int sec, unsigned int usec,
+				    unsigned int crtc_id, void *data)
+{
+	struct modeset_output *out, *iter;
+	uint64_t ts;
+
+	/* only the pointer moved: no framebuffer changed hands */
+	for (iter = output_list; iter && data; iter = iter->next) {
+		if (iter->cursor && data == iter->cursor) {
+			iter->cursor_pending = false;
+			if (!iter->cleanup)
+				modeset_draw_out(fd, iter);
+			return;
+		}
+	}
+
+	/* find the output responsible for this event */
+	out = (struct modeset_output *)data;
+	for (iter = output_list; iter && !out; iter = iter->next) {
+		if (iter->crtc.id == crtc_id)
+			out = iter;
+	}
+	if (out == NULL)
+		return;
+
+	/* the framebuffer we flipped to is on screen, the one shown before
+	 * is free again; the worker's swapchain takes note, and its scheduler
+	 * of when that was. Once the workers are stopped, nothing needs to be
+	 * returned anymore. */
+	ts = sec * 1000000000ull + usec * 1000ull;
+	out->pflip_pending = false;
+	out->commit_timing->Record(DrmLab::FrameStage::Flip, out->commit_ns, ts);
+	out->timing->Flipped(frame);
+	if (out->cleanup)
+		return;
+	modeset_return_buffer(out, out->flipping, true, frame, ts);
+	out->flipping = NULL;
+	modeset_draw_out(fd, out);
+}
+
+/*
+ * modeset_perform_modeset() is new. First we define what properties have to be
+ * changed and the values that they will receive. To check if the modeset will
+ * work as expected, we perform an atomic commit with the flag
+ * DRM_MODE_ATOMIC_TEST_ONLY. With this flag the DRM driver tests if the atomic
+ * commit would work, but it doesn't commit it to the hardware. After, the same
+ * atomic commit is performed without the TEST_ONLY flag. The first frame of
+ * every output is drawn before both: the commits reference the framebuffer
+ * it is drawn into, and nothing is displayed before the real commit anyway.
+ * The render workers don't run yet, so we draw it ourselves.
+ *
+ * NOTE: we can't perform an atomic commit without an attached frambeuffer
+ * (even when we have DRM_MODE_ATOMIC_TEST_ONLY). It will simply fail.
+ */
+
+static int modeset_perform_modeset(int fd)
+{
+	int ret, flags, modeset_flag = 0;
+	struct modeset_output *iter;
+	std::unique_ptr<DrmLab::AtomicRequest> req;
+	std::vector<DrmLab::PipeAssignment> pipes;
+
+	/* draw the first frame of all outputs */
+	for (iter = output_list; iter; iter = iter->next) {
+
+		/* colors initialization, this is the first time we're drawing */
+		iter->r = rand() % 0xff;
+		iter->g = rand() % 0xff;
+		iter->b = rand() % 0xff;
+		iter->r_up = iter->g_up = iter->b_up = true;
+
+		iter->ready = modeset_paint_framebuffer(iter);
+		if (!iter->ready)
+			return -EIO;
+		iter->ready_layers = iter->layers;
+	}
+
+	req = DrmLab::AtomicRequest::Create(atomic_backend);
+	if (!req->Valid())
+		return -ENOMEM;
+
+	/* take our CRTCs from whoever used them before, like the assigner's
+	 * test commits did. This goes first: it turns off every other plane
+	 * left on our CRTCs, also the cursor plane and overlays we're about to
+	 * use, and of a property set twice the last value wins */
+	for (iter = output_list; iter; iter = iter->next)
+		pipes.push_back({ iter->connector.id, iter->crtc.id,
+				  iter->crtc_index, iter->plane.id });
+	ret = assigner->Release(req.get(), pipes);
+	if (ret < 0) {
+		fprintf(stderr, "prepare atomic commit failed, %d\n", ret);
+		return ret;
+	}
+	if (req->Size() != 0)
+		modeset_flag = DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	/* prepare modeset on all outputs */
+	for (iter = output_list; iter; iter = iter->next) {
+		ret = modeset_atomic_prepare_commit(fd, iter, req.get());
+		/* the first frame composites every sprite: this turns our
+		 * overlay planes off */
+		if (ret == 0 && iter->offload)
+			ret = iter->offload->Apply(req.get(), iter->ready_layers);
+		if (ret == 0 && iter->cursor)
+			ret = iter->cursor->Apply(req.get());
+		if (ret < 0)
+			break;
+		if (iter->pending.NeedsModeset())
+			modeset_flag = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "prepare atomic commit failed, %d\n", errno);
+		return ret;
+	}
+
+	/* perform test-only atomic commit */
+	flags = DRM_MODE_ATOMIC_TEST_ONLY | modeset_flag;
+	ret = req->Commit(fd, flags, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "test-only atomic commit failed, %d\n", errno);
+		return ret;
+	}
+
+	/* initial modeset on all outputs */
+	flags = modeset_flag | DRM_MODE_PAGE_FLIP_EVENT;
+	ret = req->Commit(fd, flags, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "modeset atomic commit failed, %d\n", errno);
+		return ret;
+	}
+
+	for (iter = output_list; iter; iter = iter->next) {
+		iter->commit_ns = DrmLab::EventLoop::Now();
+		modeset_atomic_commit_done(iter);
+		if (iter->offload)
+			iter->offload->Committed();
+		if (iter->cursor)
+			iter->cursor->Committed();
+		iter->flipping = iter->ready;
+		iter->ready = NULL;
+		iter->present_damage.Clear();
+		iter->pflip_pending = true;
+	}
+
+	return 0;
+}
+
+/*
+ * The loop of modeset_draw() waits on a DrmLab::EventLoop, which is an epoll
+ * fd. These are its event sources besides the DRM fd.
+ */
+
+static void modeset_stdin_event(uint32_t events)
+{
+	/* input and a closed stdin (EOF or error) both quit */
+	if (events & (EPOLLHUP | EPOLLERR))
+		fprintf(stderr, "exit due to closed stdin\n");
+	else
+		fprintf(stderr, "exit due to user-input\n");
+	event_loop->RemoveFd(0);
+	event_loop->Quit();
+}
+
+/*
+ * Write the frame timing of all outputs as JSON, to the file named by
+ * LABDRM_TIMING_JSON or to stdout. It happens at exit and on SIGUSR1, on the
+ * commit thread, which owns the statistics.
+ */
+
+static void modeset_dump_timing(void)
+{
+	const char *path = getenv("LABDRM_TIMING_JSON");
+	struct modeset_output *iter;
+	FILE *f = stdout;
+
+	if (path) {
+		f = fopen(path, "w");
+		if (!f) {
+			fprintf(stderr, "cannot write '%s': %m\n", path);
+			return;
+		}
+	}
+
+	fprintf(f, "{\"outputs\": [");
+	for (iter = output_list; iter; iter = iter->next) {
+		iter->timing->Drain(iter->render_timing);
+		iter->timing->Drain(iter->commit_timing);
+
+		fprintf(f, "%s{\"connector\": %u, \"crtc\": %u, \"timing\": ",
+			iter == output_list ? "" : ", ", iter->connector.id,
+			iter->crtc.id);
+		iter->timing->WriteJson(f, iter->render_timing->Dropped() +
+					iter->commit_timing->Dropped());
+		fprintf(f, "}");
+	}
+	fprintf(f, "]}\n");
+
+	if (f != stdout)
+		fclose(f);
+	else
+		fflush(f);
+}
+
+static void modeset_signal_event(int signo)
+{
+	if (signo == SIGUSR1) {
+		modeset_dump_timing();
+		return;
+	}
+
+	fprintf(stderr, "exit due to signal %d\n", signo);
+	event_loop->Quit();
+}
+
+static void modeset_udev_event(struct udev_device *dev)
+{
+	const char *action = udev_device_get_action(dev);
+
+	/* outputs are only set up once, so just tell */
+	fprintf(stderr, "%s: %s event, connectors may have changed\n",
+		udev_device_get_sysname(dev), action ? action : "change");
+}
+
+/*
+ * Start the render worker of an output. The commit thread learns about its
+ * frames from the event loop, which calls modeset_draw_out() for this very
+ * output.
+ */
+
+static int modeset_pipe_start(int fd, struct modeset_output *out)
+{
+	struct modeset_pipe *pipe;
+	uint64_t sequence, ns;
+	int ret;
+
+	pipe = new modeset_pipe();
+	pipe->quit = false;
+	pipe->scheduler = NULL;
+	pipe->target = 0;
+	pipe->frames_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pipe->returns_fd = eventfd(0, EFD_CLOEXEC);
+	if (pipe->frames_fd < 0 || pipe->returns_fd < 0) {
+		ret = -errno;
+		goto err_fds;
+	}
+
+	ret = event_loop->AddFd(pipe->frames_fd, EPOLLIN,
+		[fd, out](uint32_t) {
+			uint64_t n;
+
+			if (read(out->pipe->frames_fd, &n, sizeof(n)) > 0)
+				modeset_draw_out(fd, out);
+		});
+	if (ret)
+		goto err_fds;
+
+	/* schedule frames for their vblank, which needs page-flip timestamps
+	 * on the same clock as ours; Mailbox and Immediate render as fast as
+	 * they can anyway. The vblank clock tells the scheduler about the
+	 * current vblank, so it can predict the next ones before the first
+	 * page-flip completes. */
+	if (present_mode == DrmLab::PresentMode::Fifo && sched_margin >= 0 &&
+	    out->vblank) {
+		pipe->scheduler = new DrmLab::FrameScheduler(sched_margin);
+		pipe->scheduler->SetNominalPeriod(out->vblank->Period());
+	}
+	if (out->vblank && out->vblank->Now(&sequence, &ns) == 0 &&
+	    pipe->scheduler)
+		pipe->scheduler->Presented(NULL, (uint32_t)sequence, ns);
+
+	out->pipe = pipe;
+	pipe->thread = std::thread(modeset_worker, out);
+	return 0;
+
+err_fds:
+	if (pipe->frames_fd >= 0)
+		close(pipe->frames_fd);
+	if (pipe->returns_fd >= 0)
+		close(pipe->returns_fd);
+	delete pipe;
+	return ret;
+}
+
+static void modeset_pipe_stop(struct modeset_output *out)
+{
+	struct modeset_pipe *pipe = out->pipe;
+
+	if (!pipe)
+		return;
+
+	pipe->quit = true;
+	modeset_wake(pipe->returns_fd);
+	pipe->thread.join();
+
+	if (pipe->scheduler && pipe->scheduler->Stats().frames > 0) {
+		const DrmLab::SchedulerStats &st = pipe->scheduler->Stats();
+		fprintf(stdout, "connector %u: %llu frames started %.2f ms before "
+			"their vblank on average (%.2f ms max), %llu missed it, "
+			"vblank predicted within %.1f us\n",
+			out->connector.id, (unsigned long long)st.frames,
+			st.latency_ns / 1e6 / st.frames, st.max_latency_ns / 1e6,
+			(unsigned long long)st.missed,
+			st.predictions ? st.error_ns / 1e3 / st.predictions : 0.0);
+	}
+	delete pipe->scheduler;
+
+	event_loop->RemoveFd(pipe->frames_fd);
+	close(pipe->frames_fd);
+	close(pipe->returns_fd);
+	delete pipe;
+	out->pipe = NULL;
+}
+
+/*
+ * modeset_draw() changes. If we got here, the modeset already occurred. When
+ * the page-flip for a certain output is done, an event will be fired and we'll
+ * be able to handle it.
+ *
+ * Here we define the function that should handle these events, which is
+ * modeset_page_flip_event(). This function calls modeset_draw_out(), which is
+ * responsible for performing another atomic commit with the newest frame.
+ * The frames come from the render workers, which we start after the modeset.
+ *
+ * Then we run an event loop for 5 seconds, which makes this thread the commit
+ * thread: it alone commits, the render workers only make TEST_ONLY commits
+ * for their sprites. The DRM fd is one of its sources:
+ * whenever it is readable, drmHandleEvent() reads the events and calls
+ * modeset_page_flip_event() for each one of them. Timers end the 5 seconds
+ * and retry commits, stdin and SIGINT/SIGTERM quit early. The signals and the
+ * udev monitor were added by main().
+ */
+
+static void modeset_draw(int fd)
+{
+	struct modeset_output *iter;
+	int ret, run_timer;
+	time_t start;
+	/* static: the loop's DRM source outlives this function, modeset_cleanup()
+	 * still dispatches the last page-flip events */
+	static drmEventContext ev;
+
+	/* init variables */
+	srand(time(&start));
+	memset(&ev, 0, sizeof(ev));
+
+	/* 3 is the first version that allow us to use page_flip_handler2, which
+	 * is just like page_flip_handler but with the addition of passing the
+	 * crtc_id as argument to the function that will handle page-flip events
+	 * (in our case, modeset_page_flip_event()). This is good because we can
+	 * find out for what output the page-flip happened.
+	 *
+	 * The usage of page_flip_handler2 is the reason why we needed to verify
+	 * the support for DRM_CAP_CRTC_IN_VBLANK_EVENT.
+	 */
+	ev.version = 3;
+	ev.page_flip_handler2 = modeset_page_flip_event;
+
+	ret = event_loop->AddDrm(fd, &ev);
+	if (ret == 0)
+		ret = event_loop->AddFd(0, EPOLLIN, modeset_stdin_event);
+	run_timer = event_loop->AddTimer([](uint64_t) { event_loop->Quit(); });
+	retry_timer = event_loop->AddTimer([fd](uint64_t) { modeset_retry(fd); });
+	cursor_timer = event_loop->AddTimer([fd](uint64_t) {
+		modeset_cursor_event(fd);
+	});
+	if (ret < 0 || run_timer < 0 || retry_timer < 0 || cursor_timer < 0) {
+		fprintf(stderr, "cannot set up the event loop\n");
+		return;
+	}
+	event_loop->ArmTimer(run_timer,
+			     DrmLab::EventLoop::Now() + 5000000000ull);
+	if (cursor_rate)
+		event_loop->ArmTimer(cursor_timer, DrmLab::EventLoop::Now(),
+				     1000000000ull / cursor_rate);
+
+	/* perform modeset using atomic commit, then let the workers render */
+	if (modeset_perform_modeset(fd) == 0) {
+		for (iter = output_list; iter; iter = iter->next) {
+			ret = modeset_pipe_start(fd, iter);
+			if (ret) {
+				fprintf(stderr, "cannot start render worker, %d\n",
+					ret);
+				event_loop->Quit();
+				break;
+			}
+		}
+	}
+
+	/* wait 5s for VBLANK, frames or input events */
+	while (!event_loop->ShouldQuit()) {
+		ret = event_loop->Dispatch(-1);
+		if (ret < 0) {
+			errno = -ret;
+			fprintf(stderr, "epoll_wait() failed with %d: %m\n", errno);
+			break;
+		}
+	}
+	event_loop->ArmTimer(retry_timer, 0);
+	event_loop->ArmTimer(cursor_timer, 0);
+
+	fprintf(stdout, "%s: %llu frames rendered, %llu dropped, "
+		"%llu commits retried after EBUSY\n",
+		DrmLab::PresentModeName(present_mode),
+		(unsigned long long)frames_rendered.load(),
+		(unsigned long long)frames_dropped,
+		(unsigned long long)commits_busy);
+	fprintf(stdout, "%llu heap allocations in %llu page-flips\n",
+		(unsigned long long)flip_allocs, (unsigned long long)flip_count);
+	if (layer_count)
+		fprintf(stdout, "%llu commits with sprites on planes rejected\n",
+			(unsigned long long)layers_rejected);
+	if (cursor_rate)
+		fprintf(stdout, "%llu pointer events, %llu commits of the pointer "
+			"alone, no frame painted for them\n",
+			(unsigned long long)cursor_events,
+			(unsigned long long)cursor_commits);
+	if (copy_ns > 0)
+		fprintf(stdout, "copied %.1f MiB in %llu frames with %u thread(s) "
+			"per output: %.2f GB/s average, %.2f - %.2f GB/s per frame\n",
+			copy_bytes / (1024.0 * 1024.0), (unsigned long long)copy_frames,
+			DrmLab::CopyEngine::ThreadsFromEnv(),
+			(double)copy_bytes / copy_ns, copy_min_gbps, copy_max_gbps);
+}
+
+/*
+ * modeset_cleanup() stays the same, apart from stopping the render workers,
+ * freeing the property cache and the sprites, waiting for the last
+ * page-flips with the event loop, and reporting the refresh rate the vblank
+ * clocks measured and the frame timing.
+ */
+
+static void modeset_cleanup(int fd)
+{
+	struct modeset_output *iter;
+	uint64_t sequence, ns;
+
+	for (iter = output_list; iter; iter = iter->next) {
+		iter->cleanup = true;
+		modeset_pipe_stop(iter);
+	}
+
+	for (iter = output_list; iter; iter = iter->next) {
+		/* if a page-flip is pending, wait for it to complete */
+		fprintf(stderr, "wait for pending page-flip to complete...\n");
+		while (iter->pflip_pending || iter->cursor_pending) {
+			if (event_loop->Dispatch(-1) < 0)
+				break;
+		}
+
+		/* the clock has seen the vblank before the first frame, so
+		 * this measures the refresh rate over the whole run */
+		if (iter->vblank && iter->vblank->Now(&sequence, &ns) == 0 &&
+		    iter->vblank->Period())
+			fprintf(stdout, "crtc %u: refreshing at %.3f Hz\n",
+				iter->crtc.id, 1e9 / iter->vblank->Period());
+
+		/* the workers are done with the engine */
+		if (iter->offload)
+			fprintf(stdout, "crtc %u: %u test commits for sprites on "
+				"planes, %u assignments reused\n", iter->crtc.id,
+				iter->offload->TestCount(),
+				iter->offload->CacheHits());
+	}
+
+	/* everything has been recorded now */
+	modeset_dump_timing();
+
+	while (output_list) {
+		/* get first output from list */
+		iter = output_list;
+
+		/* move head of the list to the next output */
+		output_list = iter->next;
+
+		/* destroy current output */
+		modeset_output_destroy(fd, iter);
+	}
+
+	modeset_free_sprites();
+
+	delete assigner;
+	assigner = NULL;
+	delete prop_cache;
+	prop_cache = NULL;
+	delete allocator;
+	allocator = NULL;
+}
+
+/*
+ * main() also changes. Instead of performing the KMS setup calling
+ * drmModeSetCrtc(), we instead setup it using the atomic API with the
+ * function modeset_perform_modeset(), which is called by modeset_draw().
+ */
+
+int main(int argc, char **argv)
+{
+	int ret, fd;
+	const char *card;
+
+	/* check which DRM device to open */
+	if (argc > 1)
+		card = argv[1];
+	else
+		card = "/dev/dri/card0";
+
+	fprintf(stderr, "using card '%s'\n", card);
+
+	/* check which atomic commit path to use */
+	atomic_backend = DrmLab::AtomicBackendFromEnv();
+	present_mode = DrmLab::PresentModeFromEnv();
+	sched_margin = DrmLab::FrameScheduler::MarginFromEnv();
+	if (getenv("LABDRM_LAYERS")) {
+		layer_count = strtoul(getenv("LABDRM_LAYERS"), NULL, 10);
+		if (layer_count > DrmLab::LayerStack::max_layers)
+			layer_count = DrmLab::LayerStack::max_layers;
+	}
+	if (getenv("LABDRM_CURSOR"))
+		cursor_rate = strtoul(getenv("LABDRM_CURSOR"), NULL, 10);
+
+	/* The event loop blocks SIGINT and SIGTERM to read them from a
+	 * signalfd, along with SIGUSR1 to dump the frame timing. That must
+	 * happen before modeset_prepare() starts the copy
+	 * threads and modeset_draw() the render workers: they would inherit
+	 * an unblocked mask and take the signals.
+	 * It also watches udev for hotplug events. */
+	event_loop = new DrmLab::EventLoop();
+	if (!event_loop->Valid()) {
+		ret = -errno;
+		goto out_return;
+	}
+	if (event_loop->AddSignals({ SIGINT, SIGTERM, SIGUSR1 },
+				   modeset_signal_event) < 0)
+		fprintf(stderr, "cannot catch signals, exit with input instead\n");
+	if (event_loop->AddUdevMonitor("drm", modeset_udev_event) < 0)
+		fprintf(stderr, "cannot monitor udev, hotplug goes unnoticed\n");
+
+	/* trace into LABDRM_TRACE if set, reading the kernel's side as it
+	 * comes in so the trace buffer doesn't overflow */
+	tracer = DrmLab::Tracer::FromEnv().release();
+	if (tracer)
+		event_loop->AddFd(tracer->Fd(), EPOLLIN, [](uint32_t) {
+			tracer->Read();
+		});
+
+	/* open the DRM device */
+	ret = modeset_open(&fd, card);
+	if (ret)
+		goto out_return;
+
+	/* prepare all connectors and CRTCs */
+	ret = modeset_prepare(fd);
+	if (ret)
+		goto out_close;
+
+	/* draw some colors for 5seconds */
+	modeset_draw(fd);
+
+	/* cleanup everything */
+	modeset_cleanup(fd);
+
+	ret = 0;
+
+out_close:
+	/* the fd of a virtual device goes with it */
+	if (!virtual_kms)
+		close(fd);
+out_return:
+	if (tracer && tracer->Read() >= 0)
+		fprintf(stderr, "trace: %llu events in '%s'\n",
+			(unsigned long long)tracer->Events(),
+			getenv("LABDRM_TRACE"));
+	delete tracer;
+	tracer = NULL;
+	if (virtual_kms && virtual_kms->DroppedEvents())
+		fprintf(stderr, "virtual KMS: %llu events dropped\n",
+			(unsigned long long)virtual_kms->DroppedEvents());
+	delete virtual_kms;
+	virtual_kms = NULL;
+	delete event_loop;
+	event_loop = NULL;
+	if (ret) {
+		errno = -ret;
+		fprintf(stderr, "modeset failed with error %d: %m\n", errno);
+	} else {
+		fprintf(stderr, "exiting\n");
+	}
+	return ret;
+}
+
+/*
+ * This is a very simple example to show how to use the KMS atomic API and how
+ * different it is from legacy KMS. Most modern drivers are using the atomic
+ * API, so it is important to have this example.
+ *
+ * Just like vsync'ed double-buffering, the atomic API does not not solve all
+ * the problems that can happen  and you have to figure out the best
+ * implementation for your use case.
+ *
+ * If you want to take a look at more complex examples that makes use of KMS
+ * atomic API, I can recommend you:
+ *
+ * - kms-quads: https://gitlab.freedesktop.org/daniels/kms-quads/
+ *   A more complex (but also well-explained) example that can be used to
+ *   learn how to build a compositor using the atomic API. Supports both
+ *   GL and software rendering.
+ *
+ * - Weston: https://gitlab.freedesktop.org/wayland/weston
+ *   Reference implementation of a Wayland compositor. It's a very
+ *   sophisticated DRM renderer, hard to understand fully as it uses more
+ *   complicated techniques like DRM planes.
+ *
+ * Any feedback is welcome. Feel free to use this code freely for your own
+ * documentation or projects.
+ *
+ *  - Hosted on http://github.com/dvdhrm/docs
+ */
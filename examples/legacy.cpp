@@ -6,43 +6,32 @@
 #include <memory>
 #include <vector>
 #include <thread>
-#include <limits>
 
 #include <cstdint>
 #include <cstdlib>
 #include <cerrno>
 #include <cstring> // memset
 #include <fcntl.h> // open
-#include <sys/mman.h> // mmap
 #include <unistd.h> // close
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "allocator.h"
+#include "cursor.h"
+#include "damage.h"
+#include "raster.h"
 
 struct drme_conn_info;
-struct drme_dumb_buffer;
-static std::shared_ptr<drme_dumb_buffer> alloc_buffer(int drm_fd, uint32_t width, uint32_t height);
-static uint32_t add_fb(std::shared_ptr<drme_conn_info> conn_info, std::shared_ptr<drme_dumb_buffer> buffer);
 void print_modes(drmModeConnectorPtr drm_conn);
 
-struct drme_dumb_buffer {
-    int fd;
-	uint32_t handle; // a DRM handle to the buffer object that we can draw into
-	uint32_t stride;
-	uint32_t width, height;
-
-    uint32_t size; // size of the memory mapped buffer
-	void *map = nullptr; // pointer to the memory mapped buffer
-
-    uint32_t format;
-};
-
 struct drme_conn_info {
     drme_conn_info() {}
 
     int drm_fd;
 
 	uint32_t buf_width, buf_height; // TODO: remove
-    std::shared_ptr<drme_dumb_buffer> buf;
+    DrmLab::Buffer buf {};
 
 	drmModeModeInfo mode; // the display mode that we want to use
 	uint32_t fb_handle; // framebuffer handle with our buffer object as scanout buffer
@@ -50,6 +39,11 @@ struct drme_conn_info {
 	uint32_t crtc_id; // the crtc ID that we want to use with this connector
 	drmModeCrtcPtr previous_crtc = nullptr; // the configuration of the crtc before we changed it. We use it so we can restore the same mode when we exit.
 
+    // a pointer on the CRTC's cursor, moved without repainting the buffer
+    std::unique_ptr<DrmLab::HardwareCursor> cursor;
+    int32_t cursor_x = 0, cursor_y = 0;
+    int32_t cursor_dx = 4, cursor_dy = 3;
+
     // TODO: backend
     // TODO: output
     // TODO: crtc
@@ -57,6 +51,9 @@ struct drme_conn_info {
 
 static std::vector<std::shared_ptr<drme_conn_info>> conn_info_list = {};
 
+// we draw straight into the scanout buffers, dumb buffers work everywhere for that
+static std::unique_ptr<DrmLab::Allocator> allocator;
+
 static int drme_device_setup(const char* card_node)
 {
     // open drm device
@@ -76,6 +73,7 @@ static int drme_device_setup(const char* card_node)
 		close(drm_fd);
 		return -1;
     }
+    allocator = DrmLab::Allocator::Create(DrmLab::AllocatorBackend::Dumb, drm_fd);
 
     // uint64_t has_addfb2;
     // if (drmGetCap(drm_fd, DRM_CAP_ADDFB2_MODIFIERS, &has_addfb2) != 0 ||
@@ -163,25 +161,16 @@ static bool drme_scan_connectors(int drm_fd)
         printf("[*] mode for connector %u is (%u x %u)\n", drm_conn->connector_id, 
             conn_info->buf_width, conn_info->buf_height);
 
-        /* Step5: create framebuffer */
-        // create dumb buffer
-        // TODO: move to allocator
-        auto buffer = alloc_buffer(drm_fd, conn_info->buf_width, conn_info->buf_height);
-        if (buffer == nullptr) {
+        /* Step5: create a buffer and its framebuffer */
+        if (allocator->Allocate(conn_info->buf_width, conn_info->buf_height, DRM_FORMAT_XRGB8888,
+                                DRM_FORMAT_MOD_INVALID, &conn_info->buf) != 0) {
+            fprintf(stderr, "[!] Failed to allocate a %ux%u buffer : (%d) %m\n",
+                    conn_info->buf_width, conn_info->buf_height, errno);
             drmModeFreeEncoder(current_encoder);
             drmModeFreeConnector(drm_conn);
             continue;
         }
-        conn_info->buf = buffer;
-        // create framebuffer object for the dumb-buffer
-        // TODO: sperate to independent opt
-        auto fb_handle = add_fb(conn_info, buffer);
-        if (fb_handle == 0) {
-            drmModeFreeEncoder(current_encoder);
-            drmModeFreeConnector(drm_conn);
-            continue;
-        }
-        conn_info->fb_handle = fb_handle;
+        conn_info->fb_handle = conn_info->buf.fb;
 
         /* Step6: cleanup */
         drmModeFreeEncoder(current_encoder);
@@ -195,84 +184,6 @@ static bool drme_scan_connectors(int drm_fd)
     return true;
 }
 
-static std::shared_ptr<drme_dumb_buffer> alloc_buffer(int drm_fd, uint32_t width, uint32_t height)
-{
-    std::shared_ptr<drme_dumb_buffer> buffer = std::make_shared<drme_dumb_buffer>();
-
-    // Step1: create dumb buffer
-    struct drm_mode_create_dumb create = {
-        .height = height,
-        .width = width,
-        .bpp = 32, // bits per pixel, TODO: set by swapchain 
-        .flags = 0
-    };
-    if (drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
-        fprintf(stderr, "[!] Failed to create DRM dumb buffer : (%d) %m\n",
-			errno);
-		return nullptr;
-    }
-
-    buffer->width  = create.width;
-    buffer->height = create.height;
-
-    buffer->stride = create.pitch;
-    buffer->handle = create.handle;
-    buffer->size   = create.size;
-
-    // Step2: map the dumb buffer for userspace drawing
-    // prepare buffer for mmap
-	struct drm_mode_map_dumb map = {
-        .handle = buffer->handle,
-        .pad = 0
-    };
-
-    if (drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) != 0) {
-        fprintf(stderr, "[!] Failed to map DRM dumb buffer : (%d) %m\n",
-			errno);
-		return nullptr;
-    }
-    // perform actual memory mapping
-    buffer->map = mmap(0, buffer->size, PROT_READ | PROT_WRITE, 
-        MAP_SHARED, drm_fd, map.offset);
-
-    // clear buffer to 0
-    memset(buffer->map, std::numeric_limits<int>::max(), buffer->size);
-
-    // FIXME: Step3: convert to DMA buffer fd
-    int prime_fd;
-    if (drmPrimeHandleToFD(drm_fd, buffer->handle, DRM_CLOEXEC,
-			&prime_fd) != 0) { // RAW
-        fprintf(stderr, "[!] Failed to convert handle to prime fd : (%d) %m\n", errno);
-		return nullptr;
-	}
-    buffer->fd = prime_fd;
-
-    return buffer;
-}
-
-/**
- * @brief 
- * 
- * @param conn_info 
- * @param buffer buffer handle
- * @return uint32_t 0 means fail, other means new fb handle
- */
-static uint32_t add_fb(std::shared_ptr<drme_conn_info> conn_info, std::shared_ptr<drme_dumb_buffer> buffer)
-{
-    uint32_t id = 0;
-
-    uint8_t depth = 32;
-    uint8_t bpp = 32;
-    // TODO: use drmModeAddFB2 & drmMOdeAddFB2WithModifiers
-    if (drmModeAddFB(conn_info->drm_fd, buffer->width, buffer->height, depth, 
-        bpp, buffer->stride, buffer->handle, &id)) {
-        fprintf(stderr, "[!] drmModeAddFB failed : (%d) %m\n",
-			errno);
-    }
-
-    return id;
-}
-
 static bool legacy_crtc_commit()
 {
     for (const auto& ci : conn_info_list) {
@@ -290,6 +201,62 @@ static bool legacy_crtc_commit()
     return true;
 }
 
+// a white arrow with a black outline, its tip at the top left
+static void legacy_cursor_setup()
+{
+    uint32_t image[16 * 24];
+    for (int32_t y = 0; y < 24; y++) {
+        int32_t edge = y < 16 ? y * 2 / 3 : (23 - y) * 4 / 3;
+        for (int32_t x = 0; x < 16; x++) {
+            image[y * 16 + x] = x > edge ? 0 : (x == 0 || x == edge || y == 23) ? 0xff000000 : 0xffffffff;
+        }
+    }
+
+    for (const auto& ci : conn_info_list) {
+        ci->cursor = DrmLab::HardwareCursor::CreateLegacy(ci->drm_fd, ci->crtc_id);
+        if (!ci->cursor) {
+            continue;
+        }
+        ci->cursor_x = ci->buf_width / 2;
+        ci->cursor_y = ci->buf_height / 2;
+        ci->cursor->SetImage(image, 16 * 4, 16, 24, 0, 0);
+        ci->cursor->MoveTo(ci->cursor_x, ci->cursor_y);
+        ci->cursor->Show(true);
+        if (ci->cursor->Commit(0, nullptr) != 0) {
+            fprintf(stderr, "[!] Failed to show the cursor on CRTC %u\n", ci->crtc_id);
+            ci->cursor.reset();
+        }
+    }
+}
+
+// move the pointers around for a second, like a mouse would: the cursor
+// ioctls take effect right away and leave the buffer as it is
+static void legacy_cursor_move()
+{
+    for (int step = 0; step < 100; step++) {
+        for (const auto& ci : conn_info_list) {
+            if (!ci->cursor) {
+                continue;
+            }
+            ci->cursor_x += ci->cursor_dx;
+            ci->cursor_y += ci->cursor_dy;
+            if (ci->cursor_x < 0 || ci->cursor_x >= static_cast<int32_t>(ci->buf_width)) {
+                ci->cursor_dx = -ci->cursor_dx;
+                ci->cursor_x += 2 * ci->cursor_dx;
+            }
+            if (ci->cursor_y < 0 || ci->cursor_y >= static_cast<int32_t>(ci->buf_height)) {
+                ci->cursor_dy = -ci->cursor_dy;
+                ci->cursor_y += 2 * ci->cursor_dy;
+            }
+            ci->cursor->MoveTo(ci->cursor_x, ci->cursor_y);
+            ci->cursor->Commit(0, nullptr);
+        }
+
+        using namespace std::literals::chrono_literals;
+        std::this_thread::sleep_for(10ms);
+    }
+}
+
 static uint8_t next_color(bool *up, uint8_t cur, unsigned int mod)
 {
 	uint8_t next;
@@ -318,17 +285,35 @@ static void redraw_loop()
 		b = next_color(&b_up, b, 5);
 
         for (const auto& ci : conn_info_list) {
-            for (uint32_t h = 0; h < ci->buf_height; h++) {
-                for (uint32_t w = 0; w < ci->buf_width; w++) {
-                    uint64_t pixel_offset = (ci->buf->stride * h) + (4 * w);
-                    uint32_t* pixel = reinterpret_cast<uint32_t*>(&(static_cast<uint8_t*>(ci->buf->map)[pixel_offset]));
-                    *pixel = (r << 16) | (g << 8) | b;
-                }
+            // only repaint one band of rows per frame (the whole buffer the first time),
+            // so the driver only has to upload that band
+            DrmLab::Damage damage;
+            damage.Clear();
+            if (i == 0) {
+                damage.SetFull(ci->buf_width, ci->buf_height);
+            } else {
+                int32_t band = (i - 1) % 8;
+                int32_t band_height = ci->buf_height / 8;
+                damage.Add(DrmLab::Rect{ 0, band * band_height, static_cast<int32_t>(ci->buf_width),
+                    band == 7 ? static_cast<int32_t>(ci->buf_height) : (band + 1) * band_height });
+            }
+
+            uint32_t color = (r << 16) | (g << 8) | b;
+            allocator->BeginCpuAccess(&ci->buf);
+            for (size_t n = 0; n < damage.count; n++) {
+                DrmLab::FillRect(ci->buf.map, ci->buf.map_stride, damage.rects[n], color);
+            }
+            allocator->EndCpuAccess(&ci->buf);
+
+            // we draw into the scanout buffer directly, so tell drivers with their own
+            // copy of the framebuffer (e.g. vkms, udl) what to upload
+            int ret = DrmLab::DirtyFB(ci->drm_fd, ci->fb_handle, damage);
+            if (ret != 0 && ret != -ENOSYS) {
+                fprintf(stderr, "[!] drmModeDirtyFB failed : (%d)\n", ret);
             }
         }
 
-        using namespace std::literals::chrono_literals;
-        std::this_thread::sleep_for(1s);
+        legacy_cursor_move();
     }
 }
 
@@ -339,6 +324,9 @@ static void cleanup()
         auto conn = *iter;
         iter = conn_info_list.erase(iter);
 
+        /* hide the cursor and free its buffers */
+        conn->cursor.reset();
+
         /* restore saved CRTC config */
         drmModeSetCrtc(conn->drm_fd, 
             conn->previous_crtc->crtc_id, 
@@ -350,20 +338,13 @@ static void cleanup()
             &conn->previous_crtc->mode);
         drmModeFreeCrtc(conn->previous_crtc);
 
-        /* unmap buffer */
-        munmap(conn->buf->map, conn->buf->size);
-
-        /* delete framebuffer & dumb buffer */
-        drmModeRmFB(conn->drm_fd, conn->fb_handle);
-        
-        struct drm_mode_destroy_dumb destroy = { 
-            .handle = conn->buf->handle 
-        };
-        drmIoctl(conn->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+        /* delete framebuffer, unmap and free the buffer */
+        allocator->Free(&conn->buf);
 
         /* free allocated memory */
         // managed by shared pointer
     }
+    allocator.reset();
 }
 
 int main()
@@ -384,6 +365,7 @@ int main()
     /* perform actual modesetting on each found connector+CRTC */
     std::cout << "[*] Perform modesetting..." << std::endl;
     legacy_crtc_commit();
+    legacy_cursor_setup();
 
     /* redraw */
     std::cout << "[*] Redrawing..." << std::endl;
@@ -0,0 +1,254 @@
+/*
+ * vblank - pace a client to the display without rendering
+ *
+ * This example wakes up once per vblank on every active CRTC, for 5 seconds,
+ * and prints how close each vblank came to where the clock predicted it. It
+ * never commits anything and doesn't need to be DRM master: the CRTCs keep
+ * showing what the compositor or the console put there.
+ *
+ * The wakeups come from DrmLab::VBlankClock (see labdrm/vblank_clock.h),
+ * which queues them with drmCrtcQueueSequence(). The kernel sends an event
+ * at the requested vblank, so there is no timer to drift from the display
+ * and no page-flip to the same framebuffer just to get an event, which is
+ * what idle outputs in the other examples would need.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "event_loop.h"
+#include "vblank_clock.h"
+
+struct vblank_crtc {
+	struct vblank_crtc *next;
+	DrmLab::VBlankClock *clock;
+	uint32_t mode_period;	/* ns, from the mode timings */
+
+	/* the vblank we wait for and where the clock expects it */
+	uint64_t target;
+	uint64_t predicted;
+
+	uint64_t count;
+	uint64_t error_ns;	/* sum of |predicted - actual| */
+	uint64_t max_error_ns;
+};
+static struct vblank_crtc *crtc_list = NULL;
+
+static DrmLab::EventLoop *event_loop = NULL;
+
+/*
+ * Refresh period of a mode in nanoseconds: the pixel clock is in kHz.
+ */
+
+static uint32_t vblank_mode_period(const drmModeModeInfo *mode)
+{
+	if (!mode->clock)
+		return 0;
+	return (uint64_t)mode->htotal * mode->vtotal * 1000000ull / mode->clock;
+}
+
+static int vblank_queue(struct vblank_crtc *crtc, uint64_t sequence);
+
+/*
+ * Called at each vblank of a CRTC. The clock has already taken the vblank
+ * into account, so the prediction had to be made when it was queued.
+ */
+
+static void vblank_event(struct vblank_crtc *crtc, uint64_t sequence,
+			 uint64_t ns)
+{
+	uint64_t error;
+
+	if (sequence == crtc->target && crtc->predicted) {
+		error = crtc->predicted > ns ? crtc->predicted - ns :
+			ns - crtc->predicted;
+		crtc->error_ns += error;
+		if (error > crtc->max_error_ns)
+			crtc->max_error_ns = error;
+		crtc->count++;
+	}
+
+	if (sequence % 60 == 0)
+		fprintf(stdout, "crtc %u: vblank %llu at %llu.%06llu, "
+			"period %.3f ms\n", crtc->clock->CrtcId(),
+			(unsigned long long)sequence,
+			(unsigned long long)(ns / 1000000000ull),
+			(unsigned long long)(ns % 1000000000ull / 1000),
+			crtc->clock->Period() / 1e6);
+
+	if (vblank_queue(crtc, sequence + 1))
+		event_loop->Quit();
+}
+
+static int vblank_queue(struct vblank_crtc *crtc, uint64_t sequence)
+{
+	int ret;
+
+	crtc->target = sequence;
+	crtc->predicted = crtc->clock->Predict(sequence);
+	ret = crtc->clock->WakeAt(sequence,
+		[crtc](uint64_t seq, uint64_t ns) {
+			vblank_event(crtc, seq, ns);
+		});
+	if (ret) {
+		errno = -ret;
+		fprintf(stderr, "cannot queue vblank %llu on crtc %u: %m\n",
+			(unsigned long long)sequence, crtc->clock->CrtcId());
+	}
+	return ret;
+}
+
+/*
+ * Set up a clock for every CRTC that is scanning out, and queue its first
+ * wakeup for the next vblank.
+ */
+
+static int vblank_prepare(int fd)
+{
+	struct vblank_crtc *crtc;
+	drmModeRes *res;
+	drmModeCrtc *c;
+	uint64_t sequence, ns;
+	int i;
+
+	res = drmModeGetResources(fd);
+	if (!res) {
+		fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+			errno);
+		return -errno;
+	}
+
+	for (i = 0; i < res->count_crtcs; ++i) {
+		c = drmModeGetCrtc(fd, res->crtcs[i]);
+		if (!c)
+			continue;
+		if (!c->mode_valid) {
+			drmModeFreeCrtc(c);
+			continue;
+		}
+
+		crtc = static_cast<vblank_crtc*>(calloc(1, sizeof(*crtc)));
+		crtc->clock = DrmLab::VBlankClock::Create(fd, c->crtc_id).release();
+		crtc->mode_period = vblank_mode_period(&c->mode);
+		drmModeFreeCrtc(c);
+		if (!crtc->clock) {
+			free(crtc);
+			break;
+		}
+		crtc->clock->SetNominalPeriod(crtc->mode_period);
+
+		if (crtc->clock->Now(&sequence, &ns) ||
+		    vblank_queue(crtc, sequence + 1)) {
+			delete crtc->clock;
+			free(crtc);
+			continue;
+		}
+
+		crtc->next = crtc_list;
+		crtc_list = crtc;
+	}
+
+	drmModeFreeResources(res);
+	if (!crtc_list) {
+		fprintf(stderr, "no active crtc\n");
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static void vblank_cleanup(void)
+{
+	struct vblank_crtc *crtc;
+
+	while (crtc_list) {
+		crtc = crtc_list;
+		crtc_list = crtc->next;
+
+		if (crtc->count && crtc->clock->Period())
+			fprintf(stdout, "crtc %u: %llu vblanks, %.3f Hz measured, "
+				"%.3f Hz by the mode; predicted within %.1f us, "
+				"%.1f us at worst\n", crtc->clock->CrtcId(),
+				(unsigned long long)crtc->count,
+				1e9 / crtc->clock->Period(),
+				crtc->mode_period ? 1e9 / crtc->mode_period : 0.0,
+				crtc->error_ns / 1e3 / crtc->count,
+				crtc->max_error_ns / 1e3);
+
+		delete crtc->clock;
+		free(crtc);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	drmEventContext ev;
+	const char *card;
+	int ret, fd, timer;
+
+	if (argc > 1)
+		card = argv[1];
+	else
+		card = "/dev/dri/card0";
+
+	fprintf(stderr, "using card '%s'\n", card);
+
+	event_loop = new DrmLab::EventLoop();
+	if (!event_loop->Valid()) {
+		ret = -errno;
+		goto out_return;
+	}
+	event_loop->AddSignals({ SIGINT, SIGTERM },
+			       [](int) { event_loop->Quit(); });
+
+	fd = open(card, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "cannot open '%s': %m\n", card);
+		goto out_return;
+	}
+
+	ret = vblank_prepare(fd);
+	if (ret)
+		goto out_close;
+
+	/* version 4 is the first with sequence_handler */
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 4;
+	ev.sequence_handler = DrmLab::VBlankClock::SequenceHandler;
+	ret = event_loop->AddDrm(fd, &ev);
+	if (ret)
+		goto out_cleanup;
+
+	/* run for 5 seconds, or until input */
+	timer = event_loop->AddTimer([](uint64_t) { event_loop->Quit(); });
+	if (timer >= 0)
+		event_loop->ArmTimer(timer, DrmLab::EventLoop::Now() +
+				     5000000000ull);
+	event_loop->AddFd(0, EPOLLIN, [](uint32_t) { event_loop->Quit(); });
+
+	event_loop->Run();
+	ret = 0;
+
+out_cleanup:
+	vblank_cleanup();
+out_close:
+	close(fd);
+out_return:
+	delete event_loop;
+	if (ret) {
+		errno = -ret;
+		fprintf(stderr, "vblank failed with error %d: %m\n", errno);
+	} else {
+		fprintf(stderr, "exiting\n");
+	}
+	return ret;
+}
@@ -0,0 +1,75 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+
+namespace DrmLab
+{
+
+static std::atomic<uint64_t> heap_alloc_count{0};
+
+uint64_t HeapAllocCount()
+{
+    return heap_alloc_count.load(std::memory_order_relaxed);
+}
+
+} // namespace DrmLab
+
+#ifdef __GLIBC__
+
+/* glibc exports its allocator under these names, which lets us wrap malloc()
+ * without dlsym() (which itself allocates). */
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t nmemb, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size)
+{
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+/* glibc exports no __libc_posix_memalign, so the checks of posix_memalign()
+ * are repeated here */
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    DrmLab::heap_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = __libc_memalign(alignment, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+#endif // __GLIBC__
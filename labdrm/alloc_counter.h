@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+namespace DrmLab
+{
+
+/**
+ * @brief Number of heap allocations (malloc, calloc, realloc, memalign,
+ * aligned_alloc, posix_memalign) made by the whole process so far, including
+ * the ones inside libdrm. valloc() and pvalloc() aren't counted.
+ *
+ * alloc_counter.cpp isn't part of the labdrm library: it replaces malloc()
+ * & co. with thin counting wrappers around the glibc allocator, so only the
+ * binaries that want the numbers link it (labdrm_alloc_counter), e.g. to
+ * check that a frame loop doesn't allocate in steady state. It only counts on
+ * glibc, elsewhere it always returns 0.
+ */
+uint64_t HeapAllocCount();
+
+} // namespace DrmLab
@@ -0,0 +1,305 @@
+#include "allocator.h"
+#include "allocator_backends.h"
+#include "virtual_kms.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+const char* AllocatorBackendName(AllocatorBackend backend)
+{
+    switch (backend) {
+    case AllocatorBackend::Dumb:
+        return "dumb";
+    case AllocatorBackend::Shm:
+        return "shm";
+    case AllocatorBackend::Gbm:
+        return "gbm";
+    case AllocatorBackend::DmaHeap:
+        return "dmaheap";
+    default:
+        return "unknown";
+    }
+}
+
+uint32_t FormatCpp(uint32_t format)
+{
+    switch (format) {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+        return 4;
+    case DRM_FORMAT_RGB565:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+void InitBuffer(Buffer* buf, AllocatorBackend backend, uint32_t width, uint32_t height,
+                uint32_t format, uint64_t modifier)
+{
+    memset(buf, 0, sizeof(*buf));
+    buf->width = width;
+    buf->height = height;
+    buf->format = format;
+    buf->modifier = modifier;
+    buf->plane_count = 1;
+    for (int i = 0; i < Buffer::max_planes; i++) {
+        buf->fds[i] = -1;
+    }
+    buf->backend = backend;
+}
+
+size_t PageAlign(size_t size)
+{
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+int AddFramebuffer(int drm_fd, Buffer* buf)
+{
+    int ret;
+
+    if (buf->modifier != DRM_FORMAT_MOD_INVALID && buf->modifier != DRM_FORMAT_MOD_LINEAR) {
+        uint64_t modifiers[Buffer::max_planes] = { 0 };
+        for (uint32_t i = 0; i < buf->plane_count; i++) {
+            modifiers[i] = buf->modifier;
+        }
+        ret = drmModeAddFB2WithModifiers(drm_fd, buf->width, buf->height, buf->format, buf->handles,
+                                         buf->strides, buf->offsets, modifiers, &buf->fb,
+                                         DRM_MODE_FB_MODIFIERS);
+    } else {
+        ret = drmModeAddFB2(drm_fd, buf->width, buf->height, buf->format, buf->handles,
+                            buf->strides, buf->offsets, &buf->fb, 0);
+    }
+
+    if (ret != 0) {
+        buf->fb = 0;
+        return -errno;
+    }
+    return 0;
+}
+
+int ImportDmabuf(int drm_fd, Buffer* buf)
+{
+    if (drmPrimeFDToHandle(drm_fd, buf->fds[0], &buf->handles[0]) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+void CloseHandle(int drm_fd, uint32_t handle)
+{
+    struct drm_gem_close gem_close;
+
+    memset(&gem_close, 0, sizeof(gem_close));
+    gem_close.handle = handle;
+    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+int DmabufSync(int dmabuf_fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+    int ret;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.flags = flags;
+    do {
+        ret = ioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    return ret < 0 ? -errno : 0;
+}
+
+/**
+ * @brief Dumb buffers: supported by every KMS driver, but their CPU mapping is
+ * write-combined on most hardware.
+ */
+class DumbAllocator : public Allocator
+{
+public:
+    explicit DumbAllocator(int drm_fd)
+        : Allocator(drm_fd)
+    {}
+
+    AllocatorBackend Backend() const override { return AllocatorBackend::Dumb; }
+    uint32_t Caps() const override { return AllocatorCapScanout | AllocatorCapCpuMap; }
+
+    int Allocate(uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+                 Buffer* buf) override
+    {
+        struct drm_mode_create_dumb creq;
+        struct drm_mode_map_dumb mreq;
+        uint32_t cpp = FormatCpp(format);
+        void* map;
+        int ret;
+
+        if (cpp == 0 || (modifier != DRM_FORMAT_MOD_INVALID && modifier != DRM_FORMAT_MOD_LINEAR)) {
+            return -EINVAL;
+        }
+        InitBuffer(buf, AllocatorBackend::Dumb, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+        memset(&creq, 0, sizeof(creq));
+        creq.width = width;
+        creq.height = height;
+        creq.bpp = cpp * 8;
+        if (drmIoctl(m_Fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+            return -errno;
+        }
+        buf->handles[0] = creq.handle;
+        buf->strides[0] = creq.pitch;
+        buf->size = creq.size;
+
+        ret = AddFramebuffer(m_Fd, buf);
+        if (ret != 0) {
+            goto err_destroy;
+        }
+
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.handle = buf->handles[0];
+        if (drmIoctl(m_Fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) != 0) {
+            ret = -errno;
+            goto err_fb;
+        }
+        map = MapDevice(m_Fd, buf->size, mreq.offset);
+        if (map == MAP_FAILED) {
+            ret = -errno;
+            goto err_fb;
+        }
+        buf->map = static_cast<uint8_t*>(map);
+        buf->map_stride = buf->strides[0];
+        memset(buf->map, 0, buf->size);
+
+        return 0;
+
+    err_fb:
+        drmModeRmFB(m_Fd, buf->fb);
+    err_destroy:
+        DestroyDumb(buf->handles[0]);
+        return ret;
+    }
+
+    void Free(Buffer* buf) override
+    {
+        munmap(buf->map, buf->size);
+        drmModeRmFB(m_Fd, buf->fb);
+        DestroyDumb(buf->handles[0]);
+        buf->map = nullptr;
+        buf->fb = 0;
+    }
+
+private:
+    void DestroyDumb(uint32_t handle)
+    {
+        struct drm_mode_destroy_dumb dreq;
+
+        memset(&dreq, 0, sizeof(dreq));
+        dreq.handle = handle;
+        drmIoctl(m_Fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    }
+};
+
+std::unique_ptr<Allocator> CreateDumbAllocator(int drm_fd)
+{
+    uint64_t cap;
+
+    if (drmGetCap(drm_fd, DRM_CAP_DUMB_BUFFER, &cap) != 0 || cap == 0) {
+        return nullptr;
+    }
+    return std::make_unique<DumbAllocator>(drm_fd);
+}
+
+std::unique_ptr<Allocator> Allocator::Create(AllocatorBackend backend, int drm_fd)
+{
+    switch (backend) {
+    case AllocatorBackend::Dumb:
+        return CreateDumbAllocator(drm_fd);
+    case AllocatorBackend::Shm:
+        return CreateShmAllocator(drm_fd);
+    case AllocatorBackend::Gbm:
+        return CreateGbmAllocator(drm_fd);
+    case AllocatorBackend::DmaHeap:
+        return CreateDmaHeapAllocator(drm_fd);
+    default:
+        return nullptr;
+    }
+}
+
+/*
+ * Allocate a buffer with `allocator`, run the caller's test on it and free it.
+ */
+static bool TryAllocator(Allocator* allocator, uint32_t width, uint32_t height, uint32_t format,
+                         const ScanoutTest& test)
+{
+    Buffer buf;
+
+    int ret = allocator->Allocate(width, height, format, DRM_FORMAT_MOD_INVALID, &buf);
+    if (ret != 0) {
+        fprintf(stderr, "[!] %s allocator can't allocate a %ux%u framebuffer: %s\n",
+                AllocatorBackendName(allocator->Backend()), width, height, strerror(-ret));
+        return false;
+    }
+
+    bool ok = !test || test(buf);
+    if (!ok) {
+        fprintf(stderr, "[!] %s buffers can't be scanned out.\n",
+                AllocatorBackendName(allocator->Backend()));
+    }
+    allocator->Free(&buf);
+    return ok;
+}
+
+std::unique_ptr<Allocator> ProbeAllocator(int drm_fd, uint32_t width, uint32_t height, uint32_t format,
+                                          const ScanoutTest& test)
+{
+    static const AllocatorBackend order[] = {
+        AllocatorBackend::Shm,
+        AllocatorBackend::DmaHeap,
+        AllocatorBackend::Gbm,
+        AllocatorBackend::Dumb,
+    };
+
+    const char* s = getenv("LABDRM_ALLOCATOR");
+    if (s != nullptr && strcmp(s, "auto") != 0) {
+        for (AllocatorBackend backend : order) {
+            if (strcmp(s, AllocatorBackendName(backend)) == 0) {
+                std::unique_ptr<Allocator> allocator = Allocator::Create(backend, drm_fd);
+                if (allocator == nullptr) {
+                    fprintf(stderr, "[!] LABDRM_ALLOCATOR=%s is not available.\n", s);
+                }
+                return allocator;
+            }
+        }
+        fprintf(stderr, "[!] unknown LABDRM_ALLOCATOR=%s, probing.\n", s);
+    }
+
+    /* a virtual device has nothing but dumb buffers, and gbm must not
+     * probe its fd for a driver */
+    if (VirtualKms::Find(drm_fd) != nullptr) {
+        return Allocator::Create(AllocatorBackend::Dumb, drm_fd);
+    }
+
+    for (AllocatorBackend backend : order) {
+        std::unique_ptr<Allocator> allocator = Allocator::Create(backend, drm_fd);
+        if (allocator != nullptr && TryAllocator(allocator.get(), width, height, format, test)) {
+            return allocator;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace DrmLab
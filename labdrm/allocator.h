@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace DrmLab
+{
+
+/**
+ * @brief Where the memory of a Buffer comes from.
+ */
+enum class AllocatorBackend
+{
+    Dumb,    // DRM_IOCTL_MODE_CREATE_DUMB, mapped through the DRM fd
+    Shm,     // sealed memfd turned into a dma-buf by /dev/udmabuf
+    Gbm,     // gbm_bo_create(), mapped with gbm_bo_map()
+    DmaHeap, // /dev/dma_heap/system, or the heap named by LABDRM_DMA_HEAP
+    Count
+};
+
+const char* AllocatorBackendName(AllocatorBackend backend);
+
+/**
+ * @brief What the buffers of an allocator can do.
+ */
+enum AllocatorCaps : uint32_t
+{
+    AllocatorCapScanout = 1u << 0,   // buffers get a KMS framebuffer
+    AllocatorCapCpuMap = 1u << 1,    // buffers are mapped for the CPU
+    AllocatorCapCpuCached = 1u << 2, // ... and the mapping is cached, so reads are cheap
+    AllocatorCapCpuSync = 1u << 3,   // CPU access must be bracketed, see Allocator::BeginCpuAccess()
+    AllocatorCapModifiers = 1u << 4, // can allocate with explicit format modifiers
+};
+
+/**
+ * @brief One buffer, whichever allocator it comes from.
+ *
+ * A plain aggregate, like the other labdrm types embedded in the examples'
+ * memset'ed structs. Plane arrays follow drmModeAddFB2(): unused planes are 0,
+ * unused fds are -1.
+ */
+struct Buffer
+{
+    static constexpr int max_planes = 4;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;   // DRM_FORMAT_*
+    uint64_t modifier; // DRM_FORMAT_MOD_*, DRM_FORMAT_MOD_LINEAR for dumb/shm/heap buffers
+    uint32_t plane_count;
+    uint32_t handles[max_planes]; // GEM handles on the DRM fd
+    uint32_t strides[max_planes];
+    uint32_t offsets[max_planes];
+    int fds[max_planes];          // dma-buf fds, -1 where there is none
+    size_t size;                  // bytes of the CPU mapping
+
+    uint8_t* map;        // CPU mapping of plane 0, nullptr if not mapped
+    uint32_t map_stride; // stride of `map`; GBM may map through a linear staging copy
+    uint32_t fb;         // KMS framebuffer, 0 if none
+
+    AllocatorBackend backend;
+    void* priv;          // owned by the allocator
+};
+
+/**
+ * @brief Allocates buffers that can be scanned out and drawn into by the CPU.
+ *
+ * Every backend allocates, maps and registers a framebuffer the same way, so
+ * the caller only deals with Buffer. Which backend is cheapest depends on the
+ * driver: a buffer the display engine can't scan out costs a full copy every
+ * frame, see ProbeAllocator().
+ */
+class Allocator
+{
+public:
+    /**
+     * @return nullptr if the backend isn't available on this system
+     */
+    static std::unique_ptr<Allocator> Create(AllocatorBackend backend, int drm_fd);
+
+    virtual ~Allocator() noexcept = default;
+
+    virtual AllocatorBackend Backend() const = 0;
+    virtual uint32_t Caps() const = 0;
+    bool Has(AllocatorCaps cap) const { return (Caps() & cap) != 0; }
+
+    /**
+     * @brief Allocate a buffer, map it and create its framebuffer.
+     * @param modifier DRM_FORMAT_MOD_INVALID to let the allocator choose
+     * @return 0 on success, negative errno otherwise
+     */
+    virtual int Allocate(uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+                         Buffer* buf) = 0;
+
+    /**
+     * @brief Remove the framebuffer, unmap and free the buffer.
+     */
+    virtual void Free(Buffer* buf) = 0;
+
+    /**
+     * @brief Bracket CPU writes to `buf->map` (only needed with AllocatorCapCpuSync).
+     *
+     * For GBM, `buf->map` is only valid in between: the mapping may be a
+     * staging copy which is written back on EndCpuAccess(). Several threads
+     * may access different buffers at the same time.
+     */
+    virtual int BeginCpuAccess(Buffer*) { return 0; }
+    virtual int EndCpuAccess(Buffer*) { return 0; }
+
+    int Fd() const { return m_Fd; }
+
+protected:
+    explicit Allocator(int drm_fd)
+        : m_Fd(drm_fd)
+    {}
+
+    int m_Fd;
+};
+
+/**
+ * @brief Extra check that a probe buffer can really be scanned out, e.g. a
+ * TEST_ONLY atomic commit putting it on the plane. The framebuffer existing
+ * only means the driver could import the memory.
+ */
+using ScanoutTest = std::function<bool(const Buffer& buf)>;
+
+/**
+ * @brief Find the best allocator for `format` at `width` x `height`.
+ *
+ * Backends are tried from the cheapest CPU path to the most conservative one:
+ * shm and heap buffers have cached CPU mappings, GBM and dumb ones usually
+ * write-combined. For each, a buffer is allocated and checked with `test`;
+ * the first that passes wins. Dumb buffers are always the last resort.
+ *
+ * LABDRM_ALLOCATOR=dumb|shm|gbm|dmaheap skips the probe and picks a backend.
+ * @return nullptr if nothing works
+ */
+std::unique_ptr<Allocator> ProbeAllocator(int drm_fd, uint32_t width, uint32_t height, uint32_t format,
+                                          const ScanoutTest& test = ScanoutTest());
+
+/**
+ * @brief Bytes per pixel of a single-plane RGB format, 0 if unsupported.
+ */
+uint32_t FormatCpp(uint32_t format);
+
+} // namespace DrmLab
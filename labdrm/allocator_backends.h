@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+
+#include "allocator.h"
+
+/*
+ * The Allocator backends and the helpers they share. Each backend lives in its
+ * own allocator_*.cpp; only those and allocator.cpp should include this.
+ */
+
+namespace DrmLab
+{
+
+std::unique_ptr<Allocator> CreateDumbAllocator(int drm_fd);
+std::unique_ptr<Allocator> CreateShmAllocator(int drm_fd);
+std::unique_ptr<Allocator> CreateGbmAllocator(int drm_fd);
+std::unique_ptr<Allocator> CreateDmaHeapAllocator(int drm_fd);
+
+/**
+ * @brief Reset `buf` to a single-plane buffer without handles, fds or mapping.
+ */
+void InitBuffer(Buffer* buf, AllocatorBackend backend, uint32_t width, uint32_t height,
+                uint32_t format, uint64_t modifier);
+
+/**
+ * @brief Rows of a linear buffer we allocate ourselves: 64 byte aligned,
+ * which every display engine we know of is happy with.
+ */
+inline uint32_t LinearStride(uint32_t width, uint32_t cpp)
+{
+    return (width * cpp + 63) & ~63u;
+}
+
+size_t PageAlign(size_t size);
+
+/**
+ * @brief drmModeAddFB2(), or drmModeAddFB2WithModifiers() if the buffer has an
+ * explicit, non-linear modifier.
+ * @return 0 on success, negative errno otherwise
+ */
+int AddFramebuffer(int drm_fd, Buffer* buf);
+
+/**
+ * @brief Import `buf->fds[0]` as `buf->handles[0]` with PRIME.
+ */
+int ImportDmabuf(int drm_fd, Buffer* buf);
+
+void CloseHandle(int drm_fd, uint32_t handle);
+
+/**
+ * @brief DMA_BUF_IOCTL_SYNC, retried on EINTR/EAGAIN.
+ */
+int DmabufSync(int dmabuf_fd, uint64_t flags);
+
+} // namespace DrmLab
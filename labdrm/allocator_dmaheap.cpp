@@ -0,0 +1,150 @@
+/*
+ * DMA-BUF heap allocator: buffers come from /dev/dma_heap/<name> and are
+ * imported into the DRM device. The "system" heap hands out cached pages,
+ * others (e.g. "system-uncached", CMA) may not.
+ */
+
+#include "allocator_backends.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+class DmaHeapAllocator : public Allocator
+{
+public:
+    DmaHeapAllocator(int drm_fd, int heap_fd, bool cached)
+        : Allocator(drm_fd)
+        , m_Heap(heap_fd)
+        , m_Cached(cached)
+    {}
+
+    ~DmaHeapAllocator() noexcept override { close(m_Heap); }
+
+    AllocatorBackend Backend() const override { return AllocatorBackend::DmaHeap; }
+    uint32_t Caps() const override
+    {
+        uint32_t caps = AllocatorCapScanout | AllocatorCapCpuMap | AllocatorCapCpuSync;
+        return m_Cached ? caps | AllocatorCapCpuCached : caps;
+    }
+
+    int Allocate(uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+                 Buffer* buf) override
+    {
+        struct dma_heap_allocation_data alloc;
+        uint32_t cpp = FormatCpp(format);
+        void* map;
+        int ret;
+
+        if (cpp == 0 || (modifier != DRM_FORMAT_MOD_INVALID && modifier != DRM_FORMAT_MOD_LINEAR)) {
+            return -EINVAL;
+        }
+        InitBuffer(buf, AllocatorBackend::DmaHeap, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+        /* heaps hand out whole pages */
+        buf->strides[0] = LinearStride(width, cpp);
+        buf->size = PageAlign(static_cast<size_t>(buf->strides[0]) * height);
+
+        memset(&alloc, 0, sizeof(alloc));
+        alloc.len = buf->size;
+        alloc.fd_flags = O_RDWR | O_CLOEXEC;
+        if (ioctl(m_Heap, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+            return -errno;
+        }
+        buf->fds[0] = static_cast<int>(alloc.fd);
+
+        ret = ImportDmabuf(m_Fd, buf);
+        if (ret != 0) {
+            goto err_dmabuf;
+        }
+        ret = AddFramebuffer(m_Fd, buf);
+        if (ret != 0) {
+            goto err_handle;
+        }
+
+        /* dma-bufs are mmap'ed through their own fd */
+        map = mmap(nullptr, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->fds[0], 0);
+        if (map == MAP_FAILED) {
+            ret = -errno;
+            goto err_fb;
+        }
+        buf->map = static_cast<uint8_t*>(map);
+        buf->map_stride = buf->strides[0];
+
+        BeginCpuAccess(buf);
+        memset(buf->map, 0, buf->size);
+        EndCpuAccess(buf);
+
+        return 0;
+
+    err_fb:
+        drmModeRmFB(m_Fd, buf->fb);
+    err_handle:
+        CloseHandle(m_Fd, buf->handles[0]);
+    err_dmabuf:
+        close(buf->fds[0]);
+        buf->fds[0] = -1;
+        return ret;
+    }
+
+    void Free(Buffer* buf) override
+    {
+        drmModeRmFB(m_Fd, buf->fb);
+        munmap(buf->map, buf->size);
+        CloseHandle(m_Fd, buf->handles[0]);
+        close(buf->fds[0]);
+        buf->fds[0] = -1;
+        buf->map = nullptr;
+        buf->fb = 0;
+    }
+
+    int BeginCpuAccess(Buffer* buf) override
+    {
+        return DmabufSync(buf->fds[0], DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    }
+
+    int EndCpuAccess(Buffer* buf) override
+    {
+        return DmabufSync(buf->fds[0], DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    }
+
+private:
+    int m_Heap;
+    bool m_Cached;
+};
+
+std::unique_ptr<Allocator> CreateDmaHeapAllocator(int drm_fd)
+{
+    uint64_t cap;
+
+    if (drmGetCap(drm_fd, DRM_CAP_PRIME, &cap) != 0 || !(cap & DRM_PRIME_CAP_IMPORT)) {
+        return nullptr;
+    }
+
+    const char* heap = getenv("LABDRM_DMA_HEAP");
+    if (heap == nullptr) {
+        heap = "system";
+    }
+    std::string path = std::string("/dev/dma_heap/") + heap;
+    int heap_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (heap_fd < 0) {
+        return nullptr;
+    }
+    return std::make_unique<DmaHeapAllocator>(drm_fd, heap_fd, strcmp(heap, "system") == 0);
+}
+
+} // namespace DrmLab
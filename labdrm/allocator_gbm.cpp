@@ -0,0 +1,154 @@
+/*
+ * GBM allocator: buffer objects from the driver's own allocator, which knows
+ * the tiling and placement the display engine wants. The CPU reaches them
+ * only through gbm_bo_map(), which may hand out a linear staging copy.
+ */
+
+#include "allocator_backends.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include <gbm.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+struct GbmBufferPriv
+{
+    struct gbm_bo* bo;
+    void* map_data; // gbm_bo_map() cookie, nullptr when unmapped
+};
+
+class GbmAllocator : public Allocator
+{
+public:
+    GbmAllocator(int drm_fd, struct gbm_device* gbm)
+        : Allocator(drm_fd)
+        , m_Gbm(gbm)
+    {}
+
+    ~GbmAllocator() noexcept override { gbm_device_destroy(m_Gbm); }
+
+    AllocatorBackend Backend() const override { return AllocatorBackend::Gbm; }
+    uint32_t Caps() const override
+    {
+        return AllocatorCapScanout | AllocatorCapCpuMap | AllocatorCapCpuSync | AllocatorCapModifiers;
+    }
+
+    int Allocate(uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+                 Buffer* buf) override
+    {
+        struct gbm_bo* bo;
+        int ret;
+
+        if (FormatCpp(format) == 0) {
+            return -EINVAL;
+        }
+
+        if (modifier == DRM_FORMAT_MOD_INVALID) {
+            /* linear, so that the mapping doesn't need a detiling copy */
+            bo = gbm_bo_create(m_Gbm, width, height, format,
+                               GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+        } else {
+            bo = gbm_bo_create_with_modifiers2(m_Gbm, width, height, format, &modifier, 1,
+                                               GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+        }
+        if (bo == nullptr) {
+            return errno != 0 ? -errno : -ENOMEM;
+        }
+
+        int planes = gbm_bo_get_plane_count(bo);
+        if (planes <= 0 || planes > Buffer::max_planes) {
+            gbm_bo_destroy(bo);
+            return -EINVAL;
+        }
+
+        InitBuffer(buf, AllocatorBackend::Gbm, width, height, format, gbm_bo_get_modifier(bo));
+        buf->plane_count = static_cast<uint32_t>(planes);
+        for (int i = 0; i < planes; i++) {
+            /* owned by the bo, never closed by us */
+            buf->handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+            buf->strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+            buf->offsets[i] = gbm_bo_get_offset(bo, i);
+        }
+        buf->size = static_cast<size_t>(buf->strides[0]) * height;
+
+        ret = AddFramebuffer(m_Fd, buf);
+        if (ret != 0) {
+            gbm_bo_destroy(bo);
+            return ret;
+        }
+
+        buf->priv = new GbmBufferPriv { bo, nullptr };
+        return 0;
+    }
+
+    void Free(Buffer* buf) override
+    {
+        GbmBufferPriv* priv = static_cast<GbmBufferPriv*>(buf->priv);
+
+        if (priv->map_data != nullptr) {
+            gbm_bo_unmap(priv->bo, priv->map_data);
+        }
+        drmModeRmFB(m_Fd, buf->fb);
+        gbm_bo_destroy(priv->bo);
+        delete priv;
+
+        buf->priv = nullptr;
+        buf->map = nullptr;
+        buf->fb = 0;
+    }
+
+    int BeginCpuAccess(Buffer* buf) override
+    {
+        GbmBufferPriv* priv = static_cast<GbmBufferPriv*>(buf->priv);
+
+        std::lock_guard<std::mutex> lock(m_MapMutex);
+        if (priv->map_data != nullptr) {
+            return 0;
+        }
+
+        uint32_t stride = 0;
+        void* map = gbm_bo_map(priv->bo, 0, 0, buf->width, buf->height, GBM_BO_TRANSFER_READ_WRITE,
+                               &stride, &priv->map_data);
+        if (map == nullptr) {
+            priv->map_data = nullptr;
+            return -EIO;
+        }
+        buf->map = static_cast<uint8_t*>(map);
+        buf->map_stride = stride;
+        return 0;
+    }
+
+    int EndCpuAccess(Buffer* buf) override
+    {
+        GbmBufferPriv* priv = static_cast<GbmBufferPriv*>(buf->priv);
+
+        std::lock_guard<std::mutex> lock(m_MapMutex);
+        if (priv->map_data != nullptr) {
+            gbm_bo_unmap(priv->bo, priv->map_data);
+            priv->map_data = nullptr;
+        }
+        buf->map = nullptr;
+        return 0;
+    }
+
+private:
+    struct gbm_device* m_Gbm;
+    std::mutex m_MapMutex; // the driver's map path isn't safe to enter from several threads
+};
+
+std::unique_ptr<Allocator> CreateGbmAllocator(int drm_fd)
+{
+    struct gbm_device* gbm = gbm_create_device(drm_fd);
+    if (gbm == nullptr) {
+        return nullptr;
+    }
+    return std::make_unique<GbmAllocator>(drm_fd, gbm);
+}
+
+} // namespace DrmLab
@@ -0,0 +1,175 @@
+/*
+ * Shm allocator: a sealed memfd turned into a dma-buf by /dev/udmabuf and
+ * imported into the DRM device. The CPU draws into ordinary cached pages
+ * and the display engine scans them out directly, so there is no copy.
+ */
+
+#include "allocator_backends.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+/*
+ * memfd for udmabuf: it must be sealed against shrinking, so the pages can't
+ * go away under the device, and must not be sealed against writes.
+ */
+static int AllocateSealedMemfd(size_t size)
+{
+    int fd = memfd_create("labdrm-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int ret;
+    do {
+        ret = ftruncate(fd, static_cast<off_t>(size));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+class ShmAllocator : public Allocator
+{
+public:
+    ShmAllocator(int drm_fd, int udmabuf_dev)
+        : Allocator(drm_fd)
+        , m_Udmabuf(udmabuf_dev)
+    {}
+
+    ~ShmAllocator() noexcept override { close(m_Udmabuf); }
+
+    AllocatorBackend Backend() const override { return AllocatorBackend::Shm; }
+    uint32_t Caps() const override
+    {
+        return AllocatorCapScanout | AllocatorCapCpuMap | AllocatorCapCpuCached | AllocatorCapCpuSync;
+    }
+
+    int Allocate(uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+                 Buffer* buf) override
+    {
+        struct udmabuf_create create;
+        uint32_t cpp = FormatCpp(format);
+        int memfd;
+        void* map;
+        int ret;
+
+        if (cpp == 0 || (modifier != DRM_FORMAT_MOD_INVALID && modifier != DRM_FORMAT_MOD_LINEAR)) {
+            return -EINVAL;
+        }
+        InitBuffer(buf, AllocatorBackend::Shm, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+        /* udmabuf works on whole pages */
+        buf->strides[0] = LinearStride(width, cpp);
+        buf->size = PageAlign(static_cast<size_t>(buf->strides[0]) * height);
+
+        memfd = AllocateSealedMemfd(buf->size);
+        if (memfd < 0) {
+            return -errno;
+        }
+
+        /* turn the memfd into a dma-buf... */
+        memset(&create, 0, sizeof(create));
+        create.memfd = static_cast<uint32_t>(memfd);
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.offset = 0;
+        create.size = buf->size;
+        buf->fds[0] = ioctl(m_Udmabuf, UDMABUF_CREATE, &create);
+        if (buf->fds[0] < 0) {
+            ret = -errno;
+            buf->fds[0] = -1;
+            goto err_memfd;
+        }
+
+        /* ... which the DRM device imports as a GEM object */
+        ret = ImportDmabuf(m_Fd, buf);
+        if (ret != 0) {
+            goto err_dmabuf;
+        }
+        ret = AddFramebuffer(m_Fd, buf);
+        if (ret != 0) {
+            goto err_handle;
+        }
+
+        /* the dma-buf holds the pages, the memfd is only needed for the mapping */
+        map = mmap(nullptr, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (map == MAP_FAILED) {
+            ret = -errno;
+            goto err_fb;
+        }
+        close(memfd);
+        buf->map = static_cast<uint8_t*>(map);
+        buf->map_stride = buf->strides[0];
+
+        return 0;
+
+    err_fb:
+        drmModeRmFB(m_Fd, buf->fb);
+    err_handle:
+        CloseHandle(m_Fd, buf->handles[0]);
+    err_dmabuf:
+        close(buf->fds[0]);
+        buf->fds[0] = -1;
+    err_memfd:
+        close(memfd);
+        return ret;
+    }
+
+    void Free(Buffer* buf) override
+    {
+        drmModeRmFB(m_Fd, buf->fb);
+        munmap(buf->map, buf->size);
+        CloseHandle(m_Fd, buf->handles[0]);
+        close(buf->fds[0]);
+        buf->fds[0] = -1;
+        buf->map = nullptr;
+        buf->fb = 0;
+    }
+
+    int BeginCpuAccess(Buffer* buf) override
+    {
+        return DmabufSync(buf->fds[0], DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    }
+
+    int EndCpuAccess(Buffer* buf) override
+    {
+        return DmabufSync(buf->fds[0], DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    }
+
+private:
+    int m_Udmabuf;
+};
+
+std::unique_ptr<Allocator> CreateShmAllocator(int drm_fd)
+{
+    uint64_t cap;
+
+    if (drmGetCap(drm_fd, DRM_CAP_PRIME, &cap) != 0 || !(cap & DRM_PRIME_CAP_IMPORT)) {
+        return nullptr;
+    }
+
+    /* missing if the udmabuf module isn't loaded */
+    int udmabuf_dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (udmabuf_dev < 0) {
+        return nullptr;
+    }
+    return std::make_unique<ShmAllocator>(drm_fd, udmabuf_dev);
+}
+
+} // namespace DrmLab
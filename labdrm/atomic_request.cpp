@@ -0,0 +1,114 @@
+#include "atomic_request.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <xf86drm.h>
+
+namespace DrmLab
+{
+
+AtomicBackend AtomicBackendFromEnv()
+{
+    const char* s = getenv("LABDRM_ATOMIC");
+    if (s != nullptr && strcmp(s, "direct") == 0) {
+        return AtomicBackend::Direct;
+    }
+    return AtomicBackend::Libdrm;
+}
+
+std::unique_ptr<AtomicRequest> AtomicRequest::Create(AtomicBackend backend, int reserve)
+{
+    switch (backend) {
+    case AtomicBackend::Direct:
+        return std::make_unique<DirectAtomicRequest>(reserve);
+    case AtomicBackend::Libdrm:
+    default:
+        return std::make_unique<LibdrmAtomicRequest>(reserve);
+    }
+}
+
+LibdrmAtomicRequest::LibdrmAtomicRequest(int reserve)
+    : m_Req(drmModeAtomicAlloc())
+{
+    if (m_Req == nullptr) {
+        fprintf(stderr, "[!] failed to allocate atomic request.\n");
+        return;
+    }
+
+    /* Grow the item array once: libdrm reallocs it on demand while adding
+     * properties, but keeps it when the cursor is moved back. */
+    for (int i = 0; i < reserve; i++) {
+        if (drmModeAtomicAddProperty(m_Req, 0, 0, 0) < 0) {
+            break;
+        }
+    }
+    drmModeAtomicSetCursor(m_Req, 0);
+}
+
+LibdrmAtomicRequest::~LibdrmAtomicRequest()
+{
+    if (m_Req != nullptr) {
+        drmModeAtomicFree(m_Req);
+    }
+}
+
+DirectAtomicRequest::DirectAtomicRequest(int reserve)
+{
+    /* worst case: every property on its own object */
+    m_Objs.reserve(reserve);
+    m_CountProps.reserve(reserve);
+    m_Props.reserve(reserve);
+    m_Values.reserve(reserve);
+}
+
+void DirectAtomicRequest::SetBase()
+{
+    m_BaseObjs = m_Objs.size();
+    m_BaseProps = m_Props.size();
+    m_BaseLastCount = m_CountProps.empty() ? 0 : m_CountProps.back();
+}
+
+void DirectAtomicRequest::Rewind()
+{
+    /* shrinking a vector never frees its storage */
+    m_Objs.resize(m_BaseObjs);
+    m_CountProps.resize(m_BaseObjs);
+    m_Props.resize(m_BaseProps);
+    m_Values.resize(m_BaseProps);
+    if (m_BaseObjs > 0) {
+        m_CountProps.back() = m_BaseLastCount;
+    }
+}
+
+void DirectAtomicRequest::Reset()
+{
+    m_BaseObjs = 0;
+    m_BaseProps = 0;
+    m_BaseLastCount = 0;
+    Rewind();
+}
+
+int DirectAtomicRequest::Commit(int fd, uint32_t flags, void* user_data)
+{
+    /* same as drmModeAtomicCommit(): nothing to do for an empty request */
+    if (m_Props.empty()) {
+        return 0;
+    }
+
+    struct drm_mode_atomic atomic;
+    memset(&atomic, 0, sizeof(atomic));
+    atomic.flags = flags;
+    atomic.count_objs = m_Objs.size();
+    atomic.objs_ptr = reinterpret_cast<uintptr_t>(m_Objs.data());
+    atomic.count_props_ptr = reinterpret_cast<uintptr_t>(m_CountProps.data());
+    atomic.props_ptr = reinterpret_cast<uintptr_t>(m_Props.data());
+    atomic.prop_values_ptr = reinterpret_cast<uintptr_t>(m_Values.data());
+    atomic.user_data = reinterpret_cast<uintptr_t>(user_data);
+
+    int ret = drmIoctl(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+    return ret < 0 ? -errno : ret;
+}
+
+} // namespace DrmLab
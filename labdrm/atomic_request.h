@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+/**
+ * @brief How an AtomicRequest talks to the kernel.
+ */
+enum class AtomicBackend
+{
+    Libdrm, // drmModeAtomicReq + drmModeAtomicCommit()
+    Direct, // our own DRM_IOCTL_MODE_ATOMIC arguments
+};
+
+/**
+ * @brief Pick the atomic backend from the LABDRM_ATOMIC environment variable
+ * ("libdrm" or "direct"), defaulting to libdrm.
+ */
+AtomicBackend AtomicBackendFromEnv();
+
+/**
+ * @brief An atomic request which is kept alive across frames.
+ *
+ * Instead of allocating a request for every commit, the owner keeps one and
+ * rewinds it. Everything added before SetBase() is the base state, which
+ * Rewind() keeps: put properties every commit of the owner needs there, and
+ * add the per-frame ones after it.
+ */
+class AtomicRequest
+{
+public:
+    /**
+     * @param reserve number of properties to make room for up front
+     */
+    static std::unique_ptr<AtomicRequest> Create(AtomicBackend backend, int reserve = 32);
+
+    virtual ~AtomicRequest() noexcept = default;
+
+    virtual bool Valid() const = 0;
+
+    /**
+     * @return a negative errno on failure
+     */
+    virtual int Add(uint32_t object_id, uint32_t prop_id, uint64_t value) = 0;
+
+    /**
+     * @brief Number of properties currently in the request.
+     */
+    virtual int Size() const = 0;
+
+    /**
+     * @brief Make the current content the base state kept by Rewind().
+     */
+    virtual void SetBase() = 0;
+
+    /**
+     * @brief Drop everything added after the base state.
+     */
+    virtual void Rewind() = 0;
+
+    /**
+     * @brief Drop everything, including the base state.
+     */
+    virtual void Reset() = 0;
+
+    /**
+     * @return 0 on success, negative errno otherwise, with errno set as well;
+     * the same for every backend
+     */
+    virtual int Commit(int fd, uint32_t flags, void* user_data) = 0;
+};
+
+/**
+ * @brief AtomicRequest on top of drmModeAtomicReq.
+ *
+ * libdrm never shrinks the item array of a request, so moving the cursor back
+ * instead of freeing the request reuses the storage grown by earlier frames.
+ * drmModeAtomicCommit() still sorts a copy of the items and allocates the
+ * ioctl arrays on every commit.
+ */
+class LibdrmAtomicRequest : public AtomicRequest
+{
+public:
+    explicit LibdrmAtomicRequest(int reserve);
+    ~LibdrmAtomicRequest() noexcept override;
+
+    LibdrmAtomicRequest(const LibdrmAtomicRequest&) = delete;
+    LibdrmAtomicRequest& operator=(const LibdrmAtomicRequest&) = delete;
+
+    bool Valid() const override { return m_Req != nullptr; }
+
+    int Add(uint32_t object_id, uint32_t prop_id, uint64_t value) override
+    {
+        int ret = drmModeAtomicAddProperty(m_Req, object_id, prop_id, value);
+        return ret < 0 ? ret : 0;
+    }
+
+    int Size() const override { return drmModeAtomicGetCursor(m_Req); }
+    void SetBase() override { m_Base = drmModeAtomicGetCursor(m_Req); }
+    void Rewind() override { drmModeAtomicSetCursor(m_Req, m_Base); }
+    void Reset() override
+    {
+        m_Base = 0;
+        drmModeAtomicSetCursor(m_Req, 0);
+    }
+
+    int Commit(int fd, uint32_t flags, void* user_data) override
+    {
+        /* older libdrm returns -1 and leaves the error in errno */
+        int ret = drmModeAtomicCommit(fd, m_Req, flags, user_data);
+        return ret < 0 ? -errno : ret;
+    }
+
+private:
+    drmModeAtomicReq* m_Req;
+    int m_Base = 0;
+};
+
+/**
+ * @brief AtomicRequest which builds the DRM_IOCTL_MODE_ATOMIC arguments itself.
+ *
+ * Object IDs, per-object property counts, property IDs and values are kept in
+ * the four arrays the ioctl takes, so committing is a single ioctl with no
+ * sort, copy or allocation. Nothing is sorted: properties stay in the order
+ * they were added, and only a run of properties of the same object shares an
+ * object entry, so adding all properties of an object in a row (as
+ * OutputState does) keeps the arrays short. The kernel applies them in
+ * order, so a property added twice ends up with the last value, as with
+ * libdrm.
+ */
+class DirectAtomicRequest : public AtomicRequest
+{
+public:
+    explicit DirectAtomicRequest(int reserve);
+
+    bool Valid() const override { return true; }
+
+    int Add(uint32_t object_id, uint32_t prop_id, uint64_t value) override
+    {
+        if (m_Objs.empty() || m_Objs.back() != object_id) {
+            m_Objs.push_back(object_id);
+            m_CountProps.push_back(0);
+        }
+        m_CountProps.back()++;
+        m_Props.push_back(prop_id);
+        m_Values.push_back(value);
+        return 0;
+    }
+
+    int Size() const override { return static_cast<int>(m_Props.size()); }
+    void SetBase() override;
+    void Rewind() override;
+    void Reset() override;
+    int Commit(int fd, uint32_t flags, void* user_data) override;
+
+private:
+    std::vector<uint32_t> m_Objs;
+    std::vector<uint32_t> m_CountProps;
+    std::vector<uint32_t> m_Props;
+    std::vector<uint64_t> m_Values;
+
+    /* base state: sizes of the arrays and the property count of its last object */
+    size_t m_BaseObjs = 0;
+    size_t m_BaseProps = 0;
+    uint32_t m_BaseLastCount = 0;
+};
+
+} // namespace DrmLab
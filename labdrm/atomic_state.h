@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+
+#include "atomic_request.h"
+#include "drm_property.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief Add a property to an atomic request by its enum.
+ *
+ * Only an array lookup; a property ID of 0 (optional and unsupported) is
+ * skipped.
+ */
+template <typename E>
+inline int AtomicAddProperty(AtomicRequest* req, const PropertyTable<E>& obj,
+                             E prop, uint64_t value)
+{
+    uint32_t prop_id = obj.PropId(prop);
+    if (prop_id == 0) {
+        return 0;
+    }
+    return req->Add(obj.id, prop_id, value);
+}
+
+/**
+ * @brief Desired vs. committed property values of one KMS object.
+ *
+ * The owner sets the desired values every frame, and only the properties that
+ * differ from what was last committed end up in the atomic request. Like
+ * PropertyTable this is a plain aggregate: an all-zero object is valid and
+ * means "nothing committed yet", so the first commit carries every property.
+ */
+template <typename E>
+struct ObjectState
+{
+    static constexpr size_t count = static_cast<size_t>(E::Count);
+    static_assert(count <= 32, "ObjectState uses 32-bit property masks");
+
+    uint64_t desired[count];
+    uint64_t committed[count];
+    uint32_t desired_mask;   // properties with a desired value
+    uint32_t committed_mask; // properties whose committed value is known
+
+    static constexpr uint32_t Bit(E prop) { return 1u << static_cast<uint32_t>(prop); }
+
+    void Set(E prop, uint64_t value)
+    {
+        desired[static_cast<size_t>(prop)] = value;
+        desired_mask |= Bit(prop);
+    }
+
+    uint64_t Committed(E prop) const { return committed[static_cast<size_t>(prop)]; }
+
+    /**
+     * @brief Mask of properties whose desired value isn't committed yet.
+     */
+    uint32_t DirtyMask() const
+    {
+        uint32_t dirty = desired_mask & ~committed_mask;
+        uint32_t known = desired_mask & committed_mask;
+        for (size_t i = 0; i < count; i++) {
+            if ((known & (1u << i)) && desired[i] != committed[i]) {
+                dirty |= 1u << i;
+            }
+        }
+        return dirty;
+    }
+
+    /**
+     * @brief Call `fn(prop, value)` for every dirty property.
+     */
+    template <typename F>
+    void ForEachDirty(uint32_t dirty, F&& fn) const
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (dirty & (1u << i)) {
+                fn(static_cast<E>(i), desired[i]);
+            }
+        }
+    }
+
+    /**
+     * @brief Record that the given properties were accepted by the kernel.
+     */
+    void MarkCommitted(uint32_t mask)
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (mask & (1u << i)) {
+                committed[i] = desired[i];
+            }
+        }
+        committed_mask |= mask;
+    }
+
+    /**
+     * @brief Forget the committed state, e.g. after a VT switch.
+     */
+    void Invalidate() { committed_mask = 0; }
+};
+
+/**
+ * @brief Atomic state of one output: connector -> CRTC -> primary plane.
+ */
+struct OutputState
+{
+    ObjectState<ConnectorProperty> connector;
+    ObjectState<CrtcProperty> crtc;
+    ObjectState<PlaneProperty> plane;
+
+    /* Properties which can't be changed without DRM_MODE_ATOMIC_ALLOW_MODESET. */
+    static constexpr uint32_t connector_modeset_mask =
+        ObjectState<ConnectorProperty>::Bit(ConnectorProperty::CrtcId);
+    static constexpr uint32_t crtc_modeset_mask =
+        ObjectState<CrtcProperty>::Bit(CrtcProperty::ModeId) |
+        ObjectState<CrtcProperty>::Bit(CrtcProperty::Active);
+
+    /* Properties the kernel resets with every commit. Their committed value
+     * is always 0, so a non-zero desired value is sent every time. */
+    static constexpr uint32_t plane_volatile_mask =
+        ObjectState<PlaneProperty>::Bit(PlaneProperty::FbDamageClips);
+
+    /**
+     * @brief Dirty masks of a pending commit, returned by AddChanged().
+     */
+    struct Dirty
+    {
+        uint32_t connector;
+        uint32_t crtc;
+        uint32_t plane;
+
+        bool Empty() const { return (connector | crtc | plane) == 0; }
+        bool NeedsModeset() const
+        {
+            return (connector & connector_modeset_mask) || (crtc & crtc_modeset_mask);
+        }
+    };
+
+    /**
+     * @brief Add only the changed properties of this output to `req`.
+     * @param dirty receives what was added, to pass to MarkCommitted()
+     * @return 0 on success, negative errno if libdrm ran out of memory
+     */
+    int AddChanged(AtomicRequest* req, const ConnectorProperties& conn_props,
+                   const CrtcProperties& crtc_props, const PlaneProperties& plane_props,
+                   Dirty* dirty) const
+    {
+        int ret = 0;
+
+        dirty->connector = connector.DirtyMask();
+        dirty->crtc = crtc.DirtyMask();
+        dirty->plane = plane.DirtyMask();
+
+        connector.ForEachDirty(dirty->connector, [&](ConnectorProperty prop, uint64_t value) {
+            ret |= AtomicAddProperty(req, conn_props, prop, value);
+        });
+        crtc.ForEachDirty(dirty->crtc, [&](CrtcProperty prop, uint64_t value) {
+            ret |= AtomicAddProperty(req, crtc_props, prop, value);
+        });
+        plane.ForEachDirty(dirty->plane, [&](PlaneProperty prop, uint64_t value) {
+            ret |= AtomicAddProperty(req, plane_props, prop, value);
+        });
+
+        return ret < 0 ? -ENOMEM : 0;
+    }
+
+    void MarkCommitted(const Dirty& dirty)
+    {
+        connector.MarkCommitted(dirty.connector);
+        crtc.MarkCommitted(dirty.crtc);
+        plane.MarkCommitted(dirty.plane);
+
+        for (size_t i = 0; i < ObjectState<PlaneProperty>::count; i++) {
+            if (plane_volatile_mask & (1u << i)) {
+                plane.committed[i] = 0;
+            }
+        }
+    }
+
+    void Invalidate()
+    {
+        connector.Invalidate();
+        crtc.Invalidate();
+        plane.Invalidate();
+    }
+};
+
+} // namespace DrmLab
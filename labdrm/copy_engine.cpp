@@ -0,0 +1,170 @@
+#include "copy_engine.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "raster.h"
+
+namespace DrmLab
+{
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+CopyEngine::CopyEngine(unsigned threads)
+{
+    for (unsigned i = 1; i < threads; i++) {
+        m_Workers.emplace_back(&CopyEngine::WorkerMain, this, i);
+    }
+}
+
+CopyEngine::~CopyEngine() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_Start.notify_all();
+    for (std::thread& worker : m_Workers) {
+        worker.join();
+    }
+}
+
+unsigned CopyEngine::ThreadsFromEnv()
+{
+    const char* s = getenv("LABDRM_COPY_THREADS");
+    if (s == nullptr) {
+        return 1;
+    }
+
+    int threads = atoi(s);
+    if (threads <= 0) {
+        threads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    return threads > 0 ? static_cast<unsigned>(threads) : 1;
+}
+
+/*
+ * Copy the `share`-th part of the rows of all rectangles, as if they were
+ * stacked on top of each other.
+ */
+void CopyEngine::RunShare(const Job& job, unsigned share)
+{
+    uint64_t begin = job.rows * share / job.shares;
+    uint64_t end = job.rows * (share + 1) / job.shares;
+    uint64_t first = 0; // index of the first row of the current rectangle
+
+    for (size_t i = 0; i < job.damage->count && first < end; i++) {
+        const Rect& r = job.damage->rects[i];
+        uint64_t height = r.Height();
+
+        if (first + height > begin) {
+            int32_t y1 = r.y1 + static_cast<int32_t>(begin > first ? begin - first : 0);
+            int32_t y2 = r.y1 + static_cast<int32_t>(end - first < height ? end - first : height);
+            size_t row_bytes = static_cast<size_t>(r.Width()) * job.cpp;
+            uint8_t* d = job.dst + static_cast<size_t>(y1) * job.dst_stride + static_cast<size_t>(r.x1) * job.cpp;
+            const uint8_t* s = job.src + static_cast<size_t>(y1) * job.src_stride + static_cast<size_t>(r.x1) * job.cpp;
+
+            /* whole rows on both sides without padding: one call for all of them */
+            if (row_bytes == job.dst_stride && row_bytes == job.src_stride) {
+                row_bytes *= y2 - y1;
+                y2 = y1 + 1;
+            }
+
+            for (int32_t y = y1; y < y2; y++) {
+                if (job.streaming) {
+                    StreamCopy(d, s, row_bytes);
+                } else {
+                    memcpy(d, s, row_bytes);
+                }
+                d += job.dst_stride;
+                s += job.src_stride;
+            }
+        }
+
+        first += height;
+    }
+}
+
+void CopyEngine::WorkerMain(unsigned index)
+{
+    uint64_t seen = 0;
+
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Start.wait(lock, [&] { return m_Quit || m_Generation != seen; });
+            if (m_Quit) {
+                return;
+            }
+            seen = m_Generation;
+            job = m_Job;
+        }
+
+        if (index < job.shares) {
+            RunShare(job, index);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (--m_Pending == 0) {
+                m_Done.notify_one();
+            }
+        }
+    }
+}
+
+void CopyEngine::Copy(uint8_t* dst, uint32_t dst_stride, const uint8_t* src, uint32_t src_stride,
+                      uint32_t cpp, const Damage& damage)
+{
+    uint64_t start = NowNs();
+
+    Job job;
+    job.dst = dst;
+    job.src = src;
+    job.dst_stride = dst_stride;
+    job.src_stride = src_stride;
+    job.cpp = cpp;
+    job.damage = &damage;
+    job.rows = 0;
+    for (size_t i = 0; i < damage.count; i++) {
+        job.rows += damage.rects[i].Height();
+    }
+
+    uint64_t bytes = damage.Area() * cpp;
+    job.streaming = bytes >= stream_threshold;
+    job.shares = 1;
+    if (bytes >= split_threshold && job.rows > 1) {
+        job.shares = job.rows < Threads() ? static_cast<unsigned>(job.rows) : Threads();
+    }
+
+    if (job.shares > 1) {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Job = job;
+            m_Pending = static_cast<unsigned>(m_Workers.size());
+            m_Generation++;
+        }
+        m_Start.notify_all();
+
+        RunShare(job, 0);
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Done.wait(lock, [&] { return m_Pending == 0; });
+    } else {
+        RunShare(job, 0);
+    }
+
+    m_Stats.bytes = bytes;
+    m_Stats.ns = NowNs() - start;
+    m_Stats.threads = job.shares;
+    m_Stats.streaming = job.streaming;
+}
+
+} // namespace DrmLab
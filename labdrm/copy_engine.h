@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "damage.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief What one CopyEngine::Copy() did.
+ */
+struct CopyStats
+{
+    uint64_t bytes;
+    uint64_t ns;
+    unsigned threads;  // threads which took part, including the caller
+    bool streaming;    // whether non-temporal stores were used
+
+    double GBps() const { return ns == 0 ? 0.0 : static_cast<double>(bytes) / ns; }
+};
+
+/**
+ * @brief Copies damaged rectangles from a shadow buffer to a scanout buffer.
+ *
+ * Rows are copied one by one, so the two buffers may have different strides.
+ * Large copies use non-temporal stores (see StreamCopy()), which don't read
+ * the destination into the cache first; scanout mappings are often
+ * write-combined, where that matters most. Large copies are also split by
+ * rows across a pool of worker threads, with the calling thread doing the
+ * first share.
+ *
+ * A CopyEngine is meant to be used by one thread at a time.
+ */
+class CopyEngine
+{
+public:
+    /* copies below these sizes aren't worth streaming / waking the workers for */
+    static constexpr size_t stream_threshold = 256 * 1024;
+    static constexpr size_t split_threshold = 1024 * 1024;
+
+    /**
+     * @param threads total number of threads to copy with, including the
+     * caller; 1 means no worker threads
+     */
+    explicit CopyEngine(unsigned threads = 1);
+    ~CopyEngine() noexcept;
+
+    CopyEngine(const CopyEngine&) = delete;
+    CopyEngine& operator=(const CopyEngine&) = delete;
+
+    /**
+     * @brief Number of threads from the LABDRM_COPY_THREADS environment
+     * variable, 1 if unset. "0" means one per CPU.
+     */
+    static unsigned ThreadsFromEnv();
+
+    unsigned Threads() const { return static_cast<unsigned>(m_Workers.size()) + 1; }
+
+    /**
+     * @brief Copy the damaged rectangles from `src` to `dst`, like CopyDamage().
+     * @param cpp bytes per pixel
+     */
+    void Copy(uint8_t* dst, uint32_t dst_stride, const uint8_t* src, uint32_t src_stride,
+              uint32_t cpp, const Damage& damage);
+
+    /**
+     * @brief Statistics of the last Copy().
+     */
+    const CopyStats& LastStats() const { return m_Stats; }
+
+private:
+    struct Job
+    {
+        uint8_t* dst;
+        const uint8_t* src;
+        uint32_t dst_stride;
+        uint32_t src_stride;
+        uint32_t cpp;
+        const Damage* damage;
+        uint64_t rows;    // rows of all rectangles together
+        unsigned shares;  // number of threads the rows are split across
+        bool streaming;
+    };
+
+    static void RunShare(const Job& job, unsigned share);
+    void WorkerMain(unsigned index);
+
+    std::vector<std::thread> m_Workers;
+    std::mutex m_Mutex;
+    std::condition_variable m_Start;
+    std::condition_variable m_Done;
+    uint64_t m_Generation = 0;
+    unsigned m_Pending = 0;
+    bool m_Quit = false;
+    Job m_Job {};
+
+    CopyStats m_Stats {};
+};
+
+} // namespace DrmLab
@@ -0,0 +1,271 @@
+#include "cursor.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+#include "plane_offload.h"
+
+namespace DrmLab
+{
+
+std::unique_ptr<HardwareCursor> HardwareCursor::Create(int drm_fd, PropertyCache& cache, uint32_t crtc_id,
+                                                       uint32_t crtc_index)
+{
+    std::unique_ptr<HardwareCursor> cursor(new HardwareCursor(drm_fd, crtc_id, CursorBackend::Atomic));
+    int ret = cursor->Load(cache, crtc_index);
+    if (ret == 0) {
+        ret = cursor->Allocate();
+    }
+    if (ret != 0) {
+        if (ret != -ENOENT) {
+            fprintf(stderr, "[!] cannot set up the cursor of CRTC %u: %s\n", crtc_id, strerror(-ret));
+        }
+        return nullptr;
+    }
+    return cursor;
+}
+
+std::unique_ptr<HardwareCursor> HardwareCursor::CreateLegacy(int drm_fd, uint32_t crtc_id)
+{
+    std::unique_ptr<HardwareCursor> cursor(new HardwareCursor(drm_fd, crtc_id, CursorBackend::Legacy));
+    int ret = cursor->Allocate();
+    if (ret != 0) {
+        fprintf(stderr, "[!] cannot set up the cursor of CRTC %u: %s\n", crtc_id, strerror(-ret));
+        return nullptr;
+    }
+    return cursor;
+}
+
+HardwareCursor::HardwareCursor(int drm_fd, uint32_t crtc_id, CursorBackend backend)
+    : m_Fd(drm_fd)
+    , m_CrtcId(crtc_id)
+    , m_Backend(backend)
+{}
+
+HardwareCursor::~HardwareCursor() noexcept
+{
+    /* removing the framebuffers takes an atomic cursor off its plane, a
+     * legacy one has none of ours */
+    if (m_Backend == CursorBackend::Legacy && m_State.Committed(PlaneProperty::FbId) != 0) {
+        drmModeSetCursor(m_Fd, m_CrtcId, 0, 0, 0);
+    }
+    for (Buffer& buf : m_Buffers) {
+        if (buf.fb != 0) {
+            m_Allocator->Free(&buf);
+        }
+    }
+    if (m_Claimed) {
+        ReleasePlane(m_Fd, m_Props.id);
+    }
+}
+
+/* the first cursor plane of the CRTC nobody claimed, and the zpos it takes */
+int HardwareCursor::Load(PropertyCache& cache, uint32_t crtc_index)
+{
+    m_Req = AtomicRequest::Create(AtomicBackendFromEnv(), PlaneProperties::count);
+    if (!m_Req->Valid()) {
+        return -ENOMEM;
+    }
+
+    drmModePlaneRes* res = drmModeGetPlaneResources(m_Fd);
+    if (res == nullptr) {
+        return -errno;
+    }
+    for (uint32_t i = 0; i < res->count_planes && !m_Claimed; i++) {
+        drmModePlane* p = drmModeGetPlane(m_Fd, res->planes[i]);
+        if (p == nullptr) {
+            continue;
+        }
+        bool usable = (p->possible_crtcs & (1u << crtc_index)) != 0;
+        drmModeFreePlane(p);
+
+        uint64_t type = 0;
+        ObjectSnapshot props(cache, res->planes[i], DRM_MODE_OBJECT_PLANE);
+        if (!usable || !props.Find("type", &type) || type != DRM_PLANE_TYPE_CURSOR) {
+            continue;
+        }
+        m_Props = {};
+        m_Props.id = res->planes[i];
+        if (ResolveProperties(props, &m_Props) != 0 || !ClaimPlane(m_Fd, m_Props.id)) {
+            continue;
+        }
+        m_Claimed = true;
+
+        if (m_Props.Has(PlaneProperty::Zpos)) {
+            const drmModePropertyRes* info = cache.GetFull(m_Props.PropId(PlaneProperty::Zpos));
+            if (info != nullptr && !(info->flags & DRM_MODE_PROP_IMMUTABLE) && info->count_values >= 2) {
+                m_ZposFixed = false;
+                m_Zpos = info->values[1];
+            }
+        }
+    }
+    drmModeFreePlaneResources(res);
+    return m_Claimed ? 0 : -ENOENT;
+}
+
+/* two transparent buffers of the size the driver likes best */
+int HardwareCursor::Allocate()
+{
+    uint64_t value;
+    if (drmGetCap(m_Fd, DRM_CAP_CURSOR_WIDTH, &value) == 0 && value != 0) {
+        m_Width = static_cast<uint32_t>(value);
+    }
+    if (drmGetCap(m_Fd, DRM_CAP_CURSOR_HEIGHT, &value) == 0 && value != 0) {
+        m_Height = static_cast<uint32_t>(value);
+    }
+
+    m_Allocator = Allocator::Create(AllocatorBackend::Dumb, m_Fd);
+    if (!m_Allocator) {
+        return -ENODEV;
+    }
+    for (Buffer& buf : m_Buffers) {
+        int ret = m_Allocator->Allocate(m_Width, m_Height, DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_INVALID, &buf);
+        if (ret != 0) {
+            return ret;
+        }
+        m_Allocator->BeginCpuAccess(&buf);
+        for (uint32_t y = 0; y < m_Height; y++) {
+            memset(buf.map + y * buf.map_stride, 0, m_Width * 4);
+        }
+        m_Allocator->EndCpuAccess(&buf);
+    }
+    return 0;
+}
+
+int HardwareCursor::SetImage(const uint32_t* argb, uint32_t stride, uint32_t width, uint32_t height,
+                             int32_t hot_x, int32_t hot_y)
+{
+    if (width > m_Width || height > m_Height) {
+        return -EINVAL;
+    }
+
+    /* not the buffer the display has, or is about to have */
+    unsigned image = m_State.Committed(PlaneProperty::FbId) == Id(0) ? 1 : 0;
+
+    Buffer& buf = m_Buffers[image];
+    m_Allocator->BeginCpuAccess(&buf);
+    for (uint32_t y = 0; y < m_Height; y++) {
+        uint8_t* row = buf.map + y * buf.map_stride;
+        uint32_t copied = 0;
+        if (y < height) {
+            memcpy(row, reinterpret_cast<const uint8_t*>(argb) + y * stride, width * 4);
+            copied = width;
+        }
+        memset(row + copied * 4, 0, (m_Width - copied) * 4);
+    }
+    m_Allocator->EndCpuAccess(&buf);
+
+    m_Image = image;
+    m_HotX = hot_x;
+    m_HotY = hot_y;
+    SetState();
+    return 0;
+}
+
+void HardwareCursor::MoveTo(int32_t x, int32_t y)
+{
+    m_X = x;
+    m_Y = y;
+    SetState();
+}
+
+void HardwareCursor::Show(bool visible)
+{
+    m_Visible = visible;
+    SetState();
+}
+
+/* what the plane should show; a hidden cursor keeps its position, so moves
+ * don't make it dirty */
+void HardwareCursor::SetState()
+{
+    if (!m_Visible) {
+        m_State.Set(PlaneProperty::FbId, 0);
+        m_State.Set(PlaneProperty::CrtcId, 0);
+        return;
+    }
+
+    m_State.Set(PlaneProperty::FbId, Id(m_Image));
+    m_State.Set(PlaneProperty::CrtcId, m_CrtcId);
+    m_State.Set(PlaneProperty::CrtcX, static_cast<uint64_t>(static_cast<int64_t>(m_X - m_HotX)));
+    m_State.Set(PlaneProperty::CrtcY, static_cast<uint64_t>(static_cast<int64_t>(m_Y - m_HotY)));
+    if (m_Backend == CursorBackend::Legacy) {
+        return;
+    }
+    m_State.Set(PlaneProperty::SrcX, 0);
+    m_State.Set(PlaneProperty::SrcY, 0);
+    m_State.Set(PlaneProperty::SrcW, static_cast<uint64_t>(m_Width) << 16);
+    m_State.Set(PlaneProperty::SrcH, static_cast<uint64_t>(m_Height) << 16);
+    m_State.Set(PlaneProperty::CrtcW, m_Width);
+    m_State.Set(PlaneProperty::CrtcH, m_Height);
+    if (!m_ZposFixed) {
+        m_State.Set(PlaneProperty::Zpos, m_Zpos);
+    }
+}
+
+int HardwareCursor::Apply(AtomicRequest* req)
+{
+    if (m_Backend != CursorBackend::Atomic) {
+        return -EINVAL;
+    }
+
+    int ret = 0;
+    m_Pending = m_State.DirtyMask();
+    m_State.ForEachDirty(m_Pending, [&](PlaneProperty prop, uint64_t value) {
+        ret |= AtomicAddProperty(req, m_Props, prop, value);
+    });
+    return ret < 0 ? -ENOMEM : 0;
+}
+
+void HardwareCursor::Committed()
+{
+    m_State.MarkCommitted(m_Pending);
+    m_Pending = 0;
+}
+
+/* legacy: the new position first, so a cursor being shown appears where it
+ * should be */
+int HardwareCursor::Commit(uint32_t flags, void* user_data)
+{
+    uint32_t dirty = m_State.DirtyMask();
+    if (dirty == 0) {
+        return 0;
+    }
+
+    if (m_Backend == CursorBackend::Atomic) {
+        m_Req->Reset();
+        int ret = Apply(m_Req.get());
+        if (ret == 0) {
+            ret = m_Req->Commit(m_Fd, flags, user_data);
+        }
+        if (ret != 0) {
+            m_Pending = 0;
+            return ret;
+        }
+        Committed();
+        m_Commits++;
+        return 0;
+    }
+
+    using State = ObjectState<PlaneProperty>;
+    if (dirty & (State::Bit(PlaneProperty::CrtcX) | State::Bit(PlaneProperty::CrtcY))) {
+        if (drmModeMoveCursor(m_Fd, m_CrtcId, m_X - m_HotX, m_Y - m_HotY) != 0) {
+            return -errno;
+        }
+    }
+    if (dirty & (State::Bit(PlaneProperty::FbId) | State::Bit(PlaneProperty::CrtcId))) {
+        int ret = m_Visible ? drmModeSetCursor(m_Fd, m_CrtcId, m_Buffers[m_Image].handles[0], m_Width, m_Height)
+                            : drmModeSetCursor(m_Fd, m_CrtcId, 0, 0, 0);
+        if (ret != 0) {
+            return -errno;
+        }
+    }
+    m_State.MarkCommitted(dirty);
+    m_Commits++;
+    return 0;
+}
+
+} // namespace DrmLab
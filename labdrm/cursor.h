@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "allocator.h"
+#include "atomic_request.h"
+#include "atomic_state.h"
+#include "drm_property.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief How a HardwareCursor reaches the display.
+ */
+enum class CursorBackend
+{
+    Atomic, // the CRTC's cursor plane, with atomic commits
+    Legacy, // drmModeSetCursor() and drmModeMoveCursor()
+};
+
+/**
+ * @brief A pointer image on the cursor plane of a CRTC.
+ *
+ * Drawn into the primary framebuffer, a pointer would cost a repaint and a
+ * copy of the frame for every mouse event. On the cursor plane, moving it
+ * only changes CRTC_X/CRTC_Y, and the frame stays as it is.
+ *
+ * The image lives in two ARGB8888 dumb buffers of the size the driver
+ * prefers (DRM_CAP_CURSOR_WIDTH/HEIGHT): the plane always shows all of one,
+ * transparent around the image, and a new image goes into the other one. The
+ * hotspot is subtracted here, not sent to the kernel.
+ *
+ * MoveTo(), SetImage() and Show() only change the desired state. It reaches
+ * the display either with the next frame, through Apply() and Committed(),
+ * or on its own with Commit(). With atomic, a cursor-only commit takes the
+ * CRTC until the next vblank like any other, so while a frame is pending the
+ * move should ride along with the next one instead. Legacy cursor updates
+ * don't wait for anything.
+ */
+class HardwareCursor
+{
+public:
+    /**
+     * @brief A cursor on the cursor plane of a CRTC which nothing else
+     * claimed, see ClaimPlane().
+     * @return nullptr if there is no such plane
+     */
+    static std::unique_ptr<HardwareCursor> Create(int drm_fd, PropertyCache& cache, uint32_t crtc_id,
+                                                  uint32_t crtc_index);
+
+    /**
+     * @brief A cursor set with the legacy cursor ioctls.
+     * @return nullptr if the driver has no cursor or the buffers can't be
+     * allocated
+     */
+    static std::unique_ptr<HardwareCursor> CreateLegacy(int drm_fd, uint32_t crtc_id);
+
+    ~HardwareCursor() noexcept;
+
+    HardwareCursor(const HardwareCursor&) = delete;
+    HardwareCursor& operator=(const HardwareCursor&) = delete;
+
+    CursorBackend Backend() const { return m_Backend; }
+    uint32_t Width() const { return m_Width; }
+    uint32_t Height() const { return m_Height; }
+
+    /**
+     * @brief Copy a new image into the buffer the last commit didn't put on
+     * the display. With a commit in flight, the old buffer may still be
+     * scanned out until its vblank, so the caller waits for it first.
+     * @param argb premultiplied ARGB8888, at most Width() x Height()
+     * @param hot_x, hot_y the pixel of the image at the pointer position
+     * @return 0 on success, -EINVAL if the image is too big
+     */
+    int SetImage(const uint32_t* argb, uint32_t stride, uint32_t width, uint32_t height, int32_t hot_x,
+                 int32_t hot_y);
+
+    /**
+     * @brief Put the hotspot at `x`, `y` on the CRTC.
+     */
+    void MoveTo(int32_t x, int32_t y);
+
+    /**
+     * @brief Show or hide the cursor; it starts hidden.
+     */
+    void Show(bool visible);
+
+    /**
+     * @brief Whether the desired state isn't on the display yet.
+     */
+    bool Dirty() const { return m_State.DirtyMask() != 0; }
+
+    /**
+     * @brief Add the changed cursor plane properties to a commit. Atomic only.
+     * @return 0 on success, negative errno otherwise
+     */
+    int Apply(AtomicRequest* req);
+
+    /**
+     * @brief The commit with the last Apply() succeeded.
+     */
+    void Committed();
+
+    /**
+     * @brief Commit only the cursor. With atomic, `flags` and `user_data`
+     * are those of drmModeAtomicCommit(); legacy updates take effect at once
+     * and send no event. Nothing is committed if the cursor isn't Dirty().
+     * @return 0 on success, negative errno otherwise
+     */
+    int Commit(uint32_t flags, void* user_data);
+
+    /**
+     * @brief Number of cursor-only commits so far.
+     */
+    uint32_t CommitCount() const { return m_Commits; }
+
+private:
+    HardwareCursor(int drm_fd, uint32_t crtc_id, CursorBackend backend);
+
+    int Load(PropertyCache& cache, uint32_t crtc_index);
+    int Allocate();
+    void SetState();
+
+    /* what FB_ID means for the backend: the framebuffer, or the GEM handle
+     * of the legacy ioctls */
+    uint64_t Id(unsigned image) const
+    {
+        return m_Backend == CursorBackend::Atomic ? m_Buffers[image].fb : m_Buffers[image].handles[0];
+    }
+
+    int m_Fd;
+    uint32_t m_CrtcId;
+    CursorBackend m_Backend;
+    uint32_t m_Width = 64;
+    uint32_t m_Height = 64;
+
+    std::unique_ptr<Allocator> m_Allocator;
+    Buffer m_Buffers[2] = {};
+    unsigned m_Image = 0; // the buffer with the newest image
+
+    int32_t m_X = 0;
+    int32_t m_Y = 0;
+    int32_t m_HotX = 0;
+    int32_t m_HotY = 0;
+    bool m_Visible = false;
+
+    PlaneProperties m_Props = {};
+    bool m_Claimed = false;
+    uint64_t m_Zpos = 0;  // the highest the plane takes
+    bool m_ZposFixed = true;
+    ObjectState<PlaneProperty> m_State = {};
+    uint32_t m_Pending = 0; // dirty mask of the last Apply()
+    std::unique_ptr<AtomicRequest> m_Req;
+    uint32_t m_Commits = 0;
+};
+
+} // namespace DrmLab
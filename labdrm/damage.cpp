@@ -0,0 +1,138 @@
+#include "damage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+static_assert(sizeof(Rect) == sizeof(struct drm_mode_rect), "Rect must match struct drm_mode_rect");
+
+void Damage::Add(const Rect& rect)
+{
+    if (rect.Empty()) {
+        return;
+    }
+
+    if (count < max_rects) {
+        rects[count++] = rect;
+        return;
+    }
+
+    /* out of room: collapse everything into one bounding box */
+    Rect bounds = Bounds();
+    bounds.x1 = std::min(bounds.x1, rect.x1);
+    bounds.y1 = std::min(bounds.y1, rect.y1);
+    bounds.x2 = std::max(bounds.x2, rect.x2);
+    bounds.y2 = std::max(bounds.y2, rect.y2);
+    rects[0] = bounds;
+    count = 1;
+}
+
+void Damage::Add(const Damage& other)
+{
+    for (size_t i = 0; i < other.count; i++) {
+        Add(other.rects[i]);
+    }
+}
+
+void Damage::SetFull(int32_t width, int32_t height)
+{
+    rects[0] = Rect{ 0, 0, width, height };
+    count = 1;
+}
+
+void Damage::Clip(int32_t width, int32_t height)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        Rect r = rects[i];
+        r.x1 = std::max(r.x1, 0);
+        r.y1 = std::max(r.y1, 0);
+        r.x2 = std::min(r.x2, width);
+        r.y2 = std::min(r.y2, height);
+        if (!r.Empty()) {
+            rects[n++] = r;
+        }
+    }
+    count = n;
+}
+
+Rect Damage::Bounds() const
+{
+    if (count == 0) {
+        return Rect{ 0, 0, 0, 0 };
+    }
+
+    Rect bounds = rects[0];
+    for (size_t i = 1; i < count; i++) {
+        bounds.x1 = std::min(bounds.x1, rects[i].x1);
+        bounds.y1 = std::min(bounds.y1, rects[i].y1);
+        bounds.x2 = std::max(bounds.x2, rects[i].x2);
+        bounds.y2 = std::max(bounds.y2, rects[i].y2);
+    }
+    return bounds;
+}
+
+uint64_t Damage::Area() const
+{
+    uint64_t area = 0;
+    for (size_t i = 0; i < count; i++) {
+        area += static_cast<uint64_t>(rects[i].Width()) * rects[i].Height();
+    }
+    return area;
+}
+
+void CopyDamage(uint8_t* dst, uint32_t dst_stride, const uint8_t* src, uint32_t src_stride,
+                uint32_t cpp, const Damage& damage)
+{
+    for (size_t i = 0; i < damage.count; i++) {
+        const Rect& r = damage.rects[i];
+        size_t row_bytes = static_cast<size_t>(r.Width()) * cpp;
+        uint8_t* d = dst + static_cast<size_t>(r.y1) * dst_stride + static_cast<size_t>(r.x1) * cpp;
+        const uint8_t* s = src + static_cast<size_t>(r.y1) * src_stride + static_cast<size_t>(r.x1) * cpp;
+
+        for (int32_t y = r.y1; y < r.y2; y++) {
+            memcpy(d, s, row_bytes);
+            d += dst_stride;
+            s += src_stride;
+        }
+    }
+}
+
+int CreateDamageBlob(int fd, const Damage& damage, uint32_t* blob_id)
+{
+    *blob_id = 0;
+    if (damage.Empty()) {
+        return 0;
+    }
+
+    if (drmModeCreatePropertyBlob(fd, damage.rects, sizeof(Rect) * damage.count, blob_id) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int DirtyFB(int fd, uint32_t fb_id, const Damage& damage)
+{
+    drmModeClip clips[Damage::max_rects];
+
+    /* no clips would mean the whole framebuffer */
+    if (damage.Empty()) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < damage.count; i++) {
+        clips[i].x1 = damage.rects[i].x1;
+        clips[i].y1 = damage.rects[i].y1;
+        clips[i].x2 = damage.rects[i].x2;
+        clips[i].y2 = damage.rects[i].y2;
+    }
+
+    return drmModeDirtyFB(fd, fb_id, clips, damage.count);
+}
+
+} // namespace DrmLab
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DrmLab
+{
+
+/**
+ * @brief A rectangle in framebuffer coordinates, x2/y2 exclusive.
+ *
+ * Same layout as the kernel's struct drm_mode_rect, so an array of these can be
+ * passed as FB_DAMAGE_CLIPS blob directly.
+ */
+struct Rect
+{
+    int32_t x1, y1, x2, y2;
+
+    int32_t Width() const { return x2 - x1; }
+    int32_t Height() const { return y2 - y1; }
+    bool Empty() const { return x2 <= x1 || y2 <= y1; }
+};
+
+/**
+ * @brief The damaged region of one frame, as a short list of rectangles.
+ *
+ * Storage is fixed so that tracking damage never allocates, and the struct
+ * can live in memset'ed example structs. When the list is full, new damage
+ * is merged into the bounding box of everything, which over-reports but is
+ * never wrong.
+ */
+struct Damage
+{
+    static constexpr size_t max_rects = 16;
+
+    Rect rects[max_rects];
+    size_t count;
+
+    void Clear() { count = 0; }
+    bool Empty() const { return count == 0; }
+
+    void Add(const Rect& rect);
+    void Add(const Damage& other);
+
+    /**
+     * @brief Damage the whole `width` x `height` buffer.
+     */
+    void SetFull(int32_t width, int32_t height);
+
+    /**
+     * @brief Clip every rectangle to the `width` x `height` buffer.
+     */
+    void Clip(int32_t width, int32_t height);
+
+    Rect Bounds() const;
+
+    /**
+     * @brief Number of damaged pixels, counting overlaps twice.
+     */
+    uint64_t Area() const;
+};
+
+/**
+ * @brief Copy only the damaged rectangles from `src` to `dst`.
+ *
+ * The two buffers may have different strides; `cpp` is the number of bytes
+ * per pixel. A plain memcpy() per row: for large, per-frame copies to scanout
+ * buffers see CopyEngine.
+ */
+void CopyDamage(uint8_t* dst, uint32_t dst_stride, const uint8_t* src, uint32_t src_stride,
+                uint32_t cpp, const Damage& damage);
+
+/**
+ * @brief Create a property blob for the FB_DAMAGE_CLIPS plane property.
+ *
+ * The blob can be destroyed right after the commit that uses it; the kernel
+ * holds its own reference.
+ * @return 0 on success, negative errno otherwise
+ */
+int CreateDamageBlob(int fd, const Damage& damage, uint32_t* blob_id);
+
+/**
+ * @brief Tell the driver which parts of a framebuffer changed, for the
+ * legacy (non-atomic) path.
+ *
+ * Drivers which scan out directly from the buffer don't implement this and
+ * return -ENOSYS, which is fine to ignore.
+ */
+int DirtyFB(int fd, uint32_t fb_id, const Damage& damage);
+
+} // namespace DrmLab
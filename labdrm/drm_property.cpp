@@ -0,0 +1,212 @@
+#include "drm_property.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <xf86drm.h>
+
+namespace DrmLab
+{
+
+struct PropertyDesc
+{
+    const char* name;
+    bool required;
+};
+
+static const PropertyDesc connector_props[] = {
+    { "CRTC_ID", true }, // ConnectorProperty::CrtcId
+};
+
+static const PropertyDesc crtc_props[] = {
+    { "MODE_ID", true }, // CrtcProperty::ModeId
+    { "ACTIVE", true }, // CrtcProperty::Active
+};
+
+static const PropertyDesc plane_props[] = {
+    { "type", true }, // PlaneProperty::Type
+    { "FB_ID", true }, // PlaneProperty::FbId
+    { "CRTC_ID", true }, // PlaneProperty::CrtcId
+    { "SRC_X", true }, // PlaneProperty::SrcX
+    { "SRC_Y", true }, // PlaneProperty::SrcY
+    { "SRC_W", true }, // PlaneProperty::SrcW
+    { "SRC_H", true }, // PlaneProperty::SrcH
+    { "CRTC_X", true }, // PlaneProperty::CrtcX
+    { "CRTC_Y", true }, // PlaneProperty::CrtcY
+    { "CRTC_W", true }, // PlaneProperty::CrtcW
+    { "CRTC_H", true }, // PlaneProperty::CrtcH
+    { "FB_DAMAGE_CLIPS", false }, // PlaneProperty::FbDamageClips
+    { "zpos", false }, // PlaneProperty::Zpos
+    { "alpha", false }, // PlaneProperty::Alpha
+    { "pixel blend mode", false }, // PlaneProperty::PixelBlendMode
+    { "rotation", false }, // PlaneProperty::Rotation
+};
+
+static_assert(sizeof(connector_props) / sizeof(connector_props[0]) == ConnectorProperties::count,
+    "connector property names out of sync with ConnectorProperty");
+static_assert(sizeof(crtc_props) / sizeof(crtc_props[0]) == CrtcProperties::count,
+    "CRTC property names out of sync with CrtcProperty");
+static_assert(sizeof(plane_props) / sizeof(plane_props[0]) == PlaneProperties::count,
+    "plane property names out of sync with PlaneProperty");
+
+PropertyCache::PropertyCache(int fd)
+    : m_Fd(fd)
+{}
+
+PropertyCache::~PropertyCache()
+{
+    for (auto& [id, prop] : m_Full) {
+        drmModeFreeProperty(prop);
+    }
+}
+
+const PropertyInfo* PropertyCache::Get(uint32_t prop_id)
+{
+    auto it = m_Infos.find(prop_id);
+    if (it != m_Infos.end()) {
+        return &it->second;
+    }
+
+    /* With count_values and count_enum_blobs set to 0 the kernel only fills
+     * in the name and flags, so this is a single ioctl. drmModeGetProperty()
+     * would also copy out all values and enums, which we rarely need. */
+    struct drm_mode_get_property arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.prop_id = prop_id;
+    m_IoctlCount++;
+    if (drmIoctl(m_Fd, DRM_IOCTL_MODE_GETPROPERTY, &arg) != 0) {
+        fprintf(stderr, "[!] cannot get property %u: %s\n", prop_id, strerror(errno));
+        return nullptr;
+    }
+
+    PropertyInfo info;
+    info.prop_id = prop_id;
+    info.flags = arg.flags;
+    memcpy(info.name, arg.name, sizeof(info.name));
+    info.name[sizeof(info.name) - 1] = '\0';
+
+    return &m_Infos.emplace(prop_id, info).first->second;
+}
+
+const drmModePropertyRes* PropertyCache::GetFull(uint32_t prop_id)
+{
+    auto it = m_Full.find(prop_id);
+    if (it != m_Full.end()) {
+        return it->second;
+    }
+
+    m_IoctlCount += 2; // count + fill
+    drmModePropertyPtr prop = drmModeGetProperty(m_Fd, prop_id);
+    if (prop == nullptr) {
+        return nullptr;
+    }
+    m_Full.emplace(prop_id, prop);
+    return prop;
+}
+
+ObjectSnapshot::ObjectSnapshot(PropertyCache& cache, uint32_t object_id, uint32_t object_type)
+    : m_Cache(cache)
+    , m_Props(drmModeObjectGetProperties(cache.Fd(), object_id, object_type))
+{
+    m_Cache.m_IoctlCount += 2; // count + fill
+}
+
+ObjectSnapshot::~ObjectSnapshot()
+{
+    if (m_Props != nullptr) {
+        drmModeFreeObjectProperties(m_Props);
+    }
+}
+
+const char* ObjectSnapshot::Name(uint32_t i) const
+{
+    const PropertyInfo* info = m_Cache.Get(m_Props->props[i]);
+    return info != nullptr ? info->name : "";
+}
+
+bool ObjectSnapshot::Find(const char* name, uint64_t* value) const
+{
+    for (uint32_t i = 0; i < Count(); i++) {
+        if (strcmp(Name(i), name) == 0) {
+            *value = m_Props->prop_values[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename E>
+static int Resolve(const ObjectSnapshot& snapshot, PropertyTable<E>* table, const PropertyDesc* descs)
+{
+    using Traits = PropertyTraits<E>;
+
+    memset(table->prop_ids, 0, sizeof(table->prop_ids));
+
+    if (!snapshot.Valid()) {
+        fprintf(stderr, "[!] cannot get %s %u properties: %s\n",
+            Traits::object_name, table->id, strerror(errno));
+        return -errno;
+    }
+
+    /* one pass over the object's properties, the names are only compared here */
+    for (uint32_t i = 0; i < snapshot.Count(); i++) {
+        const char* name = snapshot.Name(i);
+        for (size_t p = 0; p < PropertyTable<E>::count; p++) {
+            if (strcmp(name, descs[p].name) == 0) {
+                table->prop_ids[p] = snapshot.PropId(i);
+                break;
+            }
+        }
+    }
+
+    int ret = 0;
+    for (size_t p = 0; p < PropertyTable<E>::count; p++) {
+        if (table->prop_ids[p] == 0 && descs[p].required) {
+            fprintf(stderr, "[!] %s %u has no property: %s\n",
+                Traits::object_name, table->id, descs[p].name);
+            ret = -EINVAL;
+        }
+    }
+
+    return ret;
+}
+
+const char* PropertyName(ConnectorProperty prop)
+{
+    return connector_props[static_cast<size_t>(prop)].name;
+}
+
+const char* PropertyName(CrtcProperty prop)
+{
+    return crtc_props[static_cast<size_t>(prop)].name;
+}
+
+const char* PropertyName(PlaneProperty prop)
+{
+    return plane_props[static_cast<size_t>(prop)].name;
+}
+
+int ResolveProperties(PropertyCache& cache, ConnectorProperties* table)
+{
+    ObjectSnapshot snapshot(cache, table->id, DRM_MODE_OBJECT_CONNECTOR);
+    return Resolve(snapshot, table, connector_props);
+}
+
+int ResolveProperties(PropertyCache& cache, CrtcProperties* table)
+{
+    ObjectSnapshot snapshot(cache, table->id, DRM_MODE_OBJECT_CRTC);
+    return Resolve(snapshot, table, crtc_props);
+}
+
+int ResolveProperties(PropertyCache& cache, PlaneProperties* table)
+{
+    ObjectSnapshot snapshot(cache, table->id, DRM_MODE_OBJECT_PLANE);
+    return Resolve(snapshot, table, plane_props);
+}
+
+int ResolveProperties(const ObjectSnapshot& snapshot, PlaneProperties* table)
+{
+    return Resolve(snapshot, table, plane_props);
+}
+
+} // namespace DrmLab
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+/*
+ * Properties used by the atomic commit path. Each enum indexes a fixed table of
+ * property IDs, so the per-frame code never has to look a property up by name.
+ * Keep each enum in sync with its name table in drm_property.cpp.
+ */
+
+enum class ConnectorProperty : uint32_t
+{
+    CrtcId,
+    Count
+};
+
+enum class CrtcProperty : uint32_t
+{
+    ModeId,
+    Active,
+    Count
+};
+
+enum class PlaneProperty : uint32_t
+{
+    Type,
+    FbId,
+    CrtcId,
+    SrcX,
+    SrcY,
+    SrcW,
+    SrcH,
+    CrtcX,
+    CrtcY,
+    CrtcW,
+    CrtcH,
+    FbDamageClips,
+    Zpos,
+    Alpha,
+    PixelBlendMode,
+    Rotation,
+    Count
+};
+
+template <typename E>
+struct PropertyTraits;
+
+template <>
+struct PropertyTraits<ConnectorProperty>
+{
+    static constexpr uint32_t object_type = DRM_MODE_OBJECT_CONNECTOR;
+    static constexpr const char* object_name = "connector";
+};
+
+template <>
+struct PropertyTraits<CrtcProperty>
+{
+    static constexpr uint32_t object_type = DRM_MODE_OBJECT_CRTC;
+    static constexpr const char* object_name = "CRTC";
+};
+
+template <>
+struct PropertyTraits<PlaneProperty>
+{
+    static constexpr uint32_t object_type = DRM_MODE_OBJECT_PLANE;
+    static constexpr const char* object_name = "plane";
+};
+
+/**
+ * @brief Property IDs of one KMS object, indexed by a property enum.
+ *
+ * This is a plain aggregate so that it can live inside the malloc'ed/memset
+ * output structs of the examples. A zero ID means the object doesn't expose
+ * that (optional) property.
+ */
+template <typename E>
+struct PropertyTable
+{
+    static constexpr size_t count = static_cast<size_t>(E::Count);
+
+    uint32_t id;
+    uint32_t prop_ids[count];
+
+    uint32_t PropId(E prop) const { return prop_ids[static_cast<size_t>(prop)]; }
+    bool Has(E prop) const { return PropId(prop) != 0; }
+};
+
+using ConnectorProperties = PropertyTable<ConnectorProperty>;
+using CrtcProperties = PropertyTable<CrtcProperty>;
+using PlaneProperties = PropertyTable<PlaneProperty>;
+
+/**
+ * @brief Metadata of a property, without its enum list or blob ids.
+ */
+struct PropertyInfo
+{
+    uint32_t prop_id;
+    uint32_t flags;
+    char name[DRM_PROP_NAME_LEN];
+};
+
+/**
+ * @brief Device-wide cache of property metadata, keyed by property ID.
+ *
+ * Property IDs are global to a DRM device, and all connectors (CRTCs, planes)
+ * share the same property objects. So the metadata is fetched lazily with a
+ * single GETPROPERTY ioctl the first time an ID is seen, and every later
+ * object reuses it. The enum list of a property is only fetched on request.
+ */
+class PropertyCache
+{
+public:
+    explicit PropertyCache(int fd);
+    ~PropertyCache() noexcept;
+
+    PropertyCache(const PropertyCache&) = delete;
+    PropertyCache& operator=(const PropertyCache&) = delete;
+
+    int Fd() const { return m_Fd; }
+
+    /**
+     * @brief Get the metadata of a property, fetching it on first use.
+     * @return nullptr if the kernel doesn't know this property
+     */
+    const PropertyInfo* Get(uint32_t prop_id);
+
+    /**
+     * @brief Get the full property including enums/values (libdrm object).
+     * The returned object is owned by the cache.
+     */
+    const drmModePropertyRes* GetFull(uint32_t prop_id);
+
+    /**
+     * @brief Number of property ioctls issued through this cache, including
+     * those of the ObjectSnapshots taken with it.
+     */
+    uint32_t IoctlCount() const { return m_IoctlCount; }
+
+private:
+    friend class ObjectSnapshot;
+
+    int m_Fd;
+    uint32_t m_IoctlCount = 0;
+    std::unordered_map<uint32_t, PropertyInfo> m_Infos;
+    std::unordered_map<uint32_t, drmModePropertyPtr> m_Full;
+};
+
+/**
+ * @brief Property values of one object, read with a single
+ * drmModeObjectGetProperties() call.
+ */
+class ObjectSnapshot
+{
+public:
+    ObjectSnapshot(PropertyCache& cache, uint32_t object_id, uint32_t object_type);
+    ~ObjectSnapshot() noexcept;
+
+    ObjectSnapshot(const ObjectSnapshot&) = delete;
+    ObjectSnapshot& operator=(const ObjectSnapshot&) = delete;
+
+    bool Valid() const { return m_Props != nullptr; }
+    uint32_t Count() const { return Valid() ? m_Props->count_props : 0; }
+    uint32_t PropId(uint32_t i) const { return m_Props->props[i]; }
+    uint64_t Value(uint32_t i) const { return m_Props->prop_values[i]; }
+
+    /**
+     * @brief Name of the i-th property, from the device cache.
+     */
+    const char* Name(uint32_t i) const;
+
+    /**
+     * @brief Look up a property value by name.
+     * @return false if the object has no such property
+     */
+    bool Find(const char* name, uint64_t* value) const;
+
+private:
+    PropertyCache& m_Cache;
+    drmModeObjectPropertiesPtr m_Props;
+};
+
+/**
+ * @brief Get the kernel name of a property, e.g. "CRTC_ID".
+ */
+const char* PropertyName(ConnectorProperty prop);
+const char* PropertyName(CrtcProperty prop);
+const char* PropertyName(PlaneProperty prop);
+
+/**
+ * @brief Resolve all property names of `table->id` to property IDs.
+ *
+ * This is done once at setup. Missing optional properties are left as 0, a
+ * missing required property makes the whole resolve fail, so the commit path
+ * can rely on every required ID being valid.
+ * @return 0 on success, negative errno otherwise
+ */
+int ResolveProperties(PropertyCache& cache, ConnectorProperties* table);
+int ResolveProperties(PropertyCache& cache, CrtcProperties* table);
+int ResolveProperties(PropertyCache& cache, PlaneProperties* table);
+
+/**
+ * @brief Same, from a snapshot of `table->id` the caller took already, so
+ * the properties aren't read twice.
+ */
+int ResolveProperties(const ObjectSnapshot& snapshot, PlaneProperties* table);
+
+} // namespace DrmLab
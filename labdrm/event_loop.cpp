@@ -0,0 +1,236 @@
+#include "event_loop.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <libudev.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace DrmLab
+{
+
+/* sources dispatched per epoll_wait() */
+static constexpr int max_events = 16;
+
+EventLoop::EventLoop()
+    : m_Epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+    sigemptyset(&m_Blocked);
+}
+
+EventLoop::~EventLoop() noexcept
+{
+    for (auto& entry : m_Sources) {
+        if (entry.second->owned) {
+            close(entry.second->fd);
+        }
+    }
+    for (struct udev_monitor* monitor : m_Monitors) {
+        udev_monitor_unref(monitor);
+    }
+    if (m_Udev != nullptr) {
+        udev_unref(m_Udev);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &m_Blocked, nullptr);
+    if (m_Epoll >= 0) {
+        close(m_Epoll);
+    }
+}
+
+uint64_t EventLoop::Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+int EventLoop::Add(int fd, bool owned, uint32_t events, FdCallback callback)
+{
+    if (m_Sources.count(fd) != 0) {
+        return -EEXIST;
+    }
+
+    std::unique_ptr<Source> source(new Source { fd, owned, std::move(callback) });
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source.get();
+    if (epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -errno;
+    }
+
+    m_Sources[fd] = std::move(source);
+    return 0;
+}
+
+int EventLoop::AddFd(int fd, uint32_t events, FdCallback callback)
+{
+    return Add(fd, false, events, std::move(callback));
+}
+
+void EventLoop::RemoveFd(int fd)
+{
+    auto it = m_Sources.find(fd);
+    if (it == m_Sources.end()) {
+        return;
+    }
+
+    epoll_ctl(m_Epoll, EPOLL_CTL_DEL, fd, nullptr);
+    if (it->second->owned) {
+        close(fd);
+    }
+
+    /* events of this batch may still point at it */
+    it->second->fd = -1;
+    m_Removed.push_back(std::move(it->second));
+    m_Sources.erase(it);
+}
+
+int EventLoop::AddDrm(int drm_fd, drmEventContext* context)
+{
+    return Add(drm_fd, false, EPOLLIN, [drm_fd, context](uint32_t) {
+        drmHandleEvent(drm_fd, context);
+    });
+}
+
+int EventLoop::AddTimer(TimerCallback callback)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int ret = Add(fd, true, EPOLLIN, [fd, callback](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            callback(expirations);
+        }
+    });
+    if (ret != 0) {
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+int EventLoop::ArmTimer(int timer, uint64_t deadline_ns, uint64_t interval_ns)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline_ns / 1000000000ull;
+    its.it_value.tv_nsec = deadline_ns % 1000000000ull;
+    its.it_interval.tv_sec = interval_ns / 1000000000ull;
+    its.it_interval.tv_nsec = interval_ns % 1000000000ull;
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, nullptr) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int EventLoop::AddSignals(std::initializer_list<int> signals, SignalCallback callback)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    for (int signo : signals) {
+        sigaddset(&mask, signo);
+    }
+
+    int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int ret = Add(fd, true, EPOLLIN, [fd, callback](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+            callback(static_cast<int>(info.ssi_signo));
+        }
+    });
+    if (ret != 0) {
+        close(fd);
+        return ret;
+    }
+
+    /* the default action would run before the signalfd is ever read */
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    for (int signo : signals) {
+        sigaddset(&m_Blocked, signo);
+    }
+    return fd;
+}
+
+int EventLoop::AddUdevMonitor(const char* subsystem, UdevCallback callback)
+{
+    if (m_Udev == nullptr) {
+        m_Udev = udev_new();
+        if (m_Udev == nullptr) {
+            return -ENOMEM;
+        }
+    }
+
+    struct udev_monitor* monitor = udev_monitor_new_from_netlink(m_Udev, "udev");
+    if (monitor == nullptr) {
+        return -ENOMEM;
+    }
+    if (udev_monitor_filter_add_match_subsystem_devtype(monitor, subsystem, nullptr) < 0 ||
+        udev_monitor_enable_receiving(monitor) < 0) {
+        udev_monitor_unref(monitor);
+        return -EIO;
+    }
+
+    /* the fd belongs to the monitor */
+    int fd = udev_monitor_get_fd(monitor);
+    int ret = Add(fd, false, EPOLLIN, [monitor, callback](uint32_t) {
+        struct udev_device* device = udev_monitor_receive_device(monitor);
+        if (device != nullptr) {
+            callback(device);
+            udev_device_unref(device);
+        }
+    });
+    if (ret != 0) {
+        udev_monitor_unref(monitor);
+        return ret;
+    }
+
+    m_Monitors.push_back(monitor);
+    return fd;
+}
+
+int EventLoop::Dispatch(int timeout_ms)
+{
+    struct epoll_event events[max_events];
+
+    int count = epoll_wait(m_Epoll, events, max_events, timeout_ms);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Source* source = static_cast<Source*>(events[i].data.ptr);
+        if (source->fd >= 0) {
+            source->callback(events[i].events);
+        }
+    }
+
+    m_Removed.clear();
+    return count;
+}
+
+void EventLoop::Run()
+{
+    while (!m_Quit) {
+        if (Dispatch(-1) < 0) {
+            break;
+        }
+    }
+}
+
+} // namespace DrmLab
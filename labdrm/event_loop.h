@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <signal.h>
+#include <xf86drm.h>
+
+struct udev;
+struct udev_device;
+struct udev_monitor;
+
+namespace DrmLab
+{
+
+/**
+ * @brief An epoll based event loop.
+ *
+ * Every source is a file descriptor with a callback: any number of DRM
+ * devices, whose events go to a drmEventContext; timerfds for frame
+ * deadlines; a signalfd for clean shutdown; and a udev monitor for hotplug.
+ * The loop itself is an epoll fd which is readable whenever Dispatch() has
+ * something to do, so it can be embedded in another event loop.
+ *
+ * Callbacks may add and remove sources, including their own.
+ */
+class EventLoop
+{
+public:
+    using FdCallback = std::function<void(uint32_t events)>;
+    using TimerCallback = std::function<void(uint64_t expirations)>;
+    using SignalCallback = std::function<void(int signo)>;
+    using UdevCallback = std::function<void(struct udev_device* device)>;
+
+    EventLoop();
+    ~EventLoop() noexcept;
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool Valid() const { return m_Epoll >= 0; }
+
+    /**
+     * @brief The epoll fd, readable when there are events to dispatch.
+     */
+    int Fd() const { return m_Epoll; }
+
+    /**
+     * @brief Call `callback` whenever `fd` is ready for `events` (EPOLLIN,
+     * ...). The fd stays owned by the caller.
+     * @return 0 on success, negative errno otherwise
+     */
+    int AddFd(int fd, uint32_t events, FdCallback callback);
+
+    /**
+     * @brief Stop watching `fd`, and close it if the loop created it.
+     */
+    void RemoveFd(int fd);
+
+    /**
+     * @brief Read the events of a DRM device with drmHandleEvent() whenever
+     * it is readable. `context` must stay valid; the handlers receive the
+     * user_data of the commit which caused the event.
+     */
+    int AddDrm(int drm_fd, drmEventContext* context);
+
+    /**
+     * @brief Create a CLOCK_MONOTONIC timer, disarmed.
+     * @return the timerfd, which identifies the timer, or negative errno
+     */
+    int AddTimer(TimerCallback callback);
+
+    /**
+     * @brief Let `timer` fire at the absolute CLOCK_MONOTONIC time
+     * `deadline_ns`, then every `interval_ns` unless that is 0. A deadline of
+     * 0 disarms it.
+     */
+    int ArmTimer(int timer, uint64_t deadline_ns, uint64_t interval_ns = 0);
+
+    /**
+     * @brief Block `signals` and deliver them through a signalfd.
+     *
+     * Call this before starting any thread: threads inherit the signal mask,
+     * and a thread which doesn't block the signals would still receive them.
+     * @return the signalfd or negative errno
+     */
+    int AddSignals(std::initializer_list<int> signals, SignalCallback callback);
+
+    /**
+     * @brief Watch udev for events of devices of `subsystem`, e.g. "drm" for
+     * connector hotplug.
+     * @return the monitor's fd or negative errno
+     */
+    int AddUdevMonitor(const char* subsystem, UdevCallback callback);
+
+    /**
+     * @brief Wait up to `timeout_ms` (-1 forever, 0 not at all) and dispatch
+     * the ready sources.
+     * @return number of sources dispatched, negative errno on failure
+     */
+    int Dispatch(int timeout_ms);
+
+    /**
+     * @brief Dispatch until Quit().
+     */
+    void Run();
+
+    void Quit() { m_Quit = true; }
+    bool ShouldQuit() const { return m_Quit; }
+
+    /**
+     * @brief Current CLOCK_MONOTONIC time, for ArmTimer().
+     */
+    static uint64_t Now();
+
+private:
+    struct Source
+    {
+        int fd;     // -1 once removed
+        bool owned; // created by the loop, closed on removal
+        FdCallback callback;
+    };
+
+    int Add(int fd, bool owned, uint32_t events, FdCallback callback);
+
+    int m_Epoll;
+    std::map<int, std::unique_ptr<Source>> m_Sources;
+    std::vector<std::unique_ptr<Source>> m_Removed; // freed after Dispatch()
+
+    struct udev* m_Udev = nullptr;
+    std::vector<struct udev_monitor*> m_Monitors;
+
+    sigset_t m_Blocked; // signals blocked by AddSignals(), unblocked again on destruction
+    bool m_Quit = false;
+};
+
+} // namespace DrmLab
@@ -0,0 +1,193 @@
+#include "frame_scheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace DrmLab
+{
+
+/* render times measured before the estimate is trusted */
+static constexpr size_t min_render_samples = 8;
+
+int64_t FrameScheduler::MarginFromEnv()
+{
+    const char* s = getenv("LABDRM_SCHED_MARGIN_US");
+    if (s == nullptr) {
+        return 1000000;
+    }
+    if (strcmp(s, "off") == 0) {
+        return -1;
+    }
+
+    long us = atol(s);
+    return us < 0 ? -1 : static_cast<int64_t>(us) * 1000;
+}
+
+uint64_t FrameScheduler::Predict(uint64_t sequence) const
+{
+    const Flip& newest = m_Flips[(m_FlipNext + flip_history - 1) % flip_history];
+    int64_t frames = static_cast<int64_t>(sequence - newest.sequence);
+
+    return m_Base + frames * static_cast<int64_t>(Period());
+}
+
+/*
+ * Least squares line through the flips, relative to the newest one so the
+ * doubles keep their precision.
+ */
+void FrameScheduler::Fit()
+{
+    const Flip& newest = m_Flips[(m_FlipNext + flip_history - 1) % flip_history];
+
+    if (m_FlipCount < 2) {
+        m_Base = newest.timestamp;
+        m_Period = 0;
+        return;
+    }
+
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double n = static_cast<double>(m_FlipCount);
+    for (size_t i = 0; i < m_FlipCount; i++) {
+        const Flip& f = m_Flips[(m_FlipNext + flip_history - 1 - i) % flip_history];
+        double x = -static_cast<double>(newest.sequence - f.sequence);
+        double y = -static_cast<double>(newest.timestamp - f.timestamp);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double var = n * sxx - sx * sx;
+    if (var <= 0) {
+        return;
+    }
+    double slope = (n * sxy - sx * sy) / var;
+    double intercept = (sy - slope * sx) / n;
+    if (slope <= 0) {
+        return;
+    }
+
+    m_Period = static_cast<uint64_t>(slope + 0.5);
+    m_Base = static_cast<uint64_t>(static_cast<double>(newest.timestamp) + intercept + 0.5);
+}
+
+uint64_t FrameScheduler::NextVblank(uint64_t now) const
+{
+    uint64_t period = Period();
+
+    if (m_FlipCount == 0 || period == 0) {
+        return 0;
+    }
+    if (now < m_Base) {
+        return m_Base;
+    }
+    return m_Base + ((now - m_Base) / period + 1) * period;
+}
+
+uint64_t FrameScheduler::RenderEstimate() const
+{
+    return m_RenderEstimate;
+}
+
+uint64_t FrameScheduler::FrameStart(uint64_t now, uint64_t* target) const
+{
+    uint64_t period = Period();
+    uint64_t vblank = NextVblank(now);
+
+    *target = 0;
+    if (vblank == 0 || m_RenderEstimate == 0) {
+        return now;
+    }
+
+    /* the frames in flight take the vblanks before ours */
+    uint64_t budget = m_RenderEstimate + m_Margin;
+    vblank += m_InFlight * period;
+    while (vblank < now + budget) {
+        vblank += period;
+    }
+
+    *target = vblank;
+    return vblank - budget;
+}
+
+void FrameScheduler::Queued(const void* frame, uint64_t start, uint64_t end, uint64_t target)
+{
+    m_Render[m_RenderNext] = end - start;
+    m_RenderNext = (m_RenderNext + 1) % render_history;
+    if (m_RenderCount < render_history) {
+        m_RenderCount++;
+    }
+
+    if (m_RenderCount >= min_render_samples) {
+        uint64_t sorted[render_history];
+        std::copy(m_Render, m_Render + m_RenderCount, sorted);
+        size_t k = static_cast<size_t>(render_quantile * (m_RenderCount - 1) + 0.5);
+        std::nth_element(sorted, sorted + k, sorted + m_RenderCount);
+        m_RenderEstimate = sorted[k];
+    }
+
+    for (Frame& f : m_Frames) {
+        if (f.id == nullptr) {
+            f = { frame, start, target };
+            m_InFlight++;
+            return;
+        }
+    }
+}
+
+void FrameScheduler::Dropped(const void* frame)
+{
+    for (Frame& f : m_Frames) {
+        if (f.id == frame) {
+            f.id = nullptr;
+            m_InFlight--;
+            return;
+        }
+    }
+}
+
+void FrameScheduler::Presented(const void* frame, uint32_t sequence, uint64_t timestamp)
+{
+    if (m_FlipCount == 0) {
+        m_Sequence = sequence;
+    } else {
+        m_Sequence += static_cast<uint32_t>(sequence - m_LastSequence);
+    }
+    m_LastSequence = sequence;
+
+    /* how good was the prediction; far off means the timing changed */
+    if (m_FlipCount > 0 && Period() != 0) {
+        uint64_t predicted = Predict(m_Sequence);
+        uint64_t error = predicted > timestamp ? predicted - timestamp : timestamp - predicted;
+        m_Stats.predictions++;
+        m_Stats.error_ns += error;
+        if (error > Period() / 2) {
+            m_FlipCount = 0;
+        }
+    }
+
+    m_Flips[m_FlipNext] = { m_Sequence, timestamp };
+    m_FlipNext = (m_FlipNext + 1) % flip_history;
+    if (m_FlipCount < flip_history) {
+        m_FlipCount++;
+    }
+    Fit();
+
+    for (Frame& f : m_Frames) {
+        if (f.id != nullptr && f.id == frame) {
+            uint64_t latency = timestamp > f.start ? timestamp - f.start : 0;
+            m_Stats.frames++;
+            m_Stats.latency_ns += latency;
+            m_Stats.max_latency_ns = std::max(m_Stats.max_latency_ns, latency);
+            if (f.target != 0 && timestamp > f.target + Period() / 2) {
+                m_Stats.missed++;
+            }
+            f.id = nullptr;
+            m_InFlight--;
+            return;
+        }
+    }
+}
+
+} // namespace DrmLab
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DrmLab
+{
+
+/**
+ * @brief What a FrameScheduler saw, for the summary at exit.
+ */
+struct SchedulerStats
+{
+    uint64_t frames;          // frames presented which were scheduled
+    uint64_t missed;          // ... and reached the screen after their target vblank
+    uint64_t latency_ns;      // sum of render start to vblank, over `frames`
+    uint64_t max_latency_ns;
+    uint64_t predictions;     // flips which had a prediction to compare with
+    uint64_t error_ns;        // sum of |predicted - actual| vblank timestamps
+};
+
+/**
+ * @brief Starts rendering each frame as late as possible while still making
+ * its vblank.
+ *
+ * Rendering right after a page-flip completes means the frame waits almost a
+ * whole refresh period before it is scanned out, and so does any input it
+ * shows. Instead, the scheduler predicts the upcoming vblanks from the
+ * timestamps of past flips, measures how long frames take to render, and
+ * starts a frame that long (plus a safety margin) before its vblank.
+ *
+ * The vblank prediction is a least squares fit of timestamp against vblank
+ * sequence number over the last flips, so jitter averages out and skipped
+ * vblanks don't disturb it. A flip far off the prediction (mode change,
+ * DPMS, a stalled driver) restarts the history. The render time is a high
+ * quantile of the recent render times, not their mean: a frame that is late
+ * costs a whole refresh period.
+ *
+ * Frames are identified by any pointer, e.g. their buffer. All times are
+ * CLOCK_MONOTONIC nanoseconds, like DRM event timestamps. Not thread-safe;
+ * it belongs to the thread which renders.
+ */
+class FrameScheduler
+{
+public:
+    static constexpr size_t flip_history = 16;
+    static constexpr size_t render_history = 64;
+    static constexpr unsigned max_frames = 8; // frames between Queued() and Presented()/Dropped()
+    static constexpr double render_quantile = 0.95;
+
+    explicit FrameScheduler(uint64_t margin_ns)
+        : m_Margin(margin_ns)
+    {}
+
+    /**
+     * @brief Safety margin from the LABDRM_SCHED_MARGIN_US environment
+     * variable, in nanoseconds; 1 ms if unset.
+     * @return -1 for "off": render as soon as a buffer is free
+     */
+    static int64_t MarginFromEnv();
+
+    /**
+     * @brief The refresh period of the mode, used until flips have been
+     * measured.
+     */
+    void SetNominalPeriod(uint64_t period_ns) { m_Nominal = period_ns; }
+
+    /**
+     * @brief When to start rendering the next frame.
+     * @param target receives the vblank the frame is for, 0 if it's not
+     * known yet (then the frame should start right away)
+     * @return start time, `now` or later
+     */
+    uint64_t FrameStart(uint64_t now, uint64_t* target) const;
+
+    /**
+     * @brief A frame was rendered from `start` to `end` and queued for
+     * `target`, as returned by FrameStart().
+     */
+    void Queued(const void* frame, uint64_t start, uint64_t end, uint64_t target);
+
+    /**
+     * @brief A queued frame was dropped without being shown.
+     */
+    void Dropped(const void* frame);
+
+    /**
+     * @brief A page-flip completed at vblank `sequence`, `timestamp`. `frame`
+     * may be one the scheduler doesn't know, its flip still feeds the
+     * prediction.
+     */
+    void Presented(const void* frame, uint32_t sequence, uint64_t timestamp);
+
+    /**
+     * @brief The first vblank after `now`, 0 if nothing is known yet.
+     */
+    uint64_t NextVblank(uint64_t now) const;
+
+    /**
+     * @brief Measured refresh period, the nominal one before there are two
+     * flips.
+     */
+    uint64_t Period() const { return m_Period != 0 ? m_Period : m_Nominal; }
+
+    /**
+     * @brief How long a frame is expected to take, 0 before enough were
+     * measured.
+     */
+    uint64_t RenderEstimate() const;
+
+    const SchedulerStats& Stats() const { return m_Stats; }
+
+private:
+    struct Flip
+    {
+        uint64_t sequence;
+        uint64_t timestamp;
+    };
+
+    struct Frame
+    {
+        const void* id; // nullptr if the slot is free
+        uint64_t start;
+        uint64_t target;
+    };
+
+    uint64_t Predict(uint64_t sequence) const;
+    void Fit();
+
+    uint64_t m_Margin;
+    uint64_t m_Nominal = 0;
+
+    /* vblank prediction: a line through the recent flips */
+    Flip m_Flips[flip_history] {};
+    size_t m_FlipCount = 0;  // valid entries, the newest at (m_FlipNext - 1)
+    size_t m_FlipNext = 0;
+    uint64_t m_Sequence = 0; // 64 bit vblank sequence, unwrapped
+    uint32_t m_LastSequence = 0;
+    uint64_t m_Base = 0;     // fitted timestamp of the newest flip's sequence
+    uint64_t m_Period = 0;   // fitted, 0 before two flips
+
+    uint64_t m_Render[render_history] {};
+    size_t m_RenderCount = 0;
+    size_t m_RenderNext = 0;
+    uint64_t m_RenderEstimate = 0;
+
+    Frame m_Frames[max_frames] {};
+    unsigned m_InFlight = 0;
+
+    SchedulerStats m_Stats {};
+};
+
+} // namespace DrmLab
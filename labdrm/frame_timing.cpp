@@ -0,0 +1,144 @@
+#include "frame_timing.h"
+
+#include <cmath>
+
+namespace DrmLab
+{
+
+const char* FrameStageName(FrameStage stage)
+{
+    switch (stage) {
+    case FrameStage::Paint:
+        return "paint";
+    case FrameStage::Copy:
+        return "copy";
+    case FrameStage::Commit:
+        return "commit";
+    case FrameStage::Flip:
+        return "flip";
+    default:
+        return "unknown";
+    }
+}
+
+/*
+ * Below 2 << sub_bits the value is the bucket. Above, a value with its top
+ * bit at `e` lands in row (e - sub_bits), column (its top sub_bits + 1 bits).
+ */
+size_t LatencyHistogram::Bucket(uint64_t ns)
+{
+    const uint64_t direct = 2u << sub_bits;
+
+    if (ns < direct) {
+        return static_cast<size_t>(ns);
+    }
+
+    unsigned e = 63 - __builtin_clzll(ns);
+    if (e > max_exponent) {
+        return buckets - 1;
+    }
+    unsigned shift = e - sub_bits;
+    return (e - sub_bits) * (1u << sub_bits) + static_cast<size_t>(ns >> shift);
+}
+
+uint64_t LatencyHistogram::BucketHigh(size_t bucket)
+{
+    const size_t direct = 2u << sub_bits;
+
+    if (bucket < direct) {
+        return bucket;
+    }
+
+    unsigned e = static_cast<unsigned>(bucket >> sub_bits) + sub_bits - 1;
+    uint64_t sub = (bucket & ((1u << sub_bits) - 1)) + (1u << sub_bits);
+    unsigned shift = e - sub_bits;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+    m_Counts[Bucket(ns)]++;
+    m_Count++;
+    m_Sum += ns;
+    if (ns < m_Min) {
+        m_Min = ns;
+    }
+    if (ns > m_Max) {
+        m_Max = ns;
+    }
+}
+
+uint64_t LatencyHistogram::Percentile(double q) const
+{
+    if (m_Count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * m_Count));
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; i++) {
+        seen += m_Counts[i];
+        if (seen >= rank) {
+            /* never beyond what was actually recorded */
+            uint64_t high = BucketHigh(i);
+            return high < m_Max ? high : m_Max;
+        }
+    }
+    return m_Max;
+}
+
+void TimingStats::Record(const StageSample& sample)
+{
+    if (sample.stage >= FrameStage::Count || sample.end < sample.start) {
+        return;
+    }
+    m_Stages[static_cast<size_t>(sample.stage)].Record(sample.end - sample.start);
+}
+
+void TimingStats::Drain(TimingRecorder* recorder)
+{
+    StageSample sample;
+
+    while (recorder->Pop(&sample)) {
+        Record(sample);
+    }
+}
+
+void TimingStats::Flipped(uint32_t sequence)
+{
+    if (m_HaveFlip) {
+        uint32_t gap = sequence - m_LastSequence;
+        if (gap > 1) {
+            m_Missed += gap - 1;
+        }
+    }
+    m_HaveFlip = true;
+    m_LastSequence = sequence;
+}
+
+void TimingStats::WriteJson(FILE* f, uint64_t dropped) const
+{
+    fprintf(f, "{\"missed_vblanks\": %llu, \"dropped_samples\": %llu, \"stages\": {",
+            static_cast<unsigned long long>(m_Missed), static_cast<unsigned long long>(dropped));
+
+    for (size_t i = 0; i < static_cast<size_t>(FrameStage::Count); i++) {
+        const LatencyHistogram& h = m_Stages[i];
+        fprintf(f,
+                "%s\"%s\": {\"count\": %llu, \"min_ns\": %llu, \"mean_ns\": %.0f, \"p50_ns\": %llu, "
+                "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                i == 0 ? "" : ", ", FrameStageName(static_cast<FrameStage>(i)),
+                static_cast<unsigned long long>(h.Count()), static_cast<unsigned long long>(h.Min()),
+                h.Mean(), static_cast<unsigned long long>(h.Percentile(0.5)),
+                static_cast<unsigned long long>(h.Percentile(0.99)),
+                static_cast<unsigned long long>(h.Percentile(0.999)),
+                static_cast<unsigned long long>(h.Max()));
+    }
+
+    fprintf(f, "}}");
+}
+
+} // namespace DrmLab
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "spsc_ring.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief The stages of a frame, from painting to the screen.
+ */
+enum class FrameStage : uint8_t
+{
+    Paint,  // painting the frame, into a shadow or the framebuffer
+    Copy,   // copying the shadow to the framebuffer, with CPU access bracketing
+    Commit, // the atomic commit ioctl
+    Flip,   // from the commit to the vblank its page-flip completed at
+    Count
+};
+
+const char* FrameStageName(FrameStage stage);
+
+/**
+ * @brief One stage of one frame, CLOCK_MONOTONIC nanoseconds.
+ */
+struct StageSample
+{
+    FrameStage stage;
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * @brief A histogram of durations with bounded relative error, like
+ * HdrHistogram.
+ *
+ * Values below 64 ns have a bucket each; above, every power of two is split
+ * into 32 buckets, so a reported value is within about 3% of the true one
+ * all the way up to minutes. Recording is an index computation and an
+ * increment; the storage is fixed.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned sub_bits = 5;
+    static constexpr unsigned max_exponent = 40; // ~18 minutes
+    static constexpr size_t buckets = (max_exponent - sub_bits + 1) * (1u << sub_bits) + (1u << sub_bits);
+
+    void Record(uint64_t ns);
+
+    uint64_t Count() const { return m_Count; }
+    uint64_t Min() const { return m_Count != 0 ? m_Min : 0; }
+    uint64_t Max() const { return m_Max; }
+    double Mean() const { return m_Count != 0 ? static_cast<double>(m_Sum) / m_Count : 0.0; }
+
+    /**
+     * @brief The value below which a fraction `q` (0 to 1) of the values
+     * are, as the highest value of its bucket.
+     */
+    uint64_t Percentile(double q) const;
+
+private:
+    static size_t Bucket(uint64_t ns);
+    static uint64_t BucketHigh(size_t bucket);
+
+    uint64_t m_Counts[buckets] {};
+    uint64_t m_Count = 0;
+    uint64_t m_Sum = 0;
+    uint64_t m_Min = UINT64_MAX;
+    uint64_t m_Max = 0;
+};
+
+/**
+ * @brief Where one thread records the stages of an output's frames.
+ *
+ * Recording is a push onto a lock-free ring, cheap enough to stay on all the
+ * time; the thread which owns the TimingStats drains it. A sample which
+ * finds the ring full is counted and lost.
+ */
+class TimingRecorder
+{
+public:
+    static constexpr size_t capacity = 256;
+
+    void Record(FrameStage stage, uint64_t start, uint64_t end)
+    {
+        if (!m_Ring.Push(StageSample { stage, start, end })) {
+            m_Dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool Pop(StageSample* sample) { return m_Ring.Pop(sample); }
+    uint64_t Dropped() const { return m_Dropped.load(std::memory_order_relaxed); }
+
+private:
+    SpscRing<StageSample, capacity> m_Ring;
+    std::atomic<uint64_t> m_Dropped { 0 };
+};
+
+/**
+ * @brief The stage histograms of one output, plus the vblanks at which it
+ * had no new frame to show.
+ *
+ * Not thread-safe: the samples of other threads come through
+ * TimingRecorder rings, see Drain().
+ */
+class TimingStats
+{
+public:
+    void Drain(TimingRecorder* recorder);
+
+    void Record(const StageSample& sample);
+
+    /**
+     * @brief A page-flip completed at vblank `sequence`; the vblanks skipped
+     * since the previous one count as missed. Async flips may complete
+     * several times within one vblank.
+     */
+    void Flipped(uint32_t sequence);
+
+    const LatencyHistogram& Stage(FrameStage stage) const
+    {
+        return m_Stages[static_cast<size_t>(stage)];
+    }
+    uint64_t MissedVblanks() const { return m_Missed; }
+
+    /**
+     * @brief Write the histograms as a JSON object: count, min, mean, p50,
+     * p99, p99.9 and max in nanoseconds for each stage, the missed vblanks,
+     * and the samples `dropped` by the recorders.
+     */
+    void WriteJson(FILE* f, uint64_t dropped) const;
+
+private:
+    LatencyHistogram m_Stages[static_cast<size_t>(FrameStage::Count)];
+    bool m_HaveFlip = false;
+    uint32_t m_LastSequence = 0;
+    uint64_t m_Missed = 0;
+};
+
+} // namespace DrmLab
@@ -0,0 +1,514 @@
+#include "output_assigner.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+namespace DrmLab
+{
+
+static int LowestBit(uint64_t mask)
+{
+    return mask == 0 ? -1 : __builtin_ctzll(mask);
+}
+
+/*
+ * Kuhn's augmenting path: give output `i` a CRTC out of `reach[i]`, moving
+ * the owners of taken CRTCs to others of theirs.
+ */
+static bool Augment(const std::vector<uint32_t>& reach, size_t i, uint32_t* seen, std::vector<int>& owner)
+{
+    for (uint32_t mask = reach[i] & ~*seen; mask != 0; mask &= mask - 1) {
+        int j = LowestBit(mask);
+        *seen |= 1u << j;
+        if (owner[j] < 0 || Augment(reach, owner[j], seen, owner)) {
+            owner[j] = static_cast<int>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::unique_ptr<OutputAssigner> OutputAssigner::Create(int drm_fd, PropertyCache& cache)
+{
+    std::unique_ptr<OutputAssigner> assigner(new OutputAssigner(drm_fd, cache));
+    int ret = assigner->Load();
+    if (ret != 0) {
+        fprintf(stderr, "[!] cannot read the KMS resources: %s\n", strerror(-ret));
+        return nullptr;
+    }
+    return assigner;
+}
+
+OutputAssigner::OutputAssigner(int drm_fd, PropertyCache& cache)
+    : m_Fd(drm_fd)
+    , m_Cache(cache)
+    , m_Req(AtomicRequest::Create(AtomicBackendFromEnv()))
+{}
+
+OutputAssigner::~OutputAssigner() noexcept
+{
+    if (m_TestFb.fb != 0) {
+        m_Allocator->Free(&m_TestFb);
+    }
+}
+
+/*
+ * Read every object once. CRTCs past the 32 a possible_crtcs mask can name,
+ * and encoders or primary planes past the 64 of our bitsets, are left out.
+ */
+int OutputAssigner::Load()
+{
+    if (!m_Req->Valid()) {
+        return -ENOMEM;
+    }
+
+    drmModeRes* res = drmModeGetResources(m_Fd);
+    if (res == nullptr) {
+        return -errno;
+    }
+
+    auto crtc_index = [res](uint32_t id) {
+        for (int i = 0; i < res->count_crtcs && i < 32; i++) {
+            if (res->crtcs[i] == id) {
+                return i;
+            }
+        }
+        return -1;
+    };
+
+    /* the CRTC each encoder drives now, to find the connectors' */
+    std::vector<int> encoder_crtcs;
+    int ret = 0;
+    for (int i = 0; i < res->count_crtcs && i < 32; i++) {
+        Crtc crtc = {};
+        crtc.props.id = res->crtcs[i];
+        ret = ResolveProperties(m_Cache, &crtc.props);
+        if (ret != 0) {
+            goto out;
+        }
+        m_Crtcs.push_back(crtc);
+    }
+
+    for (int i = 0; i < res->count_encoders && i < 64; i++) {
+        drmModeEncoder* enc = drmModeGetEncoder(m_Fd, res->encoders[i]);
+        if (enc == nullptr) {
+            ret = -errno;
+            goto out;
+        }
+        m_Encoders.push_back({enc->encoder_id, enc->possible_crtcs});
+        encoder_crtcs.push_back(enc->crtc_id != 0 ? crtc_index(enc->crtc_id) : -1);
+        drmModeFreeEncoder(enc);
+    }
+
+    for (int i = 0; i < res->count_connectors; i++) {
+        /* without a probe: hotplug handling is somebody else's business */
+        drmModeConnector* conn = drmModeGetConnectorCurrent(m_Fd, res->connectors[i]);
+        if (conn == nullptr) {
+            ret = -errno;
+            goto out;
+        }
+
+        Connector connector = {};
+        connector.props.id = conn->connector_id;
+        connector.crtc = -1;
+        for (size_t e = 0; e < m_Encoders.size(); e++) {
+            for (int k = 0; k < conn->count_encoders; k++) {
+                if (conn->encoders[k] == m_Encoders[e].id) {
+                    connector.encoders |= 1ull << e;
+                }
+            }
+            if (conn->encoder_id == m_Encoders[e].id) {
+                connector.crtc = encoder_crtcs[e];
+            }
+        }
+        drmModeFreeConnector(conn);
+
+        if (ResolveProperties(m_Cache, &connector.props) == 0) {
+            m_Connectors.push_back(connector);
+        }
+    }
+
+    {
+        drmModePlaneRes* planes = drmModeGetPlaneResources(m_Fd);
+        if (planes == nullptr) {
+            ret = -errno;
+            goto out;
+        }
+
+        for (uint32_t i = 0; i < planes->count_planes; i++) {
+            drmModePlane* p = drmModeGetPlane(m_Fd, planes->planes[i]);
+            if (p == nullptr) {
+                continue;
+            }
+
+            Plane plane = {};
+            plane.props.id = p->plane_id;
+            plane.possible_crtcs = p->possible_crtcs;
+            plane.crtc = p->crtc_id != 0 ? crtc_index(p->crtc_id) : -1;
+            drmModeFreePlane(p);
+
+            uint64_t type = 0;
+            ObjectSnapshot props(m_Cache, plane.props.id, DRM_MODE_OBJECT_PLANE);
+            plane.primary = props.Find("type", &type) && type == DRM_PLANE_TYPE_PRIMARY;
+            if (ResolveProperties(props, &plane.props) != 0) {
+                continue;
+            }
+
+            if (plane.primary && m_Primaries.size() < 64) {
+                for (size_t j = 0; j < m_Crtcs.size(); j++) {
+                    if (plane.possible_crtcs & (1u << j)) {
+                        m_Crtcs[j].primaries |= 1ull << m_Primaries.size();
+                    }
+                }
+                m_Primaries.push_back(static_cast<int>(m_Planes.size()));
+            }
+            m_Planes.push_back(plane);
+        }
+        drmModeFreePlaneResources(planes);
+    }
+
+out:
+    drmModeFreeResources(res);
+    return ret;
+}
+
+int OutputAssigner::ConnectorIndex(uint32_t id) const
+{
+    for (size_t i = 0; i < m_Connectors.size(); i++) {
+        if (m_Connectors[i].props.id == id) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+/*
+ * A framebuffer as large as the largest mode: the primary planes of all
+ * outputs scan out of it in the TEST_ONLY commits, each its own corner.
+ * Nothing ever paints into it.
+ */
+int OutputAssigner::TestFramebuffer(const std::vector<OutputRequest>& outputs)
+{
+    uint32_t width = 0, height = 0;
+    for (const OutputRequest& output : outputs) {
+        width = std::max(width, output.width);
+        height = std::max(height, output.height);
+    }
+    if (m_TestFb.fb != 0 && m_TestFb.width >= width && m_TestFb.height >= height) {
+        return 0;
+    }
+
+    if (!m_Allocator) {
+        m_Allocator = Allocator::Create(AllocatorBackend::Dumb, m_Fd);
+        if (!m_Allocator) {
+            return -ENODEV;
+        }
+    }
+    if (m_TestFb.fb != 0) {
+        m_Allocator->Free(&m_TestFb);
+        m_TestFb = {};
+    }
+    return m_Allocator->Allocate(width, height, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_INVALID, &m_TestFb);
+}
+
+std::vector<PipeAssignment> OutputAssigner::Assign(const std::vector<OutputRequest>& outputs)
+{
+    std::vector<uint32_t> key;
+    for (const OutputRequest& output : outputs) {
+        key.push_back(output.connector);
+    }
+    std::sort(key.begin(), key.end());
+
+    auto it = m_Memo.find(key);
+    if (it == m_Memo.end()) {
+        Search search = {};
+        search.outputs = &outputs;
+        search.crtc.assign(outputs.size(), -1);
+        search.plane.assign(outputs.size(), -1);
+        for (size_t i = 0; i < outputs.size(); i++) {
+            int c = ConnectorIndex(outputs[i].connector);
+            /* a connector asked for twice gets lit once */
+            for (size_t k = 0; k < i && c >= 0; k++) {
+                if (search.connectors[k] == c) {
+                    c = -1;
+                }
+            }
+            search.connectors.push_back(c);
+        }
+
+        if (TestFramebuffer(outputs) != 0) {
+            fprintf(stderr, "[!] no test framebuffer, testing with the primary planes off.\n");
+        }
+
+        for (search.target = MaxMatching(search); search.target > 0; search.target--) {
+            Solve(&search, 0, 0, 0, 0, 0);
+            if (search.found || search.tests >= max_tests || search.nodes >= max_nodes) {
+                break;
+            }
+        }
+        if (!search.found) {
+            search.crtc.assign(outputs.size(), -1);
+        }
+        it = m_Memo.emplace(key, Pipes(search)).first;
+    }
+
+    /* in the order of `outputs`, which the remembered result may not be in */
+    std::vector<PipeAssignment> pipes;
+    std::vector<bool> taken(it->second.size(), false);
+    for (const OutputRequest& output : outputs) {
+        for (size_t k = 0; k < it->second.size(); k++) {
+            if (!taken[k] && it->second[k].connector == output.connector) {
+                pipes.push_back(it->second[k]);
+                taken[k] = true;
+                break;
+            }
+        }
+    }
+    return pipes;
+}
+
+/*
+ * How many outputs a matching of connectors to CRTCs can light at most,
+ * counting the CRTCs any encoder of a connector reaches, if the CRTC has a
+ * primary plane.
+ */
+unsigned OutputAssigner::MaxMatching(const Search& search) const
+{
+    std::vector<uint32_t> reach(search.connectors.size(), 0);
+    for (size_t i = 0; i < reach.size(); i++) {
+        if (search.connectors[i] < 0) {
+            continue;
+        }
+        for (uint64_t e = m_Connectors[search.connectors[i]].encoders; e != 0; e &= e - 1) {
+            reach[i] |= m_Encoders[LowestBit(e)].possible_crtcs;
+        }
+        for (size_t j = 0; j < 32; j++) {
+            if (j >= m_Crtcs.size() || m_Crtcs[j].primaries == 0) {
+                reach[i] &= ~(1u << j);
+            }
+        }
+    }
+
+    std::vector<int> owner(m_Crtcs.size(), -1);
+    unsigned matched = 0;
+    for (size_t i = 0; i < reach.size(); i++) {
+        uint32_t seen = 0;
+        if (Augment(reach, i, &seen, owner)) {
+            matched++;
+        }
+    }
+    return matched;
+}
+
+/*
+ * Depth first over the outputs: light output `i` on each CRTC still free,
+ * its current one first, or leave it dark while enough others remain to
+ * reach the target. Each complete assignment gets a TEST_ONLY commit; the
+ * first that passes ends the search.
+ */
+void OutputAssigner::Solve(Search* search, size_t i, unsigned lit, uint32_t used_crtcs, uint64_t used_encoders,
+                           uint64_t used_primaries)
+{
+    if (search->found || search->tests >= max_tests || search->nodes++ >= max_nodes) {
+        return;
+    }
+    if (lit == search->target) {
+        search->found = Test(search);
+        return;
+    }
+    if (lit + (search->connectors.size() - i) < search->target) {
+        return;
+    }
+
+    int c = search->connectors[i];
+    if (c >= 0) {
+        const Connector& conn = m_Connectors[c];
+        for (int k = -1; k < static_cast<int>(m_Crtcs.size()) && !search->found; k++) {
+            int j = k < 0 ? conn.crtc : k;
+            if (j < 0 || (k >= 0 && j == conn.crtc) || (used_crtcs & (1u << j))) {
+                continue;
+            }
+
+            /* any free encoder which reaches the CRTC: which one doesn't
+             * show in the commit, so trying each would only repeat tests */
+            int e = -1;
+            for (uint64_t mask = conn.encoders & ~used_encoders; mask != 0; mask &= mask - 1) {
+                if (m_Encoders[LowestBit(mask)].possible_crtcs & (1u << j)) {
+                    e = LowestBit(mask);
+                    break;
+                }
+            }
+            uint64_t primaries = m_Crtcs[j].primaries & ~used_primaries;
+            if (e < 0 || primaries == 0) {
+                continue;
+            }
+
+            /* the primary plane already on the CRTC, if it's free */
+            int p = LowestBit(primaries);
+            for (uint64_t mask = primaries; mask != 0; mask &= mask - 1) {
+                if (m_Planes[m_Primaries[LowestBit(mask)]].crtc == j) {
+                    p = LowestBit(mask);
+                    break;
+                }
+            }
+
+            search->crtc[i] = j;
+            search->plane[i] = m_Primaries[p];
+            Solve(search, i + 1, lit + 1, used_crtcs | (1u << j), used_encoders | (1ull << e),
+                  used_primaries | (1ull << p));
+            if (!search->found) {
+                search->crtc[i] = -1;
+            }
+        }
+    }
+
+    if (!search->found) {
+        Solve(search, i + 1, lit, used_crtcs, used_encoders, used_primaries);
+    }
+}
+
+/*
+ * The modeset of a complete assignment, committed TEST_ONLY. The search
+ * reaches no output after the last lit one, so those are dark.
+ */
+bool OutputAssigner::Test(Search* search)
+{
+    const std::vector<OutputRequest>& outputs = *search->outputs;
+    std::vector<PipeAssignment> pipes = Pipes(*search);
+
+    m_Req->Reset();
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (search->crtc[i] < 0) {
+            continue;
+        }
+        const Connector& conn = m_Connectors[search->connectors[i]];
+        m_Req->Add(conn.props.id, conn.props.PropId(ConnectorProperty::CrtcId), m_Crtcs[search->crtc[i]].props.id);
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (search->crtc[i] < 0) {
+            continue;
+        }
+        const CrtcProperties& crtc = m_Crtcs[search->crtc[i]].props;
+        m_Req->Add(crtc.id, crtc.PropId(CrtcProperty::Active), 1);
+        m_Req->Add(crtc.id, crtc.PropId(CrtcProperty::ModeId), outputs[i].mode_blob);
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (search->crtc[i] < 0) {
+            continue;
+        }
+        const PlaneProperties& plane = m_Planes[search->plane[i]].props;
+        if (m_TestFb.fb == 0) {
+            m_Req->Add(plane.id, plane.PropId(PlaneProperty::FbId), 0);
+            m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcId), 0);
+            continue;
+        }
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::FbId), m_TestFb.fb);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcId), m_Crtcs[search->crtc[i]].props.id);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::SrcX), 0);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::SrcY), 0);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::SrcW), static_cast<uint64_t>(outputs[i].width) << 16);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::SrcH), static_cast<uint64_t>(outputs[i].height) << 16);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcX), 0);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcY), 0);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcW), outputs[i].width);
+        m_Req->Add(plane.id, plane.PropId(PlaneProperty::CrtcH), outputs[i].height);
+    }
+    if (Release(m_Req.get(), pipes) != 0) {
+        return false;
+    }
+
+    search->tests++;
+    m_Tests++;
+    return m_Req->Commit(m_Fd, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr) == 0;
+}
+
+int OutputAssigner::Release(AtomicRequest* req, const std::vector<PipeAssignment>& pipes) const
+{
+    uint32_t used_crtcs = 0;
+    std::vector<bool> lit(m_Connectors.size(), false);
+    for (const PipeAssignment& pipe : pipes) {
+        used_crtcs |= 1u << pipe.crtc_index;
+        int c = ConnectorIndex(pipe.connector);
+        if (c >= 0) {
+            lit[c] = true;
+        }
+    }
+
+    /* other connectors on our CRTCs go dark; CRTCs whose connectors all
+     * move to ours are turned off */
+    uint32_t kept_crtcs = used_crtcs;
+    uint32_t left_crtcs = 0;
+    for (size_t c = 0; c < m_Connectors.size(); c++) {
+        const Connector& conn = m_Connectors[c];
+        if (conn.crtc < 0) {
+            continue;
+        }
+        if (lit[c]) {
+            left_crtcs |= 1u << conn.crtc;
+            continue;
+        }
+        if (used_crtcs & (1u << conn.crtc)) {
+            int ret = req->Add(conn.props.id, conn.props.PropId(ConnectorProperty::CrtcId), 0);
+            if (ret != 0) {
+                return ret;
+            }
+        } else {
+            kept_crtcs |= 1u << conn.crtc;
+        }
+    }
+
+    uint32_t off_crtcs = left_crtcs & ~kept_crtcs;
+    for (size_t j = 0; j < m_Crtcs.size(); j++) {
+        if (!(off_crtcs & (1u << j))) {
+            continue;
+        }
+        const CrtcProperties& crtc = m_Crtcs[j].props;
+        int ret = req->Add(crtc.id, crtc.PropId(CrtcProperty::Active), 0);
+        if (ret == 0) {
+            ret = req->Add(crtc.id, crtc.PropId(CrtcProperty::ModeId), 0);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    /* the planes of those CRTCs, and whatever else than our primaries was
+     * left on ours, e.g. the overlays of the previous user */
+    for (const Plane& plane : m_Planes) {
+        if (plane.crtc < 0 || !((off_crtcs | used_crtcs) & (1u << plane.crtc))) {
+            continue;
+        }
+        bool ours = std::any_of(pipes.begin(), pipes.end(),
+                                [&plane](const PipeAssignment& pipe) { return pipe.plane == plane.props.id; });
+        if (ours) {
+            continue;
+        }
+        int ret = req->Add(plane.props.id, plane.props.PropId(PlaneProperty::FbId), 0);
+        if (ret == 0) {
+            ret = req->Add(plane.props.id, plane.props.PropId(PlaneProperty::CrtcId), 0);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+std::vector<PipeAssignment> OutputAssigner::Pipes(const Search& search) const
+{
+    std::vector<PipeAssignment> pipes;
+    for (size_t i = 0; i < search.crtc.size(); i++) {
+        if (search.crtc[i] < 0) {
+            continue;
+        }
+        pipes.push_back({(*search.outputs)[i].connector, m_Crtcs[search.crtc[i]].props.id,
+                         static_cast<uint32_t>(search.crtc[i]), m_Planes[search.plane[i]].props.id});
+    }
+    return pipes;
+}
+
+} // namespace DrmLab
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "allocator.h"
+#include "atomic_request.h"
+#include "drm_property.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief A connector to light, with the mode it should get.
+ */
+struct OutputRequest
+{
+    uint32_t connector;
+    uint32_t mode_blob; // MODE_ID of the CRTC
+    uint32_t width;     // hdisplay and vdisplay of the mode
+    uint32_t height;
+};
+
+/**
+ * @brief A lit connector: the CRTC driving it, and the primary plane that
+ * CRTC scans out of.
+ */
+struct PipeAssignment
+{
+    uint32_t connector;
+    uint32_t crtc;
+    uint32_t crtc_index;
+    uint32_t plane;
+};
+
+/**
+ * @brief Finds a CRTC and a primary plane for as many connectors as possible
+ * at once.
+ *
+ * Taking the first free CRTC for one connector after the other can leave a
+ * later connector without any: its encoder may only reach CRTCs the earlier
+ * ones took, although another choice would have lit all of them. The
+ * assigner works on bitsets instead: the CRTCs each encoder reaches
+ * (possible_crtcs), the encoders of each connector and the primary planes
+ * of each CRTC. A bipartite matching of connectors to CRTCs bounds how many
+ * can be lit; a search then tries the assignments of that many, the current
+ * routing first so nothing needlessly changes, and a TEST_ONLY commit
+ * verifies each one, which also catches limits the bitsets can't express
+ * (shared PLLs, bandwidth). If none passes it tries one connector less.
+ * The primary planes scan out a dumb framebuffer in those commits, since
+ * many drivers refuse an active CRTC without one.
+ *
+ * Every connector gets a CRTC of its own; nothing is cloned, so
+ * possible_clones doesn't restrict anything here. Encoders only count for
+ * feasibility (no two connectors on one encoder), the kernel picks them.
+ *
+ * Results are remembered per set of connectors, so asking again for the
+ * same heads (after a hotplug event which changed nothing relevant, say)
+ * costs no ioctls; Invalidate() forgets them.
+ */
+class OutputAssigner
+{
+public:
+    static constexpr unsigned max_tests = 64;      // TEST_ONLY commits per Assign()
+    static constexpr unsigned max_nodes = 1u << 16; // assignments tried per Assign()
+
+    /**
+     * @brief Read the encoders, CRTCs and planes of the device.
+     * @return nullptr if the resources can't be read
+     */
+    static std::unique_ptr<OutputAssigner> Create(int drm_fd, PropertyCache& cache);
+
+    ~OutputAssigner() noexcept;
+
+    OutputAssigner(const OutputAssigner&) = delete;
+    OutputAssigner& operator=(const OutputAssigner&) = delete;
+
+    /**
+     * @brief Light as many of `outputs` as possible. The modes of the
+     * connectors are taken to stay the same until Invalidate().
+     * @return the pipes of the connectors which got one, in the order of
+     * `outputs`; the others are left out
+     */
+    std::vector<PipeAssignment> Assign(const std::vector<OutputRequest>& outputs);
+
+    /**
+     * @brief Add to `req` what takes the CRTCs and connectors of `pipes`
+     * away from their current users: other connectors on those CRTCs are
+     * unrouted, and CRTCs left without a connector are turned off along with
+     * their planes. A modeset of `pipes` needs this to pass, like the
+     * TEST_ONLY commits of Assign() had it.
+     * @return 0 on success, negative errno otherwise
+     */
+    int Release(AtomicRequest* req, const std::vector<PipeAssignment>& pipes) const;
+
+    /**
+     * @brief Forget the remembered assignments.
+     */
+    void Invalidate() { m_Memo.clear(); }
+
+    /**
+     * @brief Number of TEST_ONLY commits so far.
+     */
+    uint32_t TestCount() const { return m_Tests; }
+
+private:
+    struct Encoder
+    {
+        uint32_t id;
+        uint32_t possible_crtcs;
+    };
+
+    struct Connector
+    {
+        ConnectorProperties props;
+        uint64_t encoders; // indices into m_Encoders
+        int crtc;          // index of the current CRTC, -1 if none
+    };
+
+    struct Crtc
+    {
+        CrtcProperties props;
+        uint64_t primaries; // indices into m_Primaries of its primary planes
+    };
+
+    struct Plane
+    {
+        PlaneProperties props;
+        uint32_t possible_crtcs;
+        bool primary;
+        int crtc; // index of the current CRTC, -1 if none
+    };
+
+    /* a search for `target` lit connectors among `outputs` */
+    struct Search
+    {
+        const std::vector<OutputRequest>* outputs;
+        std::vector<int> connectors; // index into m_Connectors per output, -1 if unknown
+        unsigned target;
+        std::vector<int> crtc;  // per output, -1 if unlit
+        std::vector<int> plane; // per output, index into m_Planes
+        unsigned tests;
+        unsigned nodes;
+        bool found;
+    };
+
+    OutputAssigner(int drm_fd, PropertyCache& cache);
+
+    int Load();
+    int ConnectorIndex(uint32_t id) const;
+    int TestFramebuffer(const std::vector<OutputRequest>& outputs);
+    unsigned MaxMatching(const Search& search) const;
+    void Solve(Search* search, size_t i, unsigned lit, uint32_t used_crtcs, uint64_t used_encoders,
+               uint64_t used_primaries);
+    bool Test(Search* search);
+    std::vector<PipeAssignment> Pipes(const Search& search) const;
+
+    int m_Fd;
+    PropertyCache& m_Cache;
+    std::vector<Encoder> m_Encoders;
+    std::vector<Connector> m_Connectors;
+    std::vector<Crtc> m_Crtcs;
+    std::vector<Plane> m_Planes;
+    std::vector<int> m_Primaries; // indices into m_Planes, at most 64
+    std::unique_ptr<AtomicRequest> m_Req;
+    std::unique_ptr<Allocator> m_Allocator;
+    Buffer m_TestFb = {}; // scanned out by the primary planes in TEST_ONLY commits
+    std::map<std::vector<uint32_t>, std::vector<PipeAssignment>> m_Memo; // by sorted connector ids
+    uint32_t m_Tests = 0;
+};
+
+} // namespace DrmLab
@@ -0,0 +1,648 @@
+#include "plane_offload.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <drm_fourcc.h>
+#include <set>
+#include <utility>
+#include <xf86drm.h>
+
+#include "raster.h"
+
+namespace DrmLab
+{
+
+/* by device fd and plane id */
+static std::set<std::pair<int, uint32_t>> claimed_planes;
+
+bool ClaimPlane(int drm_fd, uint32_t plane_id)
+{
+    return claimed_planes.insert({drm_fd, plane_id}).second;
+}
+
+void ReleasePlane(int drm_fd, uint32_t plane_id)
+{
+    claimed_planes.erase({drm_fd, plane_id});
+}
+
+static bool HasAlpha(uint32_t format)
+{
+    return format == DRM_FORMAT_ARGB8888 || format == DRM_FORMAT_ABGR8888 ||
+           format == DRM_FORMAT_RGBA8888 || format == DRM_FORMAT_BGRA8888;
+}
+
+static Rect Intersect(const Rect& a, const Rect& b)
+{
+    return {std::max(a.x1, b.x1), std::max(a.y1, b.y1), std::min(a.x2, b.x2), std::min(a.y2, b.y2)};
+}
+
+static uint64_t Area(const Rect& rect)
+{
+    return rect.Empty() ? 0 : static_cast<uint64_t>(rect.Width()) * static_cast<uint64_t>(rect.Height());
+}
+
+/* FNV-1a, one value at a time */
+static uint64_t Hash(uint64_t hash, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* x * y / 255, rounded */
+static uint32_t Mul255(uint32_t x, uint32_t y)
+{
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+/*
+ * Layer indices topmost first: by zpos, and by index where it's the same.
+ */
+static void SortLayers(const LayerStack& stack, size_t* order)
+{
+    for (size_t i = 0; i < stack.count; i++) {
+        order[i] = i;
+    }
+    std::sort(order, order + stack.count, [&stack](size_t a, size_t b) {
+        if (stack.layers[a].zpos != stack.layers[b].zpos) {
+            return stack.layers[a].zpos > stack.layers[b].zpos;
+        }
+        return a > b;
+    });
+}
+
+/*
+ * The general case of Composite(): every pixel of `rect` is mapped back into
+ * the source through rotation, reflection and scaling, then blended like
+ * the plane would. The kernel reflects first and rotates counter-clockwise
+ * after that (see drm_rect_rotate()), so this rotates back first.
+ */
+static void CompositeSampled(uint8_t* dst, uint32_t stride, const Rect& rect, const Layer& layer)
+{
+    const bool alpha = layer.buffer == nullptr || HasAlpha(layer.buffer->format);
+    const BlendMode blend = alpha ? layer.blend : BlendMode::None;
+    const uint32_t plane_alpha = (layer.alpha * 255u + 32767) / 65535;
+    const uint32_t rotation = layer.rotation & DRM_MODE_ROTATE_MASK;
+    const uint64_t dw = layer.dst.Width(), dh = layer.dst.Height();
+    const uint64_t sw = layer.src.Width(), sh = layer.src.Height();
+
+    for (int32_t y = rect.y1; y < rect.y2; y++) {
+        /* pixel centres, in 0..65535 across the destination */
+        uint32_t v = static_cast<uint32_t>((2 * static_cast<uint64_t>(y - layer.dst.y1) + 1) * 32768 / dh);
+        uint32_t* row = reinterpret_cast<uint32_t*>(dst + static_cast<size_t>(y) * stride);
+
+        for (int32_t x = rect.x1; x < rect.x2; x++) {
+            uint32_t u = static_cast<uint32_t>((2 * static_cast<uint64_t>(x - layer.dst.x1) + 1) * 32768 / dw);
+            uint32_t s = u, t = v;
+            if (rotation == DRM_MODE_ROTATE_90) {
+                s = 65535 - v;
+                t = u;
+            } else if (rotation == DRM_MODE_ROTATE_180) {
+                s = 65535 - u;
+                t = 65535 - v;
+            } else if (rotation == DRM_MODE_ROTATE_270) {
+                s = v;
+                t = 65535 - u;
+            }
+            if (layer.rotation & DRM_MODE_REFLECT_X) {
+                s = 65535 - s;
+            }
+            if (layer.rotation & DRM_MODE_REFLECT_Y) {
+                t = 65535 - t;
+            }
+
+            int32_t sx = layer.src.x1 + static_cast<int32_t>(s * sw >> 16);
+            int32_t sy = layer.src.y1 + static_cast<int32_t>(t * sh >> 16);
+            uint32_t p = *reinterpret_cast<const uint32_t*>(layer.pixels + static_cast<size_t>(sy) * layer.stride +
+                                                            static_cast<size_t>(sx) * 4);
+            uint32_t a = alpha ? p >> 24 : 255;
+
+            /* factor of the source colour, and its coverage */
+            uint32_t factor = plane_alpha;
+            uint32_t cover = plane_alpha;
+            if (blend == BlendMode::Premultiplied) {
+                cover = Mul255(a, plane_alpha);
+            } else if (blend == BlendMode::Coverage) {
+                cover = Mul255(a, plane_alpha);
+                factor = cover;
+            }
+
+            uint32_t d = row[x];
+            uint32_t out = std::min(255u, cover + Mul255(d >> 24, 255 - cover)) << 24;
+            for (int shift = 0; shift < 24; shift += 8) {
+                uint32_t c = Mul255((p >> shift) & 0xff, factor) + Mul255((d >> shift) & 0xff, 255 - cover);
+                out |= std::min(255u, c) << shift;
+            }
+            row[x] = out;
+        }
+    }
+}
+
+std::unique_ptr<PlaneOffload> PlaneOffload::Create(int drm_fd, PropertyCache& cache, uint32_t crtc_id,
+                                                   uint32_t crtc_index, uint32_t width, uint32_t height)
+{
+    std::unique_ptr<PlaneOffload> offload(new PlaneOffload(drm_fd, crtc_id, crtc_index, width, height));
+    int ret = offload->Load(cache);
+    if (ret != 0) {
+        fprintf(stderr, "[!] cannot read the planes of CRTC %u: %s\n", crtc_id, strerror(-ret));
+        return nullptr;
+    }
+    if (offload->m_Planes.empty()) {
+        return nullptr;
+    }
+    return offload;
+}
+
+PlaneOffload::PlaneOffload(int drm_fd, uint32_t crtc_id, uint32_t crtc_index, uint32_t width, uint32_t height)
+    : m_Fd(drm_fd)
+    , m_CrtcId(crtc_id)
+    , m_CrtcIndex(crtc_index)
+    , m_Width(width)
+    , m_Height(height)
+    , m_TestReq(AtomicRequest::Create(AtomicBackendFromEnv()))
+{}
+
+PlaneOffload::~PlaneOffload() noexcept
+{
+    for (const Plane& plane : m_Planes) {
+        ReleasePlane(m_Fd, plane.props.id);
+    }
+}
+
+/*
+ * The overlay and cursor planes of the CRTC, with what they can do. Without
+ * zpos, planes are taken to stack in the order the kernel lists them, above
+ * the primary plane, with cursors on top.
+ */
+int PlaneOffload::Load(PropertyCache& cache)
+{
+    if (!m_TestReq->Valid()) {
+        return -ENOMEM;
+    }
+
+    drmModePlaneRes* res = drmModeGetPlaneResources(m_Fd);
+    if (res == nullptr) {
+        return -errno;
+    }
+
+    bool primary_seen = false;
+    for (uint32_t i = 0; i < res->count_planes && m_Planes.size() < max_planes; i++) {
+        drmModePlane* p = drmModeGetPlane(m_Fd, res->planes[i]);
+        if (p == nullptr) {
+            continue;
+        }
+        if (!(p->possible_crtcs & (1u << m_CrtcIndex))) {
+            drmModeFreePlane(p);
+            continue;
+        }
+
+        Plane plane = {};
+        plane.props.id = p->plane_id;
+        plane.formats.assign(p->formats, p->formats + p->count_formats);
+        drmModeFreePlane(p);
+
+        uint64_t type = 0, zpos = 0;
+        ObjectSnapshot props(cache, plane.props.id, DRM_MODE_OBJECT_PLANE);
+        props.Find("type", &type);
+        bool has_zpos = props.Find("zpos", &zpos);
+
+        /* the primary plane of the CRTC is one of those, whichever it is
+         * our layers must be above it */
+        if (type == DRM_PLANE_TYPE_PRIMARY) {
+            int64_t value = has_zpos ? static_cast<int64_t>(zpos) : 0;
+            m_PrimaryZpos = primary_seen ? std::max(m_PrimaryZpos, value) : value;
+            primary_seen = true;
+            continue;
+        }
+        if (claimed_planes.count({m_Fd, plane.props.id}) || ResolveProperties(props, &plane.props) != 0) {
+            continue;
+        }
+        plane.cursor = type == DRM_PLANE_TYPE_CURSOR;
+
+        plane.zpos_fixed = true;
+        plane.zpos_min = plane.cursor ? INT32_MAX : static_cast<int64_t>(i) + 1;
+        if (plane.props.Has(PlaneProperty::Zpos)) {
+            const drmModePropertyRes* info = cache.GetFull(plane.props.PropId(PlaneProperty::Zpos));
+            plane.zpos_min = static_cast<int64_t>(zpos);
+            if (info != nullptr && !(info->flags & DRM_MODE_PROP_IMMUTABLE) && info->count_values >= 2) {
+                plane.zpos_fixed = false;
+                plane.zpos_min = static_cast<int64_t>(info->values[0]);
+            }
+            plane.zpos_max = plane.zpos_fixed ? plane.zpos_min : static_cast<int64_t>(info->values[1]);
+        } else {
+            plane.zpos_max = plane.zpos_min;
+        }
+
+        plane.rotations = DRM_MODE_ROTATE_0;
+        if (plane.props.Has(PlaneProperty::Rotation)) {
+            const drmModePropertyRes* info = cache.GetFull(plane.props.PropId(PlaneProperty::Rotation));
+            for (int e = 0; info != nullptr && e < info->count_enums; e++) {
+                plane.rotations |= 1u << info->enums[e].value;
+            }
+        }
+
+        plane.blends = 1u << static_cast<uint32_t>(BlendMode::Premultiplied);
+        if (plane.props.Has(PlaneProperty::PixelBlendMode)) {
+            static const char* const names[] = {"None", "Pre-multiplied", "Coverage"};
+            const drmModePropertyRes* info = cache.GetFull(plane.props.PropId(PlaneProperty::PixelBlendMode));
+            plane.blends = 0;
+            for (int e = 0; info != nullptr && e < info->count_enums; e++) {
+                for (uint32_t b = 0; b < 3; b++) {
+                    if (strcmp(info->enums[e].name, names[b]) == 0) {
+                        plane.blends |= 1u << b;
+                        plane.blend_values[b] = info->enums[e].value;
+                    }
+                }
+            }
+        }
+
+        m_Planes.push_back(plane);
+    }
+    drmModeFreePlaneResources(res);
+
+    std::stable_sort(m_Planes.begin(), m_Planes.end(), [](const Plane& a, const Plane& b) {
+        if (a.cursor != b.cursor) {
+            return a.cursor;
+        }
+        return a.zpos_max > b.zpos_max;
+    });
+    for (const Plane& plane : m_Planes) {
+        ClaimPlane(m_Fd, plane.props.id);
+    }
+    m_States.assign(m_Planes.size(), ObjectState<PlaneProperty>{});
+    m_Pending.assign(m_Planes.size(), 0);
+    return 0;
+}
+
+/*
+ * Everything about the stack which decides whether an assignment passes,
+ * except where the layers are: moving a plane is taken to never fail, as
+ * long as it stays on, or off, the CRTC and the overlaps stay the same.
+ * Only reads the stack and the mode, so both sides may call it.
+ */
+uint64_t PlaneOffload::ShapeKey(const LayerStack& stack) const
+{
+    const Rect crtc = {0, 0, static_cast<int32_t>(m_Width), static_cast<int32_t>(m_Height)};
+    size_t order[LayerStack::max_layers];
+    SortLayers(stack, order);
+
+    uint64_t hash = Hash(14695981039346656037ull, stack.count);
+    uint64_t overlaps = 0;
+    for (size_t d = 0; d < stack.count; d++) {
+        const Layer& layer = stack.layers[order[d]];
+        Rect visible = Intersect(layer.dst, crtc);
+        uint64_t area = Area(visible);
+
+        hash = Hash(hash, order[d]);
+        hash = Hash(hash, layer.buffer != nullptr ? layer.buffer->format : 0);
+        hash = Hash(hash, layer.buffer != nullptr ? layer.buffer->modifier : 0);
+        hash = Hash(hash, (static_cast<uint64_t>(layer.src.Width()) << 32) | static_cast<uint32_t>(layer.src.Height()));
+        hash = Hash(hash, (static_cast<uint64_t>(layer.dst.Width()) << 32) | static_cast<uint32_t>(layer.dst.Height()));
+        hash = Hash(hash, (static_cast<uint64_t>(layer.alpha) << 32) | static_cast<uint32_t>(layer.blend));
+        hash = Hash(hash, layer.rotation);
+        /* off, partly on or all on the CRTC */
+        hash = Hash(hash, area == 0 ? 0 : area == Area(layer.dst) ? 2 : 1);
+
+        for (size_t e = 0; e < d; e++) {
+            if (!Intersect(visible, Intersect(stack.layers[order[e]].dst, crtc)).Empty()) {
+                overlaps |= 1ull << (d * LayerStack::max_layers + e);
+            }
+        }
+    }
+    hash = Hash(hash, overlaps);
+    return hash != 0 ? hash : 1;
+}
+
+bool PlaneOffload::Fits(const Plane& plane, const Layer& layer) const
+{
+    if (layer.buffer == nullptr || layer.buffer->fb == 0 || layer.src.Empty() || layer.dst.Empty()) {
+        return false;
+    }
+    if (std::find(plane.formats.begin(), plane.formats.end(), layer.buffer->format) == plane.formats.end()) {
+        return false;
+    }
+    if ((layer.rotation & ~plane.rotations) != 0) {
+        return false;
+    }
+    if (layer.alpha != 0xffff && !plane.props.Has(PlaneProperty::Alpha)) {
+        return false;
+    }
+    if (HasAlpha(layer.buffer->format) && !(plane.blends & (1u << static_cast<uint32_t>(layer.blend)))) {
+        return false;
+    }
+    if (plane.cursor) {
+        /* cursors don't scale */
+        bool swap = layer.rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+        int32_t w = swap ? layer.src.Height() : layer.src.Width();
+        int32_t h = swap ? layer.src.Width() : layer.src.Height();
+        if (w != layer.dst.Width() || h != layer.dst.Height()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The zpos `plane` gets below a plane at `ceiling`: a fixed one keeps its
+ * own, others take the highest value below the ceiling. Either must be above
+ * the primary plane.
+ */
+bool PlaneOffload::NextZpos(const Plane& plane, int64_t ceiling, int64_t* zpos) const
+{
+    if (plane.zpos_fixed) {
+        *zpos = plane.zpos_min;
+        return *zpos < ceiling && *zpos > m_PrimaryZpos;
+    }
+    *zpos = std::min(ceiling - 1, plane.zpos_max);
+    return *zpos >= plane.zpos_min && *zpos > m_PrimaryZpos;
+}
+
+/*
+ * The zpos of every plane in an assignment, going down from the topmost
+ * layer; what Solve() checked when it made it.
+ */
+void PlaneOffload::PlaneZpos(const LayerStack& stack, const uint8_t* planes, int64_t* zpos) const
+{
+    size_t order[LayerStack::max_layers];
+    SortLayers(stack, order);
+
+    int64_t ceiling = INT64_MAX;
+    for (size_t d = 0; d < stack.count; d++) {
+        int p = planes[order[d]] - 1;
+        if (p >= 0) {
+            NextZpos(m_Planes[p], ceiling, &zpos[p]);
+            ceiling = zpos[p];
+        }
+    }
+}
+
+unsigned PlaneOffload::Lookup(LayerStack* stack)
+{
+    std::fill(stack->planes, stack->planes + LayerStack::max_layers, 0);
+    stack->uncached = false;
+    if (stack->count == 0 || m_Planes.empty()) {
+        return 0;
+    }
+
+    uint64_t key = ShapeKey(*stack);
+    std::lock_guard<std::mutex> lock(m_CacheLock);
+    auto it = m_Cache.find(key);
+    if (it == m_Cache.end()) {
+        stack->uncached = true;
+        return 0;
+    }
+    m_Hits++;
+
+    unsigned offloaded = 0;
+    for (size_t i = 0; i < stack->count; i++) {
+        stack->planes[i] = it->second[i];
+        offloaded += it->second[i] != 0;
+    }
+    return offloaded;
+}
+
+void PlaneOffload::Assign(const LayerStack& stack)
+{
+    if (stack.count == 0 || m_Planes.empty()) {
+        return;
+    }
+
+    /* another frame of the same shape may have been searched already */
+    uint64_t key = ShapeKey(stack);
+    {
+        std::lock_guard<std::mutex> lock(m_CacheLock);
+        if (m_Cache.count(key) != 0) {
+            return;
+        }
+    }
+
+    const Rect crtc = {0, 0, static_cast<int32_t>(m_Width), static_cast<int32_t>(m_Height)};
+    Search search = {};
+    search.stack = &stack;
+    SortLayers(stack, search.order);
+    for (size_t d = 0; d < stack.count; d++) {
+        search.area[d] = Area(Intersect(stack.layers[search.order[d]].dst, crtc));
+    }
+    for (size_t d = stack.count; d-- > 0;) {
+        search.below[d] = search.below[d + 1] + search.area[d];
+    }
+
+    Solve(&search, 0, 0, INT64_MAX, 0);
+
+    std::lock_guard<std::mutex> lock(m_CacheLock);
+    if (m_Cache.size() >= max_cached) {
+        m_Cache.clear();
+    }
+    m_Cache.emplace(key, std::vector<uint8_t>(search.best, search.best + stack.count));
+}
+
+/*
+ * Depth first over the layers, topmost first: put the layer at `depth` on
+ * each free plane it fits, then composite it. A layer under a composited one
+ * can't go on a plane where they overlap, and none that's off the CRTC
+ * needs one. Every plane taken is checked with a TEST_ONLY commit right
+ * away, so a failing layer prunes everything below it; assignments which
+ * can't beat the best one's covered pixels any more are cut off too.
+ */
+void PlaneOffload::Solve(Search* search, size_t depth, uint16_t used, int64_t ceiling, uint64_t area)
+{
+    const LayerStack& stack = *search->stack;
+
+    if (area > search->best_area) {
+        search->best_area = area;
+        memcpy(search->best, search->planes, sizeof(search->best));
+    }
+    if (depth == stack.count || area + search->below[depth] <= search->best_area ||
+        search->tests >= max_tests) {
+        return;
+    }
+
+    const Rect crtc = {0, 0, static_cast<int32_t>(m_Width), static_cast<int32_t>(m_Height)};
+    size_t i = search->order[depth];
+    const Layer& layer = stack.layers[i];
+    Rect visible = Intersect(layer.dst, crtc);
+
+    bool covered = search->area[depth] == 0;
+    for (size_t d = 0; d < depth && !covered; d++) {
+        size_t j = search->order[d];
+        covered = search->planes[j] == 0 && !Intersect(visible, stack.layers[j].dst).Empty();
+    }
+
+    for (size_t p = 0; p < m_Planes.size() && !covered; p++) {
+        if (area + search->below[depth] <= search->best_area) {
+            return;
+        }
+        int64_t zpos = 0;
+        if ((used & (1u << p)) || !Fits(m_Planes[p], layer) || !NextZpos(m_Planes[p], ceiling, &zpos)) {
+            continue;
+        }
+
+        search->planes[i] = static_cast<uint8_t>(p + 1);
+        if (Test(search)) {
+            Solve(search, depth + 1, used | (1u << p), zpos, area + search->area[depth]);
+        }
+        search->planes[i] = 0;
+        if (search->tests >= max_tests) {
+            return;
+        }
+    }
+
+    Solve(search, depth + 1, used, ceiling, area);
+}
+
+/*
+ * The planes of a partial assignment, committed TEST_ONLY: layers not yet
+ * decided are off, and all of our planes are in the request, so nothing
+ * depends on what the last commit left on them.
+ */
+bool PlaneOffload::Test(Search* search)
+{
+    const LayerStack& stack = *search->stack;
+    int64_t zpos[max_planes] = {};
+    PlaneZpos(stack, search->planes, zpos);
+
+    m_TestReq->Reset();
+    int ret = 0;
+    for (size_t p = 0; p < m_Planes.size(); p++) {
+        const Layer* layer = nullptr;
+        for (size_t i = 0; i < stack.count; i++) {
+            if (search->planes[i] == p + 1) {
+                layer = &stack.layers[i];
+            }
+        }
+
+        ObjectState<PlaneProperty> state = {};
+        SetState(&state, m_Planes[p], layer, zpos[p]);
+        state.ForEachDirty(state.DirtyMask(), [&](PlaneProperty prop, uint64_t value) {
+            ret |= AtomicAddProperty(m_TestReq.get(), m_Planes[p].props, prop, value);
+        });
+    }
+    if (ret < 0) {
+        return false;
+    }
+
+    search->tests++;
+    m_Tests++;
+    return m_TestReq->Commit(m_Fd, DRM_MODE_ATOMIC_TEST_ONLY, nullptr) == 0;
+}
+
+void PlaneOffload::SetState(ObjectState<PlaneProperty>* state, const Plane& plane, const Layer* layer,
+                            int64_t zpos) const
+{
+    if (layer == nullptr) {
+        state->Set(PlaneProperty::FbId, 0);
+        state->Set(PlaneProperty::CrtcId, 0);
+        return;
+    }
+
+    state->Set(PlaneProperty::FbId, layer->buffer->fb);
+    state->Set(PlaneProperty::CrtcId, m_CrtcId);
+    state->Set(PlaneProperty::SrcX, static_cast<uint64_t>(layer->src.x1) << 16);
+    state->Set(PlaneProperty::SrcY, static_cast<uint64_t>(layer->src.y1) << 16);
+    state->Set(PlaneProperty::SrcW, static_cast<uint64_t>(layer->src.Width()) << 16);
+    state->Set(PlaneProperty::SrcH, static_cast<uint64_t>(layer->src.Height()) << 16);
+    /* CRTC_X/Y are signed, a layer may hang off the top left */
+    state->Set(PlaneProperty::CrtcX, static_cast<uint64_t>(static_cast<int64_t>(layer->dst.x1)));
+    state->Set(PlaneProperty::CrtcY, static_cast<uint64_t>(static_cast<int64_t>(layer->dst.y1)));
+    state->Set(PlaneProperty::CrtcW, layer->dst.Width());
+    state->Set(PlaneProperty::CrtcH, layer->dst.Height());
+    if (!plane.zpos_fixed) {
+        state->Set(PlaneProperty::Zpos, static_cast<uint64_t>(zpos));
+    }
+    if (plane.props.Has(PlaneProperty::Alpha)) {
+        state->Set(PlaneProperty::Alpha, layer->alpha);
+    }
+    if (plane.props.Has(PlaneProperty::PixelBlendMode)) {
+        state->Set(PlaneProperty::PixelBlendMode, plane.blend_values[static_cast<uint32_t>(layer->blend)]);
+    }
+    if (plane.props.Has(PlaneProperty::Rotation)) {
+        state->Set(PlaneProperty::Rotation, layer->rotation != 0 ? layer->rotation : DRM_MODE_ROTATE_0);
+    }
+}
+
+void PlaneOffload::Composite(uint8_t* dst, uint32_t stride, const Rect& clip, const LayerStack& stack)
+{
+    size_t order[LayerStack::max_layers];
+    SortLayers(stack, order);
+
+    /* bottom up */
+    for (size_t d = stack.count; d-- > 0;) {
+        const Layer& layer = stack.layers[order[d]];
+        Rect rect = Intersect(layer.dst, clip);
+        if (!stack.Composited(order[d]) || layer.pixels == nullptr || layer.src.Empty() || rect.Empty()) {
+            continue;
+        }
+
+        bool plain = (layer.rotation == 0 || layer.rotation == DRM_MODE_ROTATE_0) && layer.alpha == 0xffff &&
+                     layer.src.Width() == layer.dst.Width() && layer.src.Height() == layer.dst.Height();
+        bool opaque = layer.blend == BlendMode::None ||
+                      (layer.buffer != nullptr && !HasAlpha(layer.buffer->format));
+        Rect src = {layer.src.x1 + rect.x1 - layer.dst.x1, layer.src.y1 + rect.y1 - layer.dst.y1,
+                    layer.src.x1 + rect.x2 - layer.dst.x1, layer.src.y1 + rect.y2 - layer.dst.y1};
+
+        if (plain && opaque) {
+            Blit(dst, stride, rect.x1, rect.y1, layer.pixels, layer.stride, src);
+        } else if (plain && layer.blend == BlendMode::Premultiplied) {
+            BlendOver(dst, stride, rect.x1, rect.y1, layer.pixels, layer.stride, src);
+        } else {
+            CompositeSampled(dst, stride, rect, layer);
+        }
+    }
+}
+
+int PlaneOffload::Apply(AtomicRequest* req, const LayerStack& stack)
+{
+    int64_t zpos[max_planes] = {};
+    PlaneZpos(stack, stack.planes, zpos);
+
+    int ret = 0;
+    for (size_t p = 0; p < m_Planes.size(); p++) {
+        const Layer* layer = nullptr;
+        for (size_t i = 0; i < stack.count; i++) {
+            if (stack.planes[i] == p + 1) {
+                layer = &stack.layers[i];
+            }
+        }
+
+        SetState(&m_States[p], m_Planes[p], layer, zpos[p]);
+        m_Pending[p] = m_States[p].DirtyMask();
+        m_States[p].ForEachDirty(m_Pending[p], [&](PlaneProperty prop, uint64_t value) {
+            ret |= AtomicAddProperty(req, m_Planes[p].props, prop, value);
+        });
+    }
+    return ret < 0 ? -ENOMEM : 0;
+}
+
+void PlaneOffload::Committed()
+{
+    for (size_t p = 0; p < m_Planes.size(); p++) {
+        m_States[p].MarkCommitted(m_Pending[p]);
+        m_Pending[p] = 0;
+    }
+}
+
+bool PlaneOffload::Rejected(LayerStack* stack)
+{
+    bool offloaded = false;
+    for (size_t i = 0; i < stack->count; i++) {
+        offloaded |= stack->planes[i] != 0;
+    }
+    if (!offloaded) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_CacheLock);
+        m_Cache.erase(ShapeKey(*stack));
+    }
+    std::fill(stack->planes, stack->planes + LayerStack::max_layers, 0);
+    return true;
+}
+
+} // namespace DrmLab
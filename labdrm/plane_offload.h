@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "allocator.h"
+#include "atomic_request.h"
+#include "atomic_state.h"
+#include "damage.h"
+#include "drm_property.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief How a layer's pixels are blended, see the "pixel blend mode" plane
+ * property.
+ */
+enum class BlendMode : uint32_t
+{
+    None,          // pixel alpha ignored
+    Premultiplied, // the kernel's default
+    Coverage,      // straight alpha
+};
+
+/**
+ * @brief One image on top of the primary plane.
+ */
+struct Layer
+{
+    const Buffer* buffer;  // with a framebuffer, scanned out if the layer gets a plane
+    const uint8_t* pixels; // CPU copy of the buffer, read when the layer is composited
+    uint32_t stride;       // of `pixels`
+
+    Rect src;          // part of the buffer, in pixels
+    Rect dst;          // where it goes on the CRTC, scaled to fit
+    int32_t zpos;      // stacking order, higher on top; ties go by index
+    uint16_t alpha;    // plane alpha, 0xffff opaque
+    BlendMode blend;
+    uint32_t rotation; // DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_*
+};
+
+/**
+ * @brief The layers of one frame, and where each one goes.
+ *
+ * A plain aggregate, so a frame can carry it through the examples' rings.
+ */
+struct LayerStack
+{
+    static constexpr size_t max_layers = 8;
+
+    Layer layers[max_layers];
+    size_t count;
+
+    /* set by PlaneOffload::Lookup(): the hardware plane of each layer
+     * (index + 1), or 0 if the CPU composites it into the primary plane */
+    uint8_t planes[max_layers];
+    /* ... and whether no assignment was cached for the shape yet, so that
+     * all layers are composited until PlaneOffload::Assign() found one */
+    bool uncached;
+
+    bool Composited(size_t i) const { return planes[i] == 0; }
+};
+
+/**
+ * @brief Take a plane for one user, so no PlaneOffload or HardwareCursor
+ * on the same device puts anything else on it.
+ * @return false if it is taken already
+ */
+bool ClaimPlane(int drm_fd, uint32_t plane_id);
+void ReleasePlane(int drm_fd, uint32_t plane_id);
+
+/**
+ * @brief Puts layers on the overlay and cursor planes of a CRTC, so the
+ * display hardware blends them instead of the CPU.
+ *
+ * Every layer on a plane is one less to composite into the primary
+ * framebuffer, and moving it is a change of CRTC_X/CRTC_Y instead of a
+ * repaint of where it was and where it is. Which layers fit is up to the
+ * driver, so Assign() searches assignments of layers to planes, most
+ * covered pixels first, and checks them with TEST_ONLY commits. Planes take
+ * the layers in stacking order: with zpos the planes get the values it
+ * takes, fixed (immutable) zpos values and planes without zpos keep their
+ * order. A layer goes on a plane only if no composited layer above it
+ * overlaps it, since those end up below every plane.
+ *
+ * Assignments are cached by the shape of the layer stack: formats, sizes,
+ * alpha, blend modes, rotations, stacking order and which layers overlap,
+ * but not positions. So a layer moving around reuses the assignment until it
+ * starts or stops overlapping another one, or crosses the edge of the CRTC.
+ *
+ * Lookup() and Composite() run on the render side, Assign(), Apply(),
+ * Committed() and Rejected() on the commit side, which may be another
+ * thread. Only the commit side sends commits, TEST_ONLY ones included: a
+ * stack with a new shape is composited by the render side and searched for
+ * by the commit side, for the frames after it. The cache between the two is
+ * locked.
+ */
+class PlaneOffload
+{
+public:
+    static constexpr unsigned max_planes = 16;
+    static constexpr unsigned max_tests = 16;   // TEST_ONLY commits per Assign()
+    static constexpr size_t max_cached = 256;   // assignments remembered
+
+    /**
+     * @brief Take the overlay and cursor planes of a CRTC which nothing
+     * else claimed, see ClaimPlane().
+     * @param width, height size of the mode
+     * @return nullptr if there are no such planes
+     */
+    static std::unique_ptr<PlaneOffload> Create(int drm_fd, PropertyCache& cache, uint32_t crtc_id,
+                                                uint32_t crtc_index, uint32_t width, uint32_t height);
+
+    ~PlaneOffload() noexcept;
+
+    PlaneOffload(const PlaneOffload&) = delete;
+    PlaneOffload& operator=(const PlaneOffload&) = delete;
+
+    size_t PlaneCount() const { return m_Planes.size(); }
+
+    /**
+     * @brief Fill `stack->planes` from the assignment cached for its shape.
+     * Without one, all layers are composited and `stack->uncached` is set.
+     * @return the number of layers on planes
+     */
+    unsigned Lookup(LayerStack* stack);
+
+    /**
+     * @brief Search which layers of an `uncached` stack go on planes, with
+     * TEST_ONLY commits, and cache it for the following frames. The CRTC
+     * must be active.
+     */
+    void Assign(const LayerStack& stack);
+
+    /**
+     * @brief Blend the composited layers of `stack` into the primary
+     * framebuffer, within `clip`, which must lie inside it. Layers and
+     * framebuffer are 32-bit RGB; scaled layers are sampled
+     * nearest-neighbour, so they look blockier than on a plane.
+     */
+    static void Composite(uint8_t* dst, uint32_t stride, const Rect& clip, const LayerStack& stack);
+
+    /**
+     * @brief Add the plane state of `stack` to a commit; only what changed
+     * since the last commit is added.
+     * @return 0 on success, negative errno otherwise
+     */
+    int Apply(AtomicRequest* req, const LayerStack& stack);
+
+    /**
+     * @brief The commit with the last Apply() succeeded.
+     */
+    void Committed();
+
+    /**
+     * @brief The commit with the last Apply() failed with EINVAL: forget the
+     * assignment and take the layers of `stack` off the planes. They're
+     * missing from the frame then, which was painted without them.
+     * @return false if `stack` had nothing on planes
+     */
+    bool Rejected(LayerStack* stack);
+
+    /**
+     * @brief Number of TEST_ONLY commits and cache hits so far.
+     */
+    uint32_t TestCount() const { return m_Tests; }
+    uint32_t CacheHits() const { return m_Hits; }
+
+private:
+    struct Plane
+    {
+        PlaneProperties props;
+        bool cursor;
+        std::vector<uint32_t> formats;
+        bool zpos_fixed;  // immutable, or no zpos property
+        int64_t zpos_min; // the value if fixed
+        int64_t zpos_max;
+        uint32_t rotations;       // supported DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_*
+        uint32_t blends;          // supported BlendModes, as bits
+        uint64_t blend_values[3]; // property values by BlendMode
+    };
+
+    /* the branch and bound of Assign() */
+    struct Search
+    {
+        const LayerStack* stack;
+        size_t order[LayerStack::max_layers]; // layer indices, topmost first
+        uint64_t area[LayerStack::max_layers]; // of each layer in `order`
+        uint64_t below[LayerStack::max_layers + 1]; // area of the layers from there on
+        uint8_t planes[LayerStack::max_layers];    // the current candidate, by layer
+        uint8_t best[LayerStack::max_layers];
+        uint64_t best_area;
+        unsigned tests;
+    };
+
+    PlaneOffload(int drm_fd, uint32_t crtc_id, uint32_t crtc_index, uint32_t width, uint32_t height);
+
+    int Load(PropertyCache& cache);
+    uint64_t ShapeKey(const LayerStack& stack) const;
+    bool Fits(const Plane& plane, const Layer& layer) const;
+    bool NextZpos(const Plane& plane, int64_t ceiling, int64_t* zpos) const;
+    void PlaneZpos(const LayerStack& stack, const uint8_t* planes, int64_t* zpos) const;
+    void Solve(Search* search, size_t depth, uint16_t used, int64_t ceiling, uint64_t area);
+    bool Test(Search* search);
+    void SetState(ObjectState<PlaneProperty>* state, const Plane& plane, const Layer* layer, int64_t zpos) const;
+
+    int m_Fd;
+    uint32_t m_CrtcId;
+    uint32_t m_CrtcIndex;
+    uint32_t m_Width;
+    uint32_t m_Height;
+    int64_t m_PrimaryZpos = 0;
+    std::vector<Plane> m_Planes; // topmost first
+
+    /* both sides */
+    std::mutex m_CacheLock;
+    std::unordered_map<uint64_t, std::vector<uint8_t>> m_Cache; // planes by ShapeKey()
+
+    /* render side */
+    uint32_t m_Hits = 0;
+
+    /* commit side */
+    std::unique_ptr<AtomicRequest> m_TestReq;
+    uint32_t m_Tests = 0;
+    std::vector<ObjectState<PlaneProperty>> m_States;
+    std::vector<uint32_t> m_Pending; // dirty masks of the last Apply()
+};
+
+} // namespace DrmLab
@@ -0,0 +1,262 @@
+#include "raster.h"
+#include "raster_kernels.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef LABDRM_RASTER_X86
+#include <cpuid.h>
+#endif
+
+namespace DrmLab
+{
+
+static void FillScalar(uint32_t* dst, uint32_t color, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void CopyScalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static void BlendOverScalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t s = src[i];
+        if ((s >> 24) == 0xff) {
+            dst[i] = s;
+        } else if (s != 0) {
+            dst[i] = RasterBlendPixel(dst[i], s);
+        }
+    }
+}
+
+static void StreamCopyScalar(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+const RasterKernels raster_kernels_scalar = {
+    FillScalar,
+    CopyScalar,
+    BlendOverScalar,
+    StreamCopyScalar,
+};
+
+#ifdef LABDRM_RASTER_X86
+static uint64_t ReadXcr0()
+{
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+}
+#endif
+
+RasterIsa RasterDetectIsa()
+{
+#ifdef LABDRM_RASTER_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_SSE2)) {
+        return RasterIsa::Scalar;
+    }
+
+    /* AVX needs the OS to save the YMM registers too (XCR0 bits 1 and 2) */
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return RasterIsa::Sse2;
+    }
+    uint64_t xcr0 = ReadXcr0();
+    if ((xcr0 & 0x06) != 0x06) {
+        return RasterIsa::Sse2;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_AVX2)) {
+        return RasterIsa::Sse2;
+    }
+
+    /* ... and AVX-512 the opmask and upper ZMM registers (bits 5 to 7) */
+    if ((xcr0 & 0xe0) == 0xe0 && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW)) {
+        return RasterIsa::Avx512;
+    }
+    return RasterIsa::Avx2;
+#else
+    return RasterIsa::Scalar;
+#endif
+}
+
+const char* RasterIsaName(RasterIsa isa)
+{
+    switch (isa) {
+    case RasterIsa::Sse2:
+        return "sse2";
+    case RasterIsa::Avx2:
+        return "avx2";
+    case RasterIsa::Avx512:
+        return "avx512";
+    case RasterIsa::Scalar:
+    default:
+        return "scalar";
+    }
+}
+
+static const RasterKernels* KernelsFor(RasterIsa isa)
+{
+    switch (isa) {
+#ifdef LABDRM_RASTER_X86
+    case RasterIsa::Sse2:
+        return &raster_kernels_sse2;
+    case RasterIsa::Avx2:
+        return &raster_kernels_avx2;
+    case RasterIsa::Avx512:
+        return &raster_kernels_avx512;
+#endif
+    case RasterIsa::Scalar:
+    default:
+        return &raster_kernels_scalar;
+    }
+}
+
+static RasterIsa s_DetectedIsa;
+static std::atomic<RasterIsa> s_ActiveIsa { RasterIsa::Scalar };
+
+static void RasterInit()
+{
+    /* runs once, on the first raster call of the process */
+    static const bool initialized = [] {
+        s_DetectedIsa = RasterDetectIsa();
+
+        RasterIsa isa = s_DetectedIsa;
+        const char* s = getenv("LABDRM_RASTER");
+        if (s != nullptr) {
+            for (int i = 0; i <= static_cast<int>(RasterIsa::Avx512); i++) {
+                RasterIsa candidate = static_cast<RasterIsa>(i);
+                if (strcmp(s, RasterIsaName(candidate)) == 0) {
+                    if (candidate <= s_DetectedIsa) {
+                        isa = candidate;
+                    } else {
+                        fprintf(stderr, "[!] LABDRM_RASTER=%s is not supported by this CPU, using %s.\n",
+                                s, RasterIsaName(isa));
+                    }
+                }
+            }
+        }
+        s_ActiveIsa.store(isa, std::memory_order_relaxed);
+        return true;
+    }();
+    (void)initialized;
+}
+
+RasterIsa RasterActiveIsa()
+{
+    RasterInit();
+    return s_ActiveIsa.load(std::memory_order_relaxed);
+}
+
+bool RasterSetIsa(RasterIsa isa)
+{
+    RasterInit();
+    if (isa > s_DetectedIsa) {
+        return false;
+    }
+    s_ActiveIsa.store(isa, std::memory_order_relaxed);
+    return true;
+}
+
+static const RasterKernels& Kernels()
+{
+    return *KernelsFor(RasterActiveIsa());
+}
+
+static uint32_t* PixelAt(uint8_t* base, uint32_t stride, int32_t x, int32_t y)
+{
+    return reinterpret_cast<uint32_t*>(base + static_cast<size_t>(y) * stride + static_cast<size_t>(x) * 4);
+}
+
+static const uint32_t* PixelAt(const uint8_t* base, uint32_t stride, int32_t x, int32_t y)
+{
+    return reinterpret_cast<const uint32_t*>(base + static_cast<size_t>(y) * stride + static_cast<size_t>(x) * 4);
+}
+
+void FillSpan(uint32_t* dst, uint32_t color, size_t count)
+{
+    Kernels().fill(dst, color, count);
+}
+
+void FillRect(uint8_t* dst, uint32_t stride, const Rect& rect, uint32_t color)
+{
+    if (rect.Empty()) {
+        return;
+    }
+
+    const RasterKernels& k = Kernels();
+    size_t width = rect.Width();
+    uint32_t* d = PixelAt(dst, stride, rect.x1, rect.y1);
+
+    /* whole rows without padding: one long span, no per-row overhead */
+    if (stride == width * 4) {
+        k.fill(d, color, width * rect.Height());
+        return;
+    }
+
+    for (int32_t y = rect.y1; y < rect.y2; y++) {
+        k.fill(d, color, width);
+        d = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(d) + stride);
+    }
+}
+
+void Fill(uint8_t* dst, uint32_t stride, uint32_t width, uint32_t height, uint32_t color)
+{
+    FillRect(dst, stride, Rect { 0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height) }, color);
+}
+
+/*
+ * Run a two-buffer row kernel over a rectangle, see FillRect().
+ */
+static void ForEachRow(void (*kernel)(uint32_t*, const uint32_t*, size_t),
+                       uint8_t* dst, uint32_t dst_stride, int32_t dst_x, int32_t dst_y,
+                       const uint8_t* src, uint32_t src_stride, const Rect& src_rect)
+{
+    if (src_rect.Empty()) {
+        return;
+    }
+
+    size_t width = src_rect.Width();
+    uint32_t* d = PixelAt(dst, dst_stride, dst_x, dst_y);
+    const uint32_t* s = PixelAt(src, src_stride, src_rect.x1, src_rect.y1);
+
+    if (dst_stride == width * 4 && src_stride == width * 4) {
+        kernel(d, s, width * src_rect.Height());
+        return;
+    }
+
+    for (int32_t y = src_rect.y1; y < src_rect.y2; y++) {
+        kernel(d, s, width);
+        d = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(d) + dst_stride);
+        s = reinterpret_cast<const uint32_t*>(reinterpret_cast<const uint8_t*>(s) + src_stride);
+    }
+}
+
+void Blit(uint8_t* dst, uint32_t dst_stride, int32_t dst_x, int32_t dst_y,
+          const uint8_t* src, uint32_t src_stride, const Rect& src_rect)
+{
+    ForEachRow(Kernels().copy, dst, dst_stride, dst_x, dst_y, src, src_stride, src_rect);
+}
+
+void BlendOver(uint8_t* dst, uint32_t dst_stride, int32_t dst_x, int32_t dst_y,
+               const uint8_t* src, uint32_t src_stride, const Rect& src_rect)
+{
+    ForEachRow(Kernels().blend_over, dst, dst_stride, dst_x, dst_y, src, src_stride, src_rect);
+}
+
+void StreamCopy(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    Kernels().stream_copy(dst, src, size);
+}
+
+} // namespace DrmLab
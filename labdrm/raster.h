@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "damage.h"
+
+namespace DrmLab
+{
+
+/*
+ * 2D raster operations on 32 bpp buffers (XRGB8888 / ARGB8888), for the CPU
+ * paint paths of the examples.
+ *
+ * Every operation is split into rows, and each row goes to a kernel picked
+ * once at runtime from what the CPU supports: scalar, SSE2, AVX2 or AVX-512.
+ * The kernels store to aligned addresses once the head of a row is done, and
+ * when a rectangle covers whole rows of a tightly packed buffer, all rows are
+ * handed to the kernel as a single span.
+ */
+
+enum class RasterIsa
+{
+    Scalar,
+    Sse2,
+    Avx2,
+    Avx512, // AVX-512F + AVX-512BW
+};
+
+/**
+ * @brief Best instruction set the CPU (and the OS) supports, from cpuid.
+ */
+RasterIsa RasterDetectIsa();
+
+/**
+ * @brief Instruction set used by the raster operations.
+ *
+ * Picked on first use: the LABDRM_RASTER environment variable ("scalar",
+ * "sse2", "avx2" or "avx512") can lower it, but never above what the CPU
+ * supports.
+ */
+RasterIsa RasterActiveIsa();
+
+/**
+ * @brief Force an instruction set, e.g. to compare the kernels.
+ * @return false if the CPU doesn't support it; the active one is kept then
+ */
+bool RasterSetIsa(RasterIsa isa);
+
+const char* RasterIsaName(RasterIsa isa);
+
+/**
+ * @brief Fill `count` pixels starting at `dst` with `color`.
+ */
+void FillSpan(uint32_t* dst, uint32_t color, size_t count);
+
+/**
+ * @brief Fill a rectangle of a buffer with `color`.
+ *
+ * `rect` must lie inside the buffer, see Damage::Clip().
+ */
+void FillRect(uint8_t* dst, uint32_t stride, const Rect& rect, uint32_t color);
+
+/**
+ * @brief Fill a whole `width` x `height` buffer with `color`.
+ */
+void Fill(uint8_t* dst, uint32_t stride, uint32_t width, uint32_t height, uint32_t color);
+
+/**
+ * @brief Copy the `src_rect` part of `src` to (`dst_x`, `dst_y`) in `dst`.
+ *
+ * The two buffers may have different strides but must not overlap.
+ */
+void Blit(uint8_t* dst, uint32_t dst_stride, int32_t dst_x, int32_t dst_y,
+          const uint8_t* src, uint32_t src_stride, const Rect& src_rect);
+
+/**
+ * @brief Blend the `src_rect` part of `src` over (`dst_x`, `dst_y`) in `dst`.
+ *
+ * `src` is premultiplied ARGB8888: dst = src + dst * (255 - src.a) / 255,
+ * for all four channels. Results are identical for every instruction set.
+ */
+void BlendOver(uint8_t* dst, uint32_t dst_stride, int32_t dst_x, int32_t dst_y,
+               const uint8_t* src, uint32_t src_stride, const Rect& src_rect);
+
+/**
+ * @brief Copy `size` bytes with non-temporal stores.
+ *
+ * The stores bypass the cache, which is what we want when writing to a
+ * write-combined scanout mapping, or any buffer too large to stay cached.
+ * Ends with a store fence, so the data is visible to other CPUs (and the
+ * display engine) once this returns. Falls back to memcpy() without SIMD.
+ */
+void StreamCopy(uint8_t* dst, const uint8_t* src, size_t size);
+
+} // namespace DrmLab
@@ -0,0 +1,158 @@
+/*
+ * AVX2 row kernels, built with -mavx2. See raster_kernels.h.
+ */
+
+#include "raster_kernels.h"
+
+#include <cstring>
+#include <immintrin.h>
+
+namespace DrmLab
+{
+
+static void FillAvx2(uint32_t* dst, uint32_t color, size_t count)
+{
+    /* head: single pixels up to a 32 byte boundary, then aligned stores */
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 31) != 0) {
+        *dst++ = color;
+        count--;
+    }
+
+    __m256i v = _mm256_set1_epi32(static_cast<int>(color));
+    for (; count >= 32; count -= 32, dst += 32) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst), v);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 8), v);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 16), v);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 24), v);
+    }
+    for (; count >= 8; count -= 8, dst += 8) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst), v);
+    }
+
+    while (count-- > 0) {
+        *dst++ = color;
+    }
+}
+
+static void CopyAvx2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 31) != 0) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    for (; count >= 32; count -= 32, dst += 32, src += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 16));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 24));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst), a);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 8), b);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 16), c);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + 24), d);
+    }
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst),
+                           _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)));
+    }
+
+    while (count-- > 0) {
+        *dst++ = *src++;
+    }
+}
+
+/*
+ * Same as the SSE2 version: unpack and pack both work within 128 bit lanes,
+ * so the pixel order comes out right.
+ */
+static inline __m256i ScaleHalf(__m256i d16, __m256i s16)
+{
+    const __m256i c128 = _mm256_set1_epi16(128);
+    const __m256i c255 = _mm256_set1_epi16(255);
+
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d16, _mm256_sub_epi16(c255, a)), c128);
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+static inline __m256i Blend8(__m256i d, __m256i s)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i lo = ScaleHalf(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+    __m256i hi = ScaleHalf(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+    return _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+}
+
+static void BlendOverAvx2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xff000000));
+
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 31) != 0) {
+        *dst = RasterBlendPixel(*dst, *src);
+        dst++;
+        src++;
+        count--;
+    }
+
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+        /* skip the math for fully opaque or fully transparent pixels */
+        if (_mm256_testc_si256(s, alpha)) {
+            _mm256_store_si256(reinterpret_cast<__m256i*>(dst), s);
+            continue;
+        }
+        if (_mm256_testz_si256(s, s)) {
+            continue;
+        }
+
+        __m256i d = _mm256_load_si256(reinterpret_cast<const __m256i*>(dst));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst), Blend8(d, s));
+    }
+
+    while (count-- > 0) {
+        *dst = RasterBlendPixel(*dst, *src);
+        dst++;
+        src++;
+    }
+}
+
+static void StreamCopyAvx2(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    /* non-temporal stores need an aligned destination */
+    size_t head = (0 - reinterpret_cast<uintptr_t>(dst)) & 31;
+    if (head > size) {
+        head = size;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst), a);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 32), b);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 64), c);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 96), d);
+    }
+    for (; size >= 32; size -= 32, dst += 32, src += 32) {
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)));
+    }
+
+    memcpy(dst, src, size);
+    _mm_sfence();
+}
+
+const RasterKernels raster_kernels_avx2 = {
+    FillAvx2,
+    CopyAvx2,
+    BlendOverAvx2,
+    StreamCopyAvx2,
+};
+
+} // namespace DrmLab
@@ -0,0 +1,195 @@
+/*
+ * AVX-512 row kernels, built with -mavx512f -mavx512bw. See raster_kernels.h.
+ *
+ * Unlike the narrower kernels, head and tail are a single masked store each
+ * instead of a pixel loop.
+ */
+
+#include "raster_kernels.h"
+
+#include <cstring>
+#include <immintrin.h>
+
+namespace DrmLab
+{
+
+/**
+ * @brief Mask of the pixels from `dst` up to the next 64 byte boundary, at
+ * most `count`.
+ */
+static inline __mmask16 HeadMask(const uint32_t* dst, size_t count)
+{
+    size_t head = (64 - (reinterpret_cast<uintptr_t>(dst) & 63)) / 4 % 16;
+    if (head > count) {
+        head = count;
+    }
+    return static_cast<__mmask16>((1u << head) - 1);
+}
+
+static inline __mmask16 TailMask(size_t count)
+{
+    return static_cast<__mmask16>((1u << count) - 1);
+}
+
+static void FillAvx512(uint32_t* dst, uint32_t color, size_t count)
+{
+    __m512i v = _mm512_set1_epi32(static_cast<int>(color));
+
+    __mmask16 head = HeadMask(dst, count);
+    if (head != 0) {
+        size_t n = __builtin_popcount(head);
+        _mm512_mask_storeu_epi32(dst, head, v);
+        dst += n;
+        count -= n;
+    }
+
+    for (; count >= 64; count -= 64, dst += 64) {
+        _mm512_store_si512(dst, v);
+        _mm512_store_si512(dst + 16, v);
+        _mm512_store_si512(dst + 32, v);
+        _mm512_store_si512(dst + 48, v);
+    }
+    for (; count >= 16; count -= 16, dst += 16) {
+        _mm512_store_si512(dst, v);
+    }
+
+    if (count > 0) {
+        _mm512_mask_storeu_epi32(dst, TailMask(count), v);
+    }
+}
+
+static void CopyAvx512(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    __mmask16 head = HeadMask(dst, count);
+    if (head != 0) {
+        size_t n = __builtin_popcount(head);
+        _mm512_mask_storeu_epi32(dst, head, _mm512_maskz_loadu_epi32(head, src));
+        dst += n;
+        src += n;
+        count -= n;
+    }
+
+    for (; count >= 64; count -= 64, dst += 64, src += 64) {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 16);
+        __m512i c = _mm512_loadu_si512(src + 32);
+        __m512i d = _mm512_loadu_si512(src + 48);
+        _mm512_store_si512(dst, a);
+        _mm512_store_si512(dst + 16, b);
+        _mm512_store_si512(dst + 32, c);
+        _mm512_store_si512(dst + 48, d);
+    }
+    for (; count >= 16; count -= 16, dst += 16, src += 16) {
+        _mm512_store_si512(dst, _mm512_loadu_si512(src));
+    }
+
+    if (count > 0) {
+        __mmask16 tail = TailMask(count);
+        _mm512_mask_storeu_epi32(dst, tail, _mm512_maskz_loadu_epi32(tail, src));
+    }
+}
+
+/*
+ * Same as the SSE2 version, 16 pixels at a time.
+ */
+static inline __m512i ScaleHalf(__m512i d16, __m512i s16)
+{
+    const __m512i c128 = _mm512_set1_epi16(128);
+    const __m512i c255 = _mm512_set1_epi16(255);
+
+    __m512i a = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(s16, 0xff), 0xff);
+    __m512i t = _mm512_add_epi16(_mm512_mullo_epi16(d16, _mm512_sub_epi16(c255, a)), c128);
+    return _mm512_srli_epi16(_mm512_add_epi16(t, _mm512_srli_epi16(t, 8)), 8);
+}
+
+static inline __m512i Blend16(__m512i d, __m512i s)
+{
+    const __m512i zero = _mm512_setzero_si512();
+
+    __m512i lo = ScaleHalf(_mm512_unpacklo_epi8(d, zero), _mm512_unpacklo_epi8(s, zero));
+    __m512i hi = ScaleHalf(_mm512_unpackhi_epi8(d, zero), _mm512_unpackhi_epi8(s, zero));
+    return _mm512_adds_epu8(s, _mm512_packus_epi16(lo, hi));
+}
+
+/*
+ * Blend the pixels of `mask`; the others are left alone.
+ */
+static inline void BlendMasked(uint32_t* dst, const uint32_t* src, __mmask16 mask)
+{
+    __m512i s = _mm512_maskz_loadu_epi32(mask, src);
+    __m512i d = _mm512_maskz_loadu_epi32(mask, dst);
+    _mm512_mask_storeu_epi32(dst, mask, Blend16(d, s));
+}
+
+static void BlendOverAvx512(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    const __m512i alpha = _mm512_set1_epi32(static_cast<int>(0xff000000));
+
+    __mmask16 head = HeadMask(dst, count);
+    if (head != 0) {
+        size_t n = __builtin_popcount(head);
+        BlendMasked(dst, src, head);
+        dst += n;
+        src += n;
+        count -= n;
+    }
+
+    for (; count >= 16; count -= 16, dst += 16, src += 16) {
+        __m512i s = _mm512_loadu_si512(src);
+
+        /* skip the math for fully opaque or fully transparent pixels */
+        __mmask16 opaque = _mm512_cmpeq_epi32_mask(_mm512_and_si512(s, alpha), alpha);
+        if (opaque == 0xffff) {
+            _mm512_store_si512(dst, s);
+            continue;
+        }
+        if (_mm512_test_epi32_mask(s, s) == 0) {
+            continue;
+        }
+
+        _mm512_store_si512(dst, Blend16(_mm512_load_si512(dst), s));
+    }
+
+    if (count > 0) {
+        BlendMasked(dst, src, TailMask(count));
+    }
+}
+
+static void StreamCopyAvx512(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    /* non-temporal stores need an aligned destination */
+    size_t head = (0 - reinterpret_cast<uintptr_t>(dst)) & 63;
+    if (head > size) {
+        head = size;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 256; size -= 256, dst += 256, src += 256) {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 64);
+        __m512i c = _mm512_loadu_si512(src + 128);
+        __m512i d = _mm512_loadu_si512(src + 192);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst), a);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 64), b);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 128), c);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 192), d);
+    }
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst), _mm512_loadu_si512(src));
+    }
+
+    memcpy(dst, src, size);
+    _mm_sfence();
+}
+
+const RasterKernels raster_kernels_avx512 = {
+    FillAvx512,
+    CopyAvx512,
+    BlendOverAvx512,
+    StreamCopyAvx512,
+};
+
+} // namespace DrmLab
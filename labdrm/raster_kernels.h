@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Row kernels behind raster.h, one set per instruction set. Each set lives in
+ * its own file which is built with the matching -m flags, so nothing outside
+ * of it may be compiled for an ISA the CPU might not have. Only raster.cpp
+ * and the kernel files should include this.
+ *
+ * The helpers below are static: as plain inline functions every kernel file
+ * would emit a weak copy built with its own -m flags, and the linker could
+ * pick the AVX2 one for the scalar code.
+ */
+
+namespace DrmLab
+{
+
+struct RasterKernels
+{
+    void (*fill)(uint32_t* dst, uint32_t color, size_t count);
+    void (*copy)(uint32_t* dst, const uint32_t* src, size_t count);
+    void (*blend_over)(uint32_t* dst, const uint32_t* src, size_t count);
+    void (*stream_copy)(uint8_t* dst, const uint8_t* src, size_t size);
+};
+
+/**
+ * @brief (x * a) / 255, rounded; exact for x, a in [0, 255].
+ *
+ * All kernels divide with this very formula, so they give the same results.
+ */
+static inline uint32_t RasterMulDiv255(uint32_t x, uint32_t a)
+{
+    uint32_t t = x * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t RasterBlendPixel(uint32_t dst, uint32_t src)
+{
+    uint32_t ia = 255 - (src >> 24);
+    uint32_t out = 0;
+    for (uint32_t shift = 0; shift < 32; shift += 8) {
+        uint32_t c = ((src >> shift) & 0xff) + RasterMulDiv255((dst >> shift) & 0xff, ia);
+        /* saturate like the SIMD kernels, for sources that aren't premultiplied */
+        out |= (c > 255 ? 255 : c) << shift;
+    }
+    return out;
+}
+
+extern const RasterKernels raster_kernels_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LABDRM_RASTER_X86 1
+extern const RasterKernels raster_kernels_sse2;
+extern const RasterKernels raster_kernels_avx2;
+extern const RasterKernels raster_kernels_avx512;
+#endif
+
+} // namespace DrmLab
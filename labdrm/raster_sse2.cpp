@@ -0,0 +1,157 @@
+/*
+ * SSE2 row kernels, built with -msse2. See raster_kernels.h.
+ */
+
+#include "raster_kernels.h"
+
+#include <cstring>
+#include <emmintrin.h>
+
+namespace DrmLab
+{
+
+static void FillSse2(uint32_t* dst, uint32_t color, size_t count)
+{
+    /* head: single pixels up to a 16 byte boundary, then aligned stores */
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 15) != 0) {
+        *dst++ = color;
+        count--;
+    }
+
+    __m128i v = _mm_set1_epi32(static_cast<int>(color));
+    for (; count >= 16; count -= 16, dst += 16) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), v);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 4), v);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 8), v);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 12), v);
+    }
+    for (; count >= 4; count -= 4, dst += 4) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), v);
+    }
+
+    while (count-- > 0) {
+        *dst++ = color;
+    }
+}
+
+static void CopySse2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 15) != 0) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    for (; count >= 16; count -= 16, dst += 16, src += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), a);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 4), b);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 8), c);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + 12), d);
+    }
+    for (; count >= 4; count -= 4, dst += 4, src += 4) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+    }
+
+    while (count-- > 0) {
+        *dst++ = *src++;
+    }
+}
+
+/*
+ * dst * (255 - src.a) / 255 on one half (two pixels) widened to 16 bits,
+ * with the same rounding as RasterMulDiv255().
+ */
+static inline __m128i ScaleHalf(__m128i d16, __m128i s16)
+{
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i c255 = _mm_set1_epi16(255);
+
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(c255, a)), c128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i Blend4(__m128i d, __m128i s)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i lo = ScaleHalf(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+    __m128i hi = ScaleHalf(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+    return _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+}
+
+static void BlendOverSse2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+
+    while (count > 0 && (reinterpret_cast<uintptr_t>(dst) & 15) != 0) {
+        *dst = RasterBlendPixel(*dst, *src);
+        dst++;
+        src++;
+        count--;
+    }
+
+    for (; count >= 4; count -= 4, dst += 4, src += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        /* skip the math for fully opaque or fully transparent pixels */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha), alpha)) == 0xffff) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(dst), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, _mm_setzero_si128())) == 0xffff) {
+            continue;
+        }
+
+        __m128i d = _mm_load_si128(reinterpret_cast<const __m128i*>(dst));
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), Blend4(d, s));
+    }
+
+    while (count-- > 0) {
+        *dst = RasterBlendPixel(*dst, *src);
+        dst++;
+        src++;
+    }
+}
+
+static void StreamCopySse2(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    /* non-temporal stores need an aligned destination */
+    size_t head = (0 - reinterpret_cast<uintptr_t>(dst)) & 15;
+    if (head > size) {
+        head = size;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+    }
+    for (; size >= 16; size -= 16, dst += 16, src += 16) {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+    }
+
+    memcpy(dst, src, size);
+    _mm_sfence();
+}
+
+const RasterKernels raster_kernels_sse2 = {
+    FillSse2,
+    CopySse2,
+    BlendOverSse2,
+    StreamCopySse2,
+};
+
+} // namespace DrmLab
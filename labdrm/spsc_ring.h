@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace DrmLab
+{
+
+/**
+ * @brief A bounded lock-free queue between exactly one producer thread and
+ * one consumer thread.
+ *
+ * Each index is written by one side only and lives on its own cache line,
+ * next to that side's cached copy of the other index: as long as the ring
+ * is neither full nor empty, Push() and Pop() don't even read the cache line
+ * the other thread writes. Nothing ever blocks or allocates; the caller
+ * decides how to wait, e.g. on an eventfd.
+ *
+ * @tparam N capacity, a power of two
+ */
+template <typename T, size_t N>
+class SpscRing
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+    static constexpr size_t capacity = N;
+
+    SpscRing() = default;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /**
+     * @brief Append `item`. Producer thread only.
+     * @return false if the ring is full
+     */
+    bool Push(const T& item)
+    {
+        size_t tail = m_Tail.load(std::memory_order_relaxed);
+
+        if (tail - m_HeadCache == N) {
+            m_HeadCache = m_Head.load(std::memory_order_acquire);
+            if (tail - m_HeadCache == N) {
+                return false;
+            }
+        }
+
+        m_Items[tail & (N - 1)] = item;
+        m_Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Take the oldest item. Consumer thread only.
+     * @return false if the ring is empty
+     */
+    bool Pop(T* item)
+    {
+        size_t head = m_Head.load(std::memory_order_relaxed);
+
+        if (head == m_TailCache) {
+            m_TailCache = m_Tail.load(std::memory_order_acquire);
+            if (head == m_TailCache) {
+                return false;
+            }
+        }
+
+        *item = m_Items[head & (N - 1)];
+        m_Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Number of items, only a snapshot when called while the other
+     * side is working on the ring.
+     */
+    size_t Size() const
+    {
+        return m_Tail.load(std::memory_order_acquire) - m_Head.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr size_t cacheline = 64;
+
+    /* consumer side */
+    alignas(cacheline) std::atomic<size_t> m_Head { 0 };
+    size_t m_TailCache = 0;
+
+    /* producer side */
+    alignas(cacheline) std::atomic<size_t> m_Tail { 0 };
+    size_t m_HeadCache = 0;
+
+    alignas(cacheline) T m_Items[N] {};
+};
+
+} // namespace DrmLab
@@ -0,0 +1,177 @@
+#include "swapchain.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace DrmLab
+{
+
+PresentMode PresentModeFromEnv()
+{
+    const char* s = getenv("LABDRM_PRESENT");
+    if (s != nullptr && strcmp(s, "mailbox") == 0) {
+        return PresentMode::Mailbox;
+    }
+    if (s != nullptr && strcmp(s, "immediate") == 0) {
+        return PresentMode::Immediate;
+    }
+    return PresentMode::Fifo;
+}
+
+const char* PresentModeName(PresentMode mode)
+{
+    switch (mode) {
+    case PresentMode::Fifo:
+        return "fifo";
+    case PresentMode::Mailbox:
+        return "mailbox";
+    case PresentMode::Immediate:
+        return "immediate";
+    default:
+        return "unknown";
+    }
+}
+
+Swapchain::~Swapchain() noexcept
+{
+    for (unsigned i = 0; i < m_Count; i++) {
+        m_Allocator->Free(&m_Slots[i].buf);
+    }
+}
+
+unsigned Swapchain::BuffersFromEnv()
+{
+    const char* s = getenv("LABDRM_BUFFERS");
+    if (s == nullptr) {
+        return min_buffers;
+    }
+
+    int count = atoi(s);
+    if (count < static_cast<int>(min_buffers)) {
+        return min_buffers;
+    }
+    return count > static_cast<int>(max_buffers) ? max_buffers : static_cast<unsigned>(count);
+}
+
+int Swapchain::Allocate(unsigned count, uint32_t width, uint32_t height, uint32_t format,
+                        uint64_t modifier)
+{
+    if (m_Count != 0 || count < min_buffers || count > max_buffers) {
+        return -EINVAL;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        int ret = m_Allocator->Allocate(width, height, format, modifier, &m_Slots[i].buf);
+        if (ret != 0) {
+            while (i-- > 0) {
+                m_Allocator->Free(&m_Slots[i].buf);
+            }
+            return ret;
+        }
+        m_Slots[i].state = State::Free;
+        m_Slots[i].frame = 0;
+    }
+
+    m_Count = count;
+    return 0;
+}
+
+Swapchain::Slot* Swapchain::Find(const Buffer* buf)
+{
+    for (unsigned i = 0; i < m_Count; i++) {
+        if (&m_Slots[i].buf == buf) {
+            return &m_Slots[i];
+        }
+    }
+    return nullptr;
+}
+
+Buffer* Swapchain::Acquire(unsigned* age)
+{
+    Slot* lru = nullptr;
+
+    /* never used buffers have frame 0 and go first */
+    for (unsigned i = 0; i < m_Count; i++) {
+        if (m_Slots[i].state == State::Free && (lru == nullptr || m_Slots[i].frame < lru->frame)) {
+            lru = &m_Slots[i];
+        }
+    }
+    if (lru == nullptr) {
+        return nullptr;
+    }
+
+    lru->state = State::Acquired;
+    *age = lru->frame == 0 ? 0 : static_cast<unsigned>(m_Frame - lru->frame + 1);
+    return &lru->buf;
+}
+
+void Swapchain::Release(Buffer* buf)
+{
+    Slot* slot = Find(buf);
+    if (slot != nullptr && slot->state == State::Acquired) {
+        slot->state = State::Free;
+        slot->frame = 0;
+    }
+}
+
+void Swapchain::Queue(Buffer* buf, const Damage& damage)
+{
+    Slot* slot = Find(buf);
+    if (slot == nullptr || slot->state != State::Acquired) {
+        return;
+    }
+
+    m_Frame++;
+    m_History[m_Frame % max_buffers] = damage;
+    slot->state = State::Queued;
+    slot->frame = m_Frame;
+}
+
+void Swapchain::Discard(Buffer* buf)
+{
+    Slot* slot = Find(buf);
+    if (slot != nullptr && slot->state == State::Queued) {
+        slot->state = State::Free;
+    }
+}
+
+void Swapchain::Presented(Buffer* buf)
+{
+    Slot* slot = Find(buf);
+    if (slot == nullptr || slot->state != State::Queued) {
+        return;
+    }
+
+    for (unsigned i = 0; i < m_Count; i++) {
+        if (m_Slots[i].state == State::Front) {
+            m_Slots[i].state = State::Free;
+        }
+    }
+    slot->state = State::Front;
+}
+
+bool Swapchain::AccumulateDamage(unsigned age, Damage* damage) const
+{
+    /* a buffer of age n misses the last n - 1 frames */
+    if (age == 0 || age - 1 > max_buffers || age - 1 > m_Frame) {
+        return false;
+    }
+
+    for (uint64_t frame = m_Frame - (age - 1) + 1; frame <= m_Frame; frame++) {
+        damage->Add(m_History[frame % max_buffers]);
+    }
+    return true;
+}
+
+Buffer* Swapchain::Front()
+{
+    for (unsigned i = 0; i < m_Count; i++) {
+        if (m_Slots[i].state == State::Front) {
+            return &m_Slots[i].buf;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace DrmLab
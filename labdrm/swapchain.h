@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+
+#include "allocator.h"
+#include "damage.h"
+
+namespace DrmLab
+{
+
+/**
+ * @brief When a rendered frame is shown, as in Vulkan.
+ */
+enum class PresentMode
+{
+    Fifo,      // every frame is shown, one per vblank; rendering waits for flips
+    Mailbox,   // the newest frame is shown at the next vblank, older ones are dropped
+    Immediate, // like Mailbox, but flips right away (DRM_MODE_PAGE_FLIP_ASYNC), tearing
+};
+
+/**
+ * @brief Pick the present mode from the LABDRM_PRESENT environment variable
+ * ("fifo", "mailbox" or "immediate"), defaulting to FIFO.
+ */
+PresentMode PresentModeFromEnv();
+
+const char* PresentModeName(PresentMode mode);
+
+/**
+ * @brief A ring of 2 to 4 scanout buffers which tracks the age of each.
+ *
+ * A buffer is Acquire()d by the renderer, Queue()d once its frame is
+ * complete, and becomes the front buffer when Presented() says its flip
+ * completed; the buffer shown before is free again then. With more than two
+ * buffers the renderer can draw the next frame while one buffer waits for its
+ * flip and another one is on screen.
+ *
+ * The age of an acquired buffer is the number of frames since its contents
+ * were queued, like EGL_EXT_buffer_age: 1 means it holds the previous frame,
+ * 2 the one before, and 0 that its contents are undefined. Together with the
+ * damage of the frames in between (see AccumulateDamage()) it tells the
+ * renderer what it has to repaint instead of the whole frame.
+ */
+class Swapchain
+{
+public:
+    static constexpr unsigned min_buffers = 2;
+    static constexpr unsigned max_buffers = 4;
+
+    explicit Swapchain(Allocator* allocator)
+        : m_Allocator(allocator)
+    {}
+    ~Swapchain() noexcept;
+
+    Swapchain(const Swapchain&) = delete;
+    Swapchain& operator=(const Swapchain&) = delete;
+
+    /**
+     * @brief Number of buffers from the LABDRM_BUFFERS environment variable,
+     * 2 if unset, clamped to [min_buffers, max_buffers].
+     */
+    static unsigned BuffersFromEnv();
+
+    /**
+     * @brief Allocate `count` buffers with the allocator.
+     * @return 0 on success, negative errno otherwise; nothing stays allocated
+     * on failure
+     */
+    int Allocate(unsigned count, uint32_t width, uint32_t height, uint32_t format, uint64_t modifier);
+
+    unsigned Count() const { return m_Count; }
+
+    /**
+     * @brief Take the least recently used free buffer to render into.
+     * @param age receives the age of the buffer, see above
+     * @return nullptr if every buffer is queued or on screen
+     */
+    Buffer* Acquire(unsigned* age);
+
+    /**
+     * @brief Give back an acquired buffer without queueing it. Its contents
+     * are considered undefined from now on.
+     */
+    void Release(Buffer* buf);
+
+    /**
+     * @brief The frame in the acquired `buf` is complete.
+     * @param damage what changed since the previously queued frame
+     */
+    void Queue(Buffer* buf, const Damage& damage);
+
+    /**
+     * @brief Drop the queued `buf` without presenting it, e.g. because a
+     * newer frame replaces it in Mailbox mode. It becomes free and keeps its
+     * contents and age.
+     */
+    void Discard(Buffer* buf);
+
+    /**
+     * @brief The queued `buf` is on screen now; the previous front buffer
+     * becomes free.
+     */
+    void Presented(Buffer* buf);
+
+    /**
+     * @brief Add the damage of the frames queued after the one a buffer of
+     * `age` holds to `damage`: what has to be repainted in that buffer, on
+     * top of the damage of the new frame.
+     * @return false if the buffer has to be repainted entirely, because its
+     * contents are undefined or older than the damage history
+     */
+    bool AccumulateDamage(unsigned age, Damage* damage) const;
+
+    /**
+     * @brief The buffer on screen, nullptr before the first Presented().
+     */
+    Buffer* Front();
+
+private:
+    enum class State
+    {
+        Free,
+        Acquired,
+        Queued,
+        Front,
+    };
+
+    struct Slot
+    {
+        Buffer buf;
+        State state;
+        uint64_t frame; // number of the frame in the buffer, 0 if undefined
+    };
+
+    Slot* Find(const Buffer* buf);
+
+    Allocator* m_Allocator;
+    Slot m_Slots[max_buffers] {};
+    unsigned m_Count = 0;
+
+    uint64_t m_Frame = 0;              // frames queued so far
+    Damage m_History[max_buffers] {};  // damage of the last frames, by frame number % max_buffers
+};
+
+} // namespace DrmLab
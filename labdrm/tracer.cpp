@@ -0,0 +1,349 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace DrmLab
+{
+
+const char* const Tracer::default_events =
+    "drm,"
+    "amdgpu_dm/amdgpu_dm_atomic_commit_tail_begin,"
+    "amdgpu_dm/amdgpu_dm_atomic_commit_tail_finish,"
+    "i915/intel_pipe_update_start,"
+    "i915/intel_pipe_update_vblank_evaded,"
+    "i915/intel_pipe_update_end,"
+    "msm/msm_atomic_commit_tail_start,"
+    "msm/msm_atomic_commit_tail_finish";
+
+static const char* const tracefs_roots[] = {
+    "/sys/kernel/tracing",
+    "/sys/kernel/debug/tracing",
+};
+
+/* kernel events go to a process of their own, with a thread per CPU */
+static constexpr int kernel_pid = 0;
+
+std::unique_ptr<Tracer> Tracer::Create(const char* path, const char* events)
+{
+    std::unique_ptr<Tracer> tracer(new Tracer());
+    int ret = -ENOENT;
+
+    for (const char* root : tracefs_roots) {
+        ret = tracer->Setup(root, path, events != nullptr ? events : default_events);
+        if (ret != -ENOENT) {
+            break;
+        }
+        /* the instance may be there already, the next root makes another */
+        tracer->Teardown();
+    }
+    if (ret < 0) {
+        fprintf(stderr, "[!] cannot set up tracing: %s\n", strerror(-ret));
+        return nullptr;
+    }
+    return tracer;
+}
+
+std::unique_ptr<Tracer> Tracer::FromEnv()
+{
+    const char* path = getenv("LABDRM_TRACE");
+
+    if (path == nullptr || path[0] == '\0') {
+        return nullptr;
+    }
+    return Create(path, getenv("LABDRM_TRACE_EVENTS"));
+}
+
+/*
+ * Create the instance under `root` and everything else. Whatever was set up
+ * when it fails is undone by Teardown().
+ */
+int Tracer::Setup(const char* root, const char* path, const char* events)
+{
+    char name[64];
+    unsigned enabled = 0;
+
+    m_Pid = getpid();
+    snprintf(name, sizeof(name), "/instances/labdrm-%d", m_Pid);
+    std::string instance = std::string(root) + name;
+    if (mkdir(instance.c_str(), 0755) != 0 && errno != EEXIST) {
+        return -errno;
+    }
+    m_Instance = instance;
+
+    /* the clock of CLOCK_MONOTONIC, like the page-flip timestamps */
+    if (!WriteFile("trace_clock", "mono")) {
+        fprintf(stderr, "[!] no mono trace clock, trace timestamps are not CLOCK_MONOTONIC.\n");
+    }
+
+    std::string list(events);
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        std::string event = list.substr(pos, comma - pos);
+        if (!event.empty() && WriteFile(("events/" + event + "/enable").c_str(), "1")) {
+            enabled++;
+        }
+        pos = comma + 1;
+    }
+    if (enabled == 0) {
+        fprintf(stderr, "[!] none of the trace events '%s' exist, tracing markers only.\n", events);
+    }
+
+    m_Marker = open((m_Instance + "/trace_marker").c_str(), O_WRONLY | O_CLOEXEC);
+    if (m_Marker < 0) {
+        return -errno;
+    }
+    m_Pipe = open((m_Instance + "/trace_pipe").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (m_Pipe < 0) {
+        return -errno;
+    }
+
+    m_Json = fopen(path, "w");
+    if (m_Json == nullptr) {
+        return -errno;
+    }
+    fprintf(m_Json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"kernel\"}}",
+            kernel_pid);
+
+    if (!WriteFile("tracing_on", "1")) {
+        return -errno;
+    }
+    return 0;
+}
+
+Tracer::~Tracer() noexcept
+{
+    Teardown();
+}
+
+void Tracer::Teardown()
+{
+    if (m_Pipe >= 0) {
+        WriteFile("tracing_on", "0");
+        if (m_Json != nullptr) {
+            Read();
+        }
+        close(m_Pipe);
+        m_Pipe = -1;
+    }
+    if (m_Marker >= 0) {
+        close(m_Marker);
+        m_Marker = -1;
+    }
+    if (m_Json != nullptr) {
+        fprintf(m_Json, "\n]}\n");
+        fclose(m_Json);
+        m_Json = nullptr;
+    }
+    /* the instance can only go once nothing has its files open */
+    if (!m_Instance.empty()) {
+        rmdir(m_Instance.c_str());
+        m_Instance.clear();
+    }
+}
+
+bool Tracer::WriteFile(const char* name, const char* value) const
+{
+    int fd = open((m_Instance + "/" + name).c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, value, strlen(value)) == static_cast<ssize_t>(strlen(value));
+    close(fd);
+    return ok;
+}
+
+void Tracer::Marker(const char* text, size_t len)
+{
+    /* the kernel takes a marker in one piece, from any thread; a lost one
+     * only leaves a slice open in the trace */
+    if (write(m_Marker, text, len) < 0) {
+        return;
+    }
+}
+
+void Tracer::Begin(const char* format, ...)
+{
+    char text[256];
+    va_list args;
+
+    int len = snprintf(text, sizeof(text), "B|%d|", m_Pid);
+    va_start(args, format);
+    int name = vsnprintf(text + len, sizeof(text) - len, format, args);
+    va_end(args);
+    if (name < 0) {
+        return;
+    }
+    Marker(text, std::min(static_cast<size_t>(len + name), sizeof(text) - 1));
+}
+
+void Tracer::End()
+{
+    char text[32];
+
+    int len = snprintf(text, sizeof(text), "E|%d", m_Pid);
+    Marker(text, len);
+}
+
+int Tracer::Read()
+{
+    char buf[16384];
+    uint64_t before = m_Events;
+
+    for (;;) {
+        ssize_t len = read(m_Pipe, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (len < 0) {
+            return -errno;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        m_Partial.append(buf, len);
+        size_t start = 0;
+        size_t newline;
+        while ((newline = m_Partial.find('\n', start)) != std::string::npos) {
+            m_Partial[newline] = '\0';
+            Line(m_Partial.c_str() + start);
+            start = newline + 1;
+        }
+        m_Partial.erase(0, start);
+    }
+    fflush(m_Json);
+    return static_cast<int>(m_Events - before);
+}
+
+static void WriteEscaped(FILE* f, const char* s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+}
+
+/*
+ * One line of trace_pipe, in the default format:
+ *
+ *   drme_atomic-1234    [001] .....   812.345678: tracing_mark_write: B|1234|paint
+ *        <idle>-0       [000] d.h1.   812.351234: drm_vblank_event: crtc=0, seq=4711, ...
+ *
+ * The task name may contain anything, so parsing starts at the CPU number.
+ * Lines which don't look like this, e.g. lost event notes, are skipped.
+ */
+void Tracer::Line(const char* line)
+{
+    const char* bracket = line;
+    unsigned cpu = 0;
+    char* end;
+
+    for (;;) {
+        bracket = strstr(bracket, " [");
+        if (bracket == nullptr) {
+            return;
+        }
+        cpu = strtoul(bracket + 2, &end, 10);
+        if (end != bracket + 2 && *end == ']') {
+            break;
+        }
+        bracket += 2;
+    }
+
+    /* the thread id ends the task */
+    const char* task_end = bracket;
+    while (task_end > line && task_end[-1] == ' ') {
+        task_end--;
+    }
+    const char* dash = task_end;
+    while (dash > line && dash[-1] != '-') {
+        dash--;
+    }
+    int tid = dash > line ? atoi(dash) : 0;
+
+    /* skip the flags, then the timestamp in seconds */
+    const char* p = end + 1;
+    while (*p == ' ') {
+        p++;
+    }
+    while (*p != '\0' && *p != ' ') {
+        p++;
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    uint64_t sec = strtoull(p, &end, 10);
+    if (end == p || *end != '.') {
+        return;
+    }
+    p = end + 1;
+    uint64_t frac = strtoull(p, &end, 10);
+    if (*end != ':') {
+        return;
+    }
+    for (long digits = end - p; digits < 9; digits++) {
+        frac *= 10;
+    }
+    double ts = (sec * 1000000000ull + frac) / 1000.0;
+
+    /* then the event and its fields */
+    p = end + 1;
+    while (*p == ' ') {
+        p++;
+    }
+    const char* event = p;
+    const char* colon = strchr(event, ':');
+    if (colon == nullptr) {
+        return;
+    }
+    size_t event_len = colon - event;
+    const char* fields = colon[1] == ' ' ? colon + 2 : colon + 1;
+
+    if (event_len == strlen("tracing_mark_write") && strncmp(event, "tracing_mark_write", event_len) == 0) {
+        int pid = 0;
+        if (fields[0] == 'B' && sscanf(fields, "B|%d|", &pid) == 1) {
+            const char* name = strchr(fields + 2, '|');
+            if (name == nullptr) {
+                return;
+            }
+            fprintf(m_Json, ",\n{\"name\":\"");
+            WriteEscaped(m_Json, name + 1, strlen(name + 1));
+            fprintf(m_Json, "\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", ts, pid, tid);
+        } else if (fields[0] == 'E' && sscanf(fields, "E|%d", &pid) == 1) {
+            fprintf(m_Json, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", ts, pid, tid);
+        } else {
+            return;
+        }
+    } else {
+        fprintf(m_Json, ",\n{\"name\":\"");
+        WriteEscaped(m_Json, event, event_len);
+        fprintf(m_Json, "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"task\":%d,\"fields\":\"",
+                ts, kernel_pid, cpu, tid);
+        WriteEscaped(m_Json, fields, strlen(fields));
+        fprintf(m_Json, "\"}}");
+    }
+    m_Events++;
+}
+
+} // namespace DrmLab
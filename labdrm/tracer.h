@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+namespace DrmLab
+{
+
+/**
+ * @brief Puts our frame stages and the kernel's DRM tracepoints on one
+ * timeline, as a Chrome JSON trace which Perfetto and chrome://tracing open.
+ *
+ * It creates its own tracefs instance, so the global trace buffer and its
+ * settings stay untouched: the instance runs on the "mono" trace clock,
+ * has the DRM events enabled, and gets our Begin()/End() markers through its
+ * trace_marker in the systrace format ("B|pid|name", "E|pid"). Reading the
+ * instance's trace_pipe returns both in order, with kernel timestamps,
+ * so a frame which missed its vblank shows whether our paint, copy or commit
+ * took too long or the kernel finished the commit late.
+ *
+ * Needs write access to tracefs, which usually means root.
+ */
+class Tracer
+{
+public:
+    /**
+     * @brief The events enabled by default: all of the "drm" system
+     * (drm_vblank_event, drm_vblank_event_queued, drm_vblank_event_delivered)
+     * and the atomic commit tracepoints of drivers which have them. Missing
+     * ones are skipped.
+     */
+    static const char* const default_events;
+
+    /**
+     * @brief Start tracing into the JSON file at `path`.
+     * @param events comma separated "system" or "system/event" names,
+     * default_events if nullptr
+     * @return nullptr if tracefs or the file can't be set up
+     */
+    static std::unique_ptr<Tracer> Create(const char* path, const char* events = nullptr);
+
+    /**
+     * @brief Create() with the path in LABDRM_TRACE and the events in
+     * LABDRM_TRACE_EVENTS; nullptr if LABDRM_TRACE is unset, tracing is
+     * opt-in.
+     */
+    static std::unique_ptr<Tracer> FromEnv();
+
+    /**
+     * @brief Read what is left, finish the JSON file and remove the tracefs
+     * instance.
+     */
+    ~Tracer() noexcept;
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    /**
+     * @brief Begin a slice on the calling thread, named printf-style. Safe
+     * from any thread: a marker is a single write(2).
+     */
+    void Begin(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    /**
+     * @brief End the innermost slice of the calling thread.
+     */
+    void End();
+
+    /**
+     * @brief The trace_pipe of the instance, readable when there are events
+     * for Read(). Non-blocking.
+     */
+    int Fd() const { return m_Pipe; }
+
+    /**
+     * @brief Convert the events available on Fd() to JSON, without blocking.
+     * @return the number of events written, or negative errno
+     */
+    int Read();
+
+    uint64_t Events() const { return m_Events; }
+
+private:
+    Tracer() = default;
+
+    int Setup(const char* root, const char* path, const char* events);
+    void Teardown();
+    bool WriteFile(const char* name, const char* value) const;
+    void Marker(const char* text, size_t len);
+    void Line(const char* line);
+
+    std::string m_Instance; // the tracefs instance directory
+    FILE* m_Json = nullptr;
+    int m_Marker = -1;
+    int m_Pipe = -1;
+    int m_Pid = 0;
+    std::string m_Partial; // a line trace_pipe has returned only the start of
+    uint64_t m_Events = 0;
+};
+
+} // namespace DrmLab
@@ -0,0 +1,133 @@
+#include "vblank_clock.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <unordered_map>
+#include <xf86drm.h>
+
+namespace DrmLab
+{
+
+/*
+ * Queued wakeups by the user_data of their event. The kernel can't cancel
+ * them, so a clock that goes away only forgets its own, and their events
+ * find nothing here.
+ */
+struct Waiter
+{
+    VBlankClock* clock;
+    VBlankClock::Callback callback;
+};
+
+static std::unordered_map<uint64_t, Waiter> waiters;
+static uint64_t next_waiter = 1;
+
+std::unique_ptr<VBlankClock> VBlankClock::Create(int drm_fd, uint32_t crtc_id)
+{
+    uint64_t cap = 0;
+
+    if (drmGetCap(drm_fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) != 0 || cap == 0) {
+        fprintf(stderr, "[!] vblank timestamps aren't CLOCK_MONOTONIC, no vblank clock.\n");
+        return nullptr;
+    }
+    return std::unique_ptr<VBlankClock>(new VBlankClock(drm_fd, crtc_id));
+}
+
+VBlankClock::~VBlankClock() noexcept
+{
+    for (auto it = waiters.begin(); it != waiters.end();) {
+        if (it->second.clock == this) {
+            it = waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/*
+ * A vblank the clock learned about. A vblank away from where the period
+ * predicts it (the CRTC was off, or the mode changed) starts a new
+ * measurement.
+ */
+void VBlankClock::Sample(uint64_t sequence, uint64_t ns)
+{
+    if (m_HaveSample && sequence == m_LastSequence) {
+        return;
+    }
+
+    bool restart = !m_HaveSample || sequence < m_LastSequence;
+    if (!restart && m_Period != 0) {
+        uint64_t predicted = Predict(sequence);
+        uint64_t error = predicted > ns ? predicted - ns : ns - predicted;
+        restart = error > m_Period / 4;
+    }
+
+    m_LastSequence = sequence;
+    m_LastNs = ns;
+    if (restart) {
+        m_AnchorSequence = sequence;
+        m_AnchorNs = ns;
+        m_Period = 0;
+        m_HaveSample = true;
+        return;
+    }
+
+    m_Period = (m_LastNs - m_AnchorNs) / (m_LastSequence - m_AnchorSequence);
+}
+
+int VBlankClock::Now(uint64_t* sequence, uint64_t* ns)
+{
+    if (drmCrtcGetSequence(m_Fd, m_Crtc, sequence, ns) != 0) {
+        return -errno;
+    }
+    Sample(*sequence, *ns);
+    return 0;
+}
+
+int VBlankClock::WakeAt(uint64_t sequence, Callback callback, bool relative, uint64_t* queued)
+{
+    uint32_t flags = DRM_CRTC_SEQUENCE_NEXT_ON_MISS;
+    uint64_t id = next_waiter++;
+    uint64_t target;
+
+    if (relative) {
+        flags |= DRM_CRTC_SEQUENCE_RELATIVE;
+    }
+
+    waiters[id] = Waiter { this, std::move(callback) };
+    if (drmCrtcQueueSequence(m_Fd, m_Crtc, flags, sequence, &target, id) != 0) {
+        int ret = -errno;
+        waiters.erase(id);
+        return ret;
+    }
+
+    if (queued != nullptr) {
+        *queued = target;
+    }
+    return 0;
+}
+
+uint64_t VBlankClock::Predict(uint64_t sequence) const
+{
+    if (!m_HaveSample) {
+        return 0;
+    }
+    int64_t frames = static_cast<int64_t>(sequence - m_LastSequence);
+    return m_LastNs + frames * static_cast<int64_t>(Period());
+}
+
+void VBlankClock::SequenceHandler(int, uint64_t sequence, uint64_t ns, uint64_t user_data)
+{
+    auto it = waiters.find(user_data);
+    if (it == waiters.end()) {
+        return;
+    }
+
+    /* the callback may queue the next wakeup, or destroy the clock */
+    Waiter waiter = std::move(it->second);
+    waiters.erase(it);
+    waiter.clock->Sample(sequence, ns);
+    waiter.callback(sequence, ns);
+}
+
+} // namespace DrmLab
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace DrmLab
+{
+
+/**
+ * @brief The vblank counter and timestamps of one CRTC, as a clock.
+ *
+ * It reads the current vblank with drmCrtcGetSequence() and queues wakeups
+ * for a vblank sequence number with drmCrtcQueueSequence(), neither of which
+ * needs a commit: a client that doesn't render, or an output that has
+ * nothing new to show, can pace itself to the display without spinning or
+ * flipping to the same framebuffer again. The CRTC only has to be active.
+ *
+ * Timestamps are CLOCK_MONOTONIC nanoseconds, so Create() requires
+ * DRM_CAP_TIMESTAMP_MONOTONIC. Sequence numbers are the kernel's 64 bit
+ * counter; page-flip events report its low 32 bits.
+ *
+ * Wakeups arrive as DRM events: the drmEventContext the fd is dispatched
+ * with (version 4 or later) needs SequenceHandler() as its sequence_handler.
+ * A clock must be used from the thread that dispatches them.
+ */
+class VBlankClock
+{
+public:
+    using Callback = std::function<void(uint64_t sequence, uint64_t ns)>;
+
+    /**
+     * @return nullptr if the device doesn't timestamp vblanks with
+     * CLOCK_MONOTONIC
+     */
+    static std::unique_ptr<VBlankClock> Create(int drm_fd, uint32_t crtc_id);
+
+    /**
+     * Wakeups still queued in the kernel are ignored when they arrive.
+     */
+    ~VBlankClock() noexcept;
+
+    VBlankClock(const VBlankClock&) = delete;
+    VBlankClock& operator=(const VBlankClock&) = delete;
+
+    uint32_t CrtcId() const { return m_Crtc; }
+
+    /**
+     * @brief Sequence number and timestamp of the latest vblank.
+     * @return 0 on success, negative errno otherwise
+     */
+    int Now(uint64_t* sequence, uint64_t* ns);
+
+    /**
+     * @brief Call `callback` at vblank `sequence`, or `sequence` vblanks
+     * from now if `relative`. A sequence that already passed fires at the
+     * next vblank.
+     * @param queued receives the sequence the kernel will fire at
+     * @return 0 on success, negative errno otherwise
+     */
+    int WakeAt(uint64_t sequence, Callback callback, bool relative = false, uint64_t* queued = nullptr);
+
+    /**
+     * @brief The refresh period measured so far, the nominal one (see
+     * SetNominalPeriod()) until two vblanks have been seen.
+     */
+    uint64_t Period() const { return m_Period != 0 ? m_Period : m_Nominal; }
+
+    void SetNominalPeriod(uint64_t period_ns) { m_Nominal = period_ns; }
+
+    /**
+     * @brief Expected timestamp of vblank `sequence`, 0 if no vblank has
+     * been seen yet.
+     */
+    uint64_t Predict(uint64_t sequence) const;
+
+    /**
+     * @brief drmEventContext::sequence_handler for the wakeups of all clocks.
+     */
+    static void SequenceHandler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data);
+
+private:
+    VBlankClock(int drm_fd, uint32_t crtc_id)
+        : m_Fd(drm_fd)
+        , m_Crtc(crtc_id)
+    {}
+
+    void Sample(uint64_t sequence, uint64_t ns);
+
+    int m_Fd;
+    uint32_t m_Crtc;
+    uint64_t m_Nominal = 0;
+
+    /* the period is measured from an anchor vblank to the latest one, which
+     * gets more precise the longer the clock runs */
+    bool m_HaveSample = false;
+    uint64_t m_AnchorSequence = 0;
+    uint64_t m_AnchorNs = 0;
+    uint64_t m_LastSequence = 0;
+    uint64_t m_LastNs = 0;
+    uint64_t m_Period = 0;
+};
+
+} // namespace DrmLab
@@ -0,0 +1,1592 @@
+#include "virtual_kms.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+namespace DrmLab
+{
+
+/* The devices and their fds, read without a lock by Find(), which the
+ * ioctl() of virtual_kms_ioctl.cpp calls for every fd. A slot is free while
+ * its device is nullptr; the lock only orders Create() and the destructor. */
+static constexpr unsigned max_devices = 8;
+static std::mutex registry_mutex;
+static std::atomic<VirtualKms*> registry_devices[max_devices];
+static std::atomic<int> registry_fds[max_devices];
+
+/* defined in virtual_kms_ioctl.cpp, without which nothing reaches a device */
+extern const bool virtual_kms_ioctl_linked __attribute__((weak));
+
+static constexpr uint32_t max_size = 8192;
+static constexpr uint32_t cursor_size = 64;     // DRM_CAP_CURSOR_WIDTH/HEIGHT
+static constexpr uint32_t max_cursor_size = 256; // what a cursor plane accepts at most
+static constexpr unsigned max_overlays = 8;
+
+/* where the fake mmap offsets of dumb buffers start, like DRM_FILE_PAGE_OFFSET */
+static constexpr uint64_t dumb_offset_start = 0x100000ull << 12;
+
+static const uint32_t plane_formats[] = {
+    DRM_FORMAT_XRGB8888,
+    DRM_FORMAT_ARGB8888,
+    DRM_FORMAT_XBGR8888,
+    DRM_FORMAT_ABGR8888,
+    DRM_FORMAT_RGB565,
+};
+static const uint32_t cursor_formats[] = {
+    DRM_FORMAT_ARGB8888,
+};
+
+/* the connectors list these besides the configured mode, when they fit */
+static const struct
+{
+    uint32_t width;
+    uint32_t height;
+} standard_modes[] = {
+    { 3840, 2160 },
+    { 2560, 1440 },
+    { 1920, 1080 },
+    { 1280, 720 },
+    { 1024, 768 },
+    { 640, 480 },
+};
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t FormatCpp(uint32_t format)
+{
+    switch (format) {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+        return 4;
+    case DRM_FORMAT_RGB565:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * The two-call convention of the GET ioctls: the array is copied only if it
+ * fits, and the count is set to the real one either way, so a first call
+ * with a count of 0 returns what to allocate.
+ */
+template <typename T>
+static void CopyOut(uint64_t ptr, uint32_t* count, const T* data, size_t n)
+{
+    if (ptr != 0 && n > 0 && *count >= n) {
+        memcpy(reinterpret_cast<void*>(static_cast<uintptr_t>(ptr)), data, n * sizeof(T));
+    }
+    *count = static_cast<uint32_t>(n);
+}
+
+/* like drm_copy_field(): as much as fits, and the full length */
+static void CopyString(char* dst, size_t* len, const char* src)
+{
+    size_t n = strlen(src);
+    if (dst != nullptr && *len > 0) {
+        memcpy(dst, src, std::min(*len, n));
+    }
+    *len = n;
+}
+
+static int GetVersion(void* arg)
+{
+    auto* version = static_cast<struct drm_version*>(arg);
+
+    version->version_major = 1;
+    version->version_minor = 0;
+    version->version_patchlevel = 0;
+    CopyString(version->name, &version->name_len, "virtual");
+    CopyString(version->date, &version->date_len, "0");
+    CopyString(version->desc, &version->desc_len, "labdrm virtual KMS");
+    return 0;
+}
+
+static int SetClientCap(void* arg)
+{
+    auto* cap = static_cast<struct drm_set_client_cap*>(arg);
+
+    switch (cap->capability) {
+    case DRM_CLIENT_CAP_STEREO_3D:
+    case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+    case DRM_CLIENT_CAP_ATOMIC:
+    case DRM_CLIENT_CAP_ASPECT_RATIO:
+    case DRM_CLIENT_CAP_WRITEBACK_CONNECTORS:
+        return cap->value <= 1 ? 0 : -EINVAL;
+    default:
+        return -EINVAL;
+    }
+}
+
+static bool ValidMode(const drmModeModeInfo& mode)
+{
+    return mode.clock != 0 && mode.hdisplay != 0 && mode.vdisplay != 0 && mode.htotal >= mode.hdisplay &&
+           mode.vtotal >= mode.vdisplay && mode.hdisplay <= max_size && mode.vdisplay <= max_size;
+}
+
+std::unique_ptr<VirtualKms> VirtualKms::Create(const VirtualKmsConfig& config)
+{
+    if (&virtual_kms_ioctl_linked == nullptr) {
+        fprintf(stderr, "[!] virtual KMS devices need virtual_kms_ioctl.cpp linked in.\n");
+        return nullptr;
+    }
+    if (config.outputs == 0 || config.outputs > VirtualKmsConfig::max_outputs || config.width == 0 ||
+        config.width > max_size || config.height == 0 || config.height > max_size || !(config.refresh > 0) ||
+        config.overlays > max_overlays) {
+        fprintf(stderr, "[!] invalid virtual KMS configuration.\n");
+        return nullptr;
+    }
+
+    std::unique_ptr<VirtualKms> kms(new VirtualKms(config));
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        fprintf(stderr, "[!] cannot create the virtual KMS event pipe: %s\n", strerror(errno));
+        return nullptr;
+    }
+    kms->m_Read = fds[0];
+    kms->m_Write = fds[1];
+
+    /* A full pipe drops events instead of blocking the event thread. Room
+     * for more of them than the 64 KiB default is best effort. */
+    fcntl(kms->m_Write, F_SETFL, O_NONBLOCK);
+    fcntl(kms->m_Write, F_SETPIPE_SZ, 1 << 20);
+
+    kms->m_Thread = std::thread(&VirtualKms::EventThread, kms.get());
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (unsigned i = 0; i < max_devices; i++) {
+        if (registry_devices[i].load(std::memory_order_relaxed) == nullptr) {
+            registry_fds[i].store(kms->m_Read, std::memory_order_relaxed);
+            registry_devices[i].store(kms.get(), std::memory_order_release);
+            return kms;
+        }
+    }
+    fprintf(stderr, "[!] too many virtual KMS devices.\n");
+    return nullptr;
+}
+
+bool VirtualKms::ParseConfig(const char* spec, VirtualKmsConfig* config)
+{
+    /* "1" just enables the defaults */
+    if (strcmp(spec, "1") == 0) {
+        return true;
+    }
+
+    std::string list(spec);
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty()) {
+            continue;
+        }
+
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) {
+            return false;
+        }
+        std::string key = item.substr(0, equals);
+        const char* value = item.c_str() + equals + 1;
+        char* end;
+
+        if (key == "outputs") {
+            unsigned long outputs = strtoul(value, &end, 10);
+            if (*end != '\0' || outputs == 0 || outputs > VirtualKmsConfig::max_outputs) {
+                return false;
+            }
+            config->outputs = outputs;
+        } else if (key == "refresh") {
+            double refresh = strtod(value, &end);
+            if (*end != '\0' || !(refresh > 0) || refresh > 1000) {
+                return false;
+            }
+            config->refresh = refresh;
+        } else if (key == "latency_us") {
+            double latency = strtod(value, &end);
+            if (*end != '\0' || !(latency >= 0) || latency > 10000000) {
+                return false;
+            }
+            config->commit_latency_ns = static_cast<uint64_t>(latency * 1000);
+        } else if (key == "mode") {
+            unsigned width, height;
+            char rest;
+            if (sscanf(value, "%ux%u%c", &width, &height, &rest) != 2 || width == 0 || width > max_size ||
+                height == 0 || height > max_size) {
+                return false;
+            }
+            config->width = width;
+            config->height = height;
+        } else if (key == "overlays") {
+            unsigned long overlays = strtoul(value, &end, 10);
+            if (*end != '\0' || overlays > max_overlays) {
+                return false;
+            }
+            config->overlays = overlays;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<VirtualKms> VirtualKms::FromEnv()
+{
+    const char* s = getenv("LABDRM_VIRTUAL");
+    VirtualKmsConfig config;
+
+    if (s == nullptr || s[0] == '\0') {
+        return nullptr;
+    }
+    if (!ParseConfig(s, &config)) {
+        fprintf(stderr, "[!] invalid LABDRM_VIRTUAL=%s\n", s);
+        return nullptr;
+    }
+    return Create(config);
+}
+
+VirtualKms* VirtualKms::Find(int fd)
+{
+    for (unsigned i = 0; i < max_devices; i++) {
+        VirtualKms* kms = registry_devices[i].load(std::memory_order_acquire);
+        if (kms != nullptr && registry_fds[i].load(std::memory_order_relaxed) == fd) {
+            return kms;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Every output is a connector with an encoder and a CRTC of its own, and a
+ * primary, `overlays` overlay and a cursor plane which only work with that
+ * CRTC. All objects and properties share one id space, like in the kernel.
+ */
+VirtualKms::VirtualKms(const VirtualKmsConfig& config)
+    : m_Config(config)
+{
+    static const char* const src_names[] = { "SRC_X", "SRC_Y", "SRC_W", "SRC_H" };
+    static const char* const dst_names[] = { "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H" };
+
+    m_PropType = AddProperty(DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE, "type",
+                             { DRM_PLANE_TYPE_OVERLAY, DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_CURSOR },
+                             { "Overlay", "Primary", "Cursor" });
+    m_PropFbId = AddProperty(DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, "FB_ID", { DRM_MODE_OBJECT_FB });
+    m_PropCrtcId = AddProperty(DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, "CRTC_ID", { DRM_MODE_OBJECT_CRTC });
+    for (int i = 0; i < 4; i++) {
+        m_PropSrc[i] = AddProperty(DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, src_names[i], { 0, UINT32_MAX });
+    }
+    for (int i = 0; i < 2; i++) {
+        m_PropDst[i] = AddProperty(DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, dst_names[i],
+                                   { static_cast<uint64_t>(static_cast<int64_t>(INT32_MIN)), INT32_MAX });
+    }
+    for (int i = 2; i < 4; i++) {
+        m_PropDst[i] = AddProperty(DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, dst_names[i], { 0, INT32_MAX });
+    }
+    m_PropDamage = AddProperty(DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC, "FB_DAMAGE_CLIPS", {});
+    m_PropZpos = AddProperty(DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, "zpos", { 0, config.overlays + 1 });
+    m_PropActive = AddProperty(DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, "ACTIVE", { 0, 1 });
+    m_PropModeId = AddProperty(DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC, "MODE_ID", {});
+
+    for (uint32_t i = 0; i < config.outputs; i++) {
+        Crtc crtc;
+        memset(&crtc, 0, sizeof(crtc));
+        crtc.id = AddObject(DRM_MODE_OBJECT_CRTC, i);
+        m_State.crtcs.push_back(crtc);
+
+        m_Encoders.push_back(AddObject(DRM_MODE_OBJECT_ENCODER, i));
+
+        Connector connector;
+        connector.id = AddObject(DRM_MODE_OBJECT_CONNECTOR, i);
+        connector.encoder = m_Encoders.back();
+        connector.crtc = 0;
+        m_State.connectors.push_back(connector);
+
+        for (uint32_t zpos = 0; zpos < config.overlays + 2; zpos++) {
+            Plane plane;
+            memset(&plane, 0, sizeof(plane));
+            plane.id = AddObject(DRM_MODE_OBJECT_PLANE, m_State.planes.size());
+            plane.type = zpos == 0                   ? DRM_PLANE_TYPE_PRIMARY
+                         : zpos == config.overlays + 1 ? DRM_PLANE_TYPE_CURSOR
+                                                       : DRM_PLANE_TYPE_OVERLAY;
+            plane.crtc_index = i;
+            plane.zpos = zpos;
+            m_State.planes.push_back(plane);
+        }
+    }
+
+    m_Modes.push_back(MakeMode(config.width, config.height));
+    m_Modes[0].type |= DRM_MODE_TYPE_PREFERRED;
+    for (const auto& size : standard_modes) {
+        if (size.width <= config.width && size.height <= config.height &&
+            (size.width != config.width || size.height != config.height)) {
+            m_Modes.push_back(MakeMode(size.width, size.height));
+        }
+    }
+}
+
+VirtualKms::~VirtualKms() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (unsigned i = 0; i < max_devices; i++) {
+            if (registry_devices[i].load(std::memory_order_relaxed) == this) {
+                registry_devices[i].store(nullptr, std::memory_order_release);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_Changed.notify_all();
+    if (m_Thread.joinable()) {
+        m_Thread.join();
+    }
+
+    for (auto& dumb : m_Dumbs) {
+        close(dumb.second.memfd);
+    }
+    if (m_Read >= 0) {
+        close(m_Read);
+    }
+    if (m_Write >= 0) {
+        close(m_Write);
+    }
+}
+
+uint32_t VirtualKms::AddObject(uint32_t type, uint32_t index)
+{
+    uint32_t id = m_NextId++;
+    m_Objects[id] = Object { type, index };
+    return id;
+}
+
+const VirtualKms::Object* VirtualKms::FindObject(uint32_t id, uint32_t type) const
+{
+    auto it = m_Objects.find(id);
+    if (it == m_Objects.end() || (type != DRM_MODE_OBJECT_ANY && it->second.type != type)) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+uint32_t VirtualKms::AddProperty(uint32_t flags, const char* name, std::vector<uint64_t> values,
+                                 std::vector<const char*> enums)
+{
+    Property prop;
+    prop.id = AddObject(DRM_MODE_OBJECT_PROPERTY, m_Props.size());
+    prop.flags = flags;
+    prop.name = name;
+    prop.values = std::move(values);
+    prop.enums = std::move(enums);
+    m_Props.push_back(std::move(prop));
+    return m_Props.back().id;
+}
+
+/*
+ * A mode with CVT reduced blanking like timings: short fixed blanking, which
+ * keeps the pixel clock of big modes at high refresh rates plausible.
+ */
+drmModeModeInfo VirtualKms::MakeMode(uint32_t width, uint32_t height) const
+{
+    drmModeModeInfo mode;
+
+    memset(&mode, 0, sizeof(mode));
+    mode.hdisplay = width;
+    mode.hsync_start = width + 48;
+    mode.hsync_end = width + 80;
+    mode.htotal = width + 160;
+    mode.vdisplay = height;
+    mode.vsync_start = height + 3;
+    mode.vsync_end = height + 8;
+    mode.vtotal = height + 8 + (height + 39) / 40;
+    mode.clock = static_cast<uint32_t>(llround(mode.htotal * mode.vtotal * m_Config.refresh / 1000.0));
+    mode.vrefresh = static_cast<uint32_t>(llround(mode.clock * 1000.0 / (mode.htotal * mode.vtotal)));
+    mode.type = DRM_MODE_TYPE_DRIVER;
+    snprintf(mode.name, sizeof(mode.name), "%ux%u", width, height);
+    return mode;
+}
+
+int VirtualKms::Ioctl(unsigned long request, void* arg)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    int ret;
+
+    switch (request) {
+    case DRM_IOCTL_VERSION:
+        ret = GetVersion(arg);
+        break;
+    case DRM_IOCTL_GET_CAP:
+        ret = GetCap(arg);
+        break;
+    case DRM_IOCTL_SET_CLIENT_CAP:
+        ret = SetClientCap(arg);
+        break;
+    case DRM_IOCTL_SET_MASTER:
+    case DRM_IOCTL_DROP_MASTER:
+        ret = 0;
+        break;
+    case DRM_IOCTL_MODE_GETRESOURCES:
+        ret = GetResources(arg);
+        break;
+    case DRM_IOCTL_MODE_GETCONNECTOR:
+        ret = GetConnector(arg);
+        break;
+    case DRM_IOCTL_MODE_GETENCODER:
+        ret = GetEncoder(arg);
+        break;
+    case DRM_IOCTL_MODE_GETCRTC:
+        ret = GetCrtc(arg);
+        break;
+    case DRM_IOCTL_MODE_GETPLANERESOURCES:
+        ret = GetPlaneResources(arg);
+        break;
+    case DRM_IOCTL_MODE_GETPLANE:
+        ret = GetPlane(arg);
+        break;
+    case DRM_IOCTL_MODE_GETPROPERTY:
+        ret = GetProperty(arg);
+        break;
+    case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+        ret = GetObjectProperties(arg);
+        break;
+    case DRM_IOCTL_MODE_CREATEPROPBLOB:
+        ret = CreateBlob(arg);
+        break;
+    case DRM_IOCTL_MODE_DESTROYPROPBLOB:
+        ret = DestroyBlob(arg);
+        break;
+    case DRM_IOCTL_MODE_GETPROPBLOB:
+        ret = GetBlob(arg);
+        break;
+    case DRM_IOCTL_MODE_CREATE_DUMB:
+        ret = CreateDumb(arg);
+        break;
+    case DRM_IOCTL_MODE_MAP_DUMB:
+        ret = MapDumb(arg);
+        break;
+    case DRM_IOCTL_MODE_DESTROY_DUMB:
+    case DRM_IOCTL_GEM_CLOSE:
+        /* both start with the handle */
+        ret = DestroyDumb(arg);
+        break;
+    case DRM_IOCTL_MODE_ADDFB:
+        ret = AddFramebuffer(arg);
+        break;
+    case DRM_IOCTL_MODE_ADDFB2:
+        ret = AddFramebuffer2(arg);
+        break;
+    case DRM_IOCTL_MODE_RMFB:
+        ret = RemoveFramebuffer(arg);
+        break;
+    case DRM_IOCTL_MODE_DIRTYFB:
+        ret = m_Fbs.count(static_cast<struct drm_mode_fb_dirty_cmd*>(arg)->fb_id) != 0 ? 0 : -ENOENT;
+        break;
+    case DRM_IOCTL_MODE_SETCRTC:
+        ret = SetCrtc(arg, lock);
+        break;
+    case DRM_IOCTL_MODE_PAGE_FLIP:
+        ret = PageFlip(arg, lock);
+        break;
+    case DRM_IOCTL_MODE_CURSOR:
+        ret = Cursor(arg);
+        break;
+    case DRM_IOCTL_MODE_ATOMIC:
+        ret = Atomic(arg, lock);
+        break;
+    case DRM_IOCTL_CRTC_GET_SEQUENCE:
+        ret = GetSequence(arg);
+        break;
+    case DRM_IOCTL_CRTC_QUEUE_SEQUENCE:
+        ret = QueueSequence(arg);
+        break;
+    case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+    case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+        ret = -EOPNOTSUPP;
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int VirtualKms::GetCap(void* arg)
+{
+    auto* cap = static_cast<struct drm_get_cap*>(arg);
+
+    switch (cap->capability) {
+    case DRM_CAP_DUMB_BUFFER:
+    case DRM_CAP_VBLANK_HIGH_CRTC:
+    case DRM_CAP_TIMESTAMP_MONOTONIC:
+    case DRM_CAP_ASYNC_PAGE_FLIP:
+    case DRM_CAP_ADDFB2_MODIFIERS:
+    case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+    case DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP:
+        cap->value = 1;
+        return 0;
+    case DRM_CAP_PRIME:
+        cap->value = 0;
+        return 0;
+    case DRM_CAP_CURSOR_WIDTH:
+    case DRM_CAP_CURSOR_HEIGHT:
+        cap->value = cursor_size;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+int VirtualKms::GetResources(void* arg)
+{
+    auto* res = static_cast<struct drm_mode_card_res*>(arg);
+    std::vector<uint32_t> fbs, crtcs, connectors;
+
+    for (const auto& fb : m_Fbs) {
+        fbs.push_back(fb.first);
+    }
+    for (const Crtc& crtc : m_State.crtcs) {
+        crtcs.push_back(crtc.id);
+    }
+    for (const Connector& connector : m_State.connectors) {
+        connectors.push_back(connector.id);
+    }
+
+    CopyOut(res->fb_id_ptr, &res->count_fbs, fbs.data(), fbs.size());
+    CopyOut(res->crtc_id_ptr, &res->count_crtcs, crtcs.data(), crtcs.size());
+    CopyOut(res->connector_id_ptr, &res->count_connectors, connectors.data(), connectors.size());
+    CopyOut(res->encoder_id_ptr, &res->count_encoders, m_Encoders.data(), m_Encoders.size());
+    res->min_width = 1;
+    res->max_width = max_size;
+    res->min_height = 1;
+    res->max_height = max_size;
+    return 0;
+}
+
+int VirtualKms::GetConnector(void* arg)
+{
+    auto* conn = static_cast<struct drm_mode_get_connector*>(arg);
+    const Object* obj = FindObject(conn->connector_id, DRM_MODE_OBJECT_CONNECTOR);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Connector& connector = m_State.connectors[obj->index];
+    uint32_t props[] = { m_PropCrtcId };
+    uint64_t values[] = { connector.crtc };
+    uint32_t count_props = conn->count_props;
+
+    CopyOut(conn->modes_ptr, &conn->count_modes, m_Modes.data(), m_Modes.size());
+    CopyOut(conn->encoders_ptr, &conn->count_encoders, &connector.encoder, 1);
+    CopyOut(conn->props_ptr, &conn->count_props, props, 1);
+    CopyOut(conn->prop_values_ptr, &count_props, values, 1);
+    conn->encoder_id = connector.crtc != 0 ? connector.encoder : 0;
+    conn->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+    conn->connector_type_id = obj->index + 1;
+    conn->connection = 1; // DRM_MODE_CONNECTED
+    /* 96 dpi */
+    conn->mm_width = m_Config.width * 254 / 960;
+    conn->mm_height = m_Config.height * 254 / 960;
+    conn->subpixel = 0;
+    return 0;
+}
+
+int VirtualKms::GetEncoder(void* arg)
+{
+    auto* enc = static_cast<struct drm_mode_get_encoder*>(arg);
+    const Object* obj = FindObject(enc->encoder_id, DRM_MODE_OBJECT_ENCODER);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+
+    enc->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+    enc->crtc_id = m_State.connectors[obj->index].crtc;
+    enc->possible_crtcs = 1u << obj->index;
+    enc->possible_clones = 1u << obj->index;
+    return 0;
+}
+
+int VirtualKms::GetCrtc(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_crtc*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Crtc& crtc = m_State.crtcs[obj->index];
+    const Plane& primary = m_State.planes[PrimaryPlane(obj->index)];
+
+    req->fb_id = primary.fb;
+    req->x = primary.src[0] >> 16;
+    req->y = primary.src[1] >> 16;
+    req->gamma_size = 0;
+    req->mode_valid = crtc.mode_blob != 0;
+    req->mode = crtc.mode;
+    return 0;
+}
+
+int VirtualKms::GetPlaneResources(void* arg)
+{
+    auto* res = static_cast<struct drm_mode_get_plane_res*>(arg);
+    std::vector<uint32_t> planes;
+
+    for (const Plane& plane : m_State.planes) {
+        planes.push_back(plane.id);
+    }
+    CopyOut(res->plane_id_ptr, &res->count_planes, planes.data(), planes.size());
+    return 0;
+}
+
+int VirtualKms::GetPlane(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_get_plane*>(arg);
+    const Object* obj = FindObject(req->plane_id, DRM_MODE_OBJECT_PLANE);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Plane& plane = m_State.planes[obj->index];
+
+    req->crtc_id = plane.crtc;
+    req->fb_id = plane.fb;
+    req->possible_crtcs = 1u << plane.crtc_index;
+    req->gamma_size = 0;
+    if (plane.type == DRM_PLANE_TYPE_CURSOR) {
+        CopyOut(req->format_type_ptr, &req->count_format_types, cursor_formats,
+                sizeof(cursor_formats) / sizeof(cursor_formats[0]));
+    } else {
+        CopyOut(req->format_type_ptr, &req->count_format_types, plane_formats,
+                sizeof(plane_formats) / sizeof(plane_formats[0]));
+    }
+    return 0;
+}
+
+int VirtualKms::GetProperty(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_get_property*>(arg);
+    const Object* obj = FindObject(req->prop_id, DRM_MODE_OBJECT_PROPERTY);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Property& prop = m_Props[obj->index];
+    std::vector<struct drm_mode_property_enum> enums(prop.enums.size());
+
+    for (size_t i = 0; i < prop.enums.size(); i++) {
+        memset(&enums[i], 0, sizeof(enums[i]));
+        enums[i].value = prop.values[i];
+        snprintf(enums[i].name, sizeof(enums[i].name), "%s", prop.enums[i]);
+    }
+
+    req->flags = prop.flags;
+    memset(req->name, 0, sizeof(req->name));
+    snprintf(req->name, sizeof(req->name), "%s", prop.name);
+    CopyOut(req->values_ptr, &req->count_values, prop.values.data(), prop.values.size());
+    CopyOut(req->enum_blob_ptr, &req->count_enum_blobs, enums.data(), enums.size());
+    return 0;
+}
+
+int VirtualKms::GetObjectProperties(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_obj_get_properties*>(arg);
+    const Object* obj = FindObject(req->obj_id, req->obj_type);
+    std::vector<uint32_t> props;
+    std::vector<uint64_t> values;
+
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    switch (obj->type) {
+    case DRM_MODE_OBJECT_CRTC: {
+        const Crtc& crtc = m_State.crtcs[obj->index];
+        props = { m_PropActive, m_PropModeId };
+        values = { crtc.active, crtc.mode_blob };
+        break;
+    }
+    case DRM_MODE_OBJECT_PLANE: {
+        const Plane& plane = m_State.planes[obj->index];
+        props = { m_PropType, m_PropFbId, m_PropCrtcId };
+        values = { plane.type, plane.fb, plane.crtc };
+        for (int i = 0; i < 4; i++) {
+            props.push_back(m_PropSrc[i]);
+            values.push_back(plane.src[i]);
+        }
+        for (int i = 0; i < 4; i++) {
+            props.push_back(m_PropDst[i]);
+            values.push_back(static_cast<uint64_t>(plane.dst[i]));
+        }
+        props.insert(props.end(), { m_PropDamage, m_PropZpos });
+        values.insert(values.end(), { 0, plane.zpos });
+        break;
+    }
+    case DRM_MODE_OBJECT_CONNECTOR:
+        props = { m_PropCrtcId };
+        values = { m_State.connectors[obj->index].crtc };
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    uint32_t count_values = req->count_props;
+    CopyOut(req->props_ptr, &req->count_props, props.data(), props.size());
+    CopyOut(req->prop_values_ptr, &count_values, values.data(), values.size());
+    return 0;
+}
+
+int VirtualKms::CreateBlob(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_create_blob*>(arg);
+
+    if (req->length == 0 || req->data == 0) {
+        return -EINVAL;
+    }
+    const auto* data = reinterpret_cast<const uint8_t*>(static_cast<uintptr_t>(req->data));
+    req->blob_id = AddObject(DRM_MODE_OBJECT_BLOB, 0);
+    m_Blobs[req->blob_id].assign(data, data + req->length);
+    return 0;
+}
+
+int VirtualKms::DestroyBlob(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_destroy_blob*>(arg);
+
+    if (m_Blobs.erase(req->blob_id) == 0) {
+        return -ENOENT;
+    }
+    m_Objects.erase(req->blob_id);
+    return 0;
+}
+
+int VirtualKms::GetBlob(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_get_blob*>(arg);
+    auto it = m_Blobs.find(req->blob_id);
+    if (it == m_Blobs.end()) {
+        return -ENOENT;
+    }
+
+    CopyOut(req->data, &req->length, it->second.data(), it->second.size());
+    return 0;
+}
+
+int VirtualKms::CreateDumb(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_create_dumb*>(arg);
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (req->width == 0 || req->width > max_size || req->height == 0 || req->height > max_size ||
+        req->bpp == 0 || req->bpp > 64 || req->flags != 0) {
+        return -EINVAL;
+    }
+
+    Dumb dumb;
+    dumb.pitch = (req->width * ((req->bpp + 7) / 8) + 63) & ~63u;
+    dumb.size = (static_cast<uint64_t>(dumb.pitch) * req->height + page - 1) & ~static_cast<uint64_t>(page - 1);
+    dumb.memfd = memfd_create("labdrm-virtual-dumb", MFD_CLOEXEC);
+    if (dumb.memfd < 0) {
+        return -errno;
+    }
+    if (ftruncate(dumb.memfd, dumb.size) != 0) {
+        int ret = -errno;
+        close(dumb.memfd);
+        return ret;
+    }
+    dumb.offset = dumb_offset_start + m_NextOffset;
+    m_NextOffset += dumb.size;
+
+    req->handle = m_NextHandle++;
+    req->pitch = dumb.pitch;
+    req->size = dumb.size;
+    m_Dumbs[req->handle] = dumb;
+    return 0;
+}
+
+int VirtualKms::MapDumb(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_map_dumb*>(arg);
+    auto it = m_Dumbs.find(req->handle);
+    if (it == m_Dumbs.end()) {
+        return -ENOENT;
+    }
+
+    req->offset = it->second.offset;
+    return 0;
+}
+
+int VirtualKms::DestroyDumb(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_destroy_dumb*>(arg);
+    auto it = m_Dumbs.find(req->handle);
+    if (it == m_Dumbs.end()) {
+        return -EINVAL;
+    }
+
+    close(it->second.memfd);
+    m_Dumbs.erase(it);
+    return 0;
+}
+
+/* legacy ADDFB is ADDFB2 with a format from bpp and depth */
+int VirtualKms::AddFramebuffer(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_fb_cmd*>(arg);
+    struct drm_mode_fb_cmd2 cmd2;
+
+    memset(&cmd2, 0, sizeof(cmd2));
+    if (req->bpp == 32 && req->depth == 24) {
+        cmd2.pixel_format = DRM_FORMAT_XRGB8888;
+    } else if (req->bpp == 32 && req->depth == 32) {
+        cmd2.pixel_format = DRM_FORMAT_ARGB8888;
+    } else if (req->bpp == 16 && req->depth == 16) {
+        cmd2.pixel_format = DRM_FORMAT_RGB565;
+    } else {
+        return -EINVAL;
+    }
+    cmd2.width = req->width;
+    cmd2.height = req->height;
+    cmd2.handles[0] = req->handle;
+    cmd2.pitches[0] = req->pitch;
+
+    int ret = AddFramebuffer2(&cmd2);
+    req->fb_id = cmd2.fb_id;
+    return ret;
+}
+
+int VirtualKms::AddFramebuffer2(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_fb_cmd2*>(arg);
+    uint32_t cpp = FormatCpp(req->pixel_format);
+
+    if (cpp == 0 || (req->flags & ~DRM_MODE_FB_MODIFIERS) != 0 || req->width == 0 || req->width > max_size ||
+        req->height == 0 || req->height > max_size) {
+        return -EINVAL;
+    }
+    if ((req->flags & DRM_MODE_FB_MODIFIERS) && req->modifier[0] != DRM_FORMAT_MOD_LINEAR) {
+        return -EINVAL;
+    }
+
+    auto it = m_Dumbs.find(req->handles[0]);
+    if (it == m_Dumbs.end()) {
+        return -ENOENT;
+    }
+    uint64_t end = req->offsets[0] + static_cast<uint64_t>(req->pitches[0]) * (req->height - 1) +
+                   static_cast<uint64_t>(req->width) * cpp;
+    if (req->pitches[0] < req->width * cpp || end > it->second.size) {
+        return -EINVAL;
+    }
+
+    Framebuffer fb;
+    fb.width = req->width;
+    fb.height = req->height;
+    fb.format = req->pixel_format;
+    fb.handle = req->handles[0];
+    fb.pitch = req->pitches[0];
+    fb.offset = req->offsets[0];
+    req->fb_id = AddObject(DRM_MODE_OBJECT_FB, 0);
+    m_Fbs[req->fb_id] = fb;
+    return 0;
+}
+
+/* like the kernel, removing a framebuffer takes it off the planes showing it */
+int VirtualKms::RemoveFramebuffer(void* arg)
+{
+    uint32_t id = *static_cast<unsigned int*>(arg);
+
+    if (m_Fbs.erase(id) == 0) {
+        return -ENOENT;
+    }
+    m_Objects.erase(id);
+    for (Plane& plane : m_State.planes) {
+        if (plane.fb == id) {
+            plane.fb = 0;
+            plane.crtc = 0;
+        }
+    }
+    return 0;
+}
+
+int VirtualKms::SetProperty(State* state, uint32_t object, uint32_t prop, uint64_t value, uint32_t* crtcs) const
+{
+    const Object* obj = FindObject(object, DRM_MODE_OBJECT_ANY);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+
+    switch (obj->type) {
+    case DRM_MODE_OBJECT_CRTC: {
+        Crtc& crtc = state->crtcs[obj->index];
+        *crtcs |= 1u << obj->index;
+        if (prop == m_PropActive) {
+            if (value > 1) {
+                return -EINVAL;
+            }
+            crtc.active = value != 0;
+        } else if (prop == m_PropModeId) {
+            if (value == 0) {
+                crtc.mode_blob = 0;
+                memset(&crtc.mode, 0, sizeof(crtc.mode));
+                return 0;
+            }
+            auto it = m_Blobs.find(value);
+            if (it == m_Blobs.end() || it->second.size() != sizeof(drmModeModeInfo)) {
+                return -EINVAL;
+            }
+            memcpy(&crtc.mode, it->second.data(), sizeof(crtc.mode));
+            if (!ValidMode(crtc.mode)) {
+                return -EINVAL;
+            }
+            crtc.mode_blob = value;
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    case DRM_MODE_OBJECT_PLANE: {
+        Plane& plane = state->planes[obj->index];
+        *crtcs |= 1u << plane.crtc_index;
+        if (prop == m_PropFbId) {
+            if (value != 0 && m_Fbs.count(value) == 0) {
+                return -EINVAL;
+            }
+            plane.fb = value;
+        } else if (prop == m_PropCrtcId) {
+            if (value != 0 && value != state->crtcs[plane.crtc_index].id) {
+                return -EINVAL;
+            }
+            plane.crtc = value;
+        } else if (prop == m_PropDamage) {
+            if (value != 0) {
+                auto it = m_Blobs.find(value);
+                if (it == m_Blobs.end() || it->second.size() % sizeof(struct drm_mode_rect) != 0) {
+                    return -EINVAL;
+                }
+            }
+        } else {
+            for (int i = 0; i < 4; i++) {
+                if (prop == m_PropSrc[i]) {
+                    if (value > UINT32_MAX) {
+                        return -EINVAL;
+                    }
+                    plane.src[i] = value;
+                    return 0;
+                }
+                if (prop == m_PropDst[i]) {
+                    int64_t v = static_cast<int64_t>(value);
+                    if (v > INT32_MAX || v < (i < 2 ? INT32_MIN : 0)) {
+                        return -EINVAL;
+                    }
+                    plane.dst[i] = v;
+                    return 0;
+                }
+            }
+            /* also the immutable type and zpos */
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    case DRM_MODE_OBJECT_CONNECTOR: {
+        Connector& connector = state->connectors[obj->index];
+        *crtcs |= 1u << obj->index;
+        if (prop != m_PropCrtcId || (value != 0 && value != state->crtcs[obj->index].id)) {
+            return -EINVAL;
+        }
+        connector.crtc = value;
+        return 0;
+    }
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/*
+ * The checks of drm_atomic_helper_check() which matter here. What the
+ * kernel would reject, the virtual device rejects too, so a configuration
+ * that works on it doesn't fail on hardware for a reason this could tell.
+ */
+int VirtualKms::CheckState(const State& state) const
+{
+    for (size_t i = 0; i < state.crtcs.size(); i++) {
+        const Crtc& crtc = state.crtcs[i];
+        bool enabled = crtc.mode_blob != 0;
+        if (crtc.active && !enabled) {
+            return -EINVAL;
+        }
+        if (enabled != (state.connectors[i].crtc != 0)) {
+            return -EINVAL;
+        }
+    }
+
+    for (const Plane& plane : state.planes) {
+        if ((plane.fb == 0) != (plane.crtc == 0)) {
+            return -EINVAL;
+        }
+        if (plane.fb == 0) {
+            continue;
+        }
+        const Crtc& crtc = state.crtcs[plane.crtc_index];
+        auto it = m_Fbs.find(plane.fb);
+        if (crtc.mode_blob == 0 || it == m_Fbs.end()) {
+            return -EINVAL;
+        }
+
+        const Framebuffer& fb = it->second;
+        if (plane.src[2] == 0 || plane.src[3] == 0 || plane.dst[2] == 0 || plane.dst[3] == 0 ||
+            plane.src[0] + plane.src[2] > static_cast<uint64_t>(fb.width) << 16 ||
+            plane.src[1] + plane.src[3] > static_cast<uint64_t>(fb.height) << 16) {
+            return -EINVAL;
+        }
+        if (plane.type == DRM_PLANE_TYPE_CURSOR &&
+            (plane.dst[2] > max_cursor_size || plane.dst[3] > max_cursor_size || fb.format != DRM_FORMAT_ARGB8888)) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The rule of async commits since Linux 6.9: besides FB_ID of primary planes
+ * (and FB_DAMAGE_CLIPS, which isn't kept here), properties may only be set
+ * to the values they have.
+ */
+bool VirtualKms::AsyncFlip(const State& state) const
+{
+    for (size_t i = 0; i < state.crtcs.size(); i++) {
+        const Crtc& a = m_State.crtcs[i];
+        const Crtc& b = state.crtcs[i];
+        if (a.active != b.active || a.mode_blob != b.mode_blob ||
+            m_State.connectors[i].crtc != state.connectors[i].crtc) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < state.planes.size(); i++) {
+        const Plane& a = m_State.planes[i];
+        const Plane& b = state.planes[i];
+        if (a.crtc != b.crtc || memcmp(a.src, b.src, sizeof(a.src)) != 0 || memcmp(a.dst, b.dst, sizeof(a.dst)) != 0) {
+            return false;
+        }
+        if (a.fb != b.fb && b.type != DRM_PLANE_TYPE_PRIMARY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VirtualKms::Busy(uint32_t crtcs) const
+{
+    for (size_t i = 0; i < m_State.crtcs.size(); i++) {
+        if ((crtcs & (1u << i)) && m_State.crtcs[i].busy_until != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int VirtualKms::Atomic(void* arg, std::unique_lock<std::mutex>& lock)
+{
+    auto* req = static_cast<struct drm_mode_atomic*>(arg);
+    const auto* objs = reinterpret_cast<const uint32_t*>(static_cast<uintptr_t>(req->objs_ptr));
+    const auto* count_props = reinterpret_cast<const uint32_t*>(static_cast<uintptr_t>(req->count_props_ptr));
+    const auto* props = reinterpret_cast<const uint32_t*>(static_cast<uintptr_t>(req->props_ptr));
+    const auto* values = reinterpret_cast<const uint64_t*>(static_cast<uintptr_t>(req->prop_values_ptr));
+
+    if ((req->flags & ~DRM_MODE_ATOMIC_FLAGS) != 0 || req->reserved != 0) {
+        return -EINVAL;
+    }
+    if ((req->flags & DRM_MODE_ATOMIC_TEST_ONLY) && (req->flags & DRM_MODE_PAGE_FLIP_EVENT)) {
+        return -EINVAL;
+    }
+
+    /* a blocking commit waits for the pending ones on its CRTCs, then
+     * starts over from the state they left */
+    for (;;) {
+        State state = m_State;
+        uint32_t crtcs = 0;
+        size_t k = 0;
+
+        for (uint32_t i = 0; i < req->count_objs; i++) {
+            for (uint32_t j = 0; j < count_props[i]; j++, k++) {
+                int ret = SetProperty(&state, objs[i], props[k], values[k], &crtcs);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+
+        int ret = CheckState(state);
+        if (ret != 0) {
+            return ret;
+        }
+
+        bool modeset = false;
+        for (size_t i = 0; i < state.crtcs.size(); i++) {
+            const Crtc& a = m_State.crtcs[i];
+            const Crtc& b = state.crtcs[i];
+            modeset |= a.active != b.active || memcmp(&a.mode, &b.mode, sizeof(a.mode)) != 0 ||
+                       m_State.connectors[i].crtc != state.connectors[i].crtc;
+        }
+        if (modeset && (!(req->flags & DRM_MODE_ATOMIC_ALLOW_MODESET) || (req->flags & DRM_MODE_PAGE_FLIP_ASYNC))) {
+            return -EINVAL;
+        }
+        if ((req->flags & DRM_MODE_PAGE_FLIP_ASYNC) && !AsyncFlip(state)) {
+            return -EINVAL;
+        }
+        if (req->flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+            return 0;
+        }
+
+        if (Busy(crtcs)) {
+            if (req->flags & DRM_MODE_ATOMIC_NONBLOCK) {
+                return -EBUSY;
+            }
+            m_Changed.wait(lock);
+            continue;
+        }
+
+        Commit(state, crtcs, req->flags, req->user_data, lock);
+        return 0;
+    }
+}
+
+/*
+ * Apply a checked state. Each CRTC of the commit is busy until the commit
+ * completes on it, which its event marks: at the first vblank after the
+ * latency, or when a CRTC which is enabled starts scanning out.
+ */
+void VirtualKms::Commit(State& state, uint32_t crtcs, uint32_t flags, uint64_t user_data,
+                        std::unique_lock<std::mutex>& lock)
+{
+    uint64_t now = NowNs();
+    uint64_t ready = now + m_Config.commit_latency_ns;
+
+    for (uint32_t i = 0; i < state.crtcs.size(); i++) {
+        if (!(crtcs & (1u << i))) {
+            continue;
+        }
+        const Crtc& old = m_State.crtcs[i];
+        Crtc& crtc = state.crtcs[i];
+        uint64_t when;
+
+        if (old.active != crtc.active || memcmp(&old.mode, &crtc.mode, sizeof(old.mode)) != 0) {
+            /* the count continues where it stopped, like the kernel's */
+            crtc.base = Sequence(old, now);
+            if (crtc.active) {
+                crtc.base++;
+                crtc.epoch = ready;
+                crtc.period = static_cast<uint64_t>(crtc.mode.htotal) * crtc.mode.vtotal * 1000000ull / crtc.mode.clock;
+            }
+            when = ready;
+        } else if (!crtc.active || (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+            when = ready;
+        } else {
+            when = NextVblank(crtc, ready);
+        }
+
+        crtc.busy_until = when;
+        Queue(Event { when, (flags & DRM_MODE_PAGE_FLIP_EVENT) ? EventType::Flip : EventType::Done, i, 0, user_data });
+    }
+
+    m_State = std::move(state);
+    m_Changed.notify_all();
+
+    if (!(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+        while (Busy(crtcs)) {
+            m_Changed.wait(lock);
+        }
+    }
+}
+
+/* legacy SETCRTC: a blocking modeset of one CRTC with the primary plane full screen */
+int VirtualKms::SetCrtc(void* arg, std::unique_lock<std::mutex>& lock)
+{
+    auto* req = static_cast<struct drm_mode_crtc*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    uint32_t index = obj->index;
+
+    while (Busy(1u << index)) {
+        m_Changed.wait(lock);
+    }
+
+    State state = m_State;
+    Crtc& crtc = state.crtcs[index];
+    if (!req->mode_valid) {
+        crtc.active = false;
+        crtc.mode_blob = 0;
+        memset(&crtc.mode, 0, sizeof(crtc.mode));
+        for (Plane& plane : state.planes) {
+            if (plane.crtc_index == index) {
+                plane.fb = 0;
+                plane.crtc = 0;
+            }
+        }
+        state.connectors[index].crtc = 0;
+    } else {
+        const auto* connectors = reinterpret_cast<const uint32_t*>(static_cast<uintptr_t>(req->set_connectors_ptr));
+        if (req->count_connectors == 0 || !ValidMode(req->mode)) {
+            return -EINVAL;
+        }
+        if (m_Fbs.count(req->fb_id) == 0) {
+            return -ENOENT;
+        }
+        state.connectors[index].crtc = 0;
+        for (uint32_t i = 0; i < req->count_connectors; i++) {
+            const Object* conn = FindObject(connectors[i], DRM_MODE_OBJECT_CONNECTOR);
+            if (conn == nullptr) {
+                return -ENOENT;
+            }
+            if (conn->index != index) {
+                return -EINVAL;
+            }
+            state.connectors[index].crtc = crtc.id;
+        }
+
+        /* the kernel also wraps a legacy mode into a blob */
+        if (memcmp(&crtc.mode, &req->mode, sizeof(crtc.mode)) != 0 || crtc.mode_blob == 0) {
+            crtc.mode_blob = AddObject(DRM_MODE_OBJECT_BLOB, 0);
+            const auto* data = reinterpret_cast<const uint8_t*>(&req->mode);
+            m_Blobs[crtc.mode_blob].assign(data, data + sizeof(req->mode));
+        }
+        crtc.active = true;
+        crtc.mode = req->mode;
+
+        Plane& primary = state.planes[PrimaryPlane(index)];
+        primary.fb = req->fb_id;
+        primary.crtc = crtc.id;
+        primary.src[0] = static_cast<uint64_t>(req->x) << 16;
+        primary.src[1] = static_cast<uint64_t>(req->y) << 16;
+        primary.src[2] = static_cast<uint64_t>(req->mode.hdisplay) << 16;
+        primary.src[3] = static_cast<uint64_t>(req->mode.vdisplay) << 16;
+        primary.dst[0] = 0;
+        primary.dst[1] = 0;
+        primary.dst[2] = req->mode.hdisplay;
+        primary.dst[3] = req->mode.vdisplay;
+    }
+
+    int ret = CheckState(state);
+    if (ret != 0) {
+        return ret;
+    }
+    Commit(state, 1u << index, DRM_MODE_ATOMIC_ALLOW_MODESET, 0, lock);
+    return 0;
+}
+
+/* legacy PAGE_FLIP: a nonblocking commit of the primary plane's framebuffer */
+int VirtualKms::PageFlip(void* arg, std::unique_lock<std::mutex>& lock)
+{
+    auto* req = static_cast<struct drm_mode_crtc_page_flip*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+
+    if ((req->flags & ~(DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC)) != 0 || req->reserved != 0) {
+        return -EINVAL;
+    }
+    if (obj == nullptr || m_Fbs.count(req->fb_id) == 0) {
+        return -ENOENT;
+    }
+    if (!m_State.crtcs[obj->index].active || m_State.planes[PrimaryPlane(obj->index)].fb == 0) {
+        return -EINVAL;
+    }
+    if (Busy(1u << obj->index)) {
+        return -EBUSY;
+    }
+
+    State state = m_State;
+    state.planes[PrimaryPlane(obj->index)].fb = req->fb_id;
+    int ret = CheckState(state);
+    if (ret != 0) {
+        return ret;
+    }
+    Commit(state, 1u << obj->index, DRM_MODE_ATOMIC_NONBLOCK | req->flags, req->user_data, lock);
+    return 0;
+}
+
+/*
+ * legacy CURSOR: like with the kernel's universal planes, the buffer gets a
+ * framebuffer of its own on the cursor plane. The update takes effect at
+ * once, without waiting for a vblank or a pending commit, and sends no
+ * event, like the kernel's legacy cursor updates.
+ */
+int VirtualKms::Cursor(void* arg)
+{
+    auto* req = static_cast<struct drm_mode_cursor*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+
+    if (req->flags == 0 || (req->flags & ~(DRM_MODE_CURSOR_BO | DRM_MODE_CURSOR_MOVE)) != 0) {
+        return -EINVAL;
+    }
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+
+    State state = m_State;
+    Plane& plane = state.planes[PrimaryPlane(obj->index) + m_Config.overlays + 1];
+    uint32_t fb = 0;
+    if (req->flags & DRM_MODE_CURSOR_BO) {
+        if (req->handle != 0) {
+            auto it = m_Dumbs.find(req->handle);
+            if (it == m_Dumbs.end()) {
+                return -ENOENT;
+            }
+            if (req->width == 0 || req->width > max_cursor_size || req->height == 0 ||
+                req->height > max_cursor_size ||
+                static_cast<uint64_t>(req->width) * req->height * 4 > it->second.size) {
+                return -EINVAL;
+            }
+            fb = AddObject(DRM_MODE_OBJECT_FB, 0);
+            m_Fbs[fb] = Framebuffer { req->width, req->height, DRM_FORMAT_ARGB8888, req->handle, req->width * 4, 0 };
+        }
+        plane.fb = fb;
+        plane.crtc = fb != 0 ? state.crtcs[obj->index].id : 0;
+        plane.src[0] = 0;
+        plane.src[1] = 0;
+        plane.src[2] = static_cast<uint64_t>(req->width) << 16;
+        plane.src[3] = static_cast<uint64_t>(req->height) << 16;
+        plane.dst[2] = req->width;
+        plane.dst[3] = req->height;
+    }
+    if (req->flags & DRM_MODE_CURSOR_MOVE) {
+        plane.dst[0] = req->x;
+        plane.dst[1] = req->y;
+    }
+
+    int ret = CheckState(state);
+    if (ret != 0) {
+        if (fb != 0) {
+            m_Fbs.erase(fb);
+            m_Objects.erase(fb);
+        }
+        return ret;
+    }
+
+    /* the framebuffer the last legacy cursor update made goes with the buffer */
+    if (req->flags & DRM_MODE_CURSOR_BO) {
+        auto old = m_CursorFbs.find(obj->index);
+        if (old != m_CursorFbs.end()) {
+            m_Fbs.erase(old->second);
+            m_Objects.erase(old->second);
+            m_CursorFbs.erase(old);
+        }
+        if (fb != 0) {
+            m_CursorFbs[obj->index] = fb;
+        }
+    }
+    /* only the cursor plane, whatever a pending commit does to the others */
+    m_State.planes[PrimaryPlane(obj->index) + m_Config.overlays + 1] = plane;
+    return 0;
+}
+
+int VirtualKms::GetSequence(void* arg)
+{
+    auto* req = static_cast<struct drm_crtc_get_sequence*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Crtc& crtc = m_State.crtcs[obj->index];
+    uint64_t sequence = Sequence(crtc, NowNs());
+
+    req->active = crtc.active;
+    req->sequence = sequence;
+    req->sequence_ns = crtc.active ? VblankTime(crtc, sequence) : 0;
+    return 0;
+}
+
+int VirtualKms::QueueSequence(void* arg)
+{
+    auto* req = static_cast<struct drm_crtc_queue_sequence*>(arg);
+    const Object* obj = FindObject(req->crtc_id, DRM_MODE_OBJECT_CRTC);
+    if (obj == nullptr) {
+        return -ENOENT;
+    }
+    const Crtc& crtc = m_State.crtcs[obj->index];
+
+    if ((req->flags & ~(DRM_CRTC_SEQUENCE_RELATIVE | DRM_CRTC_SEQUENCE_NEXT_ON_MISS)) != 0 || !crtc.active) {
+        return -EINVAL;
+    }
+
+    uint64_t now = NowNs();
+    uint64_t current = Sequence(crtc, now);
+    uint64_t target = req->flags & DRM_CRTC_SEQUENCE_RELATIVE ? current + req->sequence : req->sequence;
+    if ((req->flags & DRM_CRTC_SEQUENCE_NEXT_ON_MISS) && target <= current) {
+        target = current + 1;
+    }
+
+    /* a vblank which has passed signals right away, like in the kernel */
+    if (target <= current) {
+        Queue(Event { now, EventType::Sequence, obj->index, current, req->user_data });
+    } else {
+        Queue(Event { VblankTime(crtc, target), EventType::Sequence, obj->index, target, req->user_data });
+    }
+    req->sequence = target;
+    return 0;
+}
+
+/*
+ * The vblank count of a CRTC: `base` at `epoch`, then one per period. Before
+ * the epoch of a CRTC being enabled it is the count at which it stopped.
+ */
+uint64_t VirtualKms::Sequence(const Crtc& crtc, uint64_t now) const
+{
+    if (!crtc.active) {
+        return crtc.base;
+    }
+    if (now < crtc.epoch) {
+        return crtc.base - 1;
+    }
+    return crtc.base + (now - crtc.epoch) / crtc.period;
+}
+
+uint64_t VirtualKms::VblankTime(const Crtc& crtc, uint64_t sequence) const
+{
+    return crtc.epoch + (sequence - crtc.base) * crtc.period;
+}
+
+/* the first vblank at or after `at` */
+uint64_t VirtualKms::NextVblank(const Crtc& crtc, uint64_t at) const
+{
+    if (at <= crtc.epoch) {
+        return crtc.epoch;
+    }
+    return crtc.epoch + (at - crtc.epoch + crtc.period - 1) / crtc.period * crtc.period;
+}
+
+void VirtualKms::Queue(const Event& event)
+{
+    m_Events.emplace(event.when, event);
+    m_Changed.notify_all();
+}
+
+/*
+ * Completes commits and delivers events when they are due. It waits on the
+ * same condition variable as blocking commits, which it wakes when a CRTC
+ * stops being busy.
+ */
+void VirtualKms::EventThread()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    while (!m_Quit) {
+        if (m_Events.empty()) {
+            m_Changed.wait(lock);
+            continue;
+        }
+
+        auto it = m_Events.begin();
+        if (it->first > NowNs()) {
+            m_Changed.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(it->first)));
+            continue;
+        }
+
+        Event event = it->second;
+        m_Events.erase(it);
+        if (event.type != EventType::Sequence) {
+            Crtc& crtc = m_State.crtcs[event.crtc_index];
+            if (crtc.busy_until == event.when) {
+                crtc.busy_until = 0;
+                m_Changed.notify_all();
+            }
+        }
+        Write(event);
+    }
+}
+
+void VirtualKms::Write(const Event& event)
+{
+    const Crtc& crtc = m_State.crtcs[event.crtc_index];
+    ssize_t ret;
+
+    if (event.type == EventType::Done) {
+        return;
+    }
+
+    if (event.type == EventType::Flip) {
+        struct drm_event_vblank vblank;
+        memset(&vblank, 0, sizeof(vblank));
+        vblank.base.type = DRM_EVENT_FLIP_COMPLETE;
+        vblank.base.length = sizeof(vblank);
+        vblank.user_data = event.user_data;
+        vblank.tv_sec = event.when / 1000000000ull;
+        vblank.tv_usec = event.when % 1000000000ull / 1000;
+        vblank.sequence = static_cast<uint32_t>(Sequence(crtc, event.when));
+        vblank.crtc_id = crtc.id;
+        ret = write(m_Write, &vblank, sizeof(vblank));
+    } else {
+        struct drm_event_crtc_sequence sequence;
+        memset(&sequence, 0, sizeof(sequence));
+        sequence.base.type = DRM_EVENT_CRTC_SEQUENCE;
+        sequence.base.length = sizeof(sequence);
+        sequence.user_data = event.user_data;
+        sequence.time_ns = event.when;
+        sequence.sequence = event.sequence;
+        ret = write(m_Write, &sequence, sizeof(sequence));
+    }
+
+    /* events are far smaller than PIPE_BUF, so they are written whole or not at all */
+    if (ret < 0) {
+        m_Dropped++;
+    }
+}
+
+void* VirtualKms::Map(size_t size, uint64_t offset)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    for (const auto& it : m_Dumbs) {
+        if (it.second.offset == offset) {
+            if (size > it.second.size) {
+                break;
+            }
+            return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, it.second.memfd, 0);
+        }
+    }
+    errno = EINVAL;
+    return MAP_FAILED;
+}
+
+uint64_t VirtualKms::DroppedEvents()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Dropped;
+}
+
+void* MapDevice(int drm_fd, size_t size, uint64_t offset)
+{
+    VirtualKms* kms = VirtualKms::Find(drm_fd);
+
+    if (kms != nullptr) {
+        return kms->Map(size, offset);
+    }
+    return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, offset);
+}
+
+} // namespace DrmLab
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+namespace DrmLab
+{
+
+/**
+ * @brief What a VirtualKms device looks like.
+ */
+struct VirtualKmsConfig
+{
+    static constexpr unsigned max_outputs = 32; // possible_crtcs is a 32 bit mask
+
+    unsigned outputs = 1;           // connectors, each with an encoder and a CRTC of its own
+    uint32_t width = 1920;          // preferred mode of every connector
+    uint32_t height = 1080;
+    double refresh = 60.0;          // Hz
+    uint64_t commit_latency_ns = 0; // a commit completes at the first vblank this long after it
+    unsigned overlays = 1;          // overlay planes per CRTC, besides a primary and a cursor plane
+};
+
+/**
+ * @brief An in-process KMS device, for profiling the frame pipeline without
+ * hardware or root.
+ *
+ * It has a file descriptor like a DRM device, which the examples use as
+ * usual: libdrm's calls end up in ioctl(), which virtual_kms_ioctl.cpp
+ * interposes for the fds of virtual devices, and the device implements what
+ * the examples use. That is resources, connectors, encoders, CRTCs, planes
+ * and their properties, property blobs, dumb buffers and framebuffers,
+ * atomic and legacy commits, legacy cursor updates, page-flip events, and
+ * the CRTC sequence ioctls. The fd is the read end of a pipe, so epoll and
+ * drmHandleEvent() work unchanged.
+ *
+ * virtual_kms_ioctl.cpp replaces ioctl() for the whole process, so it isn't
+ * part of labdrm: binaries which create devices link it themselves
+ * (labdrm_virtual_kms_ioctl), and Create() fails without it.
+ *
+ * Each active CRTC has vblanks at the period of its mode, counted from
+ * when it was enabled. A commit completes at the first vblank at least
+ * commit_latency_ns after it, when its events are written to the fd, and
+ * keeps its CRTCs busy until then: like a real driver a nonblocking commit
+ * fails with EBUSY in between, and a blocking one waits. Async page-flips
+ * complete after the latency, without waiting for a vblank.
+ *
+ * Nothing is scanned out: framebuffers are checked, not read. Dumb buffers
+ * are memfds, mapped with MapDevice() since there is no driver to mmap()
+ * the fd; prime import isn't supported, so only dumb buffers work.
+ */
+class VirtualKms
+{
+public:
+    /**
+     * @return nullptr if the pipe or the event thread can't be created, or
+     * virtual_kms_ioctl.cpp isn't linked in
+     */
+    static std::unique_ptr<VirtualKms> Create(const VirtualKmsConfig& config);
+
+    /**
+     * @brief Parse "outputs=32,refresh=240,latency_us=500,mode=1920x1080,
+     * overlays=1"; every key is optional.
+     * @return false on an unknown key or a bad value
+     */
+    static bool ParseConfig(const char* spec, VirtualKmsConfig* config);
+
+    /**
+     * @brief Create() from LABDRM_VIRTUAL, see ParseConfig(); nullptr if it
+     * is unset or invalid.
+     */
+    static std::unique_ptr<VirtualKms> FromEnv();
+
+    /**
+     * @brief The device of a file descriptor, nullptr for any other fd.
+     */
+    static VirtualKms* Find(int fd);
+
+    /**
+     * @brief Closes the fd; the buffers still mapped stay valid until
+     * they're unmapped.
+     */
+    ~VirtualKms() noexcept;
+
+    VirtualKms(const VirtualKms&) = delete;
+    VirtualKms& operator=(const VirtualKms&) = delete;
+
+    int Fd() const { return m_Read; }
+    const VirtualKmsConfig& Config() const { return m_Config; }
+
+    /**
+     * @brief Handle a DRM ioctl, see ioctl(2).
+     * @return 0 on success, -1 with errno set otherwise
+     */
+    int Ioctl(unsigned long request, void* arg);
+
+    /**
+     * @brief Map the dumb buffer at the fake `offset` of MAP_DUMB.
+     * @return MAP_FAILED with errno set on failure
+     */
+    void* Map(size_t size, uint64_t offset);
+
+    /**
+     * @brief Number of events not written to the fd because the reader
+     * fell too far behind.
+     */
+    uint64_t DroppedEvents();
+
+private:
+    struct Property
+    {
+        uint32_t id;
+        uint32_t flags;
+        const char* name;
+        std::vector<uint64_t> values;  // range limits, the object type, or enum values
+        std::vector<const char*> enums;
+    };
+
+    struct Crtc
+    {
+        uint32_t id;
+        bool active;
+        uint32_t mode_blob;
+        drmModeModeInfo mode;
+        uint64_t period;      // ns between vblanks
+        uint64_t epoch;       // time of vblank `base`
+        uint64_t base;        // vblank count when the CRTC was enabled
+        uint64_t busy_until;  // a commit is pending until then, 0 if none
+    };
+
+    struct Plane
+    {
+        uint32_t id;
+        uint32_t type;
+        uint32_t crtc_index; // the only CRTC it can be used with
+        uint32_t zpos;
+        uint32_t fb;
+        uint32_t crtc;
+        uint64_t src[4];     // x, y, w, h in 16.16
+        int64_t dst[4];      // x, y, w, h
+    };
+
+    struct Connector
+    {
+        uint32_t id;
+        uint32_t encoder;
+        uint32_t crtc;
+    };
+
+    struct Dumb
+    {
+        int memfd;
+        uint64_t size;
+        uint32_t pitch;
+        uint64_t offset;
+    };
+
+    struct Framebuffer
+    {
+        uint32_t width;
+        uint32_t height;
+        uint32_t format;
+        uint32_t handle;
+        uint32_t pitch;
+        uint32_t offset;
+    };
+
+    /* a full copy of what commits change, to check and apply atomically */
+    struct State
+    {
+        std::vector<Crtc> crtcs;
+        std::vector<Plane> planes;
+        std::vector<Connector> connectors;
+    };
+
+    enum class EventType
+    {
+        Done,     // a commit without events completed
+        Flip,     // ... with DRM_MODE_PAGE_FLIP_EVENT
+        Sequence, // a queued CRTC sequence was reached
+    };
+
+    struct Event
+    {
+        uint64_t when;
+        EventType type;
+        uint32_t crtc_index;
+        uint64_t sequence;
+        uint64_t user_data;
+    };
+
+    struct Object
+    {
+        uint32_t type; // DRM_MODE_OBJECT_*
+        uint32_t index;
+    };
+
+    explicit VirtualKms(const VirtualKmsConfig& config);
+
+    uint32_t AddObject(uint32_t type, uint32_t index);
+    uint32_t AddProperty(uint32_t flags, const char* name, std::vector<uint64_t> values,
+                         std::vector<const char*> enums = {});
+    drmModeModeInfo MakeMode(uint32_t width, uint32_t height) const;
+
+    int GetCap(void* arg);
+    int GetResources(void* arg);
+    int GetConnector(void* arg);
+    int GetEncoder(void* arg);
+    int GetCrtc(void* arg);
+    int GetPlaneResources(void* arg);
+    int GetPlane(void* arg);
+    int GetProperty(void* arg);
+    int GetObjectProperties(void* arg);
+    int CreateBlob(void* arg);
+    int DestroyBlob(void* arg);
+    int GetBlob(void* arg);
+    int CreateDumb(void* arg);
+    int MapDumb(void* arg);
+    int DestroyDumb(void* arg);
+    int AddFramebuffer(void* arg);
+    int AddFramebuffer2(void* arg);
+    int RemoveFramebuffer(void* arg);
+    int SetCrtc(void* arg, std::unique_lock<std::mutex>& lock);
+    int PageFlip(void* arg, std::unique_lock<std::mutex>& lock);
+    int Cursor(void* arg);
+    int Atomic(void* arg, std::unique_lock<std::mutex>& lock);
+    int GetSequence(void* arg);
+    int QueueSequence(void* arg);
+
+    const Object* FindObject(uint32_t id, uint32_t type) const;
+    int SetProperty(State* state, uint32_t object, uint32_t prop, uint64_t value, uint32_t* crtcs) const;
+    int CheckState(const State& state) const;
+    bool AsyncFlip(const State& state) const;
+    bool Busy(uint32_t crtcs) const;
+    uint32_t PrimaryPlane(uint32_t crtc_index) const { return crtc_index * (m_Config.overlays + 2); }
+    void Commit(State& state, uint32_t crtcs, uint32_t flags, uint64_t user_data,
+                std::unique_lock<std::mutex>& lock);
+
+    uint64_t Sequence(const Crtc& crtc, uint64_t now) const;
+    uint64_t VblankTime(const Crtc& crtc, uint64_t sequence) const;
+    uint64_t NextVblank(const Crtc& crtc, uint64_t at) const;
+
+    void Queue(const Event& event);
+    void EventThread();
+    void Write(const Event& event);
+
+    VirtualKmsConfig m_Config;
+    int m_Read = -1;
+    int m_Write = -1;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Changed; // events queued, commits completed, or quitting
+    std::thread m_Thread;
+    bool m_Quit = false;
+
+    uint32_t m_NextId = 1;
+    std::vector<Property> m_Props;
+    std::vector<uint32_t> m_Encoders; // by output, like the connectors and CRTCs
+    std::map<uint32_t, Object> m_Objects;
+    std::vector<drmModeModeInfo> m_Modes; // of every connector, the preferred one first
+    State m_State;
+    std::map<uint32_t, std::vector<uint8_t>> m_Blobs;
+    std::map<uint32_t, Dumb> m_Dumbs; // by GEM handle
+    std::map<uint32_t, Framebuffer> m_Fbs;
+    std::map<uint32_t, uint32_t> m_CursorFbs; // made by legacy cursor updates, by CRTC index
+    uint32_t m_NextHandle = 1;
+    uint64_t m_NextOffset = 0;
+    std::multimap<uint64_t, Event> m_Events; // by time
+
+    /* property ids, see the constructor */
+    uint32_t m_PropType = 0, m_PropFbId = 0, m_PropCrtcId = 0, m_PropSrc[4] = {}, m_PropDst[4] = {};
+    uint32_t m_PropDamage = 0, m_PropZpos = 0, m_PropActive = 0, m_PropModeId = 0;
+    uint64_t m_Dropped = 0;
+};
+
+/**
+ * @brief mmap() a buffer through a DRM fd at the `offset` MAP_DUMB returned,
+ * also for a VirtualKms.
+ * @return MAP_FAILED with errno set on failure
+ */
+void* MapDevice(int drm_fd, size_t size, uint64_t offset);
+
+} // namespace DrmLab
@@ -0,0 +1,38 @@
+/*
+ * The ioctl() of the VirtualKms devices, see virtual_kms.h.
+ *
+ * This isn't part of the labdrm library: it replaces libc's ioctl() for the
+ * whole process, so only the binaries which create virtual devices link it
+ * (labdrm_virtual_kms_ioctl). Interposing ioctl() rather than drmIoctl()
+ * also catches libdrm's calls to itself, which a -Bsymbolic libdrm resolves
+ * internally. Other fds go to the kernel as before, after a few atomic loads
+ * in VirtualKms::Find().
+ */
+
+#include "virtual_kms.h"
+
+#include <cstdarg>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace DrmLab
+{
+
+extern const bool virtual_kms_ioctl_linked = true;
+
+} // namespace DrmLab
+
+extern "C" int ioctl(int fd, unsigned long request, ...) __THROW
+{
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    DrmLab::VirtualKms* kms = DrmLab::VirtualKms::Find(fd);
+    if (kms != nullptr) {
+        return kms->Ioctl(request, arg);
+    }
+    return static_cast<int>(syscall(SYS_ioctl, fd, request, arg));
+}